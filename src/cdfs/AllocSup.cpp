@@ -88,6 +88,7 @@ extern "C"
 #pragma alloc_text(PAGE, CdFindMcbEntry)
 #pragma alloc_text(PAGE, CdInitializeMcb)
 #pragma alloc_text(PAGE, CdLookupAllocation)
+#pragma alloc_text(PAGE, CdReserveMcbEntries)
 #pragma alloc_text(PAGE, CdTruncateAllocation)
 #pragma alloc_text(PAGE, CdUninitializeMcb)
 #endif
@@ -376,14 +377,10 @@ Return Value:
 --*/
 
 {
-	ULONG NewArraySize;
-	PVOID NewMcbArray;
 	PCD_MCB_ENTRY McbEntry;
 
 	PAGED_CODE();
 
-	UNREFERENCED_PARAMETER( IrpContext );
-
 	ASSERT_IRP_CONTEXT( IrpContext );
 	ASSERT_FCB( Fcb );
 	ASSERT_LOCKED_FCB( Fcb );
@@ -394,36 +391,7 @@ Return Value:
 
 	if (McbEntryOffset >= Fcb->Mcb.MaximumEntryCount)
 	{
-		//
-		//  Allocate a new buffer and copy the old data over.
-		//
-
-		NewArraySize = Fcb->Mcb.MaximumEntryCount * 2 * sizeof( CD_MCB_ENTRY);
-
-		NewMcbArray = FsRtlAllocatePoolWithTag( CdPagedPool,
-			NewArraySize,
-			TAG_MCB_ARRAY );
-
-		RtlZeroMemory( NewMcbArray, NewArraySize );
-		RtlCopyMemory( NewMcbArray,
-			Fcb->Mcb.McbArray,
-			Fcb->Mcb.MaximumEntryCount * sizeof( CD_MCB_ENTRY ));
-
-		//
-		//  Deallocate the current array unless it is embedded in the Fcb.
-		//
-
-		if (Fcb->Mcb.MaximumEntryCount != 1)
-		{
-			CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Mcb.McbArray));
-		}
-
-		//
-		//  Now update the Mcb with the new array.
-		//
-
-		Fcb->Mcb.MaximumEntryCount *= 2;
-		Fcb->Mcb.McbArray = reinterpret_cast<PCD_MCB_ENTRY>(NewMcbArray);
+		CdReserveMcbEntries( IrpContext, Fcb, Fcb->Mcb.MaximumEntryCount * 2 );
 	}
 
 	//
@@ -581,6 +549,85 @@ Return Value:
 }
 
 
+VOID
+CdReserveMcbEntries(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PFCB Fcb,
+	     _In_ ULONG EntryCount
+)
+
+/*++
+
+Routine Description:
+
+    This routine makes sure the Mcb array can hold at least the given number
+    of entries, replacing it with a larger one if necessary.  Callers which
+    know how many extents a file has use this to size the array once.
+
+    The Fcb should be locked when this routine is called.
+
+Arguments:
+
+    Fcb - Fcb containing the Mcb to grow.
+
+    EntryCount - Number of entries the Mcb must have room for.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	ULONG NewArraySize;
+	PVOID NewMcbArray;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	ASSERT_IRP_CONTEXT( IrpContext );
+	ASSERT_FCB( Fcb );
+	ASSERT_LOCKED_FCB( Fcb );
+
+	if (EntryCount <= Fcb->Mcb.MaximumEntryCount)
+	{
+		return;
+	}
+
+	//
+	//  Allocate a new buffer and copy the old data over.
+	//
+
+	NewArraySize = EntryCount * sizeof( CD_MCB_ENTRY );
+
+	NewMcbArray = FsRtlAllocatePoolWithTag( CdPagedPool,
+		NewArraySize,
+		TAG_MCB_ARRAY );
+
+	RtlZeroMemory( NewMcbArray, NewArraySize );
+	RtlCopyMemory( NewMcbArray,
+		Fcb->Mcb.McbArray,
+		Fcb->Mcb.MaximumEntryCount * sizeof( CD_MCB_ENTRY ));
+
+	//
+	//  Deallocate the current array unless it is embedded in the Fcb.
+	//
+
+	if (Fcb->Mcb.MaximumEntryCount != 1)
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Mcb.McbArray));
+	}
+
+	//
+	//  Now update the Mcb with the new array.
+	//
+
+	Fcb->Mcb.MaximumEntryCount = EntryCount;
+	Fcb->Mcb.McbArray = reinterpret_cast<PCD_MCB_ENTRY>(NewMcbArray);
+}
+
+
 VOID
 CdTruncateAllocation(
 	_In_ PIRP_CONTEXT IrpContext,
@@ -676,6 +723,7 @@ Return Value:
 
 	Fcb->Mcb.MaximumEntryCount = 1;
 	Fcb->Mcb.CurrentEntryCount = 0;
+	Fcb->Mcb.LastEntryOffset = 0;
 
 	Fcb->Mcb.McbArray = &Fcb->McbEntry;
 
@@ -751,6 +799,10 @@ Routine Description:
     offset at the given point.  If the file offset is not currently in the
     Mcb then we return the offset of the entry to add.
 
+    The entries are in file offset order, so we binary search them.  Most
+    streams are read sequentially though, so we first try the entry we
+    found last time and the one following it.
+
     Fcb should be locked when this is called.
 
 Arguments:
@@ -766,8 +818,10 @@ Return Value:
 --*/
 
 {
+	ULONG LowMcbOffset;
+	ULONG HighMcbOffset;
 	ULONG CurrentMcbOffset;
-	PCD_MCB_ENTRY CurrentMcbEntry;
+	PCD_MCB_ENTRY McbArray;
 
 	PAGED_CODE();
 
@@ -777,30 +831,58 @@ Return Value:
 	ASSERT_FCB( Fcb );
 	ASSERT_LOCKED_FCB( Fcb );
 
+	McbArray = Fcb->Mcb.McbArray;
+	LowMcbOffset = 0;
+	HighMcbOffset = Fcb->Mcb.CurrentEntryCount;
+
 	//
-	//  We expect a linear search will be sufficient here.
+	//  Check the entry we found last time.  If the offset isn't in it we
+	//  at least know which side of it to search, and a sequential reader
+	//  has most likely moved on to the next entry.
 	//
 
-	CurrentMcbOffset = 0;
-	CurrentMcbEntry = Fcb->Mcb.McbArray;
+	CurrentMcbOffset = Fcb->Mcb.LastEntryOffset;
 
-	while (CurrentMcbOffset < Fcb->Mcb.CurrentEntryCount)
+	if (CurrentMcbOffset < HighMcbOffset)
 	{
-		//
-		//  Check if the offset lies within the current Mcb position.
-		//
-
-		if (FileOffset < CurrentMcbEntry->FileOffset + CurrentMcbEntry->ByteCount)
+		if (FileOffset < McbArray[CurrentMcbOffset].FileOffset)
 		{
-			break;
+			HighMcbOffset = CurrentMcbOffset;
 		}
+		else if (FileOffset < McbArray[CurrentMcbOffset].FileOffset + McbArray[CurrentMcbOffset].ByteCount)
+		{
+			return CurrentMcbOffset;
+		}
+		else
+		{
+			LowMcbOffset = CurrentMcbOffset + 1;
 
-		//
-		//  Move to the next entry.
-		//
+			if ((LowMcbOffset < HighMcbOffset) &&
+				(FileOffset < McbArray[LowMcbOffset].FileOffset + McbArray[LowMcbOffset].ByteCount))
+			{
+				Fcb->Mcb.LastEntryOffset = LowMcbOffset;
+				return LowMcbOffset;
+			}
+		}
+	}
 
-		CurrentMcbOffset += 1;
-		CurrentMcbEntry += 1;
+	//
+	//  Look for the first entry in the range which ends beyond this
+	//  offset.
+	//
+
+	while (LowMcbOffset < HighMcbOffset)
+	{
+		CurrentMcbOffset = LowMcbOffset + (HighMcbOffset - LowMcbOffset) / 2;
+
+		if (FileOffset < McbArray[CurrentMcbOffset].FileOffset + McbArray[CurrentMcbOffset].ByteCount)
+		{
+			HighMcbOffset = CurrentMcbOffset;
+		}
+		else
+		{
+			LowMcbOffset = CurrentMcbOffset + 1;
+		}
 	}
 
 	//
@@ -808,7 +890,12 @@ Return Value:
 	//  where an entry should be added).
 	//
 
-	return CurrentMcbOffset;
+	if (LowMcbOffset < Fcb->Mcb.CurrentEntryCount)
+	{
+		Fcb->Mcb.LastEntryOffset = LowMcbOffset;
+	}
+
+	return LowMcbOffset;
 }
 
 
@@ -682,15 +682,12 @@ Return Value:
 					}
 					else
 					{
-						if (!CdIs8dot3Name(IrpContext,
-						                   ThisDirent->CdFileName.FileName))
+						if (CdLookupDirentShortName(IrpContext,
+						                            Fcb,
+						                            ThisDirent,
+						                            DirInfo->ShortName,
+						                            &FileContext.ShortName.FileName.Length))
 						{
-							CdGenerate8dot3Name(IrpContext,
-							                    &ThisDirent->CdCaseFileName.FileName,
-							                    ThisDirent->DirentOffset,
-							                    DirInfo->ShortName,
-							                    &FileContext.ShortName.FileName.Length);
-
 							DirInfo->ShortNameLength = (CCHAR) FileContext.ShortName.FileName.Length;
 						}
 					}
@@ -988,6 +985,7 @@ Return Value:
 			ClearFlag(Ccb->Flags, CCB_FLAG_ENUM_MATCH_ALL);
 			ClearFlag(Ccb->Flags, CCB_FLAG_ENUM_INITIALIZED);
 			ClearFlag(Ccb->Flags, CCB_FLAG_ENUM_NAME_EXP_HAS_WILD);
+			ClearFlag(Ccb->Flags, CCB_FLAG_ENUM_NAME_EXP_PREFIX | CCB_FLAG_ENUM_NAME_EXP_SUFFIX);
 		}
 
 		CdUnlockFcb( IrpContext, Fcb );
@@ -1051,6 +1049,13 @@ Return Value:
 			if (FsRtlDoesNameContainWildCards(&WildCardName.FileName))
 			{
 				SetFlag( CcbFlags, CCB_FLAG_ENUM_NAME_EXP_HAS_WILD );
+
+				//
+				//  Note if the name can be matched without interpreting
+				//  the expression for every file.
+				//
+
+				SetFlag( CcbFlags, CdClassifyNameExpression(IrpContext, &WildCardName.FileName) );
 			}
 
 			if ((WildCardName.VersionString.Length != 0) &&
@@ -1235,6 +1240,18 @@ Return Value:
 
 	CdVerifyOrCreateDirStreamFile(IrpContext, Fcb);
 
+	//
+	//  Decode the names in the directory if we haven't tried to yet.
+	//
+
+	if (!Fcb->Index.NameArenaTried)
+	{
+		CdBuildNameArena(IrpContext, Fcb, FileContext);
+
+		CdCleanupFileContext(IrpContext, FileContext);
+		CdInitializeFileContext( IrpContext, FileContext );
+	}
+
 	//
 	//  Determine the offset in the stream to position the FileContext and
 	//  whether this offset is known to be a file offset.
@@ -1344,7 +1361,8 @@ Return Value:
 		//  Update the name in the dirent into filename and version components.
 		//
 
-		CdUpdateDirentName(IrpContext,
+		CdLookupDirentName(IrpContext,
+		                   Fcb,
 		                   &FileContext->InitialDirent->Dirent,
 		                   FlagOn( Ccb->Flags, CCB_FLAG_IGNORE_CASE ));
 	}
@@ -1432,7 +1450,7 @@ Return Value:
 			PreviousDirent = ThisDirent;
 			ThisDirent = &FileContext->InitialDirent->Dirent;
 
-			CdUpdateDirentName(IrpContext, ThisDirent, FlagOn( Ccb->Flags, CCB_FLAG_IGNORE_CASE ));
+			CdLookupDirentName(IrpContext, Ccb->Fcb, ThisDirent, FlagOn( Ccb->Flags, CCB_FLAG_IGNORE_CASE ));
 		}
 		else
 		{
@@ -1517,15 +1535,12 @@ Return Value:
 
 				if ((Ccb->SearchExpression.VersionString.Length == 0) &&
 					!FlagOn( ThisDirent->Flags, DIRENT_FLAG_CONSTANT_ENTRY ) &&
-					!CdIs8dot3Name(IrpContext,
-					               ThisDirent->CdFileName.FileName))
+					CdLookupDirentShortName(IrpContext,
+					                        Ccb->Fcb,
+					                        ThisDirent,
+					                        FileContext->ShortName.FileName.Buffer,
+					                        &FileContext->ShortName.FileName.Length))
 				{
-					CdGenerate8dot3Name(IrpContext,
-					                    &ThisDirent->CdCaseFileName.FileName,
-					                    ThisDirent->DirentOffset,
-					                    FileContext->ShortName.FileName.Buffer,
-					                    &FileContext->ShortName.FileName.Length);
-
 					//
 					//  Check if this name matches.
 					//
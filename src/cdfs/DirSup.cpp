@@ -73,37 +73,6 @@ Abstract:
 
 #define BugCheckFileId                   (CDFS_BUG_CHECK_DIRSUP)
 
-//
-// Local Struct
-//
-
-typedef struct RawSUSPEntryHeader_tag
-{
-	CHAR Signature[2];
-	UCHAR Length;
-	UCHAR Version; //always 1
-} RAW_SUSP_ENTRY_HEADER, *PRAW_SUSP_ENTRY_HEADER;
-
-
-// Zisofs. ZF system use entry -> compression enabled
-//											1 byte				1 byte (15,16,17)
-// | 'Z' | 'F' | 16 | 1 | 'p' | 'z' | HEADER SIZE DIV 4 | LOG2 BLOCK SIZE
-//	8 bytes (4+4) intel + motorola
-//  | UNCOMPRESSED SIZE |
-//
-
-typedef struct RawZisoEntry_tag
-{
-	CHAR Signature[2]; // 'Z' 'F'
-	UCHAR Length; // 16
-	UCHAR Version; //always 1
-	CHAR Algorythm[2]; // 'p' 'z'
-	UCHAR HeaderSizeDiv4; // 4 -> size of file header /4
-	UCHAR BlockSizeLog2; // valid: 15 16 17 -> blocks (32K 64K 128K)
-	UCHAR UncompressedSizeIntel[4];
-	UCHAR UncompressedSizeMotorola[4];
-} RAW_ZISO_ENTRY, *PRAW_ZISO_ENTRY;
-
 //
 //  Local macros
 //
@@ -123,6 +92,22 @@ typedef struct RawZisoEntry_tag
 #define CdRawSystemUseEntryHeader(DC,DE,Offset)							\
 	Add2Ptr( (DC)->Sector, (DC)->SectorOffset + (DE)->SystemUseOffset + (Offset), PRAW_SUSP_ENTRY_HEADER )
 
+//
+//  ULONG
+//  CdBloomBit (
+//      _In_ PCD_NEGATIVE_CACHE Cache,
+//      _In_ ULONG Hash,
+//      _In_ ULONG Probe
+//      );
+//
+//  Returns the Bloom filter bit for the given probe of a name hash.  The
+//  probes step through the filter by the hash rotated, made odd so that
+//  they never repeat.
+//
+
+#define CdBloomBit(C,H,P)                                       \
+    (((H) + (P) * ((((H) << 16) | ((H) >> 16)) | 1)) & ((C)->BloomBits - 1))
+
 //
 //  Local support routines
 //
@@ -144,21 +129,89 @@ extern "C"
 		     _Inout_ PDIRENT Dirent
 	);
 
+	VOID
+	CdBuildNameIndex(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _Inout_ PFILE_ENUM_CONTEXT FileContext
+	);
+
+	PCD_NAME_ARENA_ENTRY
+	CdFindNameArenaEntry(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PCD_NAME_ARENA NameArena,
+		     _In_ ULONG DirentOffset,
+		     _In_ ULONG Shift
+	);
+
+	BOOLEAN
+	CdGrowNameArenaBuffer(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PVOID* Buffer,
+		     _Inout_ PULONG Capacity,
+		     _In_ ULONG Used,
+		     _In_ ULONG Needed,
+		     _In_ ULONG ElementSize
+	);
+
+	PCD_NEGATIVE_CACHE
+	CdCreateNegativeCache(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb
+	);
+
+	VOID
+	CdTrimNameIndexes(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb
+	);
+
+	BOOLEAN
+	CdIsKnownMissing(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _In_ PCD_NAME Name,
+		     _In_ ULONG Hash,
+		     _In_ ULONG Flags,
+		     _In_ BOOLEAN UseBloom
+	);
+
+	VOID
+	CdNoteMissingName(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _In_ PCD_NAME Name,
+		     _In_ ULONG Hash,
+		     _In_ ULONG Flags
+	);
+
 #if defined(__cplusplus)
 }
 #endif
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CdBuildNameArena)
+#pragma alloc_text(PAGE, CdBuildNameIndex)
 #pragma alloc_text(PAGE, CdCheckForXAExtent)
 #pragma alloc_text(PAGE, CdCheckRawDirentBounds)
 #pragma alloc_text(PAGE, CdCleanupFileContext)
+#pragma alloc_text(PAGE, CdCreateNegativeCache)
+#pragma alloc_text(PAGE, CdDeleteNameArena)
+#pragma alloc_text(PAGE, CdDeleteNameIndex)
 #pragma alloc_text(PAGE, CdFindFile)
 #pragma alloc_text(PAGE, CdFindDirectory)
 #pragma alloc_text(PAGE, CdFindFileByShortName)
+#pragma alloc_text(PAGE, CdFindNameArenaEntry)
+#pragma alloc_text(PAGE, CdGrowNameArenaBuffer)
+#pragma alloc_text(PAGE, CdIsKnownMissing)
+#pragma alloc_text(PAGE, CdTrimNameIndexes)
 #pragma alloc_text(PAGE, CdLookupDirent)
+#pragma alloc_text(PAGE, CdLookupDirentName)
+#pragma alloc_text(PAGE, CdLookupDirentShortName)
 #pragma alloc_text(PAGE, CdLookupLastFileDirent)
 #pragma alloc_text(PAGE, CdLookupNextDirent)
 #pragma alloc_text(PAGE, CdLookupNextInitialFileDirent)
+#pragma alloc_text(PAGE, CdNoteMissingName)
 #pragma alloc_text(PAGE, CdUpdateDirentFromRawDirent)
 #pragma alloc_text(PAGE, CdUpdateDirentName)
 #endif
@@ -776,11 +829,13 @@ Return Value:
 	else
 	{
 		//
-		//  We need to use an allocated buffer.  Check if the current buffer
-		//  is large enough.
+		//  We need to use an allocated buffer.  Check if we have one and
+		//  it is large enough.  Without one the buffer may be in the
+		//  directory's name arena, which we mustn't write to.
 		//
 
-		if (Length > Dirent->CdFileName.FileName.MaximumLength)
+		if (!FlagOn( Dirent->Flags, DIRENT_FLAG_ALLOC_BUFFER ) ||
+			(Length > Dirent->CdFileName.FileName.MaximumLength))
 		{
 			//
 			//  Free any allocated buffer.
@@ -928,6 +983,185 @@ Return Value:
 }
 
 
+VOID
+CdLookupDirentName(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _Inout_ PDIRENT Dirent,
+	     _In_ ULONG IgnoreCase
+)
+
+/*++
+
+Routine Description:
+
+    This routine does the work of CdUpdateDirentName for a dirent in the
+    given directory, using the names already decoded in the directory's
+    name arena when it has one.  The names then point into the arena and
+    must not be modified.  We fall back to CdUpdateDirentName for the self
+    and parent entries, and for directories without an arena.
+
+Arguments:
+
+    Fcb - Fcb for the directory containing the dirent.
+
+    Dirent - Pointer to the in-memory dirent structure.  This must be the
+        first dirent of a file.
+
+    IgnoreCase - TRUE if we should return the upcased version.  Otherwise we
+        use the exact case name.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_NAME_ARENA NameArena = Fcb->Index.NameArena;
+	PCD_NAME_ARENA_ENTRY Entry = NULL;
+
+	PAGED_CODE();
+
+	if (NameArena != NULL)
+	{
+		Entry = CdFindNameArenaEntry(IrpContext, NameArena, Dirent->DirentOffset, 0);
+	}
+
+	if (Entry == NULL)
+	{
+		CdUpdateDirentName(IrpContext, Dirent, IgnoreCase);
+		return;
+	}
+
+	//
+	//  Any buffer of our own is no longer needed.
+	//
+
+	if (FlagOn( Dirent->Flags, DIRENT_FLAG_ALLOC_BUFFER ))
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Dirent->CdFileName.FileName.Buffer));
+		ClearFlag( Dirent->Flags, DIRENT_FLAG_ALLOC_BUFFER );
+	}
+
+	ClearFlag( Dirent->Flags, DIRENT_FLAG_CONSTANT_ENTRY );
+
+	Dirent->CdFileName.FileName.Buffer = NameArena->Names + Entry->NameOffset;
+	Dirent->CdFileName.FileName.Length = Entry->NameLength;
+	Dirent->CdFileName.FileName.MaximumLength = Entry->NameLength;
+
+	Dirent->CdFileName.VersionString.Buffer = Add2Ptr( Dirent->CdFileName.FileName.Buffer,
+		Entry->NameLength,
+		PWCHAR );
+	Dirent->CdFileName.VersionString.Length = Entry->VersionLength;
+	Dirent->CdFileName.VersionString.MaximumLength = Entry->VersionLength;
+
+	//
+	//  The upcased copies follow the exact case name and version.
+	//
+
+	if (!IgnoreCase)
+	{
+		Dirent->CdCaseFileName = Dirent->CdFileName;
+	}
+	else
+	{
+		Dirent->CdCaseFileName.FileName.Buffer = Add2Ptr( Dirent->CdFileName.VersionString.Buffer,
+			Entry->VersionLength,
+			PWCHAR );
+		Dirent->CdCaseFileName.FileName.Length = Entry->NameLength;
+		Dirent->CdCaseFileName.FileName.MaximumLength = Entry->NameLength;
+
+		Dirent->CdCaseFileName.VersionString.Buffer = Add2Ptr( Dirent->CdCaseFileName.FileName.Buffer,
+			Entry->NameLength,
+			PWCHAR );
+		Dirent->CdCaseFileName.VersionString.Length = Entry->VersionLength;
+		Dirent->CdCaseFileName.VersionString.MaximumLength = Entry->VersionLength;
+	}
+}
+
+
+BOOLEAN
+CdLookupDirentShortName(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _In_ PDIRENT Dirent,
+	     _Out_writes_bytes_to_(BYTE_COUNT_8_DOT_3, *ShortByteCount) PWCHAR ShortFileName,
+	     _Inout_ PUSHORT ShortByteCount
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to find the short name of a file whose name
+    isn't 8.3.  We copy it from the directory's name arena if it has one,
+    and only generate it otherwise.
+
+Arguments:
+
+    Fcb - Fcb for the directory containing the dirent.
+
+    Dirent - First dirent of the file.  Its name has been updated.
+
+    ShortFileName - Pointer to the buffer to store the short name into.
+
+    ShortByteCount - Address to store the number of bytes in the short name.
+        It is unchanged if the name is 8.3.
+
+Return Value:
+
+    BOOLEAN - TRUE if we stored a short name, FALSE if the file's name is
+        already 8.3.
+
+--*/
+
+{
+	PCD_NAME_ARENA NameArena = Fcb->Index.NameArena;
+	PCD_NAME_ARENA_ENTRY Entry = NULL;
+
+	PAGED_CODE();
+
+	if (NameArena != NULL)
+	{
+		Entry = CdFindNameArenaEntry(IrpContext, NameArena, Dirent->DirentOffset, 0);
+	}
+
+	if (Entry != NULL)
+	{
+		if (Entry->ShortNameLength == 0)
+		{
+			return FALSE;
+		}
+
+		RtlCopyMemory( ShortFileName,
+			Add2Ptr( NameArena->Names + Entry->NameOffset,
+				2 * (Entry->NameLength + Entry->VersionLength),
+				PVOID ),
+			Entry->ShortNameLength );
+
+		*ShortByteCount = Entry->ShortNameLength;
+
+		return TRUE;
+	}
+
+	if (CdIs8dot3Name(IrpContext,
+	                  Dirent->CdFileName.FileName))
+	{
+		return FALSE;
+	}
+
+	CdGenerate8dot3Name(IrpContext,
+	                    &Dirent->CdCaseFileName.FileName,
+	                    Dirent->DirentOffset,
+	                    ShortFileName,
+	                    ShortByteCount);
+
+	return TRUE;
+}
+
+
+
 _Success_(return != FALSE) BOOLEAN
 CdFindFile(
 	_In_ PIRP_CONTEXT IrpContext,
@@ -973,6 +1207,15 @@ Return Value:
 	PDIRENT Dirent;
 	ULONG ShortNameDirentOffset;
 
+	PCD_NAME_INDEX NameIndex;
+	PCD_NAME_INDEX_ENTRY Entry;
+	ULONG EntryIndex;
+	ULONG Hash;
+
+	PCD_NEGATIVE_CACHE NegativeCache = NULL;
+	ULONG DirentHash;
+	ULONG Probe;
+
 	BOOLEAN Found = FALSE;
 
 	PAGED_CODE();
@@ -989,6 +1232,151 @@ Return Value:
 
 	ShortNameDirentOffset = CdShortNameDirentOffset(IrpContext, &Name->FileName);
 
+	//
+	//  Check whether we already know the name isn't here.  The Bloom filter
+	//  only holds long names, so it can't rule out a possible short name.
+	//
+
+	Hash = CdHashName(IrpContext, &Name->FileName);
+
+	if (CdIsKnownMissing(IrpContext,
+	                     Fcb,
+	                     Name,
+	                     Hash,
+	                     (IgnoreCase ? CD_NEGATIVE_FLAG_IGNORE_CASE : 0),
+	                     (ShortNameDirentOffset == MAXULONG)))
+	{
+		return FALSE;
+	}
+
+	//
+	//  Decode the names in the directory if we haven't tried to yet.
+	//
+
+	if (!Fcb->Index.NameArenaTried)
+	{
+		CdBuildNameArena(IrpContext, Fcb, FileContext);
+
+		CdCleanupFileContext(IrpContext, FileContext);
+		CdInitializeFileContext( IrpContext, FileContext );
+	}
+
+	//
+	//  A name which can't be a short name can be looked up in the name
+	//  index.  Throw away an index from before the last verify, and build
+	//  one if we haven't tried to in this generation.  While memory is low
+	//  we free the volume's indexes and name arenas, this directory's
+	//  included, and build none.
+	//
+
+	if (ShortNameDirentOffset == MAXULONG)
+	{
+		if ((Fcb->Index.NameIndex != NULL) &&
+			(Fcb->Index.NameIndex->Generation != Fcb->Vcb->NameIndexGeneration))
+		{
+			CdDeleteNameIndex(IrpContext, Fcb);
+		}
+
+		if (CdIsMemoryLow())
+		{
+			CdTrimNameIndexes(IrpContext, Fcb->Vcb);
+		}
+		else if ((Fcb->Index.NameIndex == NULL) &&
+			(Fcb->Index.NameIndexGeneration != Fcb->Vcb->NameIndexGeneration))
+		{
+			CdBuildNameIndex(IrpContext, Fcb, FileContext);
+
+			CdCleanupFileContext(IrpContext, FileContext);
+			CdInitializeFileContext( IrpContext, FileContext );
+		}
+
+		NameIndex = Fcb->Index.NameIndex;
+
+		if (NameIndex != NULL)
+		{
+			//
+			//  Walk the chain for this hash.  Any file with this name has
+			//  it, so if none of these match then the name isn't here.
+			//
+
+			for (EntryIndex = NameIndex->Buckets[ Hash & (NameIndex->BucketCount - 1) ];
+			     EntryIndex != 0;
+			     EntryIndex = Entry->Next)
+			{
+				Entry = &NameIndex->Entries[ EntryIndex - 1 ];
+
+				if (Entry->Hash != Hash)
+				{
+					continue;
+				}
+
+				//
+				//  Position at this file and compare the names.  Start
+				//  with a clean context if an earlier entry didn't match.
+				//
+
+				if (FileContext->InitialDirent->DirContext.Bcb != NULL)
+				{
+					CdCleanupFileContext(IrpContext, FileContext);
+					CdInitializeFileContext( IrpContext, FileContext );
+				}
+
+				CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Entry->DirentOffset );
+
+				Dirent = &FileContext->InitialDirent->Dirent;
+
+				CdLookupDirentName(IrpContext, Fcb, Dirent, IgnoreCase);
+
+				if (CdIsNameInExpression(IrpContext,
+				                         &Dirent->CdCaseFileName,
+				                         Name,
+				                         0,
+				                         TRUE))
+				{
+					*MatchingName = &Dirent->CdCaseFileName;
+					Found = TRUE;
+					break;
+				}
+			}
+
+			if (Found)
+			{
+				CdLookupLastFileDirent(IrpContext, Fcb, FileContext);
+			}
+			else
+			{
+				CdNoteMissingName(IrpContext,
+				                  Fcb,
+				                  Name,
+				                  Hash,
+				                  (IgnoreCase ? CD_NEGATIVE_FLAG_IGNORE_CASE : 0));
+			}
+
+			return Found;
+		}
+	}
+
+	//
+	//  We are about to scan the whole directory, unless we find the file,
+	//  so fill in the Bloom filter as we go if it isn't complete.  There
+	//  is no point in one for a directory with a name index.
+	//
+
+	if (Fcb->Index.NameIndex == NULL)
+	{
+		NegativeCache = Fcb->Index.NegativeCache;
+
+		if (NegativeCache == NULL)
+		{
+			NegativeCache = CdCreateNegativeCache(IrpContext, Fcb);
+		}
+
+		if ((NegativeCache != NULL) && NegativeCache->BloomValid)
+		{
+			NegativeCache = NULL;
+		}
+	}
+
 	//
 	//  Position ourselves at the first entry.
 	//
@@ -1015,7 +1403,7 @@ Return Value:
 			//  Update the name in the current dirent.
 			//
 
-			CdUpdateDirentName(IrpContext, Dirent, IgnoreCase);
+			CdLookupDirentName(IrpContext, Fcb, Dirent, IgnoreCase);
 
 			//
 			//  Don't bother with constant entries.
@@ -1026,6 +1414,17 @@ Return Value:
 				continue;
 			}
 
+			if (NegativeCache != NULL)
+			{
+				DirentHash = CdHashName(IrpContext, &Dirent->CdFileName.FileName);
+
+				for (Probe = 0; Probe < CD_NEGATIVE_BLOOM_PROBES; Probe += 1)
+				{
+					SetFlag( NegativeCache->Bloom[ CdBloomBit( NegativeCache, DirentHash, Probe ) / 8 ],
+					         1 << (CdBloomBit( NegativeCache, DirentHash, Probe ) % 8) );
+				}
+			}
+
 			//
 			//  Now check whether we have a name match.
 			//  We exit the loop if we have a match.
@@ -1088,13 +1487,27 @@ Return Value:
 	while (CdLookupNextInitialFileDirent(IrpContext, Fcb, FileContext));
 
 	//
-	//  If we find the file then collect all of the dirents.
+	//  If we find the file then collect all of the dirents.  Otherwise we
+	//  have seen every file and the Bloom filter is complete.
 	//
 
 	if (Found)
 	{
 		CdLookupLastFileDirent(IrpContext, Fcb, FileContext);
 	}
+	else
+	{
+		if (NegativeCache != NULL)
+		{
+			NegativeCache->BloomValid = TRUE;
+		}
+
+		CdNoteMissingName(IrpContext,
+		                  Fcb,
+		                  Name,
+		                  Hash,
+		                  (IgnoreCase ? CD_NEGATIVE_FLAG_IGNORE_CASE : 0));
+	}
 
 	return Found;
 }
@@ -1148,6 +1561,18 @@ Return Value:
 
 	CdVerifyOrCreateDirStreamFile(IrpContext, Fcb);
 
+	//
+	//  Decode the names in the directory if we haven't tried to yet.
+	//
+
+	if (!Fcb->Index.NameArenaTried)
+	{
+		CdBuildNameArena(IrpContext, Fcb, FileContext);
+
+		CdCleanupFileContext(IrpContext, FileContext);
+		CdInitializeFileContext( IrpContext, FileContext );
+	}
+
 	//
 	//  Position ourselves at the first entry.
 	//
@@ -1173,7 +1598,7 @@ Return Value:
 			//  Update the name in the current dirent.
 			//
 
-			CdUpdateDirentName(IrpContext, Dirent, IgnoreCase);
+			CdLookupDirentName(IrpContext, Fcb, Dirent, IgnoreCase);
 
 			//
 			//  Don't bother with constant entries.
@@ -1256,10 +1681,27 @@ Return Value:
 	BOOLEAN Found = FALSE;
 	PDIRENT Dirent;
 
+	PCD_NAME_ARENA NameArena;
+	PCD_NAME_ARENA_ENTRY Entry;
+
 	ULONG ThisShortNameDirentOffset;
+	ULONG Hash;
+	ULONG Flags;
 
 	PAGED_CODE();
 
+	//
+	//  Check whether this lookup has already failed.
+	//
+
+	Hash = CdHashName(IrpContext, &Name->FileName);
+	Flags = CD_NEGATIVE_FLAG_SHORT_NAME | (IgnoreCase ? CD_NEGATIVE_FLAG_IGNORE_CASE : 0);
+
+	if (CdIsKnownMissing(IrpContext, Fcb, Name, Hash, Flags, FALSE))
+	{
+		return FALSE;
+	}
+
 	//
 	//  Make sure there is a stream file for this Fcb.
 	//
@@ -1267,102 +1709,159 @@ Return Value:
 	CdVerifyOrCreateDirStreamFile(IrpContext, Fcb);
 
 	//
-	//  Position ourselves at the start of the directory and update
-	//
+	//  Decode the names in the directory if we haven't tried to yet.
 	//
 
-	CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Fcb->Index.StreamOffset );
+	if (!Fcb->Index.NameArenaTried)
+	{
+		CdBuildNameArena(IrpContext, Fcb, FileContext);
+
+		CdCleanupFileContext(IrpContext, FileContext);
+		CdInitializeFileContext( IrpContext, FileContext );
+	}
 
 	//
-	//  Loop until we have found the entry or are beyond this dirent.
+	//  If the directory has a name arena then it already has the short
+	//  names, indexed by their dirent offsets.  We only need to read the
+	//  dirent if the short name matches.  Like the scan below, we ignore
+	//  any version in the name.
 	//
 
-	do
+	NameArena = Fcb->Index.NameArena;
+
+	if (NameArena != NULL)
 	{
-		//
-		//  Compute the short name dirent offset for the current dirent.
-		//
+		Entry = CdFindNameArenaEntry(IrpContext,
+		                             NameArena,
+		                             ShortNameDirentOffset,
+		                             SHORT_NAME_SHIFT);
+
+		if ((Entry != NULL) &&
+			(Entry->ShortNameLength == Name->FileName.Length) &&
+			RtlEqualMemory( Add2Ptr( NameArena->Names + Entry->NameOffset,
+					2 * (Entry->NameLength + Entry->VersionLength),
+					PVOID ),
+				Name->FileName.Buffer,
+				Entry->ShortNameLength ))
+		{
+			CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Entry->DirentOffset );
 
-		Dirent = &FileContext->InitialDirent->Dirent;
-		ThisShortNameDirentOffset = Dirent->DirentOffset >> SHORT_NAME_SHIFT;
+			Dirent = &FileContext->InitialDirent->Dirent;
 
-		//
-		//  If beyond the target then exit.
-		//
+			if (!FlagOn( Dirent->DirentFlags, CD_ATTRIBUTE_ASSOC ))
+			{
+				CdLookupDirentName(IrpContext, Fcb, Dirent, IgnoreCase);
 
-		if (ThisShortNameDirentOffset > ShortNameDirentOffset)
-		{
-			break;
+				RtlCopyMemory( FileContext->ShortName.FileName.Buffer,
+					Name->FileName.Buffer,
+					Name->FileName.Length );
+
+				FileContext->ShortName.FileName.Length = Name->FileName.Length;
+
+				Found = TRUE;
+			}
 		}
+	}
+	else
+	{
+		//
+		//  Otherwise position ourselves at the start of the directory and update
+		//
+		//
+
+		CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Fcb->Index.StreamOffset );
 
 		//
-		//  If equal to the target then check if we have a name match.
-		//  We will either match or fail here.
+		//  Loop until we have found the entry or are beyond this dirent.
 		//
 
-		if (ThisShortNameDirentOffset == ShortNameDirentOffset)
+		do
 		{
 			//
-			//  If this is an associated file then get out.
+			//  Compute the short name dirent offset for the current dirent.
 			//
 
-			if (FlagOn( Dirent->DirentFlags, CD_ATTRIBUTE_ASSOC ))
-			{
-				break;
-			}
+			Dirent = &FileContext->InitialDirent->Dirent;
+			ThisShortNameDirentOffset = Dirent->DirentOffset >> SHORT_NAME_SHIFT;
 
 			//
-			//  Update the name in the dirent and check if it is not
-			//  an 8.3 name.
+			//  If beyond the target then exit.
 			//
 
-			CdUpdateDirentName(IrpContext, Dirent, IgnoreCase);
-
-			if (CdIs8dot3Name(IrpContext,
-			                  Dirent->CdFileName.FileName))
+			if (ThisShortNameDirentOffset > ShortNameDirentOffset)
 			{
 				break;
 			}
 
 			//
-			//  Generate the 8.3 name see if it matches our input name.
+			//  If equal to the target then check if we have a name match.
+			//  We will either match or fail here.
 			//
 
-			CdGenerate8dot3Name(IrpContext,
-			                    &Dirent->CdCaseFileName.FileName,
-			                    Dirent->DirentOffset,
-			                    FileContext->ShortName.FileName.Buffer,
-			                    &FileContext->ShortName.FileName.Length);
+			if (ThisShortNameDirentOffset == ShortNameDirentOffset)
+			{
+				//
+				//  If this is an associated file then get out.
+				//
 
-			//
-			//  Check if this name matches.
-			//
+				if (FlagOn( Dirent->DirentFlags, CD_ATTRIBUTE_ASSOC ))
+				{
+					break;
+				}
 
-			if (CdIsNameInExpression(IrpContext,
-			                         Name,
-			                         &FileContext->ShortName,
-			                         0,
-			                         FALSE))
-			{
 				//
-				//  Let our caller know we found an entry.
+				//  Update the name in the dirent and check if it is not
+				//  an 8.3 name.
 				//
 
-				Found = TRUE;
+				CdLookupDirentName(IrpContext, Fcb, Dirent, IgnoreCase);
+
+				if (CdIs8dot3Name(IrpContext,
+				                  Dirent->CdFileName.FileName))
+				{
+					break;
+				}
+
+				//
+				//  Generate the 8.3 name see if it matches our input name.
+				//
+
+				CdGenerate8dot3Name(IrpContext,
+				                    &Dirent->CdCaseFileName.FileName,
+				                    Dirent->DirentOffset,
+				                    FileContext->ShortName.FileName.Buffer,
+				                    &FileContext->ShortName.FileName.Length);
+
+				//
+				//  Check if this name matches.
+				//
+
+				if (CdIsNameInExpression(IrpContext,
+				                         Name,
+				                         &FileContext->ShortName,
+				                         0,
+				                         FALSE))
+				{
+					//
+					//  Let our caller know we found an entry.
+					//
+
+					Found = TRUE;
+				}
+
+				//
+				//  Break out of the loop.
+				//
+
+				break;
 			}
 
 			//
-			//  Break out of the loop.
+			//  Continue until there are no more entries.
 			//
-
-			break;
 		}
-
-		//
-		//  Continue until there are no more entries.
-		//
+		while (CdLookupNextInitialFileDirent(IrpContext, Fcb, FileContext));
 	}
-	while (CdLookupNextInitialFileDirent(IrpContext, Fcb, FileContext));
 
 	//
 	//  If we find the file then collect all of the dirents.
@@ -1372,6 +1871,10 @@ Return Value:
 	{
 		CdLookupLastFileDirent(IrpContext, Fcb, FileContext);
 	}
+	else
+	{
+		CdNoteMissingName(IrpContext, Fcb, Name, Hash, Flags);
+	}
 
 	return Found;
 }
@@ -1577,6 +2080,7 @@ Return Value:
 	//
 
 	CurrentCompoundDirent = FileContext->InitialDirent;
+	FileContext->ExtentCount = 1;
 
 	//
 	//  Loop until we reach the last dirent for the file.
@@ -1715,6 +2219,7 @@ Return Value:
 		//
 
 		CurrentCompoundDirent = FileContext->CurrentDirent;
+		FileContext->ExtentCount += 1;
 		FirstPass = FALSE;
 
 		//
@@ -1785,6 +2290,119 @@ Return Value:
 }
 
 
+VOID
+CdDeleteNameIndex(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PFCB Fcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to free the name index of a directory and return
+    its pool to the volume's budget.  The next lookup in the directory may
+    build it again.
+
+Arguments:
+
+    Fcb - Fcb for the directory.  It is owned exclusively or being deleted.
+        The Vcb mutex must not be held.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_NAME_INDEX NameIndex;
+
+	PAGED_CODE();
+
+	//
+	//  Take the index off the volume's queue with the Vcb locked, so that
+	//  a trim doesn't free it as well.
+	//
+
+	CdLockVcb( IrpContext, Fcb->Vcb );
+
+	NameIndex = Fcb->Index.NameIndex;
+
+	if (NameIndex != NULL)
+	{
+		RemoveEntryList( &Fcb->Index.NameIndexLinks );
+		Fcb->Index.NameIndex = NULL;
+	}
+
+	CdUnlockVcb( IrpContext, Fcb->Vcb );
+
+	if (NameIndex != NULL)
+	{
+		InterlockedExchangeAdd( &Fcb->Vcb->NameIndexBytes,
+		                        -(LONG) NameIndex->AllocationSize );
+
+		CdFreePool(reinterpret_cast<PVOID*>(&NameIndex));
+	}
+}
+
+
+VOID
+CdDeleteNameArena(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PFCB Fcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to free the name arena of a directory when its
+    Fcb is deleted, and return its pool to the volume's budget.
+
+Arguments:
+
+    Fcb - Fcb for the directory being deleted.  The Vcb mutex must not be
+        held.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_NAME_ARENA NameArena;
+
+	PAGED_CODE();
+
+	//
+	//  Take the arena off the volume's queue with the Vcb locked, so that
+	//  a trim doesn't free it as well.
+	//
+
+	CdLockVcb( IrpContext, Fcb->Vcb );
+
+	NameArena = Fcb->Index.NameArena;
+
+	if (NameArena != NULL)
+	{
+		RemoveEntryList( &Fcb->Index.NameArenaLinks );
+		Fcb->Index.NameArena = NULL;
+	}
+
+	CdUnlockVcb( IrpContext, Fcb->Vcb );
+
+	if (NameArena != NULL)
+	{
+		InterlockedExchangeAdd( &Fcb->Vcb->NameIndexBytes,
+		                        -(LONG) NameArena->AllocationSize );
+
+		CdFreePool(reinterpret_cast<PVOID*>(&NameArena));
+	}
+}
+
+
 //
 //  Local support routine
 //
@@ -1970,3 +2588,1020 @@ Return Value:
 	Dirent->ExtentType = ExtentType;
 	return ExtentType;
 }
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdBuildNameIndex(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _Inout_ PFILE_ENUM_CONTEXT FileContext
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to build the name index for a directory by
+    scanning it once.  We index the files CdFindFile can return, and give
+    up on directories which are small, have too many files or would put the
+    volume over its budget.  The index comes from low priority pool so that
+    directories go back to being scanned when memory is short.
+
+    Either way we note that we have tried in this generation.
+
+Arguments:
+
+    Fcb - Fcb for the directory, owned exclusively.  Its stream file exists.
+
+    FileContext - Initialized file context to scan with.  The caller must
+        clean it up.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PVCB Vcb = Fcb->Vcb;
+	PDIRENT Dirent;
+
+	PCD_NAME_INDEX NameIndex;
+	PCD_NAME_INDEX_ENTRY Entries = NULL;
+	PCD_NAME_INDEX_ENTRY NewEntries;
+
+	ULONG EntryCount = 0;
+	ULONG Capacity;
+	ULONG BucketCount;
+	ULONG AllocationSize;
+	ULONG Index;
+	ULONG Bucket;
+
+	PAGED_CODE();
+
+	Fcb->Index.NameIndexGeneration = Vcb->NameIndexGeneration;
+
+	if (Fcb->FileSize.QuadPart < CD_NAME_INDEX_MIN_DIRECTORY)
+	{
+		return;
+	}
+
+	//
+	//  Start with room for a file in every 64 bytes of directory, which
+	//  covers short names, and grow from there.
+	//
+
+	Capacity = CD_NAME_INDEX_MAX_ENTRIES;
+
+	if (Fcb->FileSize.QuadPart / 64 < Capacity)
+	{
+		Capacity = (ULONG) (Fcb->FileSize.QuadPart / 64);
+	}
+
+	Entries = reinterpret_cast<PCD_NAME_INDEX_ENTRY>(ExAllocatePoolWithTagPriority( CdPagedPool,
+		Capacity * sizeof( CD_NAME_INDEX_ENTRY ),
+		TAG_NAME_INDEX,
+		LowPoolPriority ));
+
+	if (Entries == NULL)
+	{
+		return;
+	}
+
+	__try
+	{
+		CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Fcb->Index.StreamOffset );
+
+		do
+		{
+			Dirent = &FileContext->InitialDirent->Dirent;
+
+			//
+			//  Skip the same entries CdFindFile does.
+			//
+
+			if (FlagOn( Dirent->DirentFlags, CD_ATTRIBUTE_ASSOC | CD_ATTRIBUTE_DIRECTORY ))
+			{
+				continue;
+			}
+
+			CdLookupDirentName(IrpContext, Fcb, Dirent, FALSE);
+
+			if (FlagOn( Dirent->Flags, DIRENT_FLAG_CONSTANT_ENTRY ))
+			{
+				continue;
+			}
+
+			if (EntryCount == Capacity)
+			{
+				if (Capacity == CD_NAME_INDEX_MAX_ENTRIES)
+				{
+					try_leave( CdFreePool(reinterpret_cast<PVOID*>(&Entries)) );
+				}
+
+				Capacity = Min( Capacity * 2, CD_NAME_INDEX_MAX_ENTRIES );
+
+				NewEntries = reinterpret_cast<PCD_NAME_INDEX_ENTRY>(ExAllocatePoolWithTagPriority( CdPagedPool,
+					Capacity * sizeof( CD_NAME_INDEX_ENTRY ),
+					TAG_NAME_INDEX,
+					LowPoolPriority ));
+
+				if (NewEntries == NULL)
+				{
+					try_leave( CdFreePool(reinterpret_cast<PVOID*>(&Entries)) );
+				}
+
+				RtlCopyMemory( NewEntries, Entries, EntryCount * sizeof( CD_NAME_INDEX_ENTRY ));
+				CdFreePool(reinterpret_cast<PVOID*>(&Entries));
+				Entries = NewEntries;
+			}
+
+			Entries[EntryCount].Hash = CdHashName(IrpContext, &Dirent->CdFileName.FileName);
+			Entries[EntryCount].DirentOffset = Dirent->DirentOffset;
+			EntryCount += 1;
+		}
+		while (CdLookupNextInitialFileDirent(IrpContext, Fcb, FileContext));
+	}
+	__finally
+	{
+		if (AbnormalTermination())
+		{
+			CdFreePool(reinterpret_cast<PVOID*>(&Entries));
+		}
+	}
+
+	if (Entries == NULL)
+	{
+		return;
+	}
+
+	//
+	//  Use a power of two buckets, at least one per file, and charge the
+	//  whole index to the volume before allocating it.
+	//
+
+	for (BucketCount = 1; BucketCount < EntryCount; BucketCount *= 2)
+	{
+		NOTHING;
+	}
+
+	AllocationSize = sizeof( CD_NAME_INDEX ) +
+	                 BucketCount * sizeof( ULONG ) +
+	                 EntryCount * sizeof( CD_NAME_INDEX_ENTRY );
+
+	if (InterlockedExchangeAdd( &Vcb->NameIndexBytes, AllocationSize ) + AllocationSize > CD_NAME_INDEX_VOLUME_BUDGET)
+	{
+		NameIndex = NULL;
+	}
+	else
+	{
+		NameIndex = reinterpret_cast<PCD_NAME_INDEX>(ExAllocatePoolWithTagPriority( CdPagedPool,
+			AllocationSize,
+			TAG_NAME_INDEX,
+			LowPoolPriority ));
+	}
+
+	if (NameIndex == NULL)
+	{
+		InterlockedExchangeAdd( &Vcb->NameIndexBytes, -(LONG) AllocationSize );
+		CdFreePool(reinterpret_cast<PVOID*>(&Entries));
+		return;
+	}
+
+	NameIndex->Generation = Fcb->Index.NameIndexGeneration;
+	NameIndex->AllocationSize = AllocationSize;
+	NameIndex->BucketCount = BucketCount;
+	NameIndex->Buckets = Add2Ptr( NameIndex, sizeof( CD_NAME_INDEX ), PULONG );
+	NameIndex->EntryCount = EntryCount;
+	NameIndex->Entries = Add2Ptr( NameIndex->Buckets, BucketCount * sizeof( ULONG ), PCD_NAME_INDEX_ENTRY );
+
+	RtlZeroMemory( NameIndex->Buckets, BucketCount * sizeof( ULONG ));
+	RtlCopyMemory( NameIndex->Entries, Entries, EntryCount * sizeof( CD_NAME_INDEX_ENTRY ));
+
+	//
+	//  Push the files onto their chains from last to first, so that each
+	//  chain is in directory order and the highest version of a name comes
+	//  first, as it would in a scan.
+	//
+
+	for (Index = EntryCount; Index != 0; Index -= 1)
+	{
+		Bucket = NameIndex->Entries[Index - 1].Hash & (BucketCount - 1);
+
+		NameIndex->Entries[Index - 1].Next = NameIndex->Buckets[Bucket];
+		NameIndex->Buckets[Bucket] = Index;
+	}
+
+	CdFreePool(reinterpret_cast<PVOID*>(&Entries));
+
+	CdLockVcb( IrpContext, Vcb );
+
+	InsertTailList( &Vcb->NameIndexQueue, &Fcb->Index.NameIndexLinks );
+	Fcb->Index.NameIndex = NameIndex;
+
+	CdUnlockVcb( IrpContext, Vcb );
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdTrimNameIndexes(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PVCB Vcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called when memory is low to free the name indexes and
+    name arenas of the directories on a volume.  We can't wait for a
+    directory with the Vcb locked, so one in use by someone else keeps them
+    until its next lookup.  A directory we free is allowed to build them
+    again once memory is no longer low.
+
+Arguments:
+
+    Vcb - Vcb for the volume.  The Vcb mutex must not be held.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PLIST_ENTRY Links;
+	PFCB Fcb;
+	PCD_NAME_INDEX NameIndex;
+	PCD_NAME_ARENA NameArena;
+
+	PAGED_CODE();
+
+	if (IsListEmpty( &Vcb->NameIndexQueue ) &&
+		IsListEmpty( &Vcb->NameArenaQueue ))
+	{
+		return;
+	}
+
+	CdLockVcb( IrpContext, Vcb );
+
+	Links = Vcb->NameIndexQueue.Flink;
+
+	while (Links != &Vcb->NameIndexQueue)
+	{
+		Fcb = CONTAINING_RECORD( Links, FCB, Index.NameIndexLinks );
+		Links = Links->Flink;
+
+		//
+		//  This only fails if another thread owns the Fcb, and we may
+		//  already own it ourselves.
+		//
+
+		if (!CdAcquireFcbExclusive( IrpContext, Fcb, TRUE ))
+		{
+			continue;
+		}
+
+		NameIndex = Fcb->Index.NameIndex;
+
+		RemoveEntryList( &Fcb->Index.NameIndexLinks );
+		Fcb->Index.NameIndex = NULL;
+		Fcb->Index.NameIndexGeneration = 0;
+
+		CdReleaseFcb( IrpContext, Fcb );
+
+		InterlockedExchangeAdd( &Vcb->NameIndexBytes, -(LONG) NameIndex->AllocationSize );
+
+		CdFreePool(reinterpret_cast<PVOID*>(&NameIndex));
+	}
+
+	//
+	//  Arenas are read by anyone who has the Fcb acquired, so owning it
+	//  exclusively here keeps them all out.
+	//
+
+	Links = Vcb->NameArenaQueue.Flink;
+
+	while (Links != &Vcb->NameArenaQueue)
+	{
+		Fcb = CONTAINING_RECORD( Links, FCB, Index.NameArenaLinks );
+		Links = Links->Flink;
+
+		if (!CdAcquireFcbExclusive( IrpContext, Fcb, TRUE ))
+		{
+			continue;
+		}
+
+		NameArena = Fcb->Index.NameArena;
+
+		RemoveEntryList( &Fcb->Index.NameArenaLinks );
+		Fcb->Index.NameArena = NULL;
+		Fcb->Index.NameArenaTried = FALSE;
+
+		CdReleaseFcb( IrpContext, Fcb );
+
+		InterlockedExchangeAdd( &Vcb->NameIndexBytes, -(LONG) NameArena->AllocationSize );
+
+		CdFreePool(reinterpret_cast<PVOID*>(&NameArena));
+	}
+
+	CdUnlockVcb( IrpContext, Vcb );
+}
+
+
+//
+//  Local support routine
+//
+
+PCD_NEGATIVE_CACHE
+CdCreateNegativeCache(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to allocate the negative lookup cache for a
+    directory, with an empty list of misses and a Bloom filter sized at a
+    byte for every 32 bytes of directory.  No file takes less than that, so
+    this allows at least eight bits a file until the filter reaches its
+    largest size.  The cache comes from low priority pool, and if we can't
+    have it the directory does without.
+
+Arguments:
+
+    Fcb - Fcb for the directory, owned exclusively.
+
+Return Value:
+
+    PCD_NEGATIVE_CACHE - The new cache, also stored in the Fcb, or NULL.
+
+--*/
+
+{
+	PCD_NEGATIVE_CACHE NegativeCache;
+	ULONG BloomBytes;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	NT_ASSERT( Fcb->Index.NegativeCache == NULL );
+
+	for (BloomBytes = CD_NEGATIVE_BLOOM_MIN_BYTES;
+	     (BloomBytes < CD_NEGATIVE_BLOOM_MAX_BYTES) && (BloomBytes < Fcb->FileSize.QuadPart / 32);
+	     BloomBytes *= 2)
+	{
+		NOTHING;
+	}
+
+	NegativeCache = reinterpret_cast<PCD_NEGATIVE_CACHE>(ExAllocatePoolWithTagPriority( CdPagedPool,
+		sizeof( CD_NEGATIVE_CACHE ) + BloomBytes,
+		TAG_NEGATIVE_CACHE,
+		LowPoolPriority ));
+
+	if (NegativeCache == NULL)
+	{
+		return NULL;
+	}
+
+	RtlZeroMemory( NegativeCache, sizeof( CD_NEGATIVE_CACHE ) + BloomBytes );
+
+	NegativeCache->Generation = Fcb->Vcb->NameIndexGeneration;
+	NegativeCache->BloomBits = BloomBytes * 8;
+	NegativeCache->Bloom = Add2Ptr( NegativeCache, sizeof( CD_NEGATIVE_CACHE ), PUCHAR );
+
+	Fcb->Index.NegativeCache = NegativeCache;
+
+	return NegativeCache;
+}
+
+
+//
+//  Local support routine
+//
+
+BOOLEAN
+CdIsKnownMissing(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _In_ PCD_NAME Name,
+	     _In_ ULONG Hash,
+	     _In_ ULONG Flags,
+	     _In_ BOOLEAN UseBloom
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called before a lookup reads a directory, to check the
+    directory's negative cache for the name.  A cache from before the last
+    verify is thrown away first.
+
+Arguments:
+
+    Fcb - Fcb for the directory, owned exclusively.
+
+    Name - Name being looked up, upcased for a case insensitive lookup.
+
+    Hash - CdHashName of the name.
+
+    Flags - CD_NEGATIVE_FLAG_ values describing the lookup.
+
+    UseBloom - Indicates whether the Bloom filter can answer this lookup.
+
+Return Value:
+
+    BOOLEAN - TRUE if the name is known not to be in the directory.
+
+--*/
+
+{
+	PCD_NEGATIVE_CACHE NegativeCache = Fcb->Index.NegativeCache;
+	PCD_NEGATIVE_ENTRY Miss;
+	ULONG Probe;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	if (NegativeCache == NULL)
+	{
+		return FALSE;
+	}
+
+	if (NegativeCache->Generation != Fcb->Vcb->NameIndexGeneration)
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Index.NegativeCache));
+		return FALSE;
+	}
+
+	//
+	//  If any of the name's bits is clear then no file has this name.
+	//
+
+	if (UseBloom && NegativeCache->BloomValid)
+	{
+		for (Probe = 0; Probe < CD_NEGATIVE_BLOOM_PROBES; Probe += 1)
+		{
+			if (!FlagOn( NegativeCache->Bloom[ CdBloomBit( NegativeCache, Hash, Probe ) / 8 ],
+			             1 << (CdBloomBit( NegativeCache, Hash, Probe ) % 8) ))
+			{
+				InterlockedIncrement( &Fcb->Vcb->NameLookupMisses );
+				InterlockedIncrement( &Fcb->Vcb->NegativeBloomHits );
+				return TRUE;
+			}
+		}
+	}
+
+	//
+	//  Otherwise look for the same lookup among the recent misses.  We
+	//  don't keep names with versions.
+	//
+
+	if (Name->VersionString.Length != 0)
+	{
+		return FALSE;
+	}
+
+	for (Index = 0; Index < NegativeCache->MissCount; Index += 1)
+	{
+		Miss = &NegativeCache->Misses[Index];
+
+		if ((Miss->Hash == Hash) &&
+			(Miss->Flags == Flags) &&
+			(Miss->Length == Name->FileName.Length) &&
+			RtlEqualMemory( Miss->Name, Name->FileName.Buffer, Miss->Length ))
+		{
+			InterlockedIncrement( &Fcb->Vcb->NameLookupMisses );
+			InterlockedIncrement( &Fcb->Vcb->NegativeListHits );
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdNoteMissingName(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _In_ PCD_NAME Name,
+	     _In_ ULONG Hash,
+	     _In_ ULONG Flags
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called when a lookup has read the directory and not
+    found the name.  We add the name to the directory's list of recent
+    misses, replacing the oldest, unless it has a version or is too long
+    to keep.
+
+Arguments:
+
+    Fcb - Fcb for the directory, owned exclusively.
+
+    Name - Name which wasn't found, upcased for a case insensitive lookup.
+
+    Hash - CdHashName of the name.
+
+    Flags - CD_NEGATIVE_FLAG_ values describing the lookup.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_NEGATIVE_CACHE NegativeCache = Fcb->Index.NegativeCache;
+	PCD_NEGATIVE_ENTRY Miss;
+
+	PAGED_CODE();
+
+	InterlockedIncrement( &Fcb->Vcb->NameLookupMisses );
+
+	if ((Name->VersionString.Length != 0) ||
+		(Name->FileName.Length > sizeof( Miss->Name )))
+	{
+		return;
+	}
+
+	if (NegativeCache == NULL)
+	{
+		NegativeCache = CdCreateNegativeCache(IrpContext, Fcb);
+
+		if (NegativeCache == NULL)
+		{
+			return;
+		}
+	}
+
+	Miss = &NegativeCache->Misses[NegativeCache->NextMiss];
+
+	Miss->Hash = Hash;
+	Miss->Flags = (USHORT) Flags;
+	Miss->Length = Name->FileName.Length;
+
+	RtlCopyMemory( Miss->Name, Name->FileName.Buffer, Miss->Length );
+
+	NegativeCache->NextMiss = (NegativeCache->NextMiss + 1) % CD_NEGATIVE_MISSES;
+
+	if (NegativeCache->MissCount < CD_NEGATIVE_MISSES)
+	{
+		NegativeCache->MissCount += 1;
+	}
+}
+
+
+VOID
+CdBuildNameArena(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _Inout_ PFILE_ENUM_CONTEXT FileContext
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to decode the names of all the files in a
+    directory into its name arena, in one pass over the directory.  We
+    collect the names in buffers which grow as needed, then copy them into
+    an arena of the right size which is charged to the volume's budget
+    like the name indexes.  Everything comes from low priority pool, and a
+    directory without an arena goes on decoding names as it reads them.
+
+    Like the name index, an arena is only worth a scan of its own in a
+    directory of at least CD_NAME_INDEX_MIN_DIRECTORY bytes, and none is
+    built while memory is low.
+
+    The directory may only be shared, so we publish the arena with the Vcb
+    locked and throw ours away if someone else got there first.  Either
+    way we note that we have tried.
+
+Arguments:
+
+    Fcb - Fcb for the directory.  Its stream file exists.
+
+    FileContext - Initialized file context to scan with.  The caller must
+        clean it up.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PVCB Vcb = Fcb->Vcb;
+	PDIRENT Dirent;
+
+	PCD_NAME_ARENA NameArena;
+	PCD_NAME_ARENA_ENTRY Entries;
+	PWCHAR Names;
+	PWCHAR NextName;
+
+	ULONG EntryCount = 0;
+	ULONG EntryCapacity;
+	ULONG NameBytes = 0;
+	ULONG NameCapacity;
+	ULONG FileBytes;
+	ULONG AllocationSize;
+
+	WCHAR ShortName[ BYTE_COUNT_8_DOT_3 / sizeof( WCHAR ) ];
+	USHORT ShortNameLength;
+
+	PAGED_CODE();
+
+	//
+	//  Try again on a later lookup if memory is low now.
+	//
+
+	if (CdIsMemoryLow())
+	{
+		return;
+	}
+
+	CdLockFcb( IrpContext, Fcb );
+	Fcb->Index.NameArenaTried = TRUE;
+	CdUnlockFcb( IrpContext, Fcb );
+
+	if (Fcb->FileSize.QuadPart < CD_NAME_INDEX_MIN_DIRECTORY)
+	{
+		return;
+	}
+
+	//
+	//  Start with room for a file in every 64 bytes of directory, each
+	//  with 16 characters of name, and grow from there.
+	//
+
+	EntryCapacity = CD_NAME_INDEX_MAX_ENTRIES;
+
+	if (Fcb->FileSize.QuadPart / 64 < EntryCapacity)
+	{
+		EntryCapacity = (ULONG) (Fcb->FileSize.QuadPart / 64) + 1;
+	}
+
+	NameCapacity = EntryCapacity * 2 * 16 * sizeof( WCHAR );
+
+	Entries = reinterpret_cast<PCD_NAME_ARENA_ENTRY>(ExAllocatePoolWithTagPriority( CdPagedPool,
+		EntryCapacity * sizeof( CD_NAME_ARENA_ENTRY ),
+		TAG_NAME_ARENA,
+		LowPoolPriority ));
+
+	Names = reinterpret_cast<PWCHAR>(ExAllocatePoolWithTagPriority( CdPagedPool,
+		NameCapacity,
+		TAG_NAME_ARENA,
+		LowPoolPriority ));
+
+	__try
+	{
+		if ((Entries == NULL) || (Names == NULL))
+		{
+			try_leave( NOTHING );
+		}
+
+		CdLookupInitialFileDirent( IrpContext, Fcb, FileContext, Fcb->Index.StreamOffset );
+
+		do
+		{
+			Dirent = &FileContext->InitialDirent->Dirent;
+
+			CdUpdateDirentName(IrpContext, Dirent, TRUE);
+
+			if (FlagOn( Dirent->Flags, DIRENT_FLAG_CONSTANT_ENTRY ))
+			{
+				continue;
+			}
+
+			//
+			//  Generate the short name of a file whose name isn't 8.3.
+			//  RtlGenerate8dot3Name upcases it, so it is the same whatever
+			//  the case of the name we start from.
+			//
+
+			ShortNameLength = 0;
+
+			if (!CdIs8dot3Name(IrpContext,
+			                   Dirent->CdFileName.FileName))
+			{
+				CdGenerate8dot3Name(IrpContext,
+				                    &Dirent->CdCaseFileName.FileName,
+				                    Dirent->DirentOffset,
+				                    ShortName,
+				                    &ShortNameLength);
+			}
+
+			//
+			//  Make room for this file, giving up on directories with too
+			//  many files or names.
+			//
+
+			FileBytes = Dirent->CdFileName.FileName.Length + Dirent->CdFileName.VersionString.Length;
+
+			if ((EntryCount == CD_NAME_INDEX_MAX_ENTRIES) ||
+				!CdGrowNameArenaBuffer( IrpContext,
+				                        reinterpret_cast<PVOID*>(&Entries),
+				                        &EntryCapacity,
+				                        EntryCount * sizeof( CD_NAME_ARENA_ENTRY ),
+				                        (EntryCount + 1) * sizeof( CD_NAME_ARENA_ENTRY ),
+				                        sizeof( CD_NAME_ARENA_ENTRY )) ||
+				!CdGrowNameArenaBuffer( IrpContext,
+				                        reinterpret_cast<PVOID*>(&Names),
+				                        &NameCapacity,
+				                        NameBytes,
+				                        NameBytes + 2 * FileBytes + ShortNameLength,
+				                        1 ))
+			{
+				try_leave( NOTHING );
+			}
+
+			Entries[EntryCount].DirentOffset = Dirent->DirentOffset;
+			Entries[EntryCount].NameOffset = NameBytes / sizeof( WCHAR );
+			Entries[EntryCount].NameLength = Dirent->CdFileName.FileName.Length;
+			Entries[EntryCount].VersionLength = Dirent->CdFileName.VersionString.Length;
+			Entries[EntryCount].ShortNameLength = ShortNameLength;
+
+			//
+			//  Store the exact case name and version, then the upcased ones
+			//  and the short name.  Upcasing doesn't change their lengths.
+			//
+
+			NextName = Add2Ptr( Names, NameBytes, PWCHAR );
+
+			RtlCopyMemory( NextName,
+				Dirent->CdFileName.FileName.Buffer,
+				Dirent->CdFileName.FileName.Length );
+
+			RtlCopyMemory( Add2Ptr( NextName, Dirent->CdFileName.FileName.Length, PVOID ),
+				Dirent->CdFileName.VersionString.Buffer,
+				Dirent->CdFileName.VersionString.Length );
+
+			RtlCopyMemory( Add2Ptr( NextName, FileBytes, PVOID ),
+				Dirent->CdCaseFileName.FileName.Buffer,
+				Dirent->CdFileName.FileName.Length );
+
+			RtlCopyMemory( Add2Ptr( NextName, FileBytes + Dirent->CdFileName.FileName.Length, PVOID ),
+				Dirent->CdCaseFileName.VersionString.Buffer,
+				Dirent->CdFileName.VersionString.Length );
+
+			RtlCopyMemory( Add2Ptr( NextName, 2 * FileBytes, PVOID ),
+				ShortName,
+				ShortNameLength );
+
+			EntryCount += 1;
+			NameBytes += 2 * FileBytes + ShortNameLength;
+		}
+		while (CdLookupNextInitialFileDirent(IrpContext, Fcb, FileContext));
+
+		//
+		//  Charge the arena to the volume before allocating it.
+		//
+
+		AllocationSize = sizeof( CD_NAME_ARENA ) +
+		                 EntryCount * sizeof( CD_NAME_ARENA_ENTRY ) +
+		                 NameBytes;
+
+		if (InterlockedExchangeAdd( &Vcb->NameIndexBytes, AllocationSize ) + AllocationSize > CD_NAME_INDEX_VOLUME_BUDGET)
+		{
+			NameArena = NULL;
+		}
+		else
+		{
+			NameArena = reinterpret_cast<PCD_NAME_ARENA>(ExAllocatePoolWithTagPriority( CdPagedPool,
+				AllocationSize,
+				TAG_NAME_ARENA,
+				LowPoolPriority ));
+		}
+
+		if (NameArena == NULL)
+		{
+			InterlockedExchangeAdd( &Vcb->NameIndexBytes, -(LONG) AllocationSize );
+			try_leave( NOTHING );
+		}
+
+		NameArena->AllocationSize = AllocationSize;
+		NameArena->EntryCount = EntryCount;
+		NameArena->LastEntry = 0;
+		NameArena->Entries = Add2Ptr( NameArena, sizeof( CD_NAME_ARENA ), PCD_NAME_ARENA_ENTRY );
+		NameArena->Names = Add2Ptr( NameArena->Entries, EntryCount * sizeof( CD_NAME_ARENA_ENTRY ), PWCHAR );
+
+		RtlCopyMemory( NameArena->Entries, Entries, EntryCount * sizeof( CD_NAME_ARENA_ENTRY ));
+		RtlCopyMemory( NameArena->Names, Names, NameBytes );
+
+		CdLockVcb( IrpContext, Vcb );
+
+		if (Fcb->Index.NameArena == NULL)
+		{
+			InsertTailList( &Vcb->NameArenaQueue, &Fcb->Index.NameArenaLinks );
+			Fcb->Index.NameArena = NameArena;
+			NameArena = NULL;
+		}
+
+		CdUnlockVcb( IrpContext, Vcb );
+
+		if (NameArena != NULL)
+		{
+			InterlockedExchangeAdd( &Vcb->NameIndexBytes, -(LONG) AllocationSize );
+			CdFreePool(reinterpret_cast<PVOID*>(&NameArena));
+		}
+	}
+	__finally
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Entries));
+		CdFreePool(reinterpret_cast<PVOID*>(&Names));
+	}
+}
+
+
+//
+//  Local support routine
+//
+
+BOOLEAN
+CdGrowNameArenaBuffer(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PVOID* Buffer,
+	     _Inout_ PULONG Capacity,
+	     _In_ ULONG Used,
+	     _In_ ULONG Needed,
+	     _In_ ULONG ElementSize
+)
+
+/*++
+
+Routine Description:
+
+    This routine makes sure one of the buffers CdBuildNameArena collects
+    names in has room for the given number of bytes, doubling it as often
+    as needed.  No buffer grows past the volume's budget for names.
+
+Arguments:
+
+    Buffer - The buffer, replaced with a larger one if necessary.
+
+    Capacity - Number of elements the buffer holds, updated if it grows.
+
+    Used - Number of bytes in use, to copy to a new buffer.
+
+    Needed - Number of bytes which must fit.
+
+    ElementSize - Size in bytes of the elements counted by Capacity.
+
+Return Value:
+
+    BOOLEAN - TRUE if the buffer has room, FALSE if it couldn't be grown.
+        The buffer is unchanged in that case.
+
+--*/
+
+{
+	ULONG NewCapacity = *Capacity;
+	PVOID NewBuffer;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	while (NewCapacity * ElementSize < Needed)
+	{
+		if (NewCapacity * ElementSize > CD_NAME_INDEX_VOLUME_BUDGET / 2)
+		{
+			return FALSE;
+		}
+
+		NewCapacity *= 2;
+	}
+
+	if (NewCapacity == *Capacity)
+	{
+		return TRUE;
+	}
+
+	NewBuffer = ExAllocatePoolWithTagPriority( CdPagedPool,
+		NewCapacity * ElementSize,
+		TAG_NAME_ARENA,
+		LowPoolPriority );
+
+	if (NewBuffer == NULL)
+	{
+		return FALSE;
+	}
+
+	RtlCopyMemory( NewBuffer, *Buffer, Used );
+	CdFreePool( Buffer );
+
+	*Buffer = NewBuffer;
+	*Capacity = NewCapacity;
+
+	return TRUE;
+}
+
+
+//
+//  Local support routine
+//
+
+PCD_NAME_ARENA_ENTRY
+CdFindNameArenaEntry(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PCD_NAME_ARENA NameArena,
+	     _In_ ULONG DirentOffset,
+	     _In_ ULONG Shift
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to find the entry in a name arena for the file
+    whose first dirent is at the given offset.  A walk through the
+    directory usually wants the entry we found last or the one after it,
+    so we check those before searching the whole arena.
+
+    The offset may be shifted right, in which case we find the file whose
+    dirent begins in the block it gives.  Looking for a short name we
+    shift by SHORT_NAME_SHIFT.
+
+Arguments:
+
+    NameArena - Name arena of the directory.
+
+    DirentOffset - Offset of the dirent in the directory, shifted right by
+        Shift.
+
+    Shift - Number of bits the offsets are shifted by.
+
+Return Value:
+
+    PCD_NAME_ARENA_ENTRY - The entry for the file, or NULL if there isn't
+        one.
+
+--*/
+
+{
+	ULONG EntryIndex = NameArena->LastEntry;
+	ULONG Low = 0;
+	ULONG High = NameArena->EntryCount;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	if ((EntryIndex + 1 < NameArena->EntryCount) &&
+		((NameArena->Entries[EntryIndex + 1].DirentOffset >> Shift) == DirentOffset))
+	{
+		EntryIndex += 1;
+	}
+	else if ((EntryIndex >= NameArena->EntryCount) ||
+		((NameArena->Entries[EntryIndex].DirentOffset >> Shift) != DirentOffset))
+	{
+		while (Low < High)
+		{
+			EntryIndex = Low + (High - Low) / 2;
+
+			if ((NameArena->Entries[EntryIndex].DirentOffset >> Shift) < DirentOffset)
+			{
+				Low = EntryIndex + 1;
+			}
+			else
+			{
+				High = EntryIndex;
+			}
+		}
+
+		if ((Low == NameArena->EntryCount) ||
+			((NameArena->Entries[Low].DirentOffset >> Shift) != DirentOffset))
+		{
+			return NULL;
+		}
+
+		EntryIndex = Low;
+	}
+
+	NameArena->LastEntry = EntryIndex;
+
+	return &NameArena->Entries[EntryIndex];
+}
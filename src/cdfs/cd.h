@@ -374,6 +374,38 @@ typedef RAW_DIRENT* PRAW_DIRENT;
     (RD)->FlagsISO                                  \
 )
 
+//
+//  System use entries (SUSP) in the system use area of a directory entry.
+//  Cdfs only looks for the Rock Ridge zisofs entry.
+//
+
+typedef struct RawSUSPEntryHeader_tag
+{
+	CHAR Signature[2];
+	UCHAR Length;
+	UCHAR Version; //always 1
+} RAW_SUSP_ENTRY_HEADER, *PRAW_SUSP_ENTRY_HEADER;
+
+
+// Zisofs. ZF system use entry -> compression enabled
+//											1 byte				1 byte (15,16,17)
+// | 'Z' | 'F' | 16 | 1 | 'p' | 'z' | HEADER SIZE DIV 4 | LOG2 BLOCK SIZE
+//	8 bytes (4+4) intel + motorola
+//  | UNCOMPRESSED SIZE |
+//
+
+typedef struct RawZisoEntry_tag
+{
+	CHAR Signature[2]; // 'Z' 'F'
+	UCHAR Length; // 16
+	UCHAR Version; //always 1
+	CHAR Algorythm[2]; // 'p' 'z'
+	UCHAR HeaderSizeDiv4; // 4 -> size of file header /4
+	UCHAR BlockSizeLog2; // valid: 15 16 17 -> blocks (32K 64K 128K)
+	UCHAR UncompressedSizeIntel[4];
+	UCHAR UncompressedSizeMotorola[4];
+} RAW_ZISO_ENTRY, *PRAW_ZISO_ENTRY;
+
 //
 //  The following macro converts from CD time to NT time.  On ISO
 //  9660 media, we now pay attention to the GMT offset (integer
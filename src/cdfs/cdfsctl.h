@@ -0,0 +1,273 @@
+/*++
+
+Module Name:
+
+    CdFsctl.h
+
+Abstract:
+
+    This module defines the private file system controls understood by
+    Cdfs and the layout of the data they return.  It is shared with the
+    user mode tools that issue them, so it only depends on the standard
+    ioctl definitions.
+
+
+--*/
+
+#ifndef _CDFSCTL_
+#define _CDFSCTL_
+
+//
+//  Private file system controls.  All of them must be issued against a
+//  handle to the volume.  The read trace shows the reads of every user of
+//  the volume, so querying it needs a handle opened for read access.
+//  Setting the tuning changes it for every user of the volume, so it needs
+//  a handle opened for write access and SeManageVolumePrivilege.
+//
+//      FSCTL_CDFS_QUERY_READ_TRACE - Returns a CDFS_READ_TRACE holding the
+//          most recent reads seen by CdCommonRead, oldest first.
+//
+//      FSCTL_CDFS_QUERY_SECTOR_CACHE - Returns a CDFS_SECTOR_CACHE_STATISTICS
+//          describing the volume's directory sector cache.
+//
+//      FSCTL_CDFS_QUERY_IO_STATISTICS - Returns the volume's
+//          CDFS_IO_STATISTICS.
+//
+//      FSCTL_CDFS_QUERY_TUNING - Returns the volume's CDFS_VOLUME_TUNING.
+//
+//      FSCTL_CDFS_SET_TUNING - Takes a CDFS_VOLUME_TUNING and applies it to
+//          the volume.
+//
+
+#define FSCTL_CDFS_QUERY_READ_TRACE     CTL_CODE( FILE_DEVICE_CD_ROM_FILE_SYSTEM, 0x800, METHOD_BUFFERED, FILE_READ_DATA )
+#define FSCTL_CDFS_QUERY_SECTOR_CACHE   CTL_CODE( FILE_DEVICE_CD_ROM_FILE_SYSTEM, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS )
+#define FSCTL_CDFS_QUERY_TUNING         CTL_CODE( FILE_DEVICE_CD_ROM_FILE_SYSTEM, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS )
+#define FSCTL_CDFS_SET_TUNING           CTL_CODE( FILE_DEVICE_CD_ROM_FILE_SYSTEM, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA )
+#define FSCTL_CDFS_QUERY_IO_STATISTICS  CTL_CODE( FILE_DEVICE_CD_ROM_FILE_SYSTEM, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+//
+//  One recorded read.  FileId is the Cdfs file id of the stream being read
+//  and Timestamp is the system interrupt time at which the read arrived.
+//
+//  Records flagged CDFS_READ_TRACE_DEVICE_IO describe a read we sent to the
+//  device rather than one we received.  ByteOffset is then the byte offset
+//  on the disk, and FileId is zero when the read is not on behalf of a
+//  single stream (volume descriptors, sector cache fills, XA runs).
+//  CDFS_READ_TRACE_RAW_SECTORS marks device reads of raw XA sectors, whose
+//  Length still counts cooked bytes.
+//
+
+typedef struct _CDFS_READ_TRACE_RECORD
+{
+	LONGLONG FileId;
+	LONGLONG ByteOffset;
+	ULONG Length;
+	ULONG Flags;
+	ULONGLONG Timestamp;
+} CDFS_READ_TRACE_RECORD, *PCDFS_READ_TRACE_RECORD;
+
+#define CDFS_READ_TRACE_PAGING_IO       (0x00000001)
+#define CDFS_READ_TRACE_NON_CACHED      (0x00000002)
+#define CDFS_READ_TRACE_SYNCHRONOUS     (0x00000004)
+#define CDFS_READ_TRACE_COMPRESSED      (0x00000008)
+#define CDFS_READ_TRACE_DEVICE_IO       (0x00000010)
+#define CDFS_READ_TRACE_RAW_SECTORS     (0x00000020)
+
+//
+//  Output of FSCTL_CDFS_QUERY_READ_TRACE.  TotalRecorded counts every read
+//  since the volume was mounted, so a value larger than RecordCount means
+//  older records were overwritten or did not fit in the caller's buffer.
+//
+
+typedef struct _CDFS_READ_TRACE
+{
+	ULONG RecordCount;
+	ULONG TotalRecorded;
+	CDFS_READ_TRACE_RECORD Records[ ANYSIZE_ARRAY ];
+} CDFS_READ_TRACE, *PCDFS_READ_TRACE;
+
+//
+//  Classes of metadata read through the sector cache.  Directories and
+//  the path table are always cached; zisofs files only for the header and
+//  block pointer table read when the file is first opened.
+//
+
+#define CDFS_SECTOR_CACHE_CLASS_DIRECTORY           (0)
+#define CDFS_SECTOR_CACHE_CLASS_PATH_TABLE          (1)
+#define CDFS_SECTOR_CACHE_CLASS_COMPRESSION_TABLE   (2)
+#define CDFS_SECTOR_CACHE_CLASSES                   (3)
+
+typedef struct _CDFS_SECTOR_CACHE_CLASS_STATISTICS
+{
+	ULONG Hits;
+	ULONG Misses;
+} CDFS_SECTOR_CACHE_CLASS_STATISTICS, *PCDFS_SECTOR_CACHE_CLASS_STATISTICS;
+
+//
+//  Output of FSCTL_CDFS_QUERY_SECTOR_CACHE.  ChunkCount is zero if the
+//  volume has no sector cache, which is the case for multi track discs.
+//  Hits count lookups satisfied from memory, Misses count chunks read from
+//  the disc and Evictions count chunks replaced to make room for them.
+//  Hits and Misses are the totals over Classes, which is indexed by the
+//  CDFS_SECTOR_CACHE_CLASS_ values.  The counters are sampled without
+//  stopping the volume and wrap.
+//
+
+typedef struct _CDFS_SECTOR_CACHE_STATISTICS
+{
+	ULONG ChunkCount;
+	ULONG ChunkSize;
+	ULONG Hits;
+	ULONG Misses;
+	ULONG Evictions;
+	CDFS_SECTOR_CACHE_CLASS_STATISTICS Classes[ CDFS_SECTOR_CACHE_CLASSES ];
+} CDFS_SECTOR_CACHE_STATISTICS, *PCDFS_SECTOR_CACHE_STATISTICS;
+
+//
+//  Per volume tuning, in and out of FSCTL_CDFS_SET_TUNING and
+//  FSCTL_CDFS_QUERY_TUNING.  Settings last until the volume is dismounted.
+//
+//      MaxQueueDepth - Largest number of reads a single non-cached request
+//          sends to the device at once, from 1 to CDFS_MAX_QUEUE_DEPTH.
+//          Requests needing more are issued in several passes.
+//
+//      InterleaveBridgeBytes - Largest gap between the file units of an
+//          interleaved file, up to CDFS_MAX_INTERLEAVE_BRIDGE, that a
+//          non-cached read reads through instead of issuing a separate
+//          read for each unit.  Set it to what the drive can read in the
+//          time of a short seek.  Zero turns bridging off.
+//
+//      WarmUpLevels - Depth below the root, up to CDFS_MAX_WARM_UP_LEVELS,
+//          of the directories read into the sector cache in the background
+//          after mount.  The warm-up runs once, so a new value only limits
+//          one still running, and zero stops it.
+//
+//      MaxTransferLength - Largest read in bytes sent to the device at once.
+//          Longer runs are split into reads of this size.  Zero selects the
+//          most the device's adapter takes in one transfer, and larger
+//          values are refused.  Otherwise it must be a multiple of 2048 and at
+//          least CDFS_MIN_TRANSFER_LENGTH.  Query returns the length in use.
+//
+
+typedef struct _CDFS_VOLUME_TUNING
+{
+	ULONG MaxQueueDepth;
+	ULONG InterleaveBridgeBytes;
+	ULONG WarmUpLevels;
+	ULONG MaxTransferLength;
+} CDFS_VOLUME_TUNING, *PCDFS_VOLUME_TUNING;
+
+#define CDFS_MAX_QUEUE_DEPTH            (0x100)
+#define CDFS_MAX_INTERLEAVE_BRIDGE      (0x100000)
+#define CDFS_MIN_TRANSFER_LENGTH        (0x1000)
+#define CDFS_MAX_WARM_UP_LEVELS         (8)
+
+//
+//  Device reads of one priority.  Low priority reads are those made for
+//  requests with an I/O priority hint below normal, and for the sector
+//  cache warm-up.  Of these only synchronous reads into the caller's
+//  buffer wait, for up to a quarter second, to go to the device until no
+//  normal priority read is outstanding.  Paging reads, read-ahead and
+//  sector cache fills never wait, as others may be waiting on them.  The
+//  warm-up instead waits before each of its reads until no read has been
+//  received for a while.
+//
+//      Reads - Batches of device reads sent together for one request.
+//
+//      Deferred - Batches which waited for normal priority reads.
+//
+//      TotalLatency, MaxLatency - Microseconds from a batch being ready to
+//          its last read completing, including any wait.
+//
+
+#define CDFS_READ_PRIORITY_NORMAL       (0)
+#define CDFS_READ_PRIORITY_LOW          (1)
+#define CDFS_READ_PRIORITIES            (2)
+
+typedef struct _CDFS_READ_PRIORITY_STATISTICS
+{
+	ULONG Reads;
+	ULONG Deferred;
+	ULONGLONG TotalLatency;
+	ULONGLONG MaxLatency;
+} CDFS_READ_PRIORITY_STATISTICS, *PCDFS_READ_PRIORITY_STATISTICS;
+
+//
+//  Output of FSCTL_CDFS_QUERY_IO_STATISTICS, counting non-cached reads
+//  and failed file lookups since the volume was mounted.  The counters wrap.
+//
+//      BounceBufferCount - Page sized buffers the volume keeps for reads
+//          which don't start or end on a sector boundary.  Zero if they
+//          couldn't be allocated at mount.
+//
+//      BounceBufferUses - Unaligned runs which used one of them.
+//
+//      BounceBufferMisses - Unaligned runs which found none free and
+//          allocated a buffer of their own.
+//
+//      XAStagingBufferCount - Buffers an XA volume keeps to read the raw
+//          sectors around an unaligned raw read in one transfer.
+//
+//      XAStagedReads - Unaligned raw reads which used one of them.
+//
+//      XAStagingMisses - Unaligned raw reads which found none free and
+//          read a single sector instead.
+//
+//      BridgedReads - Reads of interleaved files which read through the
+//          gaps between file units.
+//
+//      BridgedGaps, BridgedGapBytes - Gaps read through by those reads and
+//          the bytes read from them and thrown away.
+//
+//      CoalescedReads - Device reads saved because the sectors were already
+//          being read for another request.
+//
+//      WarmUpReads - Path table, directory and zisofs table reads made by
+//          the warm-up after mount.  The sector cache statistics count
+//          them along with all other metadata reads.
+//
+//      SplitRuns - Times a run of contiguous sectors was cut short to keep
+//          a device read within the volume's MaxTransferLength.
+//
+//      Priorities - Device reads by priority, indexed by the
+//          CDFS_READ_PRIORITY_ values.
+//
+//      NameLookupMisses - Opens of files which weren't in the directory.
+//
+//      NegativeBloomHits, NegativeListHits - Those of them answered without
+//          reading the directory, by the directory's Bloom filter of its
+//          file names or its list of recent misses.
+//
+//      StagingBufferCount - Multi-sector buffers the volume keeps to read
+//          an unaligned run longer than a page in one transfer.
+//
+//      StagedReads - Unaligned runs which used one of them.
+//
+//      StagingMisses - Unaligned runs longer than a page which found none
+//          free and read a page at a time instead.
+//
+
+typedef struct _CDFS_IO_STATISTICS
+{
+	ULONG BounceBufferCount;
+	ULONG BounceBufferUses;
+	ULONG BounceBufferMisses;
+	ULONG XAStagingBufferCount;
+	ULONG XAStagedReads;
+	ULONG XAStagingMisses;
+	ULONG BridgedReads;
+	ULONG BridgedGaps;
+	ULONG BridgedGapBytes;
+	ULONG CoalescedReads;
+	ULONG WarmUpReads;
+	ULONG SplitRuns;
+	CDFS_READ_PRIORITY_STATISTICS Priorities[ CDFS_READ_PRIORITIES ];
+	ULONG NameLookupMisses;
+	ULONG NegativeBloomHits;
+	ULONG NegativeListHits;
+	ULONG StagingBufferCount;
+	ULONG StagedReads;
+	ULONG StagingMisses;
+} CDFS_IO_STATISTICS, *PCDFS_IO_STATISTICS;
+
+#endif // _CDFSCTL_
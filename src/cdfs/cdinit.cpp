@@ -255,6 +255,11 @@ Return Value:
 		CdFreePool(reinterpret_cast<PVOID*>(&IrpContext));
 	}
 
+	if (CdData.LowMemoryEvent != NULL)
+	{
+		ZwClose(CdData.LowMemoryEventHandle);
+	}
+
 	IoFreeWorkItem(CdData.CloseItem);
 	ExDeleteResourceLite(&CdData.DataResource);
 	ObDereferenceObject (CdData.FileSystemDeviceObject);
@@ -289,6 +294,8 @@ Return Value:
 --*/
 
 {
+	UNICODE_STRING EventName;
+
 	//
 	//  Start by initializing the FastIoDispatch Table.
 	//
@@ -368,6 +375,16 @@ Return Value:
 		ExDeleteResourceLite(&CdData.DataResource);
 		return STATUS_INSUFFICIENT_RESOURCES ;
 	}
+
+	//
+	//  Open the system's low memory condition event.  We can run without
+	//  it, we just don't give back our caches early.
+	//
+
+	RtlInitUnicodeString( &EventName, L"\\KernelObjects\\LowMemoryCondition" );
+
+	CdData.LowMemoryEvent = IoCreateNotificationEvent( &EventName, &CdData.LowMemoryEventHandle );
+
 	//
 	//  Do the initialization based on the system size.
 	//
@@ -52,12 +52,20 @@ Abstract:
 #define TAG_GEN_SHORT_NAME      'sgdC'      //  Generated short name
 #define TAG_IO_BUFFER           'fbdC'      //  Temporary IO buffer
 #define TAG_IO_CONTEXT          'oidC'      //  Io context for async reads
+#define TAG_IO_RUNS             'ridC'      //  Io run array for deep non-cached reads
 #define TAG_IRP_CONTEXT         'cidC'      //  Irp Context
 #define TAG_IRP_CONTEXT_LITE    'lidC'      //  Irp Context lite
 #define TAG_MCB_ARRAY           'amdC'      //  Mcb array
+#define TAG_NAME_ARENA          'andC'      //  Decoded directory names
+#define TAG_NAME_INDEX          'indC'      //  Directory name index
+#define TAG_NEGATIVE_CACHE      'cndC'      //  Directory negative lookup cache
 #define TAG_PATH_ENTRY_NAME     'nPdC'      //  CdName in path entry
+#define TAG_PATH_INDEX          'ipdC'      //  In-memory path table
 #define TAG_PREFIX_ENTRY        'epdC'      //  Prefix Entry
 #define TAG_PREFIX_NAME         'npdC'      //  Prefix Entry name
+#define TAG_PREFIX_TABLE        'tpdC'      //  Prefix hash table
+#define TAG_READ_TRACE          'trdC'      //  Read trace ring
+#define TAG_SECTOR_CACHE        'csdC'      //  Sector cache chunk table
 #define TAG_SPANNING_PATH_TABLE 'psdC'      //  Buffer for spanning path table
 #define TAG_UPCASE_NAME         'nudC'      //  Buffer for upcased name
 #define TAG_VOL_DESC            'dvdC'      //  Buffer for volume descriptor
@@ -80,6 +88,19 @@ Abstract:
 #define CdNonPagedPool              NonPagedPoolNx
 #define CdNonPagedPoolCacheAligned  NonPagedPoolNxCacheAligned
 
+//
+//  BOOLEAN
+//  CdIsMemoryLow (
+//      );
+//
+//  Returns whether the system has signalled that free memory is short.
+//  Caches we can rebuild are given back and not grown while it is.
+//
+
+#define CdIsMemoryLow()                                                 \
+    ((CdData.LowMemoryEvent != NULL) &&                                 \
+     (KeReadStateEvent( CdData.LowMemoryEvent ) != 0))
+
 // 
 // Compression support routines and some other data types
 //
@@ -89,6 +110,7 @@ Abstract:
 
 #include "nodetype.h"
 #include "Cd.h"
+#include "CdFsctl.h"
 #include "CdStruc.h"
 #include "CdData.h"
 
@@ -198,6 +220,13 @@ extern "C"
 		     _In_ LONGLONG DataLength
 	);
 
+	VOID
+	CdReserveMcbEntries(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PFCB Fcb,
+		     _In_ ULONG EntryCount
+	);
+
 	VOID
 	CdTruncateAllocation(
 		_In_ PIRP_CONTEXT IrpContext,
@@ -388,6 +417,21 @@ extern "C"
 		     _In_ PDEVICE_OBJECT TargetDeviceObject
 	);
 
+	VOID
+	CdRecordReadTrace(
+		_In_ PVCB Vcb,
+		     _In_ LONGLONG FileId,
+		     _In_ LONGLONG ByteOffset,
+		     _In_ ULONG ByteCount,
+		     _In_ ULONG Flags
+	);
+
+	VOID
+	CdStartWarmUp(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PVCB Vcb
+	);
+
 
 	//
 	//  VOID
@@ -459,6 +503,30 @@ extern "C"
 		     _In_ ULONG IgnoreCase
 	);
 
+	VOID
+	CdLookupDirentName(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _Inout_ PDIRENT Dirent,
+		     _In_ ULONG IgnoreCase
+	);
+
+	BOOLEAN
+	CdLookupDirentShortName(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _In_ PDIRENT Dirent,
+		     _Out_writes_bytes_to_(BYTE_COUNT_8_DOT_3, *ShortByteCount) PWCHAR ShortFileName,
+		     _Inout_ PUSHORT ShortByteCount
+	);
+
+	VOID
+	CdBuildNameArena(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _Inout_ PFILE_ENUM_CONTEXT FileContext
+	);
+
 	_Success_(return != FALSE) BOOLEAN
 	CdFindFile(
 		_In_ PIRP_CONTEXT IrpContext,
@@ -509,6 +577,18 @@ extern "C"
 		     _In_ PFILE_ENUM_CONTEXT FileContext
 	);
 
+	VOID
+	CdDeleteNameIndex(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PFCB Fcb
+	);
+
+	VOID
+	CdDeleteNameArena(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PFCB Fcb
+	);
+
 	//
 	//  VOID
 	//  CdInitializeFileContext (
@@ -700,6 +780,12 @@ extern "C"
 		     _In_ BOOLEAN CheckVersion
 	);
 
+	ULONG
+	CdClassifyNameExpression(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PUNICODE_STRING Expression
+	);
+
 	ULONG
 	CdShortNameDirentOffset(
 		_In_ PIRP_CONTEXT IrpContext,
@@ -713,6 +799,12 @@ extern "C"
 		     _In_ PUNICODE_STRING NameB
 	);
 
+	ULONG
+	CdHashName(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PUNICODE_STRING Name
+	);
+
 
 	//
 	//  Filesystem control operations.  Implemented in Fsctrl.c
@@ -772,6 +864,12 @@ extern "C"
 		     _In_ BOOLEAN IgnoreCase
 	);
 
+	VOID
+	CdBuildPathIndex(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PVCB Vcb
+	);
+
 	//
 	//  VOID
 	//  CdInitializeCompoundPathEntry (
@@ -983,17 +1081,17 @@ extern "C"
 	//
 
 
-#define CdAcquireCacheForRead( IC)                                                      \
-    ExAcquireResourceSharedLite( &(IC)->Vcb->SectorCacheResource, TRUE)
+#define CdAcquireCacheForRead( IC, P)                                                   \
+    ExAcquireResourceSharedLite( &(P)->Resource, TRUE)
 
-#define CdAcquireCacheForUpdate( IC)                                                    \
-    ExAcquireResourceExclusiveLite( &(IC)->Vcb->SectorCacheResource, TRUE)
+#define CdAcquireCacheForUpdate( IC, P)                                                 \
+    ExAcquireResourceExclusiveLite( &(P)->Resource, TRUE)
 
-#define CdReleaseCache( IC)                                                             \
-    ExReleaseResourceLite( &(IC)->Vcb->SectorCacheResource);
+#define CdReleaseCache( IC, P)                                                          \
+    ExReleaseResourceLite( &(P)->Resource);
 
-#define CdConvertCacheToShared( IC)                                                     \
-    ExConvertExclusiveToSharedLite( &(IC)->Vcb->SectorCacheResource);
+#define CdConvertCacheToShared( IC, P)                                                  \
+    ExConvertExclusiveToSharedLite( &(P)->Resource);
 
 #define CdAcquireCdData(IC)                                                             \
     ExAcquireResourceExclusiveLite( &CdData.DataResource, TRUE )
@@ -1184,6 +1282,36 @@ BOOLEAN DummyRestoreIrql(_Inout_ PFAST_MUTEX FastMutex);
 		     _Inout_ PVCB Vcb
 	);
 
+	VOID
+	CdCreateSectorCache(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PVCB Vcb,
+		     _In_ ULONG PathTableSize,
+		     _In_ ULONG StackSize
+	);
+
+	VOID
+	CdResetSectorCache(
+		_Inout_ PCD_SECTOR_CACHE SectorCache
+	);
+
+	VOID
+	CdDeleteSectorCache(
+		_Inout_ PVCB Vcb
+	);
+
+	VOID
+	CdCreateBufferPool(
+		_Inout_ PCD_BUFFER_POOL Pool,
+		        _In_ ULONG BufferCount,
+		        _In_ ULONG BufferSize
+	);
+
+	VOID
+	CdDeleteBufferPool(
+		_Inout_ PCD_BUFFER_POOL Pool
+	);
+
 	PFCB
 	CdCreateFcb(
 		_In_ PIRP_CONTEXT IrpContext,
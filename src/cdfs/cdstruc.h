@@ -192,6 +192,9 @@ typedef NAME_LINK* PNAME_LINK;
 class PREFIX_ENTRY;
 typedef PREFIX_ENTRY* PPREFIX_ENTRY;
 
+class CD_PREFIX_TABLE;
+typedef CD_PREFIX_TABLE* PCD_PREFIX_TABLE;
+
 class CD_DATA;
 typedef CD_DATA* PCD_DATA;
 
@@ -201,6 +204,51 @@ typedef CDROM_TOC_LARGE* PCDROM_TOC_LARGE;
 class CD_SECTOR_CACHE_CHUNK;
 typedef CD_SECTOR_CACHE_CHUNK* PCD_SECTOR_CACHE_CHUNK;
 
+class CD_SECTOR_CACHE_PARTITION;
+typedef CD_SECTOR_CACHE_PARTITION* PCD_SECTOR_CACHE_PARTITION;
+
+class CD_SECTOR_CACHE;
+typedef CD_SECTOR_CACHE* PCD_SECTOR_CACHE;
+
+class CD_READ_TRACE;
+typedef CD_READ_TRACE* PCD_READ_TRACE;
+
+class CD_BOUNCE_BUFFER;
+typedef CD_BOUNCE_BUFFER* PCD_BOUNCE_BUFFER;
+
+class CD_BUFFER_POOL;
+typedef CD_BUFFER_POOL* PCD_BUFFER_POOL;
+
+class CD_INFLIGHT_READ;
+typedef CD_INFLIGHT_READ* PCD_INFLIGHT_READ;
+
+class CD_DEVICE_READ;
+typedef CD_DEVICE_READ* PCD_DEVICE_READ;
+
+class CD_NAME_INDEX_ENTRY;
+typedef CD_NAME_INDEX_ENTRY* PCD_NAME_INDEX_ENTRY;
+
+class CD_NAME_INDEX;
+typedef CD_NAME_INDEX* PCD_NAME_INDEX;
+
+class CD_NAME_ARENA_ENTRY;
+typedef CD_NAME_ARENA_ENTRY* PCD_NAME_ARENA_ENTRY;
+
+class CD_NAME_ARENA;
+typedef CD_NAME_ARENA* PCD_NAME_ARENA;
+
+class CD_NEGATIVE_ENTRY;
+typedef CD_NEGATIVE_ENTRY* PCD_NEGATIVE_ENTRY;
+
+class CD_NEGATIVE_CACHE;
+typedef CD_NEGATIVE_CACHE* PCD_NEGATIVE_CACHE;
+
+class CD_PATH_INDEX_ENTRY;
+typedef CD_PATH_INDEX_ENTRY* PCD_PATH_INDEX_ENTRY;
+
+class CD_PATH_INDEX;
+typedef CD_PATH_INDEX* PCD_PATH_INDEX;
+
 class VCB;
 typedef VCB* PVCB;
 
@@ -293,6 +341,13 @@ public:
 	//
 
 	PCD_MCB_ENTRY McbArray;
+
+	//
+	//  Offset of the entry CdFindMcbEntry last found.  Sequential reads
+	//  usually land in it or the one after, so we look there first.
+	//
+
+	ULONG LastEntryOffset;
 };
 
 class CD_MCB_ENTRY
@@ -351,15 +406,15 @@ public:
 };
 
 //
-//  Following is the splay link structure for the prefix lookup.
-//  The names can be in either Unicode string or Ansi string format.
+//  Following is the name link structure for the prefix lookup.  Hash is
+//  the CdHashName of the name, computed when the link is inserted.
 //
 
 class NAME_LINK
 {
 public:
 
-	RTL_SPLAY_LINKS Links;
+	ULONG Hash;
 	UNICODE_STRING FileName;
 };
 
@@ -404,6 +459,27 @@ public:
 #define PREFIX_FLAG_EXACT_CASE_IN_TREE              (0x00000001)
 #define PREFIX_FLAG_IGNORE_CASE_IN_TREE             (0x00000002)
 
+//
+//  Prefix table.  An index Fcb has one for the exact case names of its
+//  children and one for their upcased names, each allocated with its first
+//  name and freed with its last.  The table is open addressed with linear
+//  probing, over SlotCount slots kept a power of two and at least twice
+//  EntryCount.  Lookups only read it, so they need the parent Fcb at least
+//  shared.  Inserts and removals need it exclusive.
+//
+
+class CD_PREFIX_TABLE
+{
+public:
+
+	ULONG SlotCount;
+	ULONG EntryCount;
+
+	PNAME_LINK Slots[ ANYSIZE_ARRAY ];
+};
+
+#define CD_PREFIX_TABLE_MIN_SLOTS                   (8)
+
 
 //
 //  The CD_DATA record is the top record in the CDROM file system in-memory
@@ -510,6 +586,22 @@ public:
 	//
 
 	PIO_WORKITEM CloseItem;
+
+	//
+	//  The system's low memory condition event, if we could open it.  It is
+	//  signalled while free memory is short, and then the directory name
+	//  indexes are freed and no new ones are built.
+	//
+
+	PKEVENT LowMemoryEvent;
+	HANDLE LowMemoryEventHandle;
+
+	//
+	//  Bytes of zisofs staging buffers kept by handles between reads.  It
+	//  may not grow past COMPRESSION_BUFFER_RETAIN_TOTAL.
+	//
+
+	__volatile LONG RetainedCompressionBytes;
 };
 
 #define CD_FLAGS_SHUTDOWN                   (0x0001)
@@ -544,16 +636,201 @@ public:
 	TRACK_DATA TrackData[ MAXIMUM_NUMBER_TRACKS_LARGE];
 };
 
+//
+//  The sector cache holds aligned chunks of CD_SEC_CHUNK_BLOCKS blocks,
+//  counting from block 16 (VRS start).  Chunk n caches the blocks starting
+//  at 16 + n * CD_SEC_CHUNK_BLOCKS, and always lives in partition
+//  n % CD_SEC_CACHE_PARTITIONS.  Each partition has its own resource, its
+//  own share of the chunks and hash buckets, and its own Irp to fill them,
+//  so a miss only blocks lookups of the chunks sharing its partition.
+//
+//  Chunks are replaced with the CLOCK algorithm.  A chunk read in is not
+//  marked referenced, so a one time scan through the directories is
+//  replaced before chunks that have been hit since they were read.
+//
+
+#define CD_SEC_CHUNK_BLOCKS         0x18
+#define CD_SEC_CACHE_PARTITIONS     4
+
 class CD_SECTOR_CACHE_CHUNK
 {
 public:
 
+	//
+	//  First block cached in this chunk, or CD_SEC_CACHE_NO_LBN if the
+	//  chunk is free.  Only free chunks are off the hash chains.
+	//
+
 	ULONG BaseLbn;
-	PUCHAR Buffer;
+
+	//
+	//  Index of the next chunk in the same hash bucket.
+	//
+
+	ULONG NextInBucket;
+
+	//
+	//  Set by a hit, cleared as the clock hand passes.
+	//
+
+	__volatile LONG Referenced;
+};
+
+#define CD_SEC_CACHE_NO_LBN         ((ULONG)-1)
+#define CD_SEC_CACHE_NO_CHUNK       ((ULONG)-1)
+#define CD_SEC_CACHE_NO_CLASS       ((ULONG)-1)
+
+class CD_SECTOR_CACHE_PARTITION
+{
+public:
+
+	ERESOURCE Resource;
+
+	PIRP Irp;
+	KEVENT Event;
+
+	//
+	//  Next chunk, relative to the start of the partition, the clock hand
+	//  will look at.
+	//
+
+	ULONG ClockHand;
+};
+
+class CD_SECTOR_CACHE
+{
+public:
+
+	//
+	//  Total number of chunks, a multiple of CD_SEC_CACHE_PARTITIONS, and
+	//  the mask applied to a chunk's number within its partition to find
+	//  its hash bucket.
+	//
+
+	ULONG ChunkCount;
+	ULONG BucketMask;
+
+	//
+	//  Counters returned by FSCTL_CDFS_QUERY_SECTOR_CACHE, per class of
+	//  metadata read.
+	//
+
+	__volatile LONG Hits[ CDFS_SECTOR_CACHE_CLASSES ];
+	__volatile LONG Misses[ CDFS_SECTOR_CACHE_CLASSES ];
+	__volatile LONG Evictions;
+
+	CD_SECTOR_CACHE_PARTITION Partitions[ CD_SEC_CACHE_PARTITIONS ];
+
+	//
+	//  ChunkCount chunks, partition p owning the p'th run of
+	//  ChunkCount / CD_SEC_CACHE_PARTITIONS of them, followed by the hash
+	//  bucket heads laid out the same way.  Both follow this structure in
+	//  the same allocation.
+	//
+
+	PCD_SECTOR_CACHE_CHUNK Chunks;
+	PULONG Buckets;
+};
+
+//
+//  The number of chunks is picked at mount from the size of the path
+//  table, which grows with the number of directories on the disc.
+//
+
+#define CD_SEC_CACHE_MIN_CHUNKS     (8)
+#define CD_SEC_CACHE_MAX_CHUNKS     (0x80)
+#define CD_SEC_CACHE_PT_BYTES_PER_CHUNK (0x100)
+
+//
+//  Bounded ring of the most recent reads on a volume, returned through
+//  FSCTL_CDFS_QUERY_READ_TRACE.  Writers claim a slot by incrementing
+//  NextRecord and never wait, so a reader may see a record that is still
+//  being filled in.  The record count must be a power of two.
+//
+
+#define CD_READ_TRACE_RECORDS   (0x200)
+
+class CD_READ_TRACE
+{
+public:
+
+	__volatile LONG NextRecord;
+	CDFS_READ_TRACE_RECORD Records[ CD_READ_TRACE_RECORDS ];
+};
+
+//
+//  A buffer of nonpaged pool and the Mdl describing it, used to read the
+//  unaligned head or tail of a non-cached read.  Each Vcb keeps a pool of
+//  CD_BOUNCE_BUFFERS pages so small unaligned reads don't allocate, a pool
+//  of CD_STAGING_BUFFERS buffers of up to CD_STAGING_BYTES for longer
+//  unaligned runs, and XA volumes a pool of CD_XA_STAGING_BUFFERS buffers
+//  of up to CD_XA_STAGING_SECTORS raw sectors.
+//
+
+#define CD_BOUNCE_BUFFERS       (8)
+
+#define CD_STAGING_BUFFERS      (2)
+#define CD_STAGING_BYTES        (0x10000)
+
+#define CD_XA_STAGING_BUFFERS   (2)
+#define CD_XA_STAGING_SECTORS   (27)
+
+class CD_BOUNCE_BUFFER
+{
+public:
+
+	SLIST_ENTRY Links;
+
+	PVOID Buffer;
+	PMDL Mdl;
+};
+
+//
+//  A list of bounce buffers of BufferSize bytes, taken and returned
+//  without a lock.  Buffers is the array backing the list, with
+//  BufferCount entries, or NULL if the pool couldn't be allocated.  Each
+//  buffer starts on a page.
+//
+
+class CD_BUFFER_POOL
+{
+public:
+
+	SLIST_HEADER List;
+
+	PCD_BOUNCE_BUFFER Buffers;
+	ULONG BufferCount;
+	ULONG BufferSize;
 };
 
-#define CD_SEC_CACHE_CHUNKS  4
-#define CD_SEC_CHUNK_BLOCKS  0x18
+//
+//  A synchronous single run paging read in progress.  The entry lives on
+//  the issuing thread's stack and is on the Vcb's InFlightReads list until
+//  the read completes.  A read of sectors it covers waits on DataReady and
+//  copies from Buffer, the issuer's system address for the data, instead
+//  of going to the device.  Only paging reads are published, since no
+//  process can write their pages while the read is in progress.  The
+//  issuer waits on WaitersDone before returning while Waiters is non-zero.
+//  Waiters and the list are protected by the Vcb's InFlightMutex.
+//
+
+class CD_INFLIGHT_READ
+{
+public:
+
+	LIST_ENTRY Links;
+
+	LONGLONG DiskOffset;
+	ULONG ByteCount;
+
+	PVOID Buffer;
+	NTSTATUS Status;
+
+	ULONG Waiters;
+
+	KEVENT DataReady;
+	KEVENT WaitersDone;
+};
 
 //
 //  The Vcb (Volume control block) record corresponds to every
@@ -589,6 +866,12 @@ typedef enum _VCB_CONDITION
 	VcbDismountInProgress
 } VCB_CONDITION;
 
+//
+//  Buckets the Fcb table starts with, embedded in the Vcb.
+//
+
+#define CD_FCB_TABLE_INITIAL_BUCKETS                (16)
+
 class VCB
 {
 public:
@@ -656,6 +939,13 @@ public:
 	PFCB RootIndexFcb;
 	PFCB PathTableFcb;
 
+	//
+	//  Copy of the path table built at mount.  NULL if it couldn't be
+	//  built, in which case we walk the path table on the disk.
+	//
+
+	PCD_PATH_INDEX PathIndex;
+
 	//
 	//  Location of current session and offset of volume descriptors.
 	//
@@ -721,10 +1011,18 @@ public:
 	ULONG BlockInverseMask;
 
 	//
-	//  Fcb table.  Synchronized with the Vcb fast mutex.
+	//  Fcb table.  Fcbs are chained through their FcbTableLinks in the
+	//  bucket picked by the hash of their FileId.  FcbTableBuckets is a
+	//  power of two, starting with the embedded FcbTableInitialBuckets and
+	//  doubling whenever FcbTableCount reaches twice as many.  Synchronized
+	//  with the Vcb fast mutex.
 	//
 
-	RTL_GENERIC_TABLE FcbTable;
+	PLIST_ENTRY FcbTable;
+	ULONG FcbTableBuckets;
+	ULONG FcbTableCount;
+
+	LIST_ENTRY FcbTableInitialBuckets[ CD_FCB_TABLE_INITIAL_BUCKETS ];
 
 	//
 	//  Volume TOC.  Cache this information for quick lookup.
@@ -755,6 +1053,20 @@ public:
 	ULONG MaximumTransferRawSectors;
 	ULONG MaximumPhysicalPages;
 
+	//
+	//  Cooked reads are split to MaximumTransfer bytes per device read.
+	//  DeviceMaximumTransfer is the most the adapter takes in one transfer
+	//  from any buffer, and MaximumTransfer is that or less if tuned down.
+	//  Buffers must be aligned to AlignmentMask.  SplitRuns counts runs cut
+	//  short to fit.
+	//
+
+	ULONG DeviceMaximumTransfer;
+	ULONG MaximumTransfer;
+	ULONG AlignmentMask;
+
+	__volatile LONG SplitRuns;
+
 	//
 	//  Preallocated VPB for swapout, so we are not forced to consider
 	//  must succeed pool.
@@ -775,19 +1087,177 @@ public:
 	//
 
 	PUCHAR SectorCacheBuffer;
-	CD_SECTOR_CACHE_CHUNK SecCacheChunks[ CD_SEC_CACHE_CHUNKS];
-	ULONG SecCacheLRUChunkIndex;
+	PCD_SECTOR_CACHE SectorCache;
+
+	//
+	//  Trace of the reads on this volume.  NULL if it could not be
+	//  allocated, in which case reads are simply not recorded.
+	//
 
-	PIRP SectorCacheIrp;
-	KEVENT SectorCacheEvent;
-	ERESOURCE SectorCacheResource;
+	PCD_READ_TRACE ReadTrace;
 
-#if DBG
-	ULONG SecCacheHits;
-	ULONG SecCacheMisses;
-#endif
+	//
+	//  Largest number of reads a single non-cached request may have at the
+	//  device at once.  Set from FSCTL_CDFS_SET_TUNING.
+	//
+
+	ULONG MaxQueueDepth;
+
+	//
+	//  Page sized bounce buffers for unaligned non-cached reads.  When the
+	//  pool is empty we allocate a buffer as before and count it in
+	//  BounceBufferMisses.
+	//
+
+	CD_BUFFER_POOL BouncePool;
+
+	__volatile LONG BounceBufferUses;
+	__volatile LONG BounceBufferMisses;
+
+	//
+	//  Multi-sector staging buffers for unaligned cooked runs longer than a
+	//  page, allocated at mount if the device takes more than a page at
+	//  once.  The counters record the runs staged this way and those which
+	//  found the pool empty and read a page at a time.
+	//
+
+	CD_BUFFER_POOL StagingPool;
+
+	__volatile LONG StagedReads;
+	__volatile LONG StagingMisses;
+
+	//
+	//  Staging buffers for raw XA reads, allocated at mount for XA volumes
+	//  only.  A raw read which starts or ends inside a raw sector reads the
+	//  sectors around it into one of these in a single transfer.  The
+	//  counters record the reads staged this way and those which found the
+	//  pool empty and read a sector at a time.
+	//
+
+	CD_BUFFER_POOL XAStagingPool;
+
+	__volatile LONG XAStagedReads;
+	__volatile LONG XAStagingMisses;
+
+	//
+	//  Largest gap between the file units of an interleaved file that a
+	//  non-cached read will read through rather than seek over, zero to
+	//  always seek.  Set from FSCTL_CDFS_SET_TUNING.  The counters record
+	//  the reads which did so, the gaps they bridged and the bytes in them.
+	//
+
+	ULONG InterleaveBridgeBytes;
+
+	__volatile LONG BridgedReads;
+	__volatile LONG BridgedGaps;
+	__volatile LONG BridgedGapBytes;
+
+	//
+	//  Device reads in progress which other reads may share, and the count
+	//  of reads satisfied by sharing one rather than going to the device.
+	//
+
+	LIST_ENTRY InFlightReads;
+	FAST_MUTEX InFlightMutex;
+
+	__volatile LONG CoalescedReads;
+
+	//
+	//  Background warm-up of the sector cache after mount.  WarmUpLevels
+	//  is the depth of directories it reads, and is checked as it goes so
+	//  that lowering it to zero stops it.  WarmUpDone is signalled unless
+	//  a warm-up is queued or running.  LastForegroundRead is the interrupt
+	//  time in milliseconds of the last read we received, which the warm-up
+	//  waits to be CD_WARM_UP_IDLE_TIME old before each read of its own.
+	//  The WarmUpPathTable fields are copied from the path table Fcb when
+	//  the warm-up is queued, since the Fcb may go away while it runs.
+	//
+
+	PIO_WORKITEM WarmUpItem;
+	KEVENT WarmUpDone;
+
+	ULONG WarmUpPathTableLbn;
+	ULONG WarmUpPathTableAllocation;
+	ULONG WarmUpPathTableSize;
+	ULONG WarmUpPathTableOffset;
+
+	__volatile ULONG WarmUpLevels;
+	__volatile ULONG LastForegroundRead;
+
+	__volatile LONG WarmUpReads;
+
+	//
+	//  Read priority.  ForegroundReads counts the batches of device reads
+	//  outstanding for normal priority requests, and ForegroundIdle is
+	//  signalled whenever it is zero.  Synchronous low priority reads which
+	//  nobody else waits on, so not paging reads or sector cache fills, wait
+	//  for it, up to CD_READ_DEFER_TIME, before going to the device.  Both,
+	//  and the statistics for each CDFS_READ_PRIORITY_, are guarded by
+	//  ReadPriorityLock.
+	//
+
+	KSPIN_LOCK ReadPriorityLock;
+	ULONG ForegroundReads;
+	KEVENT ForegroundIdle;
+
+	CDFS_READ_PRIORITY_STATISTICS ReadPriorityStatistics[ CDFS_READ_PRIORITIES ];
+
+	//
+	//  Directory name indexes.  NameIndexBytes is the pool held by the
+	//  indexes and name arenas of all the directories on the volume, which
+	//  may not grow past CD_NAME_INDEX_VOLUME_BUDGET.  NameIndexGeneration is bumped
+	//  whenever the volume is verified, and an index built in an earlier
+	//  generation is thrown away on its next use.  NameIndexQueue and
+	//  NameArenaQueue link the directories which have an index or a name
+	//  arena, so that they can be freed when memory is low.  Both are
+	//  guarded by the Vcb mutex.
+	//
+
+	__volatile LONG NameIndexBytes;
+	__volatile LONG NameIndexGeneration;
+	LIST_ENTRY NameIndexQueue;
+	LIST_ENTRY NameArenaQueue;
+
+	//
+	//  File lookups which found nothing, and those of them the negative
+	//  caches answered without reading the directory.
+	//
+
+	__volatile LONG NameLookupMisses;
+	__volatile LONG NegativeBloomHits;
+	__volatile LONG NegativeListHits;
 };
 
+#define CD_DEFAULT_QUEUE_DEPTH                      (0x20)
+#define CD_DEFAULT_MAXIMUM_TRANSFER                 (0x10000)
+#define CD_DEFAULT_INTERLEAVE_BRIDGE                (0x10000)
+
+//
+//  Largest span of disk a single bridged read covers, units and gaps.
+//
+
+#define CD_MAX_BRIDGE_SPAN                          (0x40000)
+
+#define CD_DEFAULT_WARM_UP_LEVELS                   (2)
+#define CD_WARM_UP_IDLE_TIME                        (100)
+
+//
+//  Longest a synchronous low priority read waits in milliseconds for the
+//  normal priority reads outstanding to finish.
+//
+
+#define CD_READ_DEFER_TIME                          (250)
+
+//
+//  Directories smaller than CD_NAME_INDEX_MIN_DIRECTORY bytes are quicker
+//  to scan than to index, and ones with more than CD_NAME_INDEX_MAX_ENTRIES
+//  files are always scanned.
+//
+
+#define CD_NAME_INDEX_MIN_DIRECTORY                 (0x1000)
+#define CD_NAME_INDEX_MAX_ENTRIES                   (0x10000)
+#define CD_NAME_INDEX_VOLUME_BUDGET                 (0x400000)
+
 #define VCB_STATE_HSG                               (0x00000001)
 #define VCB_STATE_ISO                               (0x00000002)
 #define VCB_STATE_JOLIET                            (0x00000004)
@@ -889,6 +1359,126 @@ public:
 	PFILE_LOCK FileLock;
 };
 
+//
+//  Hashed index of the file names in a directory, built by CdFindFile so
+//  that opens don't scan the directory.  Entries are keyed by the hash of
+//  the upcased name without its version, so the versions of a name share a
+//  key and are chained in directory order.  Buckets holds BucketCount chain
+//  heads, a power of two, as indexes into Entries plus one, with zero
+//  ending a chain.  The index covers every file in the directory, so a
+//  name whose hash is not in it is not in the directory.
+//
+
+class CD_NAME_INDEX_ENTRY
+{
+public:
+
+	ULONG Hash;
+	ULONG DirentOffset;
+	ULONG Next;
+};
+
+class CD_NAME_INDEX
+{
+public:
+
+	LONG Generation;
+	ULONG AllocationSize;
+
+	ULONG BucketCount;
+	PULONG Buckets;
+
+	ULONG EntryCount;
+	PCD_NAME_INDEX_ENTRY Entries;
+};
+
+//
+//  Decoded names of the files in a directory, built in one pass by
+//  CdBuildNameArena so that lookups and enumerations don't convert, split
+//  and upcase each name every time they pass it.  Entries has one entry for
+//  the first dirent of each file, in directory order.  Each gives the
+//  lengths in bytes of the file's exact case name and version, which are
+//  followed in Names by their upcased copies, starting at NameOffset.
+//  After them comes the file's generated short name, ShortNameLength bytes
+//  long.  ShortNameLength is zero if the file's name is already 8.3.
+//  Since only one dirent can begin in each 32 byte block of the directory,
+//  the entries are also an index from short names to their files.
+//  LastEntry is the entry last found by CdFindNameArenaEntry, so that
+//  walks through the directory find the next one straight away.  It is
+//  only a hint and isn't guarded.
+//
+
+class CD_NAME_ARENA_ENTRY
+{
+public:
+
+	ULONG DirentOffset;
+	ULONG NameOffset;
+	USHORT NameLength;
+	USHORT VersionLength;
+	USHORT ShortNameLength;
+};
+
+class CD_NAME_ARENA
+{
+public:
+
+	ULONG AllocationSize;
+
+	ULONG EntryCount;
+	__volatile ULONG LastEntry;
+
+	PCD_NAME_ARENA_ENTRY Entries;
+	PWCHAR Names;
+};
+
+//
+//  Negative lookup cache of a directory, consulted by CdFindFile and
+//  CdFindFileByShortName before they read the directory.  Bloom is a
+//  filter of BloomBits bits, a power of two, with CD_NEGATIVE_BLOOM_PROBES
+//  bits set for the hash of each file CdFindFile can match.  It is filled
+//  in as CdFindFile scans the directory and only used once BloomValid shows
+//  a scan has reached the end.  Misses is a ring of the last names not
+//  found, which catches the names the filter lets through and the short
+//  name lookups it can't answer.  Flags on each records the kind of lookup
+//  that missed, and only the same kind of lookup may match it.
+//
+
+#define CD_NEGATIVE_NAME_LENGTH                     (32)
+#define CD_NEGATIVE_MISSES                          (8)
+
+#define CD_NEGATIVE_BLOOM_MIN_BYTES                 (0x40)
+#define CD_NEGATIVE_BLOOM_MAX_BYTES                 (0x2000)
+#define CD_NEGATIVE_BLOOM_PROBES                    (3)
+
+#define CD_NEGATIVE_FLAG_IGNORE_CASE                (0x0001)
+#define CD_NEGATIVE_FLAG_SHORT_NAME                 (0x0002)
+
+class CD_NEGATIVE_ENTRY
+{
+public:
+
+	ULONG Hash;
+	USHORT Flags;
+	USHORT Length;
+	WCHAR Name[ CD_NEGATIVE_NAME_LENGTH ];
+};
+
+class CD_NEGATIVE_CACHE
+{
+public:
+
+	LONG Generation;
+	BOOLEAN BloomValid;
+
+	ULONG BloomBits;
+	PUCHAR Bloom;
+
+	ULONG MissCount;
+	ULONG NextMiss;
+	CD_NEGATIVE_ENTRY Misses[ CD_NEGATIVE_MISSES ];
+};
+
 class FCB_INDEX
 {
 public:
@@ -932,11 +1522,46 @@ public:
 	ULONG ChildOrdinal;
 
 	//
-	//  Root of splay trees for exact and ignore case prefix trees.
+	//  Prefix tables for the exact and ignore case names of the children.
+	//
+
+	PCD_PREFIX_TABLE ExactCaseTable;
+	PCD_PREFIX_TABLE IgnoreCaseTable;
+
+	//
+	//  Name index for the files in the directory, if one has been built.
+	//  NameIndexGeneration is the volume's NameIndexGeneration when we
+	//  last tried to build it, so that we don't try again in the same
+	//  generation if it could not be built.  Both are guarded by the Fcb.
+	//  NameIndexLinks is on the Vcb's NameIndexQueue while there is an
+	//  index, and the index is only set or cleared with the Vcb mutex held.
+	//
+
+	PCD_NAME_INDEX NameIndex;
+	LONG NameIndexGeneration;
+	LIST_ENTRY NameIndexLinks;
+
+	//
+	//  Decoded names of the files in the directory.  It is built on the
+	//  first lookup or enumeration, and only freed with the Fcb owned
+	//  exclusively, so the pointer may be read with the Fcb acquired but
+	//  not locked.  NameArenaTried shows we have tried to build it, and is
+	//  set with the Fcb locked.  NameArenaLinks is on the Vcb's
+	//  NameArenaQueue while there is an arena, and the arena is only set or
+	//  cleared with the Vcb mutex held.
+	//
+
+	PCD_NAME_ARENA NameArena;
+	BOOLEAN NameArenaTried;
+	LIST_ENTRY NameArenaLinks;
+
+	//
+	//  Names known not to be in the directory, allocated on the first
+	//  scan for a file.  Thrown away, like the name index, on its first
+	//  use after a verify.  Guarded by the Fcb.
 	//
 
-	PRTL_SPLAY_LINKS ExactCaseRoot;
-	PRTL_SPLAY_LINKS IgnoreCaseRoot;
+	PCD_NEGATIVE_CACHE NegativeCache;
 };
 
 class FCB_NONPAGED
@@ -1040,6 +1665,13 @@ public:
 
 	FILE_ID FileId;
 
+	//
+	//  Links to the chain of Fcb's in the Vcb's Fcb table.  Synchronized
+	//  with the VcbMutex.
+	//
+
+	LIST_ENTRY FcbTableLinks;
+
 	//
 	//  Counts on this Fcb.  Cleanup count represents the number of open handles
 	//  on this Fcb.  Reference count represents the number of reasons this Fcb
@@ -1229,6 +1861,16 @@ public:
 #define CCB_FLAG_ENUM_INITIALIZED               (0x00200000)
 #define CCB_FLAG_ENUM_NOMATCH_CONSTANT_ENTRY    (0x00400000)
 
+//
+//  Set by CdClassifyNameExpression for a name expression with wild cards
+//  which is a literal prefix followed by '*', or a literal suffix after a
+//  leading '*' or DOS_STAR.  CdIsNameInExpression then compares the
+//  literal part directly instead of interpreting the expression.
+//
+
+#define CCB_FLAG_ENUM_NAME_EXP_PREFIX           (0x00800000)
+#define CCB_FLAG_ENUM_NAME_EXP_SUFFIX           (0x01000000)
+
 
 //
 //  The Irp Context record is allocated for every orginating Irp.  It is
@@ -1331,6 +1973,7 @@ public:
 #define IRP_CONTEXT_FLAG_ALLOC_IO               (0x00000100)
 #define IRP_CONTEXT_FLAG_DISABLE_POPUPS         (0x00000200)
 #define IRP_CONTEXT_FLAG_FORCE_VERIFY           (0x00000400)
+#define IRP_CONTEXT_FLAG_COMPRESSION_TABLE      (0x00000800)
 
 //
 //  Flags used for create.
@@ -1418,6 +2061,21 @@ public:
 };
 
 
+//
+//  Device reads sent together for one request, tracked from when they are
+//  ready to go until the last completes for the volume's read priority
+//  accounting.  Vcb is NULL while none are outstanding.
+//
+
+class CD_DEVICE_READ
+{
+public:
+	PVCB Vcb;
+	ULONG Priority;
+	ULONGLONG StartTime;
+};
+
+
 //
 //  Context structure for asynchronous I/O calls.  Most of these fields
 //  are actually only required for the ReadMultiple routines, but
@@ -1439,6 +2097,12 @@ public:
 	__volatile NTSTATUS Status;
 	BOOLEAN AllocatedContext;
 
+	//
+	//  The reads sent to the device for this context.
+	//
+
+	CD_DEVICE_READ DeviceRead;
+
 	union
 	{
 		//
@@ -1640,6 +2304,47 @@ public:
 };
 
 
+//
+//  In-memory copy of the path table, read once at mount by
+//  CdBuildPathIndex.  Entries is indexed by ordinal less one and holds the
+//  fields of each path entry, with the raw name bytes in Names.  Every
+//  directory but the root is also chained into Buckets, a power of two
+//  count of chain heads keyed by the parent's ordinal and the hash of the
+//  upcased name.  Chains hold ordinals in path table order, zero ending
+//  them.  The whole index is one allocation, from low priority pool and
+//  no larger than CD_PATH_INDEX_MAX_BYTES.
+//
+
+class CD_PATH_INDEX_ENTRY
+{
+public:
+
+	ULONG PathTableOffset;
+	ULONG DiskOffset;
+	ULONG ParentOrdinal;
+	ULONG Hash;
+	ULONG NextOrdinal;
+
+	ULONG NameOffset;
+	ULONG DirNameLen;
+};
+
+class CD_PATH_INDEX
+{
+public:
+
+	ULONG EntryCount;
+	ULONG BucketCount;
+
+	PCD_PATH_INDEX_ENTRY Entries;
+	PULONG Buckets;
+	PCHAR Names;
+};
+
+#define CD_PATH_INDEX_MAX_ENTRIES               (0x100000)
+#define CD_PATH_INDEX_MAX_BYTES                 (0x800000)
+
+
 //
 //  The following is used for enumerating through a directory via the
 //  dirents.
@@ -1838,6 +2543,13 @@ public:
 
 	LONGLONG FileSize;
 
+	//
+	//  Number of dirents, and so extents, for the file.  Set along with
+	//  FileSize by CdLookupLastFileDirent.
+	//
+
+	ULONG ExtentCount;
+
 	//
 	//  Short name for this file.
 	//
@@ -86,6 +86,27 @@ public:
 	PMDL TransferMdl;
 	PVOID TransferVirtualAddress;
 
+	//
+	//  Bounce buffer supplying the transfer buffer and Mdl above and the
+	//  Vcb pool it came from, or NULL if we allocated them or are using
+	//  the user's.
+	//
+
+	PCD_BOUNCE_BUFFER BounceBuffer;
+	PCD_BUFFER_POOL BufferPool;
+
+	//
+	//  For a run which reads through the gaps of an interleaved file, the
+	//  bytes in the transfer buffer for the first file unit, for each
+	//  following unit and for each gap between them.  The transfer is
+	//  gathered into the user's buffer a unit at a time.  BridgeGapSize is
+	//  zero for any other run.
+	//
+
+	ULONG BridgeFirstUnitSize;
+	ULONG BridgeUnitSize;
+	ULONG BridgeGapSize;
+
 	//
 	//  Associated Irp used to perform the Io.
 	//
@@ -95,8 +116,66 @@ public:
 
 typedef IO_RUN* PIO_RUN;
 
+//
+//  Number of runs a non-cached read can describe without allocating.
+//  Requests that need more runs get an array sized by the volume's queue
+//  depth.
+//
+
 #define MAX_PARALLEL_IOS            5
 
+//
+//  Returns the sector cache class of a non-cached read of this Fcb, or
+//  CD_SEC_CACHE_NO_CLASS if the read should go straight to the device.
+//
+//  ULONG
+//  CdSectorCacheClass (
+//      _In_ PIRP_CONTEXT IrpContext,
+//      _In_ PFCB Fcb
+//      );
+//
+
+#define CdSectorCacheClass(IC,F) (                                                      \
+    ((NULL == (F)->Vcb->SectorCacheBuffer) ||                                           \
+     (VcbMounted != (IC)->Vcb->VcbCondition)) ?                                         \
+        CD_SEC_CACHE_NO_CLASS :                                                         \
+    (SafeNodeType( F ) == CDFS_NTC_FCB_INDEX) ?                                         \
+        CDFS_SECTOR_CACHE_CLASS_DIRECTORY :                                             \
+    (SafeNodeType( F ) == CDFS_NTC_FCB_PATH_TABLE) ?                                    \
+        CDFS_SECTOR_CACHE_CLASS_PATH_TABLE :                                            \
+    FlagOn( (IC)->Flags, IRP_CONTEXT_FLAG_COMPRESSION_TABLE ) ?                         \
+        CDFS_SECTOR_CACHE_CLASS_COMPRESSION_TABLE :                                     \
+        CD_SEC_CACHE_NO_CLASS                                                           \
+)
+
+//
+//  A directory or zisofs table to be read by the sector cache warm-up, and
+//  the level below the root of the directory it was found through.
+//
+
+class CD_WARM_UP_EXTENT
+{
+public:
+	ULONG Lbn;
+	ULONG Level;
+};
+
+typedef CD_WARM_UP_EXTENT* PCD_WARM_UP_EXTENT;
+
+//
+//  Progress of a sector cache warm-up: the chunk holding the last block it
+//  read, and how many more chunks it may bring into the cache.
+//
+
+class CD_WARM_UP_CONTEXT
+{
+public:
+	ULONG LastChunk;
+	ULONG ChunksLeft;
+};
+
+typedef CD_WARM_UP_CONTEXT* PCD_WARM_UP_CONTEXT;
+
 //
 //  Local support routines
 //
@@ -115,7 +194,8 @@ extern "C"
 		     _In_ ULONG UserBufferOffset,
 		     _In_ LONGLONG StartingOffset,
 		     _In_ ULONG ByteCount,
-		     _Out_ PIO_RUN IoRuns,
+		     _Out_writes_(MaxRunCount) PIO_RUN IoRuns,
+		     _In_ ULONG MaxRunCount,
 		     _Out_ PULONG RunCount,
 		     _Out_ PULONG ThisByteCount
 	);
@@ -130,11 +210,71 @@ extern "C"
 		     _In_ ULONG UserBufferOffset,
 		     _In_ LONGLONG StartingOffset,
 		     _In_ ULONG ByteCount,
-		     _Out_ PIO_RUN IoRuns,
+		     _Out_writes_(MaxRunCount) PIO_RUN IoRuns,
+		     _In_ ULONG MaxRunCount,
 		     _Out_ PULONG RunCount,
 		     _Out_ PULONG ThisByteCount
 	);
 
+	_Requires_lock_held_(_Global_critical_region_)
+	BOOLEAN
+	CdPrepareBridgedRun(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb,
+		     _Inout_ PIO_RUN IoRun,
+		     _In_ LONGLONG FileOffset,
+		     _In_ LONGLONG DiskOffset,
+		     _In_ ULONG ByteCount,
+		     _In_ ULONG RemainingByteCount,
+		     _In_ ULONG MaxDiskByteCount,
+		     _In_ BOOLEAN RawSectors,
+		     _Out_ PULONG BridgedByteCount
+	);
+
+	VOID
+	CdAllocateTransferBuffer(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb,
+		     _Inout_ PIO_RUN IoRun
+	);
+
+	BOOLEAN
+	CdAllocateStagingBuffer(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb,
+		     _Inout_ PIO_RUN IoRun
+	);
+
+	BOOLEAN
+	CdAllocateXAStagingBuffer(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb,
+		     _Inout_ PIO_RUN IoRun,
+		     _Inout_ PULONG ByteCount
+	);
+
+	VOID
+	CdGatherBridgedRun(
+		_In_ PIO_RUN IoRun
+	);
+
+	BOOLEAN
+	CdJoinInFlightRead(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb,
+		     _In_ PIO_RUN IoRun,
+		     _Out_ PCD_INFLIGHT_READ InFlightRead,
+		     _Out_ PBOOLEAN Published
+	);
+
+	VOID
+	CdEndInFlightRead(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb,
+		     _Inout_ PCD_INFLIGHT_READ InFlightRead,
+		     _In_ NTSTATUS Status
+	);
+
 	BOOLEAN
 	CdFinishBuffers(
 		_In_ PIRP_CONTEXT IrpContext,
@@ -202,7 +342,56 @@ extern "C"
 	BOOLEAN
 	CdReadDirDataThroughCache(
 		_In_ PIRP_CONTEXT IrpContext,
-		     _In_ PIO_RUN Run
+		     _In_ PIO_RUN Run,
+		     _In_ ULONG CacheClass
+	);
+
+	VOID
+	CdBeginDeviceRead(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ BOOLEAN CanDefer,
+		     _Out_ PCD_DEVICE_READ DeviceRead
+	);
+
+	VOID
+	CdEndDeviceRead(
+		_Inout_ PCD_DEVICE_READ DeviceRead
+	);
+
+	IO_WORKITEM_ROUTINE CdWarmUpWorker;
+
+	_Requires_lock_held_(_Global_critical_region_)
+	VOID
+	CdWarmUpSectorCache(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PVCB Vcb
+	);
+
+	_Requires_lock_held_(_Global_critical_region_)
+	BOOLEAN
+	CdWarmUpRead(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PCD_WARM_UP_CONTEXT WarmUp,
+		     _In_ ULONG Lbn,
+		     _In_ ULONG ByteCount,
+		     _Out_writes_bytes_(ByteCount) PVOID Buffer,
+		     _In_ ULONG CacheClass
+	);
+
+	VOID
+	CdFindWarmUpTables(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_reads_bytes_(SECTOR_SIZE) PUCHAR Sector,
+		     _In_ ULONG Level,
+		     _Out_writes_(MaxTables) PCD_WARM_UP_EXTENT Tables,
+		     _Inout_ PULONG TableCount,
+		     _In_ ULONG MaxTables
+	);
+
+	VOID
+	CdSortWarmUpExtents(
+		_Inout_updates_(Count) PCD_WARM_UP_EXTENT Extents,
+		     _In_ ULONG Count
 	);
 
 #if defined(__cplusplus)
@@ -217,8 +406,12 @@ extern "C"
 #pragma alloc_text(PAGE, CdNonCachedXARead)
 #pragma alloc_text(PAGE, CdVolumeDasdWrite)
 #pragma alloc_text(PAGE, CdFinishBuffers)
+#pragma alloc_text(PAGE, CdEndInFlightRead)
+#pragma alloc_text(PAGE, CdGatherBridgedRun)
+#pragma alloc_text(PAGE, CdJoinInFlightRead)
 #pragma alloc_text(PAGE, CdPerformDevIoCtrl)
 #pragma alloc_text(PAGE, CdPerformDevIoCtrlEx)
+#pragma alloc_text(PAGE, CdPrepareBridgedRun)
 #pragma alloc_text(PAGE, CdPrepareBuffers)
 #pragma alloc_text(PAGE, CdPrepareXABuffers)
 #pragma alloc_text(PAGE, CdReadAudioSystemFile)
@@ -226,9 +419,19 @@ extern "C"
 #pragma alloc_text(PAGE, CdSingleAsync)
 #pragma alloc_text(PAGE, CdWaitSync)
 #pragma alloc_text(PAGE, CdReadDirDataThroughCache)
+#pragma alloc_text(PAGE, CdAllocateStagingBuffer)
+#pragma alloc_text(PAGE, CdAllocateTransferBuffer)
+#pragma alloc_text(PAGE, CdAllocateXAStagingBuffer)
 #pragma alloc_text(PAGE, CdFreeDirCache)
 #pragma alloc_text(PAGE, CdLbnToMmSsFf)
 #pragma alloc_text(PAGE, CdHijackIrpAndFlushDevice)
+#pragma alloc_text(PAGE, CdRecordReadTrace)
+#pragma alloc_text(PAGE, CdStartWarmUp)
+#pragma alloc_text(PAGE, CdWarmUpWorker)
+#pragma alloc_text(PAGE, CdWarmUpSectorCache)
+#pragma alloc_text(PAGE, CdWarmUpRead)
+#pragma alloc_text(PAGE, CdFindWarmUpTables)
+#pragma alloc_text(PAGE, CdSortWarmUpExtents)
 #endif
 
 
@@ -349,7 +552,10 @@ Return Value:
 {
 	NTSTATUS Status = STATUS_SUCCESS;
 
-	IO_RUN IoRuns[MAX_PARALLEL_IOS];
+	IO_RUN InlineIoRuns[MAX_PARALLEL_IOS];
+	PIO_RUN IoRuns = InlineIoRuns;
+	ULONG MaxRunCount;
+	ULONG QueueDepth = Fcb->Vcb->MaxQueueDepth;
 	ULONG RunCount = 0;
 	ULONG CleanupRunCount = 0;
 
@@ -363,8 +569,13 @@ Return Value:
 	BOOLEAN FlushIoBuffers = FALSE;
 	BOOLEAN FirstPass = TRUE;
 
+	CD_INFLIGHT_READ InFlightRead;
+	BOOLEAN InFlight = FALSE;
+
 	PAGED_CODE();
 
+	MaxRunCount = min( QueueDepth, MAX_PARALLEL_IOS );
+
 	//
 	//  We want to make sure the user's buffer is locked in all cases.
 	//
@@ -398,9 +609,7 @@ Return Value:
 	//  mark the request waitable.
 	//
 
-	if ((SafeNodeType( Fcb) == CDFS_NTC_FCB_INDEX) &&
-		(NULL != Fcb->Vcb->SectorCacheBuffer) &&
-		(VcbMounted == IrpContext->Vcb->VcbCondition))
+	if (CdSectorCacheClass( IrpContext, Fcb) != CD_SEC_CACHE_NO_CLASS)
 	{
 		if (!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT))
 		{
@@ -431,7 +640,7 @@ Return Value:
 			//  if there are unaligned entries for an async request.
 			//
 
-			RtlZeroMemory( IoRuns, sizeof( IoRuns ));
+			RtlZeroMemory( IoRuns, MaxRunCount * sizeof( IO_RUN ));
 
 			Unaligned = CdPrepareBuffers(IrpContext,
 			                             IrpContext->Irp,
@@ -441,9 +650,32 @@ Return Value:
 			                             CurrentOffset,
 			                             RemainingByteCount,
 			                             IoRuns,
+			                             MaxRunCount,
 			                             &CleanupRunCount,
 			                             &ThisByteCount);
 
+			//
+			//  If the inline array wasn't enough and the volume allows a
+			//  deeper queue, drop what we prepared and start again with room
+			//  for the whole queue, so a fragmented request goes down in one
+			//  pass rather than in waves of MAX_PARALLEL_IOS.
+			//
+
+			if ((ThisByteCount < RemainingByteCount) &&
+				(IoRuns == InlineIoRuns) &&
+				(QueueDepth > MaxRunCount))
+			{
+				CdFinishBuffers(IrpContext, IoRuns, CleanupRunCount, TRUE, FALSE);
+				CleanupRunCount = 0;
+
+				MaxRunCount = QueueDepth;
+
+				IoRuns = reinterpret_cast<PIO_RUN>(FsRtlAllocatePoolWithTag( CdPagedPool,
+					MaxRunCount * sizeof( IO_RUN ),
+					TAG_IO_RUNS ));
+
+				continue;
+			}
 
 			RunCount = CleanupRunCount;
 
@@ -466,6 +698,21 @@ Return Value:
 
 			if ((RunCount == 1) && !Unaligned && FirstPass)
 			{
+				//
+				//  A synchronous read may be able to share a device read
+				//  already in progress for the same sectors.  Otherwise
+				//  it may publish ours for others to share.
+				//
+
+				if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ))
+				{
+					if (CdJoinInFlightRead(IrpContext, Fcb->Vcb, &IoRuns[0], &InFlightRead, &InFlight))
+					{
+						CleanupRunCount = 0;
+						try_return(Status = STATUS_SUCCESS);
+					}
+				}
+
 				CdSingleAsync(IrpContext, &IoRuns[0], Fcb);
 
 				//
@@ -484,6 +731,12 @@ Return Value:
 
 					Status = IrpContext->Irp->IoStatus.Status;
 
+					if (InFlight)
+					{
+						InFlight = FALSE;
+						CdEndInFlightRead(IrpContext, Fcb->Vcb, &InFlightRead, Status);
+					}
+
 					//
 					//  Our completion routine will free the Io context but
 					//  we do want to return STATUS_PENDING.
@@ -589,6 +842,21 @@ Return Value:
 		{
 			CdFinishBuffers(IrpContext, IoRuns, CleanupRunCount, TRUE, FALSE);
 		}
+
+		if (IoRuns != InlineIoRuns)
+		{
+			CdFreePool(reinterpret_cast<PVOID*>(&IoRuns));
+		}
+
+		//
+		//  If we published a read and didn't see it complete, let anyone
+		//  waiting on it go and read for themselves.
+		//
+
+		if (InFlight)
+		{
+			CdEndInFlightRead(IrpContext, Fcb->Vcb, &InFlightRead, STATUS_UNSUCCESSFUL);
+		}
 	}
 
 	return Status;
@@ -643,8 +911,11 @@ Return Value:
 	RIFF_HEADER LocalRiffHeader;
 	PRIFF_HEADER RiffHeader;
 
-	RAW_READ_INFO RawReads[MAX_PARALLEL_IOS];
-	IO_RUN IoRuns[MAX_PARALLEL_IOS];
+	RAW_READ_INFO InlineRawReads[MAX_PARALLEL_IOS];
+	IO_RUN InlineIoRuns[MAX_PARALLEL_IOS];
+	PRAW_READ_INFO RawReads = InlineRawReads;
+	PIO_RUN IoRuns = InlineIoRuns;
+	ULONG MaxRunCount = MAX_PARALLEL_IOS;
 	ULONG RunCount = 0;
 	ULONG CleanupRunCount = 0;
 
@@ -865,6 +1136,29 @@ Return Value:
 
 		TrackMode = CdFileTrackMode(Fcb);
 
+		//
+		//  Raw reads are always synchronous and the Vcb's XA sector carries
+		//  state between passes, so rather than growing the run array on
+		//  demand we size it up front.  Anything longer than a page may
+		//  need more runs than fit inline.
+		//
+
+		if (Fcb->Vcb->MaxQueueDepth < MAX_PARALLEL_IOS)
+		{
+			MaxRunCount = Fcb->Vcb->MaxQueueDepth;
+		}
+		else if ((Fcb->Vcb->MaxQueueDepth > MAX_PARALLEL_IOS) &&
+			(RemainingByteCount > PAGE_SIZE))
+		{
+			MaxRunCount = Fcb->Vcb->MaxQueueDepth;
+
+			IoRuns = reinterpret_cast<PIO_RUN>(FsRtlAllocatePoolWithTag( CdPagedPool,
+				MaxRunCount * (sizeof( IO_RUN ) + sizeof( RAW_READ_INFO )),
+				TAG_IO_RUNS ));
+
+			RawReads = Add2Ptr( IoRuns, MaxRunCount * sizeof( IO_RUN ), PRAW_READ_INFO );
+		}
+
 		//
 		//  Loop while there are more bytes to transfer.
 		//
@@ -880,8 +1174,8 @@ Return Value:
 
 			if (!TryingYellowbookMode2)
 			{
-				RtlZeroMemory( IoRuns, sizeof( IoRuns ));
-				RtlZeroMemory( RawReads, sizeof( RawReads ));
+				RtlZeroMemory( IoRuns, MaxRunCount * sizeof( IO_RUN ));
+				RtlZeroMemory( RawReads, MaxRunCount * sizeof( RAW_READ_INFO ));
 
 				CdPrepareXABuffers(IrpContext,
 				                   IrpContext->Irp,
@@ -891,6 +1185,7 @@ Return Value:
 				                   CurrentOffset,
 				                   RemainingByteCount,
 				                   IoRuns,
+				                   MaxRunCount,
 				                   &CleanupRunCount,
 				                   &ThisByteCount);
 			}
@@ -1000,6 +1295,11 @@ Return Value:
 		{
 			CdFinishBuffers(IrpContext, IoRuns, CleanupRunCount, TRUE, FALSE);
 		}
+
+		if (IoRuns != InlineIoRuns)
+		{
+			CdFreePool(reinterpret_cast<PVOID*>(&IoRuns));
+		}
 	}
 
 	return Status;
@@ -1170,6 +1470,11 @@ Return Value:
 
 	SetFlag( IoGetNextIrpStackLocation( Irp )->Flags, SL_OVERRIDE_VERIFY_VOLUME );
 
+	if (IrpContext->Vcb != NULL)
+	{
+		CdRecordReadTrace(IrpContext->Vcb, 0, StartingOffset, ByteCount, CDFS_READ_TRACE_DEVICE_IO);
+	}
+
 	//
 	//  Send the request down to the driver.  If an error occurs return
 	//  it to the caller.
@@ -1492,7 +1797,8 @@ CdPrepareBuffers(
 	     _In_ ULONG UserBufferOffset,
 	     _In_ LONGLONG StartingOffset,
 	     _In_ ULONG ByteCount,
-	     _Out_ PIO_RUN IoRuns,
+	     _Out_writes_(MaxRunCount) PIO_RUN IoRuns,
+	     _In_ ULONG MaxRunCount,
 	     _Out_ PULONG RunCount,
 	     _Out_ PULONG ThisByteCount
 )
@@ -1523,12 +1829,14 @@ Arguments:
     StartingOffset - Offset in the stream to begin the read.
 
     ByteCount - Number of bytes to read.  We will fill the IoRuns array up
-        to this point.  We will stop early if we exceed the maximum number
-        of parallel Ios we support.
+        to this point.  We will stop early if we run out of entries in the
+        IoRuns array.
 
     IoRuns - Pointer to the IoRuns array.  The entire array is zeroes when
         this routine is called.
 
+    MaxRunCount - Number of entries in the IoRuns array.
+
     RunCount - Number of entries in the IoRuns array filled here.
 
     ThisByteCount - Number of bytes described by the IoRun entries.  Will
@@ -1626,6 +1934,8 @@ Return Value:
 		//
 		//      Byte count is a multiple of 2048 (Length of transfer)
 		//
+		//      User's buffer meets the adapter's alignment
+		//
 		//  If the ByteCount is at least one sector then do the
 		//  unaligned transfer only for the tail.  We can use the
 		//  user's buffer for the aligned portion.
@@ -1633,7 +1943,9 @@ Return Value:
 
 		if (FlagOn( (ULONG) DiskOffset, SECTOR_MASK ) ||
 			(FlagOn( (ULONG) CurrentByteCount, SECTOR_MASK ) &&
-				(CurrentByteCount < SECTOR_SIZE)))
+				(CurrentByteCount < SECTOR_SIZE)) ||
+			FlagOn( (ULONG_PTR) Add2Ptr( Irp->UserBuffer, CurrentUserBufferOffset, PVOID ),
+				Fcb->Vcb->AlignmentMask ))
 		{
 			NT_ASSERT( SafeNodeType(Fcb) != CDFS_NTC_FCB_INDEX);
 
@@ -1663,14 +1975,26 @@ Return Value:
 
 			//
 			//  We need to allocate an auxilary buffer for the next sector.
-			//  Read up to a page containing the partial data.
+			//  A run longer than a page is read in one transfer through a
+			//  staging buffer if the Vcb has one free.  Otherwise read up
+			//  to a page containing the partial data.
 			//
 
 			ThisIoRun->DiskByteCount = SectorAlign( ThisIoRun->TransferBufferOffset + CurrentByteCount );
 
-			if (ThisIoRun->DiskByteCount > PAGE_SIZE)
+			if ((ThisIoRun->DiskByteCount <= PAGE_SIZE) ||
+				!CdAllocateStagingBuffer( IrpContext, Fcb->Vcb, ThisIoRun ))
 			{
-				ThisIoRun->DiskByteCount = PAGE_SIZE;
+				if (ThisIoRun->DiskByteCount > PAGE_SIZE)
+				{
+					ThisIoRun->DiskByteCount = PAGE_SIZE;
+				}
+
+				//
+				//  Get a buffer and Mdl for the non-aligned transfer.
+				//
+
+				CdAllocateTransferBuffer( IrpContext, Fcb->Vcb, ThisIoRun );
 			}
 
 			if (ThisIoRun->TransferBufferOffset + CurrentByteCount > ThisIoRun->DiskByteCount)
@@ -1681,35 +2005,30 @@ Return Value:
 			ThisIoRun->TransferByteCount = CurrentByteCount;
 
 			//
-			//  Allocate a buffer for the non-aligned transfer.
-			//
-
-			ThisIoRun->TransferBuffer = FsRtlAllocatePoolWithTag( CdNonPagedPool, PAGE_SIZE, TAG_IO_BUFFER );
-
-			//
-			//  Allocate and build the Mdl to describe this buffer.
+			//  Remember we found an unaligned transfer.
 			//
 
-			ThisIoRun->TransferMdl = IoAllocateMdl(ThisIoRun->TransferBuffer,
-			                                       PAGE_SIZE,
-			                                       FALSE,
-			                                       FALSE,
-			                                       NULL);
-
-			ThisIoRun->TransferVirtualAddress = ThisIoRun->TransferBuffer;
-
-			if (ThisIoRun->TransferMdl == NULL)
-			{
-				IrpContext->Irp->IoStatus.Information = 0;
-				CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-			}
-
-			MmBuildMdlForNonPagedPool(ThisIoRun->TransferMdl);
+			FoundUnaligned = TRUE;
 
 			//
-			//  Remember we found an unaligned transfer.
+			//  If this run stops short of the request at the end of a file
+			//  unit and the gap to the next unit is cheaper to read than to
+			//  seek over, read through the gaps into a buffer of our own.
+			//  Finishing the run gathers the units, so treat it as
+			//  unaligned.
 			//
-
+		}
+		else if (CdPrepareBridgedRun(IrpContext,
+		                             Fcb,
+		                             ThisIoRun,
+		                             CurrentFileOffset,
+		                             DiskOffset,
+		                             CurrentByteCount,
+		                             RemainingByteCount,
+		                             Fcb->Vcb->MaximumTransfer,
+		                             FALSE,
+		                             &CurrentByteCount))
+		{
 			FoundUnaligned = TRUE;
 
 			//
@@ -1726,6 +2045,18 @@ Return Value:
 
 			CurrentByteCount = SectorTruncate( CurrentByteCount );
 
+			//
+			//  Split the run if it is more than the device takes at once.
+			//  The rest becomes the next run.
+			//
+
+			if (CurrentByteCount > Fcb->Vcb->MaximumTransfer)
+			{
+				CurrentByteCount = Fcb->Vcb->MaximumTransfer;
+
+				InterlockedIncrement( &Fcb->Vcb->SplitRuns );
+			}
+
 			//
 			//  Read these sectors from the disk.
 			//
@@ -1759,7 +2090,7 @@ Return Value:
 
 		*ThisByteCount += CurrentByteCount;
 
-		if ((RemainingByteCount == 0) || (*RunCount == MAX_PARALLEL_IOS))
+		if ((RemainingByteCount == 0) || (*RunCount == MaxRunCount))
 		{
 			break;
 		}
@@ -1792,7 +2123,8 @@ CdPrepareXABuffers(
 	     _In_ ULONG UserBufferOffset,
 	     _In_ LONGLONG StartingOffset,
 	     _In_ ULONG ByteCount,
-	     _Out_ PIO_RUN IoRuns,
+	     _Out_writes_(MaxRunCount) PIO_RUN IoRuns,
+	     _In_ ULONG MaxRunCount,
 	     _Out_ PULONG RunCount,
 	     _Out_ PULONG ThisByteCount
 )
@@ -1822,12 +2154,14 @@ Arguments:
     StartingOffset - Offset in the stream to begin the read.
 
     ByteCount - Number of bytes to read.  We will fill the IoRuns array up
-        to this point.  We will stop early if we exceed the maximum number
-        of parallel Ios we support.
+        to this point.  We will stop early if we run out of entries in the
+        IoRuns array.
 
     IoRuns - Pointer to the IoRuns array.  The entire array is zeroes when
         this routine is called.
 
+    MaxRunCount - Number of entries in the IoRuns array.
+
     RunCount - Number of entries in the IoRuns array filled here.
 
     ThisByteCount - Number of bytes described by the IoRun entries.  Will
@@ -2062,7 +2396,35 @@ Return Value:
 			//          raw sector.
 			//
 
+			//
+			//  If this run ends at a file unit of an interleaved file and
+			//  the gap to the next is short, read through the gaps into a
+			//  buffer of our own.  The device can't split raw reads, so
+			//  the whole span must fit in one transfer.
+			//
+
 			if ((RawSectorOffset == 0) &&
+				(RemainingRawByteCount >= RAW_SECTOR_SIZE) &&
+				CdPrepareBridgedRun(IrpContext,
+				                    Fcb,
+				                    ThisIoRun,
+				                    CurrentCookedOffset,
+				                    DiskOffset,
+				                    CurrentCookedByteCount,
+				                    RemainingCookedByteCount,
+				                    min( Fcb->Vcb->MaximumTransferRawSectors,
+				                         (Fcb->Vcb->MaximumPhysicalPages * PAGE_SIZE) / RAW_SECTOR_SIZE ) * SECTOR_SIZE,
+				                    TRUE,
+				                    &CurrentCookedByteCount))
+			{
+				if (ThisIoRun->TransferByteCount > RemainingRawByteCount)
+				{
+					ThisIoRun->TransferByteCount = RemainingRawByteCount;
+				}
+
+				CurrentRawByteCount = ThisIoRun->TransferByteCount;
+			}
+			else if ((RawSectorOffset == 0) &&
 				(RemainingRawByteCount >= RAW_SECTOR_SIZE))
 			{
 				//
@@ -2132,52 +2494,58 @@ Return Value:
 			else
 			{
 				//
-				//  We need to determine the number of bytes to transfer and the
-				//  offset into this page to begin the transfer.
-				//
-				//  We will transfer only one raw sector.
+				//  If the sectors following this one are contiguous, read
+				//  them along with it into a staging buffer.  This turns the
+				//  head, body and tail of a short unaligned read into one
+				//  transfer.
 				//
 
-				ThisIoRun->DiskByteCount = SECTOR_SIZE;
-
-				CurrentCookedByteCount = SECTOR_SIZE;
+				if (CdAllocateXAStagingBuffer(IrpContext,
+				                              Fcb->Vcb,
+				                              ThisIoRun,
+				                              &CurrentCookedByteCount))
+				{
+					ThisIoRun->DiskByteCount = CurrentCookedByteCount;
+					ThisIoRun->TransferBufferOffset = RawSectorOffset;
+					ThisIoRun->TransferByteCount = SectorsFromBytes( ThisIoRun->DiskByteCount ) * RAW_SECTOR_SIZE - RawSectorOffset;
 
-				ThisIoRun->TransferByteCount = RAW_SECTOR_SIZE - RawSectorOffset;
-				ThisIoRun->TransferBufferOffset = RawSectorOffset;
+					if (ThisIoRun->TransferByteCount > RemainingRawByteCount)
+					{
+						ThisIoRun->TransferByteCount = RemainingRawByteCount;
+					}
 
-				if (ThisIoRun->TransferByteCount > RemainingRawByteCount)
-				{
-					ThisIoRun->TransferByteCount = RemainingRawByteCount;
+					CurrentRawByteCount = ThisIoRun->TransferByteCount;
 				}
+				else
+				{
+					//
+					//  We need to determine the number of bytes to transfer and the
+					//  offset into this page to begin the transfer.
+					//
+					//  We will transfer only one raw sector.
+					//
 
-				CurrentRawByteCount = ThisIoRun->TransferByteCount;
+					ThisIoRun->DiskByteCount = SECTOR_SIZE;
 
-				//
-				//  We need to allocate an auxillary buffer.  We will allocate
-				//  a single page.  Then we will build an Mdl to describe the buffer.
-				//
+					CurrentCookedByteCount = SECTOR_SIZE;
 
-				ThisIoRun->TransferBuffer = FsRtlAllocatePoolWithTag( CdNonPagedPool, PAGE_SIZE, TAG_IO_BUFFER );
+					ThisIoRun->TransferByteCount = RAW_SECTOR_SIZE - RawSectorOffset;
+					ThisIoRun->TransferBufferOffset = RawSectorOffset;
 
-				//
-				//  Allocate and build the Mdl to describe this buffer.
-				//
+					if (ThisIoRun->TransferByteCount > RemainingRawByteCount)
+					{
+						ThisIoRun->TransferByteCount = RemainingRawByteCount;
+					}
 
-				ThisIoRun->TransferMdl = IoAllocateMdl(ThisIoRun->TransferBuffer,
-				                                       PAGE_SIZE,
-				                                       FALSE,
-				                                       FALSE,
-				                                       NULL);
+					CurrentRawByteCount = ThisIoRun->TransferByteCount;
 
-				ThisIoRun->TransferVirtualAddress = ThisIoRun->TransferBuffer;
+					//
+					//  We need an auxillary buffer.  We will use a single page
+					//  and an Mdl to describe it.
+					//
 
-				if (ThisIoRun->TransferMdl == NULL)
-				{
-					IrpContext->Irp->IoStatus.Information = 0;
-					CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+					CdAllocateTransferBuffer( IrpContext, Fcb->Vcb, ThisIoRun );
 				}
-
-				MmBuildMdlForNonPagedPool(ThisIoRun->TransferMdl);
 			}
 		}
 
@@ -2193,7 +2561,7 @@ Return Value:
 		//  we have all of the bytes accounted for.
 		//
 
-		if ((RemainingRawByteCount == 0) || (*RunCount == MAX_PARALLEL_IOS))
+		if ((RemainingRawByteCount == 0) || (*RunCount == MaxRunCount))
 		{
 			break;
 		}
@@ -2221,538 +2589,625 @@ Return Value:
 //  Local support routine
 //
 
+_Requires_lock_held_(_Global_critical_region_)
 BOOLEAN
-CdFinishBuffers(
+CdPrepareBridgedRun(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _Inout_ PIO_RUN IoRuns,
-	     _In_ ULONG RunCount,
-	     _In_ BOOLEAN FinalCleanup,
-	     _In_ BOOLEAN SaveXABuffer
+	     _In_ PFCB Fcb,
+	     _Inout_ PIO_RUN IoRun,
+	     _In_ LONGLONG FileOffset,
+	     _In_ LONGLONG DiskOffset,
+	     _In_ ULONG ByteCount,
+	     _In_ ULONG RemainingByteCount,
+	     _In_ ULONG MaxDiskByteCount,
+	     _In_ BOOLEAN RawSectors,
+	     _Out_ PULONG BridgedByteCount
 )
 
 /*++
 
 Routine Description:
 
-    This routine is called to perform any data transferred required for
-    unaligned Io or to perform the final cleanup of the IoRuns array.
-
-    In all cases this is where we will deallocate any buffer and mdl
-    allocated to perform the unaligned transfer.  If this is not the
-    final cleanup then we also transfer the bytes to the user buffer
-    and flush the hardware cache.
+    This routine is called when a run of a non-cached read ends before the
+    request does, typically at the end of a file unit of an interleaved
+    file.  We look at the runs which follow and, as long as each is
+    separated from the last by the same gap and that gap is no larger than
+    the volume's InterleaveBridgeBytes, extend the run to read through the
+    gaps.  The threshold stands for the number of bytes the drive can read
+    in the time it takes to seek, so a bridged gap costs less than the
+    separate read it saves.
 
-    We walk backwards through the run array because we may be shifting data
-    in the user's buffer.  Typical case is where we allocated a buffer for
-    the first part of a read and then used the user's buffer for the
-    next section (but stored it at the beginning of the buffer.
+    The span is read into a buffer allocated here.  CdFinishBuffers copies
+    the file units out of it into the user's buffer and frees it.  We give
+    up quietly, leaving the run untouched, if nothing can be bridged or we
+    can't get the memory.
 
 Arguments:
 
-    IoRuns - Pointer to the IoRuns array.
+    Fcb - Fcb for the stream being read.
 
-    RunCount - Number of entries in the IoRuns array filled here.
+    IoRun - Run being prepared.  Its user buffer has been set and its disk
+        fields and transfer buffer are filled in here if we bridge.
 
-    FinalCleanup - Indicates if we should be deallocating temporary buffers
-        (TRUE) or transferring bytes for a unaligned transfers and
-        deallocating the buffers (FALSE).  Flush the system cache if
-        transferring data.
+    FileOffset - Cooked offset in the stream of the start of this run.
 
-    SaveXABuffer - TRUE if we should __try to save an XA buffer, FALSE otherwise
+    DiskOffset - Disk offset of the start of this run.
+
+    ByteCount - Cooked bytes in this run as returned by the allocation
+        package, limited to RemainingByteCount.
+
+    RemainingByteCount - Cooked bytes left in the request starting at
+        FileOffset.
+
+    MaxDiskByteCount - Largest span of cooked sectors we may read.
+
+    RawSectors - TRUE if this is an XA read of raw sectors.  The transfer
+        buffer, unit and gap sizes are then in raw bytes.
+
+    BridgedByteCount - Stores the cooked bytes of the stream covered by
+        the run if we bridge.
 
 Return Value:
 
-    BOOLEAN - TRUE if this request needs the Io buffers to be flushed, FALSE otherwise.
+    BOOLEAN - TRUE if the run now bridges one or more gaps, FALSE otherwise.
 
 --*/
 
 {
-	BOOLEAN FlushIoBuffers = FALSE;
+	PVCB Vcb = Fcb->Vcb;
 
-	ULONG RemainingEntries = RunCount;
-	PIO_RUN ThisIoRun = &IoRuns[RunCount - 1];
-	PVCB Vcb;
+	LONGLONG NextDiskOffset;
+	ULONG NextByteCount;
+
+	ULONG DataByteCount = ByteCount;
+	ULONG SpanByteCount = ByteCount;
+	ULONG LastByteCount = ByteCount;
+	ULONG UnitSize = 0;
+	ULONG GapSize = 0;
+	ULONG GapCount = 0;
+	ULONG ThisGapSize;
+
+	ULONG BufferSize;
+	PVOID Buffer;
+	PMDL Mdl;
 
 	PAGED_CODE();
 
 	//
-	//  Walk through each entry in the IoRun array.
+	//  Bridged runs are finished after the Io completes, so the request
+	//  must be synchronous.  The run must also end on a sector before the
+	//  end of the request.
 	//
 
-	while (RemainingEntries != 0)
+	if ((Vcb->InterleaveBridgeBytes == 0) ||
+		!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ) ||
+		(ByteCount >= RemainingByteCount) ||
+		FlagOn( ByteCount, SECTOR_MASK ) ||
+		FlagOn( (ULONG) DiskOffset, SECTOR_MASK ))
 	{
-		//
-		//  We only need to deal with the case of an unaligned transfer.
-		//
+		return FALSE;
+	}
 
-		if (ThisIoRun->TransferByteCount != 0)
-		{
-			//
-			//  If not the final cleanup then transfer the data to the
-			//  user's buffer and remember that we will need to flush
-			//  the user's buffer to memory.
-			//
-
-			if (!FinalCleanup)
-			{
-				RtlCopyMemory( ThisIoRun->UserBuffer,
-					Add2Ptr( ThisIoRun->TransferBuffer,
-						ThisIoRun->TransferBufferOffset,
-						PVOID ),
-					ThisIoRun->TransferByteCount );
+	if (MaxDiskByteCount > CD_MAX_BRIDGE_SPAN)
+	{
+		MaxDiskByteCount = CD_MAX_BRIDGE_SPAN;
+	}
 
-				FlushIoBuffers = TRUE;
-			}
+	//
+	//  Add each following run while the layout stays regular.  The gather
+	//  in CdFinishBuffers needs every gap to be the same size and every run
+	//  after the first to be a full unit, except that the last may be short.
+	//
 
-			//
-			//  Free any Mdl we may have allocated.  If the Mdl isn't
-			//  present then we must have failed during the allocation
-			//  phase.
-			//
+	while (DataByteCount < RemainingByteCount)
+	{
+		CdLookupAllocation(IrpContext,
+		                   Fcb,
+		                   FileOffset + DataByteCount,
+		                   &NextDiskOffset,
+		                   &NextByteCount);
 
-			if (ThisIoRun->TransferMdl != IrpContext->Irp->MdlAddress)
-			{
-				if (ThisIoRun->TransferMdl != NULL)
-				{
-					IoFreeMdl(ThisIoRun->TransferMdl);
-				}
+		if ((NextDiskOffset <= DiskOffset + SpanByteCount) ||
+			(NextDiskOffset - (DiskOffset + SpanByteCount) > Vcb->InterleaveBridgeBytes) ||
+			FlagOn( (ULONG) NextDiskOffset, SECTOR_MASK ))
+		{
+			break;
+		}
 
-				//
-				//  Now free any buffer we may have allocated.  If the Mdl
-				//  doesn't match the original Mdl then free the buffer.
-				//
+		ThisGapSize = (ULONG) (NextDiskOffset - (DiskOffset + SpanByteCount));
 
-				if (ThisIoRun->TransferBuffer != NULL)
-				{
-					//
-					//  If this is the final buffer for an XA read then store this buffer
-					//  into the Vcb so that we will have it when reading any remaining
-					//  portion of this buffer.
-					//
+		if (NextByteCount > RemainingByteCount - DataByteCount)
+		{
+			NextByteCount = RemainingByteCount - DataByteCount;
+		}
 
-					if (SaveXABuffer)
-					{
-						Vcb = IrpContext->Vcb;
+		if (GapCount == 0)
+		{
+			GapSize = ThisGapSize;
+			UnitSize = NextByteCount;
+		}
+		else if ((ThisGapSize != GapSize) ||
+			(LastByteCount != UnitSize) ||
+			(NextByteCount > UnitSize))
+		{
+			break;
+		}
 
-						CdLockVcb( IrpContext, Vcb );
+		//
+		//  Only the final run of the request may end inside a sector.
+		//
 
-						if (Vcb->XASector != NULL)
-						{
-							CdFreePool(&Vcb->XASector);
-						}
+		if (FlagOn( NextByteCount, SECTOR_MASK ) &&
+			(NextByteCount != RemainingByteCount - DataByteCount))
+		{
+			break;
+		}
 
-						Vcb->XASector = ThisIoRun->TransferBuffer;
-						Vcb->XADiskOffset = ThisIoRun->DiskOffset;
+		if (SpanByteCount + ThisGapSize + SectorAlign( NextByteCount ) > MaxDiskByteCount)
+		{
+			break;
+		}
 
-						SaveXABuffer = FALSE;
+		SpanByteCount += ThisGapSize + SectorAlign( NextByteCount );
+		DataByteCount += NextByteCount;
+		LastByteCount = NextByteCount;
+		GapCount += 1;
+	}
 
-						CdUnlockVcb( IrpContext, Vcb );
+	if (GapCount == 0)
+	{
+		return FALSE;
+	}
 
-						//
-						//  Otherwise just free the buffer.
-						//
-					}
-					else
-					{
-						CdFreePool(&ThisIoRun->TransferBuffer);
-					}
-				}
-			}
-		}
+	//
+	//  Allocate the buffer for the span and an Mdl to describe it.
+	//
 
-		//
-		//  Now handle the case where we failed in the process
-		//  of allocating associated Irps and Mdls.
-		//
+	if (RawSectors)
+	{
+		BufferSize = SectorsFromBytes( SpanByteCount ) * RAW_SECTOR_SIZE;
+	}
+	else
+	{
+		BufferSize = SpanByteCount;
+	}
 
-		if (ThisIoRun->SavedIrp != NULL)
-		{
-			if (ThisIoRun->SavedIrp->MdlAddress != NULL)
-			{
-				IoFreeMdl(ThisIoRun->SavedIrp->MdlAddress);
-			}
+	Buffer = ExAllocatePoolWithTag( CdNonPagedPool, BufferSize, TAG_IO_BUFFER );
 
-			IoFreeIrp(ThisIoRun->SavedIrp);
-		}
+	if (Buffer == NULL)
+	{
+		return FALSE;
+	}
 
-		//
-		//  Move to the previous IoRun entry.
-		//
+	Mdl = IoAllocateMdl( Buffer, BufferSize, FALSE, FALSE, NULL );
 
-		ThisIoRun -= 1;
-		RemainingEntries -= 1;
+	if (Mdl == NULL)
+	{
+		CdFreePool( &Buffer );
+		return FALSE;
 	}
 
+	MmBuildMdlForNonPagedPool( Mdl );
+
 	//
-	//  If we copied any data then flush the Io buffers.
+	//  Describe the span in the run.
 	//
 
-	return FlushIoBuffers;
+	IoRun->DiskOffset = DiskOffset;
+	IoRun->DiskByteCount = SpanByteCount;
+
+	IoRun->TransferBuffer = Buffer;
+	IoRun->TransferMdl = Mdl;
+	IoRun->TransferVirtualAddress = Buffer;
+	IoRun->TransferBufferOffset = 0;
+
+	if (RawSectors)
+	{
+		IoRun->TransferByteCount = SectorsFromBytes( DataByteCount ) * RAW_SECTOR_SIZE;
+		IoRun->BridgeFirstUnitSize = SectorsFromBytes( ByteCount ) * RAW_SECTOR_SIZE;
+		IoRun->BridgeUnitSize = SectorsFromBytes( UnitSize ) * RAW_SECTOR_SIZE;
+		IoRun->BridgeGapSize = SectorsFromBytes( GapSize ) * RAW_SECTOR_SIZE;
+	}
+	else
+	{
+		IoRun->TransferByteCount = DataByteCount;
+		IoRun->BridgeFirstUnitSize = ByteCount;
+		IoRun->BridgeUnitSize = UnitSize;
+		IoRun->BridgeGapSize = GapSize;
+	}
+
+	InterlockedIncrement( &Vcb->BridgedReads );
+	InterlockedExchangeAdd( &Vcb->BridgedGaps, (LONG) GapCount );
+	InterlockedExchangeAdd( &Vcb->BridgedGapBytes, (LONG) (GapCount * GapSize) );
+
+	*BridgedByteCount = DataByteCount;
+
+	return TRUE;
 }
 
-//  Tell prefast this is a completion routine.
-IO_COMPLETION_ROUTINE CdSyncCompletionRoutine;
 
-NTSTATUS
-CdSyncCompletionRoutine(
-	PDEVICE_OBJECT DeviceObject,
-	PIRP Irp,
-	PVOID Contxt
+//
+//  Local support routine
+//
+
+VOID
+CdAllocateTransferBuffer(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PVCB Vcb,
+	     _Inout_ PIO_RUN IoRun
 )
 
 /*++
 
 Routine Description:
 
-    Completion routine for synchronizing back to dispatch.
+    This routine finds a page sized buffer and Mdl for an unaligned run.
+    We take a bounce buffer from the Vcb if there is one, otherwise we
+    allocate the buffer and Mdl and count the miss.  CdFinishBuffers gives
+    back whichever we used.
 
 Arguments:
 
-    Contxt - pointer to KEVENT.
+    Vcb - Volume the run is on.
+
+    IoRun - Run needing the buffer.  The transfer buffer, Mdl and virtual
+        address are filled in here.
 
 Return Value:
 
-    STATUS_MORE_PROCESSING_REQUIRED
+    None.  Raises if we need to allocate and can't.
 
 --*/
 
 {
-	PKEVENT Event = (PKEVENT)Contxt;
-	_Analysis_assume_(Contxt != NULL);
+	PSLIST_ENTRY Entry;
 
-	UNREFERENCED_PARAMETER( Irp );
-	UNREFERENCED_PARAMETER( DeviceObject );
+	PAGED_CODE();
 
-	KeSetEvent(Event, 0, FALSE);
+	Entry = InterlockedPopEntrySList( &Vcb->BouncePool.List );
+
+	if (Entry != NULL)
+	{
+		IoRun->BounceBuffer = CONTAINING_RECORD( Entry, CD_BOUNCE_BUFFER, Links );
+		IoRun->BufferPool = &Vcb->BouncePool;
+
+		IoRun->TransferBuffer = IoRun->BounceBuffer->Buffer;
+		IoRun->TransferMdl = IoRun->BounceBuffer->Mdl;
+		IoRun->TransferVirtualAddress = IoRun->TransferBuffer;
+
+		InterlockedIncrement( &Vcb->BounceBufferUses );
+		return;
+	}
+
+	InterlockedIncrement( &Vcb->BounceBufferMisses );
 
 	//
-	//  We don't want IO to get our IRP and free it.
+	//  Allocate a buffer for the non-aligned transfer.
 	//
 
-	return STATUS_MORE_PROCESSING_REQUIRED;
+	IoRun->TransferBuffer = FsRtlAllocatePoolWithTag( CdNonPagedPool, PAGE_SIZE, TAG_IO_BUFFER );
+
+	//
+	//  Allocate and build the Mdl to describe this buffer.
+	//
+
+	IoRun->TransferMdl = IoAllocateMdl(IoRun->TransferBuffer,
+	                                   PAGE_SIZE,
+	                                   FALSE,
+	                                   FALSE,
+	                                   NULL);
+
+	IoRun->TransferVirtualAddress = IoRun->TransferBuffer;
+
+	if (IoRun->TransferMdl == NULL)
+	{
+		IrpContext->Irp->IoStatus.Information = 0;
+		CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+	}
+
+	MmBuildMdlForNonPagedPool(IoRun->TransferMdl);
 }
 
 
-_Requires_lock_held_(_Global_critical_region_)
-VOID
-CdFreeDirCache(
-	_In_ PIRP_CONTEXT IrpContext
+//
+//  Local support routine
+//
+
+BOOLEAN
+CdAllocateStagingBuffer(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PVCB Vcb,
+	     _Inout_ PIO_RUN IoRun
 )
 
 /*++
 
 Routine Description:
 
-    Safely frees the sector cache buffer.
+    This routine takes a staging buffer from the Vcb for an unaligned
+    cooked run longer than a page, so that it is read in one transfer
+    rather than a page at a time.
 
 Arguments:
 
+    Vcb - Volume the run is on.
+
+    IoRun - Run needing the buffer.  On input DiskByteCount is the sectors
+        wanted, and it is trimmed to what the buffer holds and the volume
+        reads at once.  The transfer buffer, Mdl and virtual address are
+        filled in here.
+
 Return Value:
 
-    None.
+    BOOLEAN - TRUE if the run got a staging buffer, FALSE if it should read
+        a page through a bounce buffer instead.
 
 --*/
 
 {
+	PSLIST_ENTRY Entry;
+	ULONG MaxByteCount;
+
 	PAGED_CODE();
 
-	if (NULL != IrpContext->Vcb->SectorCacheBuffer)
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	if (Vcb->StagingPool.BufferCount == 0)
 	{
-		CdAcquireCacheForUpdate( IrpContext);
-		CdFreePool(reinterpret_cast<PVOID*>(&IrpContext->Vcb->SectorCacheBuffer));
-		CdReleaseCache( IrpContext);
+		return FALSE;
+	}
+
+	MaxByteCount = min( Vcb->StagingPool.BufferSize, Vcb->MaximumTransfer );
+
+	//
+	//  Nothing to gain over a bounce buffer if we can't read past a page.
+	//
+
+	if (MaxByteCount <= PAGE_SIZE)
+	{
+		return FALSE;
+	}
+
+	Entry = InterlockedPopEntrySList( &Vcb->StagingPool.List );
+
+	if (Entry == NULL)
+	{
+		InterlockedIncrement( &Vcb->StagingMisses );
+		return FALSE;
+	}
+
+	IoRun->BounceBuffer = CONTAINING_RECORD( Entry, CD_BOUNCE_BUFFER, Links );
+	IoRun->BufferPool = &Vcb->StagingPool;
+
+	IoRun->TransferBuffer = IoRun->BounceBuffer->Buffer;
+	IoRun->TransferMdl = IoRun->BounceBuffer->Mdl;
+	IoRun->TransferVirtualAddress = IoRun->TransferBuffer;
+
+	if (IoRun->DiskByteCount > MaxByteCount)
+	{
+		IoRun->DiskByteCount = SectorTruncate( MaxByteCount );
 	}
+
+	InterlockedIncrement( &Vcb->StagedReads );
+
+	return TRUE;
 }
 
-_Requires_lock_held_(_Global_critical_region_)
+
+//
+//  Local support routine
+//
+
 BOOLEAN
-CdReadDirDataThroughCache(
+CdJoinInFlightRead(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ PIO_RUN Run
+	     _In_ PVCB Vcb,
+	     _In_ PIO_RUN IoRun,
+	     _Out_ PCD_INFLIGHT_READ InFlightRead,
+	     _Out_ PBOOLEAN Published
 )
 
 /*++
 
 Routine Description:
 
-    Reads blocks through the sector cache. If the data is present, then it
-    is copied from memory.  If not present, one of the cache chunks will be
-    replaced with a chunk containing the requested region, and the data
-    copied from there.
+    This routine is called before a synchronous read sends a single run to
+    the device.  If another read of sectors covering the run is in progress
+    we wait for it and copy its data into our buffer.  Otherwise, or if
+    that read fails, a paging read puts itself on the Vcb's list for others
+    to share and the caller issues it.
 
-    Only intended for reading *directory* blocks, for the purpose of pre-caching
-    directory information, by reading a chunk of blocks which hopefully contains
-    other directory blocks, rather than just the (usually) single block requested.
+    Only paging reads are shared.  Their buffer is pages which no process
+    can touch until the read completes, where any other read goes straight
+    into a buffer its requestor could rewrite before the others copy it.
+
+    The list is looked at without the lock first, so reads don't take the
+    InFlightMutex while there is nothing to share.
 
 Arguments:
 
-    Run - description of extent required, and buffer to read into.
+    Vcb - Volume being read.
+
+    IoRun - The run about to be sent.  It reads straight into the
+        request's buffer.
+
+    InFlightRead - Entry to describe our read if we publish it.
+
+    Published - Set to TRUE if InFlightRead was published, in which case the
+        caller must pass it to CdEndInFlightRead once the read is done.
 
 Return Value:
 
-    None. Raises on error.
+    BOOLEAN - TRUE if the data is already in the request's buffer, FALSE if
+        the caller must issue the read.
 
 --*/
 
 {
-	PVCB Vcb = IrpContext->Vcb;
-	ULONG Lbn = SectorsFromLlBytes(Run->DiskOffset);
-	ULONG Remaining = SectorsFromBytes( Run->DiskByteCount);
-	PUCHAR UserBuffer = reinterpret_cast<PUCHAR>(Run->TransferBuffer);
+	PLIST_ENTRY Links;
+	PCD_INFLIGHT_READ ThisRead = NULL;
+	BOOLEAN Copied = FALSE;
 
-	NTSTATUS Status;
-	ULONG Found;
-	ULONG BufferSectorOffset;
-	ULONG StartBlock;
-	ULONG EndBlock;
-	ULONG Blocks;
+	PAGED_CODE();
 
-	PIO_STACK_LOCATION IrpSp;
-	IO_STATUS_BLOCK Iosb;
+	*Published = FALSE;
 
-	PTRACK_DATA TrackData;
+	if (!IsListEmpty( &Vcb->InFlightReads ))
+	{
+		ExAcquireFastMutex( &Vcb->InFlightMutex );
 
-#if DBG
-	BOOLEAN JustRead = FALSE;
-#endif
+		for (Links = Vcb->InFlightReads.Flink;
+			Links != &Vcb->InFlightReads;
+			Links = Links->Flink)
+		{
+			ThisRead = CONTAINING_RECORD( Links, CD_INFLIGHT_READ, Links );
 
-	ULONG Index;
-	PCD_SECTOR_CACHE_CHUNK Buffer;
-	BOOLEAN Result = FALSE;
+			if ((IoRun->DiskOffset >= ThisRead->DiskOffset) &&
+				(IoRun->DiskOffset + IoRun->DiskByteCount <= ThisRead->DiskOffset + ThisRead->ByteCount))
+			{
+				ThisRead->Waiters += 1;
+				break;
+			}
 
-	PAGED_CODE();
+			ThisRead = NULL;
+		}
 
-	CdAcquireCacheForRead( IrpContext);
+		ExReleaseFastMutex( &Vcb->InFlightMutex );
+	}
 
-	__try
+	if (ThisRead != NULL)
 	{
+		KeWaitForSingleObject( &ThisRead->DataReady,
+		                       Executive,
+		                       KernelMode,
+		                       FALSE,
+		                       NULL );
+
+		if (NT_SUCCESS( ThisRead->Status ))
+		{
+			RtlCopyMemory( IoRun->TransferBuffer,
+				Add2Ptr( ThisRead->Buffer,
+					(ULONG) (IoRun->DiskOffset - ThisRead->DiskOffset),
+					PVOID ),
+				IoRun->DiskByteCount );
+
+			KeFlushIoBuffers( IrpContext->Irp->MdlAddress, TRUE, FALSE );
+
+			IrpContext->Irp->IoStatus.Status = STATUS_SUCCESS;
+
+			InterlockedIncrement( &Vcb->CoalescedReads );
+			Copied = TRUE;
+		}
+
 		//
-		//  Check the cache hasn't gone away due to volume verify failure (which
-		//  is the *only* reason it'll go away).  If this is the case we raise 
-		//  the same error any I/O would return if the cache weren't here.
+		//  The issuer can't return until the last of us is done with its
+		//  buffer.
 		//
 
-		if (NULL == Vcb->SectorCacheBuffer)
+		ExAcquireFastMutex( &Vcb->InFlightMutex );
+
+		ThisRead->Waiters -= 1;
+
+		if (ThisRead->Waiters == 0)
 		{
-			CdRaiseStatus( IrpContext, STATUS_VERIFY_REQUIRED);
+			KeSetEvent( &ThisRead->WaitersDone, 0, FALSE );
 		}
 
-		while (Remaining)
+		ExReleaseFastMutex( &Vcb->InFlightMutex );
+
+		if (Copied)
 		{
-			Buffer = NULL;
+			return TRUE;
+		}
+	}
 
-			//
-			//  Look to see if any portion is currently cached.
-			//
-
-			for (Index = 0; Index < CD_SEC_CACHE_CHUNKS; Index++)
-			{
-				if ((Vcb->SecCacheChunks[Index].BaseLbn != -1) &&
-					(Vcb->SecCacheChunks[Index].BaseLbn <= Lbn) &&
-					((Vcb->SecCacheChunks[Index].BaseLbn + CD_SEC_CHUNK_BLOCKS) > Lbn))
-				{
-					Buffer = &Vcb->SecCacheChunks[Index];
-					break;
-				}
-			}
-
-			//
-			//  If we found any, copy it out and continue.
-			//
-
-			if (NULL != Buffer)
-			{
-				BufferSectorOffset = Lbn - Buffer->BaseLbn;
-				Found = Min( CD_SEC_CHUNK_BLOCKS - BufferSectorOffset, Remaining);
-
-				RtlCopyMemory( UserBuffer,
-					Buffer->Buffer + BytesFromSectors( BufferSectorOffset),
-					BytesFromSectors( Found));
-
-				Remaining -= Found;
-				UserBuffer += BytesFromSectors( Found);
-				Lbn += Found;
-#if DBG
-				//
-				//  Update stats.  Don't count a hit if we've just read the data in.
-				//
-
-				if (!JustRead)
-				{
-					InterlockedIncrement((LONG*)&Vcb->SecCacheHits);
-				}
-
-				JustRead = FALSE;
-#endif 
-				continue;
-			}
-
-			//
-			//  Missed the cache, so we need to read a new chunk.  Take the cache
-			//  resource exclusive while we do so.
-			//
-
-			CdReleaseCache( IrpContext);
-			CdAcquireCacheForUpdate( IrpContext);
-#if DBG 
-			Vcb->SecCacheMisses += 1;
-#endif
-			//
-			//  Select the chunk to replace and calculate the start block of the 
-			//  chunk to cache.  We cache blocks which start on Lbns aligned on 
-			//  multiples of chunk size, treating block 16 (VRS start) as block
-			//  zero.
-			//
-
-			Buffer = &Vcb->SecCacheChunks[Vcb->SecCacheLRUChunkIndex];
-
-			StartBlock = Lbn - ((Lbn - 16) % CD_SEC_CHUNK_BLOCKS);
-
-			//
-			//  Make sure we don't __try and read past end of the last track.
-			//
-
-			TrackData = &Vcb->CdromToc->TrackData[(Vcb->CdromToc->LastTrack - Vcb->CdromToc->FirstTrack + 1)];
-
-			SwapCopyUchar4( &EndBlock, &TrackData->Address );
-
-			Blocks = EndBlock - StartBlock;
-
-			if (Blocks > CD_SEC_CHUNK_BLOCKS)
-			{
-				Blocks = CD_SEC_CHUNK_BLOCKS;
-			}
+	if (!FlagOn( IrpContext->Irp->Flags, IRP_PAGING_IO ))
+	{
+		return FALSE;
+	}
 
-			if ((0 == Blocks) || (Lbn < 16))
-			{
-				CdRaiseStatus( IrpContext, STATUS_INVALID_PARAMETER);
-			}
+	//
+	//  Publish our own read.
+	//
 
-			//
-			//  Now build / send the read request.
-			//
+	InFlightRead->DiskOffset = IoRun->DiskOffset;
+	InFlightRead->ByteCount = IoRun->DiskByteCount;
+	InFlightRead->Buffer = IoRun->TransferBuffer;
+	InFlightRead->Status = STATUS_PENDING;
+	InFlightRead->Waiters = 0;
 
-			IoReuseIrp(Vcb->SectorCacheIrp, STATUS_SUCCESS);
+	KeInitializeEvent( &InFlightRead->DataReady, NotificationEvent, FALSE );
+	KeInitializeEvent( &InFlightRead->WaitersDone, NotificationEvent, FALSE );
 
-			KeClearEvent(&Vcb->SectorCacheEvent);
-			Vcb->SectorCacheIrp->Tail.Overlay.Thread = PsGetCurrentThread();
+	ExAcquireFastMutex( &Vcb->InFlightMutex );
+	InsertTailList( &Vcb->InFlightReads, &InFlightRead->Links );
+	ExReleaseFastMutex( &Vcb->InFlightMutex );
 
-			//
-			// Get a pointer to the stack location of the first driver which will be
-			// invoked.  This is where the function codes and the parameters are set.
-			//
+	*Published = TRUE;
 
-			IrpSp = IoGetNextIrpStackLocation(Vcb->SectorCacheIrp);
-			IrpSp->MajorFunction = (UCHAR) IRP_MJ_READ;
+	return FALSE;
+}
 
-			//
-			//  Build an MDL to describe the buffer.
-			//
 
-			IoAllocateMdl(Buffer->Buffer,
-			              BytesFromSectors( Blocks),
-			              FALSE,
-			              FALSE,
-			              Vcb->SectorCacheIrp);
+//
+//  Local support routine
+//
 
-			if (NULL == Vcb->SectorCacheIrp->MdlAddress)
-			{
-				IrpContext->Irp->IoStatus.Information = 0;
-				CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES);
-			}
+VOID
+CdEndInFlightRead(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PVCB Vcb,
+	     _Inout_ PCD_INFLIGHT_READ InFlightRead,
+	     _In_ NTSTATUS Status
+)
 
-			//
-			//  We're reading/writing into the block cache (paged pool).  Lock the
-			//  pages and update the MDL with physical page information.
-			//
+/*++
 
-			__try
-			{
-				MmProbeAndLockPages(Vcb->SectorCacheIrp->MdlAddress,
-				                    KernelMode,
-				                    (LOCK_OPERATION) IoWriteAccess);
-			}
-#pragma warning(suppress: 6320)
-			__except (EXCEPTION_EXECUTE_HANDLER)
-			{
-				IoFreeMdl(Vcb->SectorCacheIrp->MdlAddress);
-				Vcb->SectorCacheIrp->MdlAddress = NULL;
-			}
+Routine Description:
 
-			if (NULL == Vcb->SectorCacheIrp->MdlAddress)
-			{
-				CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-			}
+    This routine takes a completed read off the Vcb's list, releases any
+    reads waiting on it and waits for them to finish copying its data.
 
-			//
-			//  Reset the BaseLbn as we can't trust this Buffer's data until the request
-			//  is successfully completed.
-			//
+Arguments:
 
-			Buffer->BaseLbn = (ULONG)-1;
+    Vcb - Volume being read.
 
-			IrpSp->Parameters.Read.Length = BytesFromSectors( Blocks);
-			IrpSp->Parameters.Read.ByteOffset.QuadPart = LlBytesFromSectors( StartBlock);
+    InFlightRead - Entry published by CdJoinInFlightRead.
 
-			IoSetCompletionRoutine(Vcb->SectorCacheIrp,
-			                       CdSyncCompletionRoutine,
-			                       &Vcb->SectorCacheEvent,
-			                       TRUE,
-			                       TRUE,
-			                       TRUE);
+    Status - Result of the read.  Waiters only copy the data on success.
 
-			Vcb->SectorCacheIrp->UserIosb = &Iosb;
+Return Value:
 
-			Status = IoCallDriver( Vcb->TargetDeviceObject, Vcb->SectorCacheIrp );
+    None
 
-			if (STATUS_PENDING == Status)
-			{
-				(VOID)KeWaitForSingleObject(&Vcb->SectorCacheEvent,
-				                            Executive,
-				                            KernelMode,
-				                            FALSE,
-				                            NULL);
+--*/
 
-				Status = Vcb->SectorCacheIrp->IoStatus.Status;
-			}
+{
+	ULONG Waiters;
 
-			Vcb->SectorCacheIrp->UserIosb = NULL;
+	PAGED_CODE();
 
-			//
-			//  Unlock the pages and free the MDL.
-			//
+	UNREFERENCED_PARAMETER( IrpContext );
 
-			MmUnlockPages(Vcb->SectorCacheIrp->MdlAddress);
-			IoFreeMdl(Vcb->SectorCacheIrp->MdlAddress);
-			Vcb->SectorCacheIrp->MdlAddress = NULL;
+	ExAcquireFastMutex( &Vcb->InFlightMutex );
 
-			if (!NT_SUCCESS( Status ))
-			{
-				try_leave( Status );
-			}
+	RemoveEntryList( &InFlightRead->Links );
 
-			//
-			//  Update the buffer information, and drop the cache resource to shared
-			//  to allow in reads.
-			//
+	InFlightRead->Status = Status;
+	Waiters = InFlightRead->Waiters;
 
-			Buffer->BaseLbn = StartBlock;
-			Vcb->SecCacheLRUChunkIndex = (Vcb->SecCacheLRUChunkIndex + 1) % CD_SEC_CACHE_CHUNKS;
+	KeSetEvent( &InFlightRead->DataReady, 0, FALSE );
 
-			CdConvertCacheToShared( IrpContext);
-#if DBG
-			JustRead = TRUE;
-#endif
-		}
+	ExReleaseFastMutex( &Vcb->InFlightMutex );
 
-		Result = TRUE;
-	}
-	__finally
+	if (Waiters != 0)
 	{
-		CdReleaseCache( IrpContext);
+		KeWaitForSingleObject( &InFlightRead->WaitersDone,
+		                       Executive,
+		                       KernelMode,
+		                       FALSE,
+		                       NULL );
 	}
-
-	return Result;
 }
 
 
@@ -2760,271 +3215,1890 @@ Return Value:
 //  Local support routine
 //
 
-_Requires_lock_held_(_Global_critical_region_)
-VOID
-CdMultipleAsync(
+BOOLEAN
+CdAllocateXAStagingBuffer(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ PFCB Fcb,
-	     _In_ ULONG RunCount,
-	     _Inout_ PIO_RUN IoRuns
+	     _In_ PVCB Vcb,
+	     _Inout_ PIO_RUN IoRun,
+	     _Inout_ PULONG ByteCount
 )
 
 /*++
 
 Routine Description:
 
-    This routine first does the initial setup required of a Master IRP that is
-    going to be completed using associated IRPs.  This routine should not
-    be used if only one async request is needed, instead the single read
-    async routines should be called.
-
-    A context parameter is initialized, to serve as a communications area
-    between here and the common completion routine.
-
-    Next this routine reads or writes one or more contiguous sectors from
-    a device asynchronously, and is used if there are multiple reads for a
-    master IRP.  A completion routine is used to synchronize with the
-    completion of all of the I/O requests started by calls to this routine.
-
-    Also, prior to calling this routine the caller must initialize the
-    IoStatus field in the Context, with the correct success status and byte
-    count which are expected if all of the parallel transfers complete
-    successfully.  After return this status will be unchanged if all requests
-    were, in fact, successful.  However, if one or more errors occur, the
-    IoStatus will be modified to reflect the error status and byte count
-    from the first run (by Vbo) which encountered an error.  I/O status
-    from all subsequent runs will not be indicated.
+    This routine takes a staging buffer from the Vcb for a raw read which
+    doesn't start or end on a raw sector.  The raw sectors are exposed to
+    the user whole, so the staged data goes to the user's buffer in one
+    copy from the start of the requested bytes.
 
 Arguments:
 
-    RunCount - Supplies the number of multiple async requests
-        that will be issued against the master irp.
+    Vcb - Volume the run is on.
 
-    IoRuns - Supplies an array containing the Offset and ByteCount for the
-        separate requests.
+    IoRun - Run needing the buffer.  The transfer buffer, Mdl and virtual
+        address are filled in here.
+
+    ByteCount - On input the cooked bytes contiguous on disk from the start
+        of the run.  On return the cooked bytes to read, trimmed to what
+        the buffer holds.
 
 Return Value:
 
-    None.
+    BOOLEAN - TRUE if the run got a staging buffer, FALSE if it should read
+        a single sector through a bounce buffer instead.
 
 --*/
 
 {
-	PIO_COMPLETION_ROUTINE CompletionRoutine;
-	PIO_STACK_LOCATION IrpSp;
-	PMDL Mdl;
-	PIRP Irp;
-	PIRP MasterIrp;
-	ULONG UnwindRunCount;
-	BOOLEAN UseSectorCache;
+	PSLIST_ENTRY Entry;
+	ULONG SectorCount = SectorsFromBytes( *ByteCount );
 
 	PAGED_CODE();
 
-	//
-	//  Set up things according to whether this is truely async.
-	//
-
-	CompletionRoutine = CdMultiSyncCompletionRoutine;
+	UNREFERENCED_PARAMETER( IrpContext );
 
-	if (!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ))
+	if (SectorCount > Vcb->XAStagingPool.BufferSize / RAW_SECTOR_SIZE)
 	{
-		CompletionRoutine = CdMultiAsyncCompletionRoutine;
+		SectorCount = Vcb->XAStagingPool.BufferSize / RAW_SECTOR_SIZE;
 	}
 
 	//
-	//  For directories, use the sector cache.
+	//  Nothing to gain over a bounce buffer for a single sector.
 	//
 
-	if ((SafeNodeType( Fcb) == CDFS_NTC_FCB_INDEX) &&
-		(NULL != Fcb->Vcb->SectorCacheBuffer) &&
-		(VcbMounted == IrpContext->Vcb->VcbCondition))
+	if (SectorCount < 2)
 	{
-		UseSectorCache = TRUE;
+		return FALSE;
 	}
-	else
+
+	Entry = InterlockedPopEntrySList( &Vcb->XAStagingPool.List );
+
+	if (Entry == NULL)
 	{
-		UseSectorCache = FALSE;
+		InterlockedIncrement( &Vcb->XAStagingMisses );
+		return FALSE;
 	}
 
-	//
-	//  Initialize some local variables.
-	//
+	IoRun->BounceBuffer = CONTAINING_RECORD( Entry, CD_BOUNCE_BUFFER, Links );
+	IoRun->BufferPool = &Vcb->XAStagingPool;
 
-	MasterIrp = IrpContext->Irp;
+	IoRun->TransferBuffer = IoRun->BounceBuffer->Buffer;
+	IoRun->TransferMdl = IoRun->BounceBuffer->Mdl;
+	IoRun->TransferVirtualAddress = IoRun->TransferBuffer;
 
-	//
-	//  Itterate through the runs, doing everything that can fail.
-	//  We let the cleanup in CdFinishBuffers clean up on error.
-	//
+	InterlockedIncrement( &Vcb->XAStagedReads );
 
-	for (UnwindRunCount = 0;
-	     UnwindRunCount < RunCount;
-	     UnwindRunCount += 1)
-	{
-		if (UseSectorCache)
-		{
-			if (!CdReadDirDataThroughCache(IrpContext, &IoRuns[UnwindRunCount]))
-			{
-				//
-				//  Turn off using directory cache and restart all over again.
-				//
+	*ByteCount = SectorCount * SECTOR_SIZE;
 
-				UseSectorCache = FALSE;
-				UnwindRunCount = 0;
-			}
+	return TRUE;
+}
 
-			continue;
-		}
 
-		//
-		//  Create an associated IRP, making sure there is one stack entry for
-		//  us, as well.
-		//
+//
+//  Local support routine
+//
 
-		IoRuns[UnwindRunCount].SavedIrp =
-			Irp = IoMakeAssociatedIrp(MasterIrp, (CCHAR)(IrpContext->Vcb->TargetDeviceObject->StackSize + 1));
+VOID
+CdGatherBridgedRun(
+	_In_ PIO_RUN IoRun
+)
 
-		if (Irp == NULL)
-		{
-			IrpContext->Irp->IoStatus.Information = 0;
-			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-		}
+/*++
 
-		//
-		// Allocate and build a partial Mdl for the request.
-		//
+Routine Description:
 
-		Mdl = IoAllocateMdl(IoRuns[UnwindRunCount].TransferVirtualAddress,
-		                    IoRuns[UnwindRunCount].DiskByteCount,
-		                    FALSE,
-		                    FALSE,
-		                    Irp);
+    This routine copies the file units of a bridged run from its transfer
+    buffer into the user's buffer, skipping the gaps between them.
 
-		if (Mdl == NULL)
-		{
-			IrpContext->Irp->IoStatus.Information = 0;
-			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-		}
+Arguments:
 
-		IoBuildPartialMdl(IoRuns[UnwindRunCount].TransferMdl,
-		                  Mdl,
-		                  IoRuns[UnwindRunCount].TransferVirtualAddress,
-		                  IoRuns[UnwindRunCount].DiskByteCount);
+    IoRun - Completed run prepared by CdPrepareBridgedRun.
 
-		//
-		//  Get the first IRP stack location in the associated Irp
-		//
+Return Value:
 
-		IoSetNextIrpStackLocation(Irp);
-		IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    None
 
-		//
-		//  Setup the Stack location to describe our read.
-		//
+--*/
 
-		IrpSp->MajorFunction = IRP_MJ_READ;
-		IrpSp->Parameters.Read.Length = IoRuns[UnwindRunCount].DiskByteCount;
-		IrpSp->Parameters.Read.ByteOffset.QuadPart = IoRuns[UnwindRunCount].DiskOffset;
+{
+	PUCHAR Source = Add2Ptr( IoRun->TransferBuffer, IoRun->TransferBufferOffset, PUCHAR );
+	PUCHAR Destination = (PUCHAR) IoRun->UserBuffer;
 
-		//
-		// Set up the completion routine address in our stack frame.
-		//
+	ULONG RemainingByteCount = IoRun->TransferByteCount;
+	ULONG UnitSize = IoRun->BridgeFirstUnitSize;
 
-		IoSetCompletionRoutine(Irp,
-		                       CompletionRoutine,
-		                       IrpContext->IoContext,
-		                       TRUE,
-		                       TRUE,
-		                       TRUE);
+	PAGED_CODE();
 
-		//
-		//  Setup the next IRP stack location in the associated Irp for the disk
-		//  driver beneath us.
-		//
+	while (RemainingByteCount != 0)
+	{
+		if (UnitSize > RemainingByteCount)
+		{
+			UnitSize = RemainingByteCount;
+		}
 
-		IrpSp = IoGetNextIrpStackLocation(Irp);
+		RtlCopyMemory( Destination, Source, UnitSize );
 
-		//
-		//  Setup the Stack location to do a read from the disk driver.
-		//
+		Destination += UnitSize;
+		Source += UnitSize + IoRun->BridgeGapSize;
+		RemainingByteCount -= UnitSize;
 
-		IrpSp->MajorFunction = IRP_MJ_READ;
-		IrpSp->Parameters.Read.Length = IoRuns[UnwindRunCount].DiskByteCount;
-		IrpSp->Parameters.Read.ByteOffset.QuadPart = IoRuns[UnwindRunCount].DiskOffset;
+		UnitSize = IoRun->BridgeUnitSize;
 	}
+}
 
-	//
-	//  If we used the cache, we're done.
-	//
 
-	if (UseSectorCache)
+//
+//  Local support routine
+//
+
+BOOLEAN
+CdFinishBuffers(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PIO_RUN IoRuns,
+	     _In_ ULONG RunCount,
+	     _In_ BOOLEAN FinalCleanup,
+	     _In_ BOOLEAN SaveXABuffer
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to perform any data transferred required for
+    unaligned Io or to perform the final cleanup of the IoRuns array.
+
+    In all cases this is where we will deallocate any buffer and mdl
+    allocated to perform the unaligned transfer.  If this is not the
+    final cleanup then we also transfer the bytes to the user buffer
+    and flush the hardware cache.
+
+    We walk backwards through the run array because we may be shifting data
+    in the user's buffer.  Typical case is where we allocated a buffer for
+    the first part of a read and then used the user's buffer for the
+    next section (but stored it at the beginning of the buffer.
+
+Arguments:
+
+    IoRuns - Pointer to the IoRuns array.
+
+    RunCount - Number of entries in the IoRuns array filled here.
+
+    FinalCleanup - Indicates if we should be deallocating temporary buffers
+        (TRUE) or transferring bytes for a unaligned transfers and
+        deallocating the buffers (FALSE).  Flush the system cache if
+        transferring data.
+
+    SaveXABuffer - TRUE if we should __try to save an XA buffer, FALSE otherwise
+
+Return Value:
+
+    BOOLEAN - TRUE if this request needs the Io buffers to be flushed, FALSE otherwise.
+
+--*/
+
+{
+	BOOLEAN FlushIoBuffers = FALSE;
+
+	ULONG RemainingEntries = RunCount;
+	PIO_RUN ThisIoRun = &IoRuns[RunCount - 1];
+	PVCB Vcb;
+
+	PAGED_CODE();
+
+	//
+	//  Walk through each entry in the IoRun array.
+	//
+
+	while (RemainingEntries != 0)
+	{
+		//
+		//  We only need to deal with the case of an unaligned transfer.
+		//
+
+		if (ThisIoRun->TransferByteCount != 0)
+		{
+			//
+			//  If not the final cleanup then transfer the data to the
+			//  user's buffer and remember that we will need to flush
+			//  the user's buffer to memory.
+			//
+
+			if (!FinalCleanup)
+			{
+				if (ThisIoRun->BridgeGapSize != 0)
+				{
+					CdGatherBridgedRun( ThisIoRun );
+				}
+				else
+				{
+					RtlCopyMemory( ThisIoRun->UserBuffer,
+						Add2Ptr( ThisIoRun->TransferBuffer,
+							ThisIoRun->TransferBufferOffset,
+							PVOID ),
+						ThisIoRun->TransferByteCount );
+				}
+
+				FlushIoBuffers = TRUE;
+			}
+
+			//
+			//  Return any bounce buffer to the Vcb, otherwise free any Mdl
+			//  we may have allocated.  If the Mdl isn't present then we
+			//  must have failed during the allocation phase.
+			//
+
+			if (ThisIoRun->BounceBuffer != NULL)
+			{
+				//
+				//  For the final buffer of an XA read, keep its last raw sector
+				//  in the Vcb's XA sector.  Reuse the one already there if we
+				//  can rather than allocating.
+				//
+
+				if (SaveXABuffer)
+				{
+					Vcb = IrpContext->Vcb;
+
+					CdLockVcb( IrpContext, Vcb );
+
+					if (Vcb->XASector == NULL)
+					{
+						Vcb->XASector = ExAllocatePoolWithTag( CdNonPagedPool, PAGE_SIZE, TAG_IO_BUFFER );
+					}
+
+					if (Vcb->XASector != NULL)
+					{
+						RtlCopyMemory( Vcb->XASector,
+							Add2Ptr( ThisIoRun->TransferBuffer,
+								(SectorsFromBytes( ThisIoRun->DiskByteCount ) - 1) * RAW_SECTOR_SIZE,
+								PVOID ),
+							RAW_SECTOR_SIZE );
+
+						Vcb->XADiskOffset = ThisIoRun->DiskOffset + ThisIoRun->DiskByteCount - SECTOR_SIZE;
+					}
+
+					SaveXABuffer = FALSE;
+
+					CdUnlockVcb( IrpContext, Vcb );
+				}
+
+				InterlockedPushEntrySList( &ThisIoRun->BufferPool->List,
+				                           &ThisIoRun->BounceBuffer->Links );
+
+				ThisIoRun->BounceBuffer = NULL;
+			}
+			else if (ThisIoRun->TransferMdl != IrpContext->Irp->MdlAddress)
+			{
+				if (ThisIoRun->TransferMdl != NULL)
+				{
+					IoFreeMdl(ThisIoRun->TransferMdl);
+				}
+
+				//
+				//  Now free any buffer we may have allocated.  If the Mdl
+				//  doesn't match the original Mdl then free the buffer.
+				//
+
+				if (ThisIoRun->TransferBuffer != NULL)
+				{
+					//
+					//  If this is the final buffer for an XA read then store this buffer
+					//  into the Vcb so that we will have it when reading any remaining
+					//  portion of this buffer.  A bridged buffer holds more than the
+					//  one sector at its disk offset, so we never keep it.
+					//
+
+					if (SaveXABuffer && (ThisIoRun->BridgeGapSize == 0))
+					{
+						Vcb = IrpContext->Vcb;
+
+						CdLockVcb( IrpContext, Vcb );
+
+						if (Vcb->XASector != NULL)
+						{
+							CdFreePool(&Vcb->XASector);
+						}
+
+						Vcb->XASector = ThisIoRun->TransferBuffer;
+						Vcb->XADiskOffset = ThisIoRun->DiskOffset;
+
+						SaveXABuffer = FALSE;
+
+						CdUnlockVcb( IrpContext, Vcb );
+
+						//
+						//  Otherwise just free the buffer.
+						//
+					}
+					else
+					{
+						CdFreePool(&ThisIoRun->TransferBuffer);
+					}
+				}
+			}
+		}
+
+		//
+		//  Now handle the case where we failed in the process
+		//  of allocating associated Irps and Mdls.
+		//
+
+		if (ThisIoRun->SavedIrp != NULL)
+		{
+			if (ThisIoRun->SavedIrp->MdlAddress != NULL)
+			{
+				IoFreeMdl(ThisIoRun->SavedIrp->MdlAddress);
+			}
+
+			IoFreeIrp(ThisIoRun->SavedIrp);
+		}
+
+		//
+		//  Move to the previous IoRun entry.
+		//
+
+		ThisIoRun -= 1;
+		RemainingEntries -= 1;
+	}
+
+	//
+	//  If we copied any data then flush the Io buffers.
+	//
+
+	return FlushIoBuffers;
+}
+
+//  Tell prefast this is a completion routine.
+IO_COMPLETION_ROUTINE CdSyncCompletionRoutine;
+
+NTSTATUS
+CdSyncCompletionRoutine(
+	PDEVICE_OBJECT DeviceObject,
+	PIRP Irp,
+	PVOID Contxt
+)
+
+/*++
+
+Routine Description:
+
+    Completion routine for synchronizing back to dispatch.
+
+Arguments:
+
+    Contxt - pointer to KEVENT.
+
+Return Value:
+
+    STATUS_MORE_PROCESSING_REQUIRED
+
+--*/
+
+{
+	PKEVENT Event = (PKEVENT)Contxt;
+	_Analysis_assume_(Contxt != NULL);
+
+	UNREFERENCED_PARAMETER( Irp );
+	UNREFERENCED_PARAMETER( DeviceObject );
+
+	KeSetEvent(Event, 0, FALSE);
+
+	//
+	//  We don't want IO to get our IRP and free it.
+	//
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+
+_Requires_lock_held_(_Global_critical_region_)
+VOID
+CdFreeDirCache(
+	_In_ PIRP_CONTEXT IrpContext
+)
+
+/*++
+
+Routine Description:
+
+    Safely frees the sector cache buffer.
+
+Arguments:
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_SECTOR_CACHE SectorCache = IrpContext->Vcb->SectorCache;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	if (NULL != IrpContext->Vcb->SectorCacheBuffer)
+	{
+		//
+		//  Readers hold at most one partition at a time, so taking all of
+		//  them in order can't deadlock.
+		//
+
+		for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+		{
+			CdAcquireCacheForUpdate( IrpContext, &SectorCache->Partitions[Index]);
+		}
+
+		CdFreePool(reinterpret_cast<PVOID*>(&IrpContext->Vcb->SectorCacheBuffer));
+
+		for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+		{
+			CdReleaseCache( IrpContext, &SectorCache->Partitions[Index]);
+		}
+	}
+}
+
+_Requires_lock_held_(_Global_critical_region_)
+BOOLEAN
+CdReadDirDataThroughCache(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PIO_RUN Run,
+	     _In_ ULONG CacheClass
+)
+
+/*++
+
+Routine Description:
+
+    Reads blocks through the sector cache. If the data is present, then it
+    is copied from memory.  If not present, one of the cache chunks in the
+    partition owning the requested region will be replaced with a chunk
+    containing it, and the data copied from there.
+
+    Only intended for reading metadata blocks (directories, the path table
+    and zisofs pointer tables), for the purpose of pre-caching metadata, by
+    reading a chunk of blocks which hopefully contains other metadata blocks,
+    rather than just the (usually) single block requested.
+
+Arguments:
+
+    Run - description of extent required, and buffer to read into.
+
+    CacheClass - CDFS_SECTOR_CACHE_CLASS_ of the read, for the statistics.
+
+Return Value:
+
+    BOOLEAN - TRUE if the run was satisfied, FALSE if a read to fill the
+        cache failed and the caller should go to the disc.  Raises on other
+        errors.
+
+--*/
+
+{
+	PVCB Vcb = IrpContext->Vcb;
+	PCD_SECTOR_CACHE SectorCache = Vcb->SectorCache;
+	ULONG Lbn = SectorsFromLlBytes(Run->DiskOffset);
+	ULONG Remaining = SectorsFromBytes( Run->DiskByteCount);
+	PUCHAR UserBuffer = reinterpret_cast<PUCHAR>(Run->TransferBuffer);
+
+	NTSTATUS Status;
+	ULONG Found;
+	ULONG BufferSectorOffset;
+	ULONG ChunkNumber;
+	ULONG ChunksPerPartition;
+	ULONG PartitionIndex;
+	ULONG StartBlock;
+	ULONG EndBlock;
+	ULONG Blocks;
+
+	PIO_STACK_LOCATION IrpSp;
+	IO_STATUS_BLOCK Iosb;
+	CD_DEVICE_READ DeviceRead;
+
+	PTRACK_DATA TrackData;
+
+	PCD_SECTOR_CACHE_PARTITION Partition = NULL;
+	PULONG Bucket;
+	PULONG Link;
+	ULONG Index;
+	PCD_SECTOR_CACHE_CHUNK Chunk;
+	BOOLEAN Result = FALSE;
+
+	PAGED_CODE();
+
+	ChunksPerPartition = SectorCache->ChunkCount / CD_SEC_CACHE_PARTITIONS;
+
+	__try
+	{
+		while (Remaining)
+		{
+			//
+			//  We cache blocks which start on Lbns aligned on multiples of chunk
+			//  size, treating block 16 (VRS start) as block zero.  Find the
+			//  chunk and the partition and bucket it hashes to.
+			//
+
+			if (Lbn < 16)
+			{
+				CdRaiseStatus( IrpContext, STATUS_INVALID_PARAMETER);
+			}
+
+			ChunkNumber = (Lbn - 16) / CD_SEC_CHUNK_BLOCKS;
+			StartBlock = 16 + ChunkNumber * CD_SEC_CHUNK_BLOCKS;
+
+			PartitionIndex = ChunkNumber % CD_SEC_CACHE_PARTITIONS;
+			Partition = &SectorCache->Partitions[PartitionIndex];
+			Bucket = &SectorCache->Buckets[PartitionIndex * (SectorCache->BucketMask + 1) +
+			                               ((ChunkNumber / CD_SEC_CACHE_PARTITIONS) & SectorCache->BucketMask)];
+
+			CdAcquireCacheForRead( IrpContext, Partition);
+
+			//
+			//  Check the cache hasn't gone away due to volume verify failure (which
+			//  is the *only* reason it'll go away).  If this is the case we raise 
+			//  the same error any I/O would return if the cache weren't here.
+			//
+
+			if (NULL == Vcb->SectorCacheBuffer)
+			{
+				CdRaiseStatus( IrpContext, STATUS_VERIFY_REQUIRED);
+			}
+
+			for (Index = *Bucket; Index != CD_SEC_CACHE_NO_CHUNK; Index = SectorCache->Chunks[Index].NextInBucket)
+			{
+				if (SectorCache->Chunks[Index].BaseLbn == StartBlock)
+				{
+					break;
+				}
+			}
+
+			if (Index != CD_SEC_CACHE_NO_CHUNK)
+			{
+				SectorCache->Chunks[Index].Referenced = TRUE;
+				InterlockedIncrement( &SectorCache->Hits[CacheClass]);
+			}
+			else
+			{
+				//
+				//  Missed the cache, so we need to read a new chunk.  Take the
+				//  partition exclusive while we do so, and check nobody beat us
+				//  to it while we didn't hold it.
+				//
+
+				CdReleaseCache( IrpContext, Partition);
+				CdAcquireCacheForUpdate( IrpContext, Partition);
+
+				if (NULL == Vcb->SectorCacheBuffer)
+				{
+					CdRaiseStatus( IrpContext, STATUS_VERIFY_REQUIRED);
+				}
+
+				for (Index = *Bucket; Index != CD_SEC_CACHE_NO_CHUNK; Index = SectorCache->Chunks[Index].NextInBucket)
+				{
+					if (SectorCache->Chunks[Index].BaseLbn == StartBlock)
+					{
+						break;
+					}
+				}
+
+				if (Index != CD_SEC_CACHE_NO_CHUNK)
+				{
+					InterlockedIncrement( &SectorCache->Hits[CacheClass]);
+				}
+				else
+				{
+					InterlockedIncrement( &SectorCache->Misses[CacheClass]);
+
+					//
+					//  Make sure we don't __try and read past end of the last track.
+					//
+
+					TrackData = &Vcb->CdromToc->TrackData[(Vcb->CdromToc->LastTrack - Vcb->CdromToc->FirstTrack + 1)];
+
+					SwapCopyUchar4( &EndBlock, &TrackData->Address );
+
+					if (EndBlock <= StartBlock)
+					{
+						CdRaiseStatus( IrpContext, STATUS_INVALID_PARAMETER);
+					}
+
+					Blocks = EndBlock - StartBlock;
+
+					if (Blocks > CD_SEC_CHUNK_BLOCKS)
+					{
+						Blocks = CD_SEC_CHUNK_BLOCKS;
+					}
+
+					//
+					//  Select the chunk to replace.  Sweep the clock hand over
+					//  the partition, giving chunks hit since it last passed a
+					//  second chance.  This ends within two sweeps.
+					//
+
+					for (;;)
+					{
+						Index = PartitionIndex * ChunksPerPartition + Partition->ClockHand;
+						Chunk = &SectorCache->Chunks[Index];
+
+						Partition->ClockHand = (Partition->ClockHand + 1) % ChunksPerPartition;
+
+						if ((Chunk->BaseLbn == CD_SEC_CACHE_NO_LBN) ||
+							!InterlockedExchange( &Chunk->Referenced, FALSE))
+						{
+							break;
+						}
+					}
+
+					//
+					//  Unhook the victim from its hash chain.  We can't trust this
+					//  chunk's data until the request is successfully completed.
+					//
+
+					if (Chunk->BaseLbn != CD_SEC_CACHE_NO_LBN)
+					{
+						ULONG OldChunkNumber = (Chunk->BaseLbn - 16) / CD_SEC_CHUNK_BLOCKS;
+
+						Link = &SectorCache->Buckets[PartitionIndex * (SectorCache->BucketMask + 1) +
+						                             ((OldChunkNumber / CD_SEC_CACHE_PARTITIONS) & SectorCache->BucketMask)];
+
+						while (*Link != Index)
+						{
+							Link = &SectorCache->Chunks[*Link].NextInBucket;
+						}
+
+						*Link = Chunk->NextInBucket;
+
+						Chunk->BaseLbn = CD_SEC_CACHE_NO_LBN;
+						Chunk->NextInBucket = CD_SEC_CACHE_NO_CHUNK;
+
+						InterlockedIncrement( &SectorCache->Evictions);
+					}
+
+					//
+					//  Now build / send the read request.
+					//
+
+					IoReuseIrp(Partition->Irp, STATUS_SUCCESS);
+
+					KeClearEvent(&Partition->Event);
+					Partition->Irp->Tail.Overlay.Thread = PsGetCurrentThread();
+
+					//
+					// Get a pointer to the stack location of the first driver which will be
+					// invoked.  This is where the function codes and the parameters are set.
+					//
+
+					IrpSp = IoGetNextIrpStackLocation(Partition->Irp);
+					IrpSp->MajorFunction = (UCHAR) IRP_MJ_READ;
+
+					//
+					//  Build an MDL to describe the buffer.
+					//
+
+					IoAllocateMdl(Vcb->SectorCacheBuffer + BytesFromSectors( Index * CD_SEC_CHUNK_BLOCKS),
+					              BytesFromSectors( Blocks),
+					              FALSE,
+					              FALSE,
+					              Partition->Irp);
+
+					if (NULL == Partition->Irp->MdlAddress)
+					{
+						IrpContext->Irp->IoStatus.Information = 0;
+						CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES);
+					}
+
+					//
+					//  We're reading/writing into the block cache (paged pool).  Lock the
+					//  pages and update the MDL with physical page information.
+					//
+
+					__try
+					{
+						MmProbeAndLockPages(Partition->Irp->MdlAddress,
+						                    KernelMode,
+						                    (LOCK_OPERATION) IoWriteAccess);
+					}
+#pragma warning(suppress: 6320)
+					__except (EXCEPTION_EXECUTE_HANDLER)
+					{
+						IoFreeMdl(Partition->Irp->MdlAddress);
+						Partition->Irp->MdlAddress = NULL;
+					}
+
+					if (NULL == Partition->Irp->MdlAddress)
+					{
+						CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+					}
+
+					IrpSp->Parameters.Read.Length = BytesFromSectors( Blocks);
+					IrpSp->Parameters.Read.ByteOffset.QuadPart = LlBytesFromSectors( StartBlock);
+
+					IoSetCompletionRoutine(Partition->Irp,
+					                       CdSyncCompletionRoutine,
+					                       &Partition->Event,
+					                       TRUE,
+					                       TRUE,
+					                       TRUE);
+
+					Partition->Irp->UserIosb = &Iosb;
+
+					CdRecordReadTrace(Vcb,
+					                  0,
+					                  IrpSp->Parameters.Read.ByteOffset.QuadPart,
+					                  IrpSp->Parameters.Read.Length,
+					                  CDFS_READ_TRACE_DEVICE_IO);
+
+					//
+					//  The fill is as urgent as the request it is for.
+					//
+
+					IoSetIoPriorityHint( Partition->Irp, IoGetIoPriorityHint( IrpContext->Irp ));
+
+					//
+					//  Others may be waiting on the partition for this fill,
+					//  so it is never held back for priority.
+					//
+
+					CdBeginDeviceRead( IrpContext, FALSE, &DeviceRead );
+
+					Status = IoCallDriver( Vcb->TargetDeviceObject, Partition->Irp );
+
+					if (STATUS_PENDING == Status)
+					{
+						(VOID)KeWaitForSingleObject(&Partition->Event,
+						                            Executive,
+						                            KernelMode,
+						                            FALSE,
+						                            NULL);
+
+						Status = Partition->Irp->IoStatus.Status;
+					}
+
+					CdEndDeviceRead( &DeviceRead );
+
+					Partition->Irp->UserIosb = NULL;
+
+					//
+					//  Unlock the pages and free the MDL.
+					//
+
+					MmUnlockPages(Partition->Irp->MdlAddress);
+					IoFreeMdl(Partition->Irp->MdlAddress);
+					Partition->Irp->MdlAddress = NULL;
+
+					if (!NT_SUCCESS( Status ))
+					{
+						try_leave( Status );
+					}
+
+					//
+					//  Hook the chunk into its hash chain.  It isn't marked
+					//  referenced, so unless it is hit again it is the first
+					//  to go when the clock hand comes round.
+					//
+
+					Chunk->BaseLbn = StartBlock;
+					Chunk->NextInBucket = *Bucket;
+					*Bucket = Index;
+				}
+
+				//
+				//  Drop the partition to shared to allow in reads.
+				//
+
+				CdConvertCacheToShared( IrpContext, Partition);
+			}
+
+			//
+			//  Copy out what we need from this chunk and continue.
+			//
+
+			BufferSectorOffset = Lbn - StartBlock;
+			Found = Min( CD_SEC_CHUNK_BLOCKS - BufferSectorOffset, Remaining);
+
+			RtlCopyMemory( UserBuffer,
+				Vcb->SectorCacheBuffer + BytesFromSectors( Index * CD_SEC_CHUNK_BLOCKS + BufferSectorOffset),
+				BytesFromSectors( Found));
+
+			CdReleaseCache( IrpContext, Partition);
+			Partition = NULL;
+
+			Remaining -= Found;
+			UserBuffer += BytesFromSectors( Found);
+			Lbn += Found;
+		}
+
+		Result = TRUE;
+	}
+	__finally
+	{
+		if (NULL != Partition)
+		{
+			CdReleaseCache( IrpContext, Partition);
+		}
+	}
+
+	return Result;
+}
+
+
+//
+//  Local support routine
+//
+
+_Requires_lock_held_(_Global_critical_region_)
+VOID
+CdMultipleAsync(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb,
+	     _In_ ULONG RunCount,
+	     _Inout_ PIO_RUN IoRuns
+)
+
+/*++
+
+Routine Description:
+
+    This routine first does the initial setup required of a Master IRP that is
+    going to be completed using associated IRPs.  This routine should not
+    be used if only one async request is needed, instead the single read
+    async routines should be called.
+
+    A context parameter is initialized, to serve as a communications area
+    between here and the common completion routine.
+
+    Next this routine reads or writes one or more contiguous sectors from
+    a device asynchronously, and is used if there are multiple reads for a
+    master IRP.  A completion routine is used to synchronize with the
+    completion of all of the I/O requests started by calls to this routine.
+
+    Also, prior to calling this routine the caller must initialize the
+    IoStatus field in the Context, with the correct success status and byte
+    count which are expected if all of the parallel transfers complete
+    successfully.  After return this status will be unchanged if all requests
+    were, in fact, successful.  However, if one or more errors occur, the
+    IoStatus will be modified to reflect the error status and byte count
+    from the first run (by Vbo) which encountered an error.  I/O status
+    from all subsequent runs will not be indicated.
+
+Arguments:
+
+    RunCount - Supplies the number of multiple async requests
+        that will be issued against the master irp.
+
+    IoRuns - Supplies an array containing the Offset and ByteCount for the
+        separate requests.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PIO_COMPLETION_ROUTINE CompletionRoutine;
+	PIO_STACK_LOCATION IrpSp;
+	PMDL Mdl;
+	PIRP Irp;
+	PIRP MasterIrp;
+	ULONG UnwindRunCount;
+	ULONG CacheClass;
+	BOOLEAN UseSectorCache;
+
+	PAGED_CODE();
+
+	//
+	//  Set up things according to whether this is truely async.
+	//
+
+	CompletionRoutine = CdMultiSyncCompletionRoutine;
+
+	if (!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ))
+	{
+		CompletionRoutine = CdMultiAsyncCompletionRoutine;
+	}
+
+	//
+	//  For metadata, use the sector cache.
+	//
+
+	CacheClass = CdSectorCacheClass( IrpContext, Fcb);
+	UseSectorCache = (CacheClass != CD_SEC_CACHE_NO_CLASS);
+
+	//
+	//  Initialize some local variables.
+	//
+
+	MasterIrp = IrpContext->Irp;
+
+	//
+	//  Itterate through the runs, doing everything that can fail.
+	//  We let the cleanup in CdFinishBuffers clean up on error.
+	//
+
+	for (UnwindRunCount = 0;
+	     UnwindRunCount < RunCount;
+	     UnwindRunCount += 1)
+	{
+		if (UseSectorCache)
+		{
+			if (!CdReadDirDataThroughCache(IrpContext, &IoRuns[UnwindRunCount], CacheClass))
+			{
+				//
+				//  Turn off using directory cache and restart all over again.
+				//
+
+				UseSectorCache = FALSE;
+				UnwindRunCount = 0;
+			}
+
+			continue;
+		}
+
+		//
+		//  Create an associated IRP, making sure there is one stack entry for
+		//  us, as well.
+		//
+
+		IoRuns[UnwindRunCount].SavedIrp =
+			Irp = IoMakeAssociatedIrp(MasterIrp, (CCHAR)(IrpContext->Vcb->TargetDeviceObject->StackSize + 1));
+
+		if (Irp == NULL)
+		{
+			IrpContext->Irp->IoStatus.Information = 0;
+			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+		}
+
+		IoSetIoPriorityHint( Irp, IoGetIoPriorityHint( MasterIrp ));
+
+		//
+		// Allocate and build a partial Mdl for the request.
+		//
+
+		Mdl = IoAllocateMdl(IoRuns[UnwindRunCount].TransferVirtualAddress,
+		                    IoRuns[UnwindRunCount].DiskByteCount,
+		                    FALSE,
+		                    FALSE,
+		                    Irp);
+
+		if (Mdl == NULL)
+		{
+			IrpContext->Irp->IoStatus.Information = 0;
+			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+		}
+
+		IoBuildPartialMdl(IoRuns[UnwindRunCount].TransferMdl,
+		                  Mdl,
+		                  IoRuns[UnwindRunCount].TransferVirtualAddress,
+		                  IoRuns[UnwindRunCount].DiskByteCount);
+
+		//
+		//  Get the first IRP stack location in the associated Irp
+		//
+
+		IoSetNextIrpStackLocation(Irp);
+		IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+		//
+		//  Setup the Stack location to describe our read.
+		//
+
+		IrpSp->MajorFunction = IRP_MJ_READ;
+		IrpSp->Parameters.Read.Length = IoRuns[UnwindRunCount].DiskByteCount;
+		IrpSp->Parameters.Read.ByteOffset.QuadPart = IoRuns[UnwindRunCount].DiskOffset;
+
+		//
+		// Set up the completion routine address in our stack frame.
+		//
+
+		IoSetCompletionRoutine(Irp,
+		                       CompletionRoutine,
+		                       IrpContext->IoContext,
+		                       TRUE,
+		                       TRUE,
+		                       TRUE);
+
+		//
+		//  Setup the next IRP stack location in the associated Irp for the disk
+		//  driver beneath us.
+		//
+
+		IrpSp = IoGetNextIrpStackLocation(Irp);
+
+		//
+		//  Setup the Stack location to do a read from the disk driver.
+		//
+
+		IrpSp->MajorFunction = IRP_MJ_READ;
+		IrpSp->Parameters.Read.Length = IoRuns[UnwindRunCount].DiskByteCount;
+		IrpSp->Parameters.Read.ByteOffset.QuadPart = IoRuns[UnwindRunCount].DiskOffset;
+	}
+
+	//
+	//  If we used the cache, we're done.
+	//
+
+	if (UseSectorCache)
+	{
+		if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT))
+		{
+			IrpContext->Irp->IoStatus.Status = STATUS_SUCCESS ;
+			KeSetEvent(&IrpContext->IoContext->SyncEvent, 0, FALSE);
+		}
+
+		return;
+	}
+
+	//
+	//  We only need to set the associated IRP count in the master irp to
+	//  make it a master IRP.  But we set the count to one more than our
+	//  caller requested, because we do not want the I/O system to complete
+	//  the I/O.  We also set our own count.
+	//
+
+	IrpContext->IoContext->IrpCount = RunCount;
+	IrpContext->IoContext->MasterIrp = MasterIrp;
+
+	//
+	//  We set the count in the master Irp to 1 since typically we
+	//  will clean up the associated irps ourselves.  Setting this to one
+	//  means completing the last associated Irp with SUCCESS (in the async
+	//  case) will complete the master irp.
+	//
+
+	MasterIrp->AssociatedIrp.IrpCount = 1;
+
+	//
+	//  If we (FS) acquired locks, transition the lock owners to an object, since
+	//  when we return this thread could go away before request completion, and
+	//  the resource package may otherwise __try to boost priority, etc.
+	//
+
+	if (!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ) &&
+		FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_TOP_LEVEL ))
+	{
+		NT_ASSERT( IrpContext->IoContext->ResourceThreadId == (ERESOURCE_THREAD)PsGetCurrentThread() );
+
+		IrpContext->IoContext->ResourceThreadId = ((ULONG_PTR)IrpContext->IoContext) | 3;
+
+		ExSetResourceOwnerPointer(IrpContext->IoContext->Resource,
+		                          (PVOID)IrpContext->IoContext->ResourceThreadId);
+	}
+
+	//
+	//  Now that all the dangerous work is done, issue the Io requests
+	//
+
+	CdBeginDeviceRead( IrpContext, TRUE, &IrpContext->IoContext->DeviceRead );
+
+	for (UnwindRunCount = 0;
+	     UnwindRunCount < RunCount;
+	     UnwindRunCount++)
+	{
+		Irp = IoRuns[UnwindRunCount].SavedIrp;
+		IoRuns[UnwindRunCount].SavedIrp = NULL;
+
+		if (NULL != Irp)
+		{
+			CdRecordReadTrace(IrpContext->Vcb,
+			                  Fcb->FileId.QuadPart,
+			                  IoRuns[UnwindRunCount].DiskOffset,
+			                  IoRuns[UnwindRunCount].DiskByteCount,
+			                  CDFS_READ_TRACE_DEVICE_IO);
+
+			//
+			//  If IoCallDriver returns an error, it has completed the Irp
+			//  and the error will be caught by our completion routines
+			//  and dealt with as a normal IO error.
+			//
+
+			(VOID) IoCallDriver( IrpContext->Vcb->TargetDeviceObject, Irp );
+		}
+	}
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdMultipleXAAsync(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ ULONG RunCount,
+	     _Inout_ PIO_RUN IoRuns,
+	     _In_ PRAW_READ_INFO RawReads,
+	     _In_ TRACK_MODE_TYPE TrackMode
+)
+
+/*++
+
+Routine Description:
+
+    This routine first does the initial setup required of a Master IRP that is
+    going to be completed using associated IRPs.  This routine is used to generate
+    the associated Irps used to read raw sectors from the disk.
+
+    A context parameter is initialized, to serve as a communications area
+    between here and the common completion routine.
+
+    Next this routine reads or writes one or more contiguous sectors from
+    a device asynchronously, and is used if there are multiple reads for a
+    master IRP.  A completion routine is used to synchronize with the
+    completion of all of the I/O requests started by calls to this routine.
+
+    Also, prior to calling this routine the caller must initialize the
+    IoStatus field in the Context, with the correct success status and byte
+    count which are expected if all of the parallel transfers complete
+    successfully.  After return this status will be unchanged if all requests
+    were, in fact, successful.  However, if one or more errors occur, the
+    IoStatus will be modified to reflect the error status and byte count
+    from the first run (by Vbo) which encountered an error.  I/O status
+    from all subsequent runs will not be indicated.
+
+Arguments:
+
+    RunCount - Supplies the number of multiple async requests
+        that will be issued against the master irp.
+
+    IoRuns - Supplies an array containing the Offset and ByteCount for the
+        separate requests.
+
+    RawReads - Supplies an array of structures to store in the Irps passed to the
+        device driver to perform the low-level Io.
+
+    TrackMode - Supplies the recording mode of sectors in these IoRuns
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	PMDL Mdl;
+	PIRP Irp;
+	PIRP MasterIrp;
+	ULONG UnwindRunCount;
+	ULONG RawByteCount;
+
+	PIO_RUN ThisIoRun = IoRuns;
+	PRAW_READ_INFO ThisRawRead = RawReads;
+
+	PAGED_CODE();
+
+	//
+	//  Initialize some local variables.
+	//
+
+	MasterIrp = IrpContext->Irp;
+
+	//
+	//  Itterate through the runs, doing everything that can fail.
+	//  We let the cleanup in CdFinishBuffers clean up on error.
+	//
+
+	for (UnwindRunCount = 0;
+	     UnwindRunCount < RunCount;
+	     UnwindRunCount += 1 , ThisIoRun += 1 , ThisRawRead += 1)
+	{
+		//
+		//  Create an associated IRP, making sure there is one stack entry for
+		//  us, as well.
+		//
+
+		ThisIoRun->SavedIrp =
+			Irp = IoMakeAssociatedIrp(MasterIrp, (CCHAR)(IrpContext->Vcb->TargetDeviceObject->StackSize + 1));
+
+		if (Irp == NULL)
+		{
+			IrpContext->Irp->IoStatus.Information = 0;
+			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+		}
+
+		IoSetIoPriorityHint( Irp, IoGetIoPriorityHint( MasterIrp ));
+
+		//
+		//  Should have been passed a byte count of at least one sector, and 
+		//  must be a multiple of sector size
+		//
+
+		NT_ASSERT( ThisIoRun->DiskByteCount && !SectorOffset(ThisIoRun->DiskByteCount));
+
+		RawByteCount = SectorsFromBytes( ThisIoRun->DiskByteCount) * RAW_SECTOR_SIZE;
+
+		//
+		// Allocate and build a partial Mdl for the request.
+		//
+
+		Mdl = IoAllocateMdl(ThisIoRun->TransferVirtualAddress,
+		                    RawByteCount,
+		                    FALSE,
+		                    FALSE,
+		                    Irp);
+
+		if (Mdl == NULL)
+		{
+			IrpContext->Irp->IoStatus.Information = 0;
+			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+		}
+
+		IoBuildPartialMdl(ThisIoRun->TransferMdl,
+		                  Mdl,
+		                  ThisIoRun->TransferVirtualAddress,
+		                  RawByteCount);
+		//
+		//  Get the first IRP stack location in the associated Irp
+		//
+
+		IoSetNextIrpStackLocation(Irp);
+		IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+		//
+		//  Setup the Stack location to describe our read (using cooked values)
+		//  These values won't be used for the raw read in any case.
+		//
+
+		IrpSp->MajorFunction = IRP_MJ_READ;
+		IrpSp->Parameters.Read.Length = ThisIoRun->DiskByteCount;
+		IrpSp->Parameters.Read.ByteOffset.QuadPart = ThisIoRun->DiskOffset;
+
+		//
+		// Set up the completion routine address in our stack frame.
+		//
+
+		IoSetCompletionRoutine(Irp,
+		                       CdMultiSyncCompletionRoutine,
+		                       IrpContext->IoContext,
+		                       TRUE,
+		                       TRUE,
+		                       TRUE);
+
+		//
+		//  Setup the next IRP stack location in the associated Irp for the disk
+		//  driver beneath us.
+		//
+
+		IrpSp = IoGetNextIrpStackLocation(Irp);
+
+		//
+		//  Setup the stack location to do a read of raw sectors at this location.
+		//  Note that the storage stack always reads multiples of whole XA sectors.
+		//
+
+		ThisRawRead->DiskOffset.QuadPart = ThisIoRun->DiskOffset;
+		ThisRawRead->SectorCount = ThisIoRun->DiskByteCount >> SECTOR_SHIFT;
+		ThisRawRead->TrackMode = TrackMode;
+
+		IrpSp->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+
+		IrpSp->Parameters.DeviceIoControl.OutputBufferLength = ThisRawRead->SectorCount * RAW_SECTOR_SIZE;
+		Irp->UserBuffer = ThisIoRun->TransferVirtualAddress;
+
+		IrpSp->Parameters.DeviceIoControl.InputBufferLength = sizeof( RAW_READ_INFO);
+		IrpSp->Parameters.DeviceIoControl.Type3InputBuffer = ThisRawRead;
+
+		IrpSp->Parameters.DeviceIoControl.IoControlCode = IOCTL_CDROM_RAW_READ;
+	}
+
+	//
+	//  We only need to set the associated IRP count in the master irp to
+	//  make it a master IRP.  But we set the count to one more than our
+	//  caller requested, because we do not want the I/O system to complete
+	//  the I/O.  We also set our own count.
+	//
+
+	IrpContext->IoContext->IrpCount = RunCount;
+	IrpContext->IoContext->MasterIrp = MasterIrp;
+
+	//
+	//  We set the count in the master Irp to 1 since typically we
+	//  will clean up the associated irps ourselves.  Setting this to one
+	//  means completing the last associated Irp with SUCCESS (in the async
+	//  case) will complete the master irp.
+	//
+
+	MasterIrp->AssociatedIrp.IrpCount = 1;
+
+	//
+	//  Now that all the dangerous work is done, issue the Io requests
+	//
+
+	CdBeginDeviceRead( IrpContext, TRUE, &IrpContext->IoContext->DeviceRead );
+
+	for (UnwindRunCount = 0;
+	     UnwindRunCount < RunCount;
+	     UnwindRunCount++)
 	{
-		if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT))
+		Irp = IoRuns[UnwindRunCount].SavedIrp;
+		IoRuns[UnwindRunCount].SavedIrp = NULL;
+
+		CdRecordReadTrace(IrpContext->Vcb,
+		                  0,
+		                  IoRuns[UnwindRunCount].DiskOffset,
+		                  IoRuns[UnwindRunCount].DiskByteCount,
+		                  CDFS_READ_TRACE_DEVICE_IO | CDFS_READ_TRACE_RAW_SECTORS);
+
+		//
+		//
+		//  If IoCallDriver returns an error, it has completed the Irp
+		//  and the error will be caught by our completion routines
+		//  and dealt with as a normal IO error.
+		//
+
+		(VOID) IoCallDriver( IrpContext->Vcb->TargetDeviceObject, Irp );
+	}
+
+	
+}
+
+
+//
+//  Local support routine
+//
+
+_Requires_lock_held_(_Global_critical_region_)
+VOID
+CdSingleAsync(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PIO_RUN Run,
+	     _In_ PFCB Fcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine reads one or more contiguous sectors from a device
+    asynchronously, and is used if there is only one read necessary to
+    complete the IRP.  It implements the read by simply filling
+    in the next stack frame in the Irp, and passing it on.  The transfer
+    occurs to the single buffer originally specified in the user request.
+
+Arguments:
+
+    ByteOffset - Supplies the starting Logical Byte Offset to begin reading from
+
+    ByteCount - Supplies the number of bytes to read from the device
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	PIO_COMPLETION_ROUTINE CompletionRoutine;
+	ULONG CacheClass;
+
+	PAGED_CODE();
+
+	//
+	//  For metadata, look in the sector cache,
+	//
+
+	CacheClass = CdSectorCacheClass( IrpContext, Fcb);
+
+	if (CacheClass != CD_SEC_CACHE_NO_CLASS)
+	{
+		if (CdReadDirDataThroughCache(IrpContext, Run, CacheClass))
 		{
-			IrpContext->Irp->IoStatus.Status = STATUS_SUCCESS ;
-			KeSetEvent(&IrpContext->IoContext->SyncEvent, 0, FALSE);
+			if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT))
+			{
+				IrpContext->Irp->IoStatus.Status = STATUS_SUCCESS ;
+				KeSetEvent(&IrpContext->IoContext->SyncEvent, 0, FALSE);
+			}
+
+			return;
+		}
+	}
+
+	//
+	//  Set up things according to whether this is truely async.
+	//
+
+	if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ))
+	{
+		CompletionRoutine = CdSingleSyncCompletionRoutine;
+	}
+	else
+	{
+		CompletionRoutine = CdSingleAsyncCompletionRoutine;
+
+		//
+		//  If we (FS) acquired locks, transition the lock owners to an object, since
+		//  when we return this thread could go away before request completion, and
+		//  the resource package may otherwise __try to boost priority, etc.
+		//
+
+		if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_TOP_LEVEL ))
+		{
+			NT_ASSERT( IrpContext->IoContext->ResourceThreadId == (ERESOURCE_THREAD)PsGetCurrentThread() );
+
+			IrpContext->IoContext->ResourceThreadId = ((ULONG_PTR)IrpContext->IoContext) | 3;
+
+			ExSetResourceOwnerPointer(IrpContext->IoContext->Resource,
+			                          (PVOID)IrpContext->IoContext->ResourceThreadId);
+		}
+	}
+
+	//
+	// Set up the completion routine address in our stack frame.
+	//
+
+	IoSetCompletionRoutine(IrpContext->Irp,
+	                       CompletionRoutine,
+	                       IrpContext->IoContext,
+	                       TRUE,
+	                       TRUE,
+	                       TRUE);
+
+	//
+	//  Setup the next IRP stack location in the associated Irp for the disk
+	//  driver beneath us.
+	//
+
+	IrpSp = IoGetNextIrpStackLocation(IrpContext->Irp);
+
+	//
+	//  Setup the Stack location to do a read from the disk driver.
+	//
+
+	IrpSp->MajorFunction = IrpContext->MajorFunction;
+	IrpSp->Parameters.Read.Length = Run->DiskByteCount;
+	IrpSp->Parameters.Read.ByteOffset.QuadPart = Run->DiskOffset;
+
+	//
+	//  Volume DASD writes come through here too.  Leave them out of the
+	//  read trace and the read priority accounting.
+	//
+
+	if (IrpContext->MajorFunction == IRP_MJ_READ)
+	{
+		CdRecordReadTrace(IrpContext->Vcb,
+		                  Fcb->FileId.QuadPart,
+		                  Run->DiskOffset,
+		                  Run->DiskByteCount,
+		                  CDFS_READ_TRACE_DEVICE_IO);
+
+		CdBeginDeviceRead( IrpContext, TRUE, &IrpContext->IoContext->DeviceRead );
+	}
+
+	//
+	//  Issue the Io request
+	//
+
+	//
+	//  If IoCallDriver returns an error, it has completed the Irp
+	//  and the error will be caught by our completion routines
+	//  and dealt with as a normal IO error.
+	//
+
+	(VOID)IoCallDriver( IrpContext->Vcb->TargetDeviceObject, IrpContext->Irp );
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdWaitSync(
+	_In_ PIRP_CONTEXT IrpContext
+)
+
+/*++
+
+Routine Description:
+
+    This routine waits for one or more previously started I/O requests
+    from the above routines, by simply waiting on the event.
+
+Arguments:
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	PAGED_CODE();
+
+
+	(VOID)KeWaitForSingleObject(&IrpContext->IoContext->SyncEvent,
+	                            Executive,
+	                            KernelMode,
+	                            FALSE,
+	                            NULL);
+
+	KeClearEvent(&IrpContext->IoContext->SyncEvent);
+
+	CdEndDeviceRead( &IrpContext->IoContext->DeviceRead );
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdBeginDeviceRead(
+	_In_ PIRP_CONTEXT IrpContext,
+	_In_ BOOLEAN CanDefer,
+	_Out_ PCD_DEVICE_READ DeviceRead
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called just before a batch of device reads for a
+    request is sent.  The request's I/O priority hint decides the priority
+    of the reads.  Normal priority reads are counted as outstanding until
+    CdEndDeviceRead.  A synchronous low priority request waits here until
+    no normal priority reads are outstanding, or for CD_READ_DEFER_TIME at
+    most, so speculative reads mostly use the drive while nothing
+    interactive needs it.  Asynchronous requests can't wait, and go to the
+    device straight away with their hint.
+
+    Paging reads are never held back, since the memory manager may be
+    waiting on them, and neither are batches the caller knows others are
+    waiting on.  A shared in-flight read is always a paging read.
+
+    This routine is not pageable since it takes the read priority lock.
+
+Arguments:
+
+    CanDefer - FALSE if others may be waiting on this batch, for instance
+        behind a lock the caller holds.
+
+    DeviceRead - Tracking for the batch, for the caller to pass to
+        CdEndDeviceRead once the reads are complete.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PVCB Vcb = IrpContext->Vcb;
+	BOOLEAN Defer = FALSE;
+	LARGE_INTEGER Timeout;
+	KIRQL SavedIrql;
+
+	DeviceRead->Priority = (IoGetIoPriorityHint( IrpContext->Irp ) < IoPriorityNormal) ?
+		CDFS_READ_PRIORITY_LOW : CDFS_READ_PRIORITY_NORMAL;
+
+	DeviceRead->StartTime = KeQueryInterruptTime();
+
+	KeAcquireSpinLock( &Vcb->ReadPriorityLock, &SavedIrql );
+
+	if (DeviceRead->Priority == CDFS_READ_PRIORITY_NORMAL)
+	{
+		if (Vcb->ForegroundReads++ == 0)
+		{
+			KeClearEvent( &Vcb->ForegroundIdle );
 		}
+	}
+	else if ((Vcb->ForegroundReads != 0) &&
+		CanDefer &&
+		FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ) &&
+		!FlagOn( IrpContext->Irp->Flags, IRP_PAGING_IO ))
+	{
+		Vcb->ReadPriorityStatistics[ CDFS_READ_PRIORITY_LOW ].Deferred += 1;
+		Defer = TRUE;
+	}
+
+	KeReleaseSpinLock( &Vcb->ReadPriorityLock, SavedIrql );
+
+	if (Defer)
+	{
+		Timeout.QuadPart = -10 * 1000 * CD_READ_DEFER_TIME;
+
+		(VOID)KeWaitForSingleObject( &Vcb->ForegroundIdle,
+		                             Executive,
+		                             KernelMode,
+		                             FALSE,
+		                             &Timeout );
+	}
+
+	DeviceRead->Vcb = Vcb;
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdEndDeviceRead(
+	_Inout_ PCD_DEVICE_READ DeviceRead
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called once the last read of a batch started with
+    CdBeginDeviceRead completes, possibly from a completion routine.  It
+    records the latency of the batch and, for normal priority reads, lets
+    waiting low priority reads go if this was the last one outstanding.
+    Nothing is done if no batch was started.
+
+Arguments:
+
+    DeviceRead - Tracking for the batch.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PVCB Vcb = DeviceRead->Vcb;
+	PCDFS_READ_PRIORITY_STATISTICS Statistics;
+	ULONGLONG Latency;
+	KIRQL SavedIrql;
 
+	if (Vcb == NULL)
+	{
 		return;
 	}
 
-	//
-	//  We only need to set the associated IRP count in the master irp to
-	//  make it a master IRP.  But we set the count to one more than our
-	//  caller requested, because we do not want the I/O system to complete
-	//  the I/O.  We also set our own count.
-	//
+	Latency = (KeQueryInterruptTime() - DeviceRead->StartTime) / 10;
+	Statistics = &Vcb->ReadPriorityStatistics[ DeviceRead->Priority ];
 
-	IrpContext->IoContext->IrpCount = RunCount;
-	IrpContext->IoContext->MasterIrp = MasterIrp;
+	KeAcquireSpinLock( &Vcb->ReadPriorityLock, &SavedIrql );
+
+	Statistics->Reads += 1;
+	Statistics->TotalLatency += Latency;
+
+	if (Latency > Statistics->MaxLatency)
+	{
+		Statistics->MaxLatency = Latency;
+	}
+
+	if ((DeviceRead->Priority == CDFS_READ_PRIORITY_NORMAL) &&
+		(--Vcb->ForegroundReads == 0))
+	{
+		KeSetEvent( &Vcb->ForegroundIdle, 0, FALSE );
+	}
+
+	KeReleaseSpinLock( &Vcb->ReadPriorityLock, SavedIrql );
+
+	DeviceRead->Vcb = NULL;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdMultiSyncCompletionRoutine(
+	PDEVICE_OBJECT DeviceObject,
+	PIRP Irp,
+	PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+    This is the completion routine for all synchronous reads
+    started via CdMultipleAsynch.
+
+    The completion routine has has the following responsibilities:
+
+        If the individual request was completed with an error, then
+        this completion routine must see if this is the first error
+        and remember the error status in the Context.
+
+        If the IrpCount goes to 1, then it sets the event in the Context
+        parameter to signal the caller that all of the asynch requests
+        are done.
+
+Arguments:
+
+    DeviceObject - Pointer to the file system device object.
+
+    Irp - Pointer to the associated Irp which is being completed.  (This
+        Irp will no longer be accessible after this routine returns.)
+
+    Context - The context parameter which was specified for all of
+        the multiple asynch I/O requests for this MasterIrp.
+
+Return Value:
+
+    The routine returns STATUS_MORE_PROCESSING_REQUIRED so that we can
+    immediately complete the Master Irp without being in a race condition
+    with the IoCompleteRequest thread trying to decrement the IrpCount in
+    the Master Irp.
+
+--*/
+
+{
+	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
+	_Analysis_assume_(Context != NULL);
+
+	AssertVerifyDeviceIrp( Irp );
 
 	//
-	//  We set the count in the master Irp to 1 since typically we
-	//  will clean up the associated irps ourselves.  Setting this to one
-	//  means completing the last associated Irp with SUCCESS (in the async
-	//  case) will complete the master irp.
+	//  If we got an error (or verify required), remember it in the Irp
 	//
 
-	MasterIrp->AssociatedIrp.IrpCount = 1;
+	if (!NT_SUCCESS( Irp->IoStatus.Status ))
+	{
+		InterlockedExchange(&IoContext->Status, Irp->IoStatus.Status);
+		IoContext->MasterIrp->IoStatus.Information = 0;
+	}
 
 	//
-	//  If we (FS) acquired locks, transition the lock owners to an object, since
-	//  when we return this thread could go away before request completion, and
-	//  the resource package may otherwise __try to boost priority, etc.
+	//  We must do this here since IoCompleteRequest won't get a chance
+	//  on this associated Irp.
 	//
 
-	if (!FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ) &&
-		FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_TOP_LEVEL ))
+	IoFreeMdl(Irp->MdlAddress);
+	IoFreeIrp(Irp);
+
+	if (InterlockedDecrement(&IoContext->IrpCount) == 0)
 	{
-		NT_ASSERT( IrpContext->IoContext->ResourceThreadId == (ERESOURCE_THREAD)PsGetCurrentThread() );
+		//
+		//  Update the Master Irp with any error status from the associated Irps.
+		//
 
-		IrpContext->IoContext->ResourceThreadId = ((ULONG_PTR)IrpContext->IoContext) | 3;
+		IoContext->MasterIrp->IoStatus.Status = IoContext->Status;
+		KeSetEvent(&IoContext->SyncEvent, 0, FALSE);
+	}
 
-		ExSetResourceOwnerPointer(IrpContext->IoContext->Resource,
-		                          (PVOID)IrpContext->IoContext->ResourceThreadId);
+	UNREFERENCED_PARAMETER( DeviceObject );
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdMultiAsyncCompletionRoutine(
+	PDEVICE_OBJECT DeviceObject,
+	PIRP Irp,
+	PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+    This is the completion routine for all asynchronous reads
+    started via CdMultipleAsynch.
+
+    The completion routine has has the following responsibilities:
+
+        If the individual request was completed with an error, then
+        this completion routine must see if this is the first error
+        and remember the error status in the Context.
+
+Arguments:
+
+    DeviceObject - Pointer to the file system device object.
+
+    Irp - Pointer to the associated Irp which is being completed.  (This
+        Irp will no longer be accessible after this routine returns.)
+
+    Context - The context parameter which was specified for all of
+             the multiple asynch I/O requests for this MasterIrp.
+
+Return Value:
+
+    Currently always returns STATUS_SUCCESS.
+
+--*/
+
+{
+	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
+	_Analysis_assume_(Context != NULL);
+	AssertVerifyDeviceIrp( Irp );
+
+	UNREFERENCED_PARAMETER( DeviceObject );
+
+	//
+	//  If we got an error (or verify required), remember it in the Irp
+	//
+
+	if (!NT_SUCCESS( Irp->IoStatus.Status ))
+	{
+		InterlockedExchange(&IoContext->Status, Irp->IoStatus.Status);
 	}
 
 	//
-	//  Now that all the dangerous work is done, issue the Io requests
+	//  Decrement IrpCount and see if it goes to zero.
 	//
 
-	for (UnwindRunCount = 0;
-	     UnwindRunCount < RunCount;
-	     UnwindRunCount++)
+	if (InterlockedDecrement(&IoContext->IrpCount) == 0)
 	{
-		Irp = IoRuns[UnwindRunCount].SavedIrp;
-		IoRuns[UnwindRunCount].SavedIrp = NULL;
+		//
+		//  Mark the master Irp pending
+		//
 
-		if (NULL != Irp)
+		IoMarkIrpPending(IoContext->MasterIrp);
+
+		//
+		//  Update the Master Irp with any error status from the associated Irps.
+		//
+
+		IoContext->MasterIrp->IoStatus.Status = IoContext->Status;
+
+		//
+		//  Update the information field with the correct value.
+		//
+
+		IoContext->MasterIrp->IoStatus.Information = 0;
+
+		if (NT_SUCCESS( IoContext->MasterIrp->IoStatus.Status ))
 		{
-			//
-			//  If IoCallDriver returns an error, it has completed the Irp
-			//  and the error will be caught by our completion routines
-			//  and dealt with as a normal IO error.
-			//
+			IoContext->MasterIrp->IoStatus.Information = IoContext->RequestedByteCount;
+		}
+
+		//
+		//  Now release the resource
+		//
+
+		_Analysis_assume_lock_held_(*IoContext->Resource);
+		ExReleaseResourceForThreadLite(IoContext->Resource, IoContext->ResourceThreadId);
+
+		CdEndDeviceRead( &IoContext->DeviceRead );
+
+		//
+		//  and __finally, free the context record.
+		//
+
+		CdFreeIoContext( IoContext );
+
+		//
+		//  Return success in this case.
+		//
+
+		return STATUS_SUCCESS ;
+	}
+	else
+	{
+		//
+		//  We need to cleanup the associated Irp and its Mdl.
+		//
 
-			(VOID) IoCallDriver( IrpContext->Vcb->TargetDeviceObject, Irp );
-		}
+		IoFreeMdl(Irp->MdlAddress);
+		IoFreeIrp(Irp);
+
+		return STATUS_MORE_PROCESSING_REQUIRED;
 	}
 }
 
@@ -3033,225 +5107,139 @@ Return Value:
 //  Local support routine
 //
 
-VOID
-CdMultipleXAAsync(
-	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ ULONG RunCount,
-	     _Inout_ PIO_RUN IoRuns,
-	     _In_ PRAW_READ_INFO RawReads,
-	     _In_ TRACK_MODE_TYPE TrackMode
+NTSTATUS
+CdSingleSyncCompletionRoutine(
+	PDEVICE_OBJECT DeviceObject,
+	PIRP Irp,
+	PVOID Context
 )
 
 /*++
 
 Routine Description:
 
-    This routine first does the initial setup required of a Master IRP that is
-    going to be completed using associated IRPs.  This routine is used to generate
-    the associated Irps used to read raw sectors from the disk.
-
-    A context parameter is initialized, to serve as a communications area
-    between here and the common completion routine.
+    This is the completion routine for all reads started via CdSingleAsynch.
 
-    Next this routine reads or writes one or more contiguous sectors from
-    a device asynchronously, and is used if there are multiple reads for a
-    master IRP.  A completion routine is used to synchronize with the
-    completion of all of the I/O requests started by calls to this routine.
+    The completion routine has has the following responsibilities:
 
-    Also, prior to calling this routine the caller must initialize the
-    IoStatus field in the Context, with the correct success status and byte
-    count which are expected if all of the parallel transfers complete
-    successfully.  After return this status will be unchanged if all requests
-    were, in fact, successful.  However, if one or more errors occur, the
-    IoStatus will be modified to reflect the error status and byte count
-    from the first run (by Vbo) which encountered an error.  I/O status
-    from all subsequent runs will not be indicated.
+        It sets the event in the Context parameter to signal the caller
+        that all of the asynch requests are done.
 
 Arguments:
 
-    RunCount - Supplies the number of multiple async requests
-        that will be issued against the master irp.
-
-    IoRuns - Supplies an array containing the Offset and ByteCount for the
-        separate requests.
+    DeviceObject - Pointer to the file system device object.
 
-    RawReads - Supplies an array of structures to store in the Irps passed to the
-        device driver to perform the low-level Io.
+    Irp - Pointer to the Irp for this request.  (This Irp will no longer
+        be accessible after this routine returns.)
 
-    TrackMode - Supplies the recording mode of sectors in these IoRuns
+    Context - The context parameter which was specified in the call to
+        CdSingleAsynch.
 
 Return Value:
 
-    None.
+    The routine returns STATUS_MORE_PROCESSING_REQUIRED so that we can
+    immediately complete the Master Irp without being in a race condition
+    with the IoCompleteRequest thread trying to decrement the IrpCount in
+    the Master Irp.
 
 --*/
 
 {
-	PIO_STACK_LOCATION IrpSp;
-	PMDL Mdl;
-	PIRP Irp;
-	PIRP MasterIrp;
-	ULONG UnwindRunCount;
-	ULONG RawByteCount;
-
-	PIO_RUN ThisIoRun = IoRuns;
-	PRAW_READ_INFO ThisRawRead = RawReads;
-
-	PAGED_CODE();
+	_Analysis_assume_(Context != NULL);
 
-	//
-	//  Initialize some local variables.
-	//
+	UNREFERENCED_PARAMETER( DeviceObject );
 
-	MasterIrp = IrpContext->Irp;
+	AssertVerifyDeviceIrp( Irp );
 
 	//
-	//  Itterate through the runs, doing everything that can fail.
-	//  We let the cleanup in CdFinishBuffers clean up on error.
+	//  Store the correct information field into the Irp.
 	//
 
-	for (UnwindRunCount = 0;
-	     UnwindRunCount < RunCount;
-	     UnwindRunCount += 1 , ThisIoRun += 1 , ThisRawRead += 1)
+	if (!NT_SUCCESS( Irp->IoStatus.Status ))
 	{
-		//
-		//  Create an associated IRP, making sure there is one stack entry for
-		//  us, as well.
-		//
-
-		ThisIoRun->SavedIrp =
-			Irp = IoMakeAssociatedIrp(MasterIrp, (CCHAR)(IrpContext->Vcb->TargetDeviceObject->StackSize + 1));
+		Irp->IoStatus.Information = 0;
+	}
 
-		if (Irp == NULL)
-		{
-			IrpContext->Irp->IoStatus.Information = 0;
-			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-		}
+	KeSetEvent(&((PCD_IO_CONTEXT)Context)->SyncEvent, 0, FALSE);
 
-		//
-		//  Should have been passed a byte count of at least one sector, and 
-		//  must be a multiple of sector size
-		//
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
 
-		NT_ASSERT( ThisIoRun->DiskByteCount && !SectorOffset(ThisIoRun->DiskByteCount));
 
-		RawByteCount = SectorsFromBytes( ThisIoRun->DiskByteCount) * RAW_SECTOR_SIZE;
+//
+//  Local support routine
+//
 
-		//
-		// Allocate and build a partial Mdl for the request.
-		//
+NTSTATUS
+CdSingleAsyncCompletionRoutine(
+	PDEVICE_OBJECT DeviceObject,
+	PIRP Irp,
+	PVOID Context
+)
 
-		Mdl = IoAllocateMdl(ThisIoRun->TransferVirtualAddress,
-		                    RawByteCount,
-		                    FALSE,
-		                    FALSE,
-		                    Irp);
+/*++
 
-		if (Mdl == NULL)
-		{
-			IrpContext->Irp->IoStatus.Information = 0;
-			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-		}
+Routine Description:
 
-		IoBuildPartialMdl(ThisIoRun->TransferMdl,
-		                  Mdl,
-		                  ThisIoRun->TransferVirtualAddress,
-		                  RawByteCount);
-		//
-		//  Get the first IRP stack location in the associated Irp
-		//
+    This is the completion routine for all asynchronous reads
+    started via CdSingleAsynch.
 
-		IoSetNextIrpStackLocation(Irp);
-		IrpSp = IoGetCurrentIrpStackLocation(Irp);
+Arguments:
 
-		//
-		//  Setup the Stack location to describe our read (using cooked values)
-		//  These values won't be used for the raw read in any case.
-		//
+    DeviceObject - Pointer to the file system device object.
 
-		IrpSp->MajorFunction = IRP_MJ_READ;
-		IrpSp->Parameters.Read.Length = ThisIoRun->DiskByteCount;
-		IrpSp->Parameters.Read.ByteOffset.QuadPart = ThisIoRun->DiskOffset;
+    Irp - Pointer to the Irp for this request.  (This Irp will no longer
+        be accessible after this routine returns.)
 
-		//
-		// Set up the completion routine address in our stack frame.
-		//
+    Context - The context parameter which was specified in the call to
+        CdSingleAsynch.
 
-		IoSetCompletionRoutine(Irp,
-		                       CdMultiSyncCompletionRoutine,
-		                       IrpContext->IoContext,
-		                       TRUE,
-		                       TRUE,
-		                       TRUE);
+Return Value:
 
-		//
-		//  Setup the next IRP stack location in the associated Irp for the disk
-		//  driver beneath us.
-		//
+    Currently always returns STATUS_SUCCESS.
 
-		IrpSp = IoGetNextIrpStackLocation(Irp);
+--*/
 
-		//
-		//  Setup the stack location to do a read of raw sectors at this location.
-		//  Note that the storage stack always reads multiples of whole XA sectors.
-		//
+{
+	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
 
-		ThisRawRead->DiskOffset.QuadPart = ThisIoRun->DiskOffset;
-		ThisRawRead->SectorCount = ThisIoRun->DiskByteCount >> SECTOR_SHIFT;
-		ThisRawRead->TrackMode = TrackMode;
+	UNREFERENCED_PARAMETER( DeviceObject );
 
-		IrpSp->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+	_Analysis_assume_(IoContext != NULL);
+	AssertVerifyDeviceIrp( Irp );
 
-		IrpSp->Parameters.DeviceIoControl.OutputBufferLength = ThisRawRead->SectorCount * RAW_SECTOR_SIZE;
-		Irp->UserBuffer = ThisIoRun->TransferVirtualAddress;
+	//
+	//  Update the information field with the correct value for bytes read.
+	//
 
-		IrpSp->Parameters.DeviceIoControl.InputBufferLength = sizeof( RAW_READ_INFO);
-		IrpSp->Parameters.DeviceIoControl.Type3InputBuffer = ThisRawRead;
+	Irp->IoStatus.Information = 0;
 
-		IrpSp->Parameters.DeviceIoControl.IoControlCode = IOCTL_CDROM_RAW_READ;
+	if (NT_SUCCESS( Irp->IoStatus.Status ))
+	{
+		Irp->IoStatus.Information = IoContext->RequestedByteCount;
 	}
 
 	//
-	//  We only need to set the associated IRP count in the master irp to
-	//  make it a master IRP.  But we set the count to one more than our
-	//  caller requested, because we do not want the I/O system to complete
-	//  the I/O.  We also set our own count.
+	//  Mark the Irp pending
 	//
 
-	IrpContext->IoContext->IrpCount = RunCount;
-	IrpContext->IoContext->MasterIrp = MasterIrp;
+	IoMarkIrpPending(Irp);
 
 	//
-	//  We set the count in the master Irp to 1 since typically we
-	//  will clean up the associated irps ourselves.  Setting this to one
-	//  means completing the last associated Irp with SUCCESS (in the async
-	//  case) will complete the master irp.
+	//  Now release the resource
 	//
 
-	MasterIrp->AssociatedIrp.IrpCount = 1;
+	_Analysis_assume_lock_held_(*IoContext->Resource);
+	ExReleaseResourceForThreadLite(IoContext->Resource, IoContext->ResourceThreadId);
+
+	CdEndDeviceRead( &IoContext->DeviceRead );
 
 	//
-	//  Now that all the dangerous work is done, issue the Io requests
+	//  and __finally, free the context record.
 	//
 
-	for (UnwindRunCount = 0;
-	     UnwindRunCount < RunCount;
-	     UnwindRunCount++)
-	{
-		Irp = IoRuns[UnwindRunCount].SavedIrp;
-		IoRuns[UnwindRunCount].SavedIrp = NULL;
-
-		//
-		//
-		//  If IoCallDriver returns an error, it has completed the Irp
-		//  and the error will be caught by our completion routines
-		//  and dealt with as a normal IO error.
-		//
-
-		(VOID) IoCallDriver( IrpContext->Vcb->TargetDeviceObject, Irp );
-	}
-
-	
+	CdFreeIoContext( IoContext );
+	return STATUS_SUCCESS ;
 }
 
 
@@ -3259,29 +5247,35 @@ Return Value:
 //  Local support routine
 //
 
-_Requires_lock_held_(_Global_critical_region_)
+_When_(SafeNodeType(Fcb) != CDFS_NTC_FCB_PATH_TABLE && StartingOffset == 0, _At_(ByteCount, _In_range_(>=, CdAudioDirentSize + sizeof(RAW_DIRENT))))
+_When_(SafeNodeType(Fcb) != CDFS_NTC_FCB_PATH_TABLE && StartingOffset != 0, _At_(ByteCount, _In_range_(>=, CdAudioDirentSize + SECTOR_SIZE)))
 VOID
-CdSingleAsync(
+CdReadAudioSystemFile(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ PIO_RUN Run,
-	     _In_ PFCB Fcb
+	     _In_ PFCB Fcb,
+	     _In_ LONGLONG StartingOffset,
+	     _In_ _In_range_(>=, CdAudioDirentSize) ULONG ByteCount,
+	     _Out_writes_bytes_(ByteCount) PVOID SystemBuffer
 )
 
 /*++
 
 Routine Description:
 
-    This routine reads one or more contiguous sectors from a device
-    asynchronously, and is used if there is only one read necessary to
-    complete the IRP.  It implements the read by simply filling
-    in the next stack frame in the Irp, and passing it on.  The transfer
-    occurs to the single buffer originally specified in the user request.
+    This routine is called to read the pseudo root directory and path
+    table for a music disk.  We build the individual elements on the
+    stack and copy into the cache buffer.
 
 Arguments:
 
-    ByteOffset - Supplies the starting Logical Byte Offset to begin reading from
+    Fcb - Fcb representing the file to read.
 
-    ByteCount - Supplies the number of bytes to read from the device
+    StartingOffset - Logical offset in the file to read from.
+
+    ByteCount - Number of bytes to read.
+
+    SystemBuffer - Pointer to buffer to fill in.  This will always be page
+        aligned.
 
 Return Value:
 
@@ -3290,478 +5284,503 @@ Return Value:
 --*/
 
 {
-	PIO_STACK_LOCATION IrpSp;
-	PIO_COMPLETION_ROUTINE CompletionRoutine;
+	PRAW_PATH_ISO RawPath;
+	PRAW_DIRENT RawDirent;
+
+	ULONG CurrentTrack;
+	ULONG SectorOffset;
+	ULONG EntryCount;
+	UCHAR TrackOnes;
+	UCHAR TrackTens;
+	PTRACK_DATA ThisTrack;
+
+	LONGLONG CurrentOffset;
+
+	PVOID CurrentSector;
+
+	PSYSTEM_USE_XA SystemUse;
+
+	ULONG BytesToCopy;
+
+	UCHAR LocalBuffer[FIELD_OFFSET( RAW_DIRENT, FileId ) + 12];
 
 	PAGED_CODE();
 
 	//
-	//  For directories, look in the sector cache,
+	//  If this is the path table then we just need a single entry.
 	//
 
-	if ((SafeNodeType( Fcb) == CDFS_NTC_FCB_INDEX) &&
-		(NULL != Fcb->Vcb->SectorCacheBuffer) &&
-		(VcbMounted == IrpContext->Vcb->VcbCondition))
+	if (SafeNodeType( Fcb ) == CDFS_NTC_FCB_PATH_TABLE)
 	{
-		if (CdReadDirDataThroughCache(IrpContext, Run))
-		{
-			if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT))
-			{
-				IrpContext->Irp->IoStatus.Status = STATUS_SUCCESS ;
-				KeSetEvent(&IrpContext->IoContext->SyncEvent, 0, FALSE);
-			}
+		//
+		//  Sanity check that the offset is zero.
+		//
 
-			return;
+		NT_ASSERT( StartingOffset == 0 );
+
+		//
+		//  Store a pseudo path entry in our local buffer.
+		//
+
+		RawPath = (PRAW_PATH_ISO) LocalBuffer;
+
+		RtlZeroMemory( RawPath, sizeof( LocalBuffer ));
+
+		RawPath->DirIdLen = 1;
+		RawPath->ParentNum = 1;
+		RawPath->DirId[0] = '\0';
+
+		//
+		//  Now copy to the user's buffer.
+		//
+
+		BytesToCopy = FIELD_OFFSET( RAW_PATH_ISO, DirId ) + 2;
+
+		if (BytesToCopy > ByteCount)
+		{
+			BytesToCopy = ByteCount;
 		}
-	}
 
-	//
-	//  Set up things according to whether this is truely async.
-	//
+		RtlCopyMemory( SystemBuffer,
+			RawPath,
+			BytesToCopy );
 
-	if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_WAIT ))
-	{
-		CompletionRoutine = CdSingleSyncCompletionRoutine;
+		//
+		//  We need to deal with the multiple sector case for the root directory.
+		//
 	}
 	else
 	{
-		CompletionRoutine = CdSingleAsyncCompletionRoutine;
+		//
+		//  Initialize the first track to return to our caller.
+		//
+
+		CurrentTrack = 0;
 
 		//
-		//  If we (FS) acquired locks, transition the lock owners to an object, since
-		//  when we return this thread could go away before request completion, and
-		//  the resource package may otherwise __try to boost priority, etc.
+		//  If the offset is zero then store the entries for the self and parent
+		//  entries.
 		//
 
-		if (FlagOn( IrpContext->Flags, IRP_CONTEXT_FLAG_TOP_LEVEL ))
+		if (StartingOffset == 0)
 		{
-			NT_ASSERT( IrpContext->IoContext->ResourceThreadId == (ERESOURCE_THREAD)PsGetCurrentThread() );
+			RawDirent = reinterpret_cast<PRAW_DIRENT>(SystemBuffer);
 
-			IrpContext->IoContext->ResourceThreadId = ((ULONG_PTR)IrpContext->IoContext) | 3;
+			//
+			//  Clear all of the fields initially.
+			//
 
-			ExSetResourceOwnerPointer(IrpContext->IoContext->Resource,
-			                          (PVOID)IrpContext->IoContext->ResourceThreadId);
-		}
-	}
+			RtlZeroMemory( RawDirent, FIELD_OFFSET( RAW_DIRENT, FileId ));
 
-	//
-	// Set up the completion routine address in our stack frame.
-	//
+			//
+			//  Now fill in the interesting fields.
+			//
 
-	IoSetCompletionRoutine(IrpContext->Irp,
-	                       CompletionRoutine,
-	                       IrpContext->IoContext,
-	                       TRUE,
-	                       TRUE,
-	                       TRUE);
+			RawDirent->DirLen = FIELD_OFFSET( RAW_DIRENT, FileId ) + 1;
+			RawDirent->FileIdLen = 1;
+			RawDirent->FileId[0] = '\0';
+			SetFlag( RawDirent->FlagsISO, CD_ATTRIBUTE_DIRECTORY );
 
-	//
-	//  Setup the next IRP stack location in the associated Irp for the disk
-	//  driver beneath us.
-	//
+			//
+			//  Set the time stamp to be Jan 1, 1995
+			//
 
-	IrpSp = IoGetNextIrpStackLocation(IrpContext->Irp);
+			RawDirent->RecordTime[0] = 95;
+			RawDirent->RecordTime[1] = 1;
+			RawDirent->RecordTime[2] = 1;
 
-	//
-	//  Setup the Stack location to do a read from the disk driver.
-	//
+			SectorOffset = RawDirent->DirLen;
 
-	IrpSp->MajorFunction = IrpContext->MajorFunction;
-	IrpSp->Parameters.Read.Length = Run->DiskByteCount;
-	IrpSp->Parameters.Read.ByteOffset.QuadPart = Run->DiskOffset;
+			RawDirent = Add2Ptr( RawDirent, SectorOffset, PRAW_DIRENT );
 
-	//
-	//  Issue the Io request
-	//
+			//
+			//  Clear all of the fields initially.
+			//
 
-	//
-	//  If IoCallDriver returns an error, it has completed the Irp
-	//  and the error will be caught by our completion routines
-	//  and dealt with as a normal IO error.
-	//
+			RtlZeroMemory( RawDirent, FIELD_OFFSET( RAW_DIRENT, FileId ));
 
-	(VOID)IoCallDriver( IrpContext->Vcb->TargetDeviceObject, IrpContext->Irp );
-}
+			//
+			//  Now fill in the interesting fields.
+			//
 
+			RawDirent->DirLen = FIELD_OFFSET( RAW_DIRENT, FileId ) + 1;
+			RawDirent->FileIdLen = 1;
+			RawDirent->FileId[0] = '\1';
+			SetFlag( RawDirent->FlagsISO, CD_ATTRIBUTE_DIRECTORY );
 
-//
-//  Local support routine
-//
+			//
+			//  Set the time stamp to be Jan 1, 1995
+			//
 
-VOID
-CdWaitSync(
-	_In_ PIRP_CONTEXT IrpContext
-)
+			RawDirent->RecordTime[0] = 95;
+			RawDirent->RecordTime[1] = 1;
+			RawDirent->RecordTime[2] = 1;
 
-/*++
+			SectorOffset += RawDirent->DirLen;
+			EntryCount = 2;
 
-Routine Description:
+			//
+			//  Otherwise compute the starting track to write to the buffer.
+			//
+		}
+		else
+		{
+			//
+			//  Count the tracks in each preceding sector.
+			//
 
-    This routine waits for one or more previously started I/O requests
-    from the above routines, by simply waiting on the event.
+			CurrentOffset = 0;
 
-Arguments:
+			do
+			{
+				CurrentTrack += CdAudioDirentsPerSector;
+				CurrentOffset += SECTOR_SIZE;
+			}
+			while (CurrentOffset < StartingOffset);
 
-Return Value:
+			//
+			//  Bias the track count to reflect the two default entries.
+			//
 
-    None
+			CurrentTrack -= 2;
 
---*/
+			SectorOffset = 0;
+			EntryCount = 0;
+		}
 
-{
-	PAGED_CODE();
+		//
+		//  We now know the first track to return as well as where we are in
+		//  the current sector.  We will walk through sector by sector adding
+		//  the entries for the separate tracks in the TOC.  We will zero
+		//  any sectors or partial sectors without data.
+		//
 
+		CurrentSector = SystemBuffer;
+		BytesToCopy = SECTOR_SIZE;
 
-	(VOID)KeWaitForSingleObject(&IrpContext->IoContext->SyncEvent,
-	                            Executive,
-	                            KernelMode,
-	                            FALSE,
-	                            NULL);
+		//
+		//  Loop for each sector.
+		//
 
-	KeClearEvent(&IrpContext->IoContext->SyncEvent);
-}
+		do
+		{
+			//
+			//  Add entries until we reach our threshold for each sector.
+			//
 
+			do
+			{
+				//
+				//  If we are beyond the entries in the TOC then exit.
+				//
 
-//
-//  Local support routine
-//
+				if (CurrentTrack >= IrpContext->Vcb->TrackCount)
+				{
+					break;
+				}
 
-NTSTATUS
-CdMultiSyncCompletionRoutine(
-	PDEVICE_OBJECT DeviceObject,
-	PIRP Irp,
-	PVOID Context
-)
+				ThisTrack = &IrpContext->Vcb->CdromToc->TrackData[CurrentTrack];
+
+				//
+				//  Point to the current position in the buffer.
+				//
+
+				RawDirent = Add2Ptr( CurrentSector, SectorOffset, PRAW_DIRENT );
 
-/*++
+				//
+				//  Clear all of the fields initially.
+				//
 
-Routine Description:
+				RtlZeroMemory( RawDirent, CdAudioDirentSize );
 
-    This is the completion routine for all synchronous reads
-    started via CdMultipleAsynch.
+				//
+				//  Now fill in the interesting fields.
+				//
 
-    The completion routine has has the following responsibilities:
+				RawDirent->DirLen = (UCHAR) CdAudioDirentSize;
+				RawDirent->FileIdLen = CdAudioFileNameLength;
 
-        If the individual request was completed with an error, then
-        this completion routine must see if this is the first error
-        and remember the error status in the Context.
+				RtlCopyMemory( RawDirent->FileId,
+					CdAudioFileName,
+					CdAudioFileNameLength );
 
-        If the IrpCount goes to 1, then it sets the event in the Context
-        parameter to signal the caller that all of the asynch requests
-        are done.
+				//
+				//  Set the time stamp to be Jan 1, 1995 00:00
+				//
 
-Arguments:
+				RawDirent->RecordTime[0] = 95;
+				RawDirent->RecordTime[1] = 1;
+				RawDirent->RecordTime[2] = 1;
 
-    DeviceObject - Pointer to the file system device object.
+				//
+				//  Put the track number into the file name.
+				//
 
-    Irp - Pointer to the associated Irp which is being completed.  (This
-        Irp will no longer be accessible after this routine returns.)
+				TrackTens = TrackOnes = ThisTrack->TrackNumber;
 
-    Context - The context parameter which was specified for all of
-        the multiple asynch I/O requests for this MasterIrp.
+				TrackOnes = (TrackOnes % 10) + '0';
 
-Return Value:
+				TrackTens /= 10;
+				TrackTens = (TrackTens % 10) + '0';
 
-    The routine returns STATUS_MORE_PROCESSING_REQUIRED so that we can
-    immediately complete the Master Irp without being in a race condition
-    with the IoCompleteRequest thread trying to decrement the IrpCount in
-    the Master Irp.
+				RawDirent->FileId[AUDIO_NAME_TENS_OFFSET] = TrackTens;
+				RawDirent->FileId[AUDIO_NAME_ONES_OFFSET] = TrackOnes;
 
---*/
+				SystemUse = Add2Ptr( RawDirent, CdAudioSystemUseOffset, PSYSTEM_USE_XA );
 
-{
-	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
-	_Analysis_assume_(Context != NULL);
+				SystemUse->Attributes = SYSTEM_USE_XA_DA;
+				SystemUse->Signature = SYSTEM_XA_SIGNATURE;
 
-	AssertVerifyDeviceIrp( Irp );
+				//
+				//  Store the track number as the file number.
+				//
 
-	//
-	//  If we got an error (or verify required), remember it in the Irp
-	//
+				SystemUse->FileNumber = (UCHAR) CurrentTrack;
 
-	if (!NT_SUCCESS( Irp->IoStatus.Status ))
-	{
-		InterlockedExchange(&IoContext->Status, Irp->IoStatus.Status);
-		IoContext->MasterIrp->IoStatus.Information = 0;
-	}
+				EntryCount += 1;
+				SectorOffset += CdAudioDirentSize;
+				CurrentTrack += 1;
+			}
+			while (EntryCount < CdAudioDirentsPerSector);
 
-	//
-	//  We must do this here since IoCompleteRequest won't get a chance
-	//  on this associated Irp.
-	//
+			//
+			//  Zero the remaining portion of this buffer.
+			//
 
-	IoFreeMdl(Irp->MdlAddress);
-	IoFreeIrp(Irp);
+			RtlZeroMemory( Add2Ptr( CurrentSector, SectorOffset, PVOID ),
+				SECTOR_SIZE - SectorOffset );
 
-	if (InterlockedDecrement(&IoContext->IrpCount) == 0)
-	{
-		//
-		//  Update the Master Irp with any error status from the associated Irps.
-		//
+			//
+			//  Prepare for the next sector.
+			//
 
-		IoContext->MasterIrp->IoStatus.Status = IoContext->Status;
-		KeSetEvent(&IoContext->SyncEvent, 0, FALSE);
+			EntryCount = 0;
+			BytesToCopy += SECTOR_SIZE;
+			SectorOffset = 0;
+			CurrentSector = Add2Ptr( CurrentSector, SECTOR_SIZE, PVOID );
+		}
+		while (BytesToCopy <= ByteCount);
 	}
 
-	UNREFERENCED_PARAMETER( DeviceObject );
-
-	return STATUS_MORE_PROCESSING_REQUIRED;
+	
 }
 
 
-//
-//  Local support routine
-//
-
 NTSTATUS
-CdMultiAsyncCompletionRoutine(
-	PDEVICE_OBJECT DeviceObject,
-	PIRP Irp,
-	PVOID Context
+CdHijackIrpAndFlushDevice(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PIRP Irp,
+	     _In_ PDEVICE_OBJECT TargetDeviceObject
 )
 
 /*++
 
 Routine Description:
 
-    This is the completion routine for all asynchronous reads
-    started via CdMultipleAsynch.
-
-    The completion routine has has the following responsibilities:
-
-        If the individual request was completed with an error, then
-        this completion routine must see if this is the first error
-        and remember the error status in the Context.
+    This routine is called when we need to send a flush to a device but
+    we don't have a flush Irp.  What this routine does is make a copy
+    of its current Irp stack location, but changes the Irp Major code
+    to a IRP_MJ_FLUSH_BUFFERS amd then send it down, but cut it off at
+    the knees in the completion routine, fix it up and return to the
+    user as if nothing had happened.
 
 Arguments:
 
-    DeviceObject - Pointer to the file system device object.
-
-    Irp - Pointer to the associated Irp which is being completed.  (This
-        Irp will no longer be accessible after this routine returns.)
+    Irp - The Irp to hijack
 
-    Context - The context parameter which was specified for all of
-             the multiple asynch I/O requests for this MasterIrp.
+    TargetDeviceObject - The device to send the request to.
 
 Return Value:
 
-    Currently always returns STATUS_SUCCESS.
+    NTSTATUS - The Status from the flush in case anybody cares.
 
 --*/
 
 {
-	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
-	_Analysis_assume_(Context != NULL);
-	AssertVerifyDeviceIrp( Irp );
-
-	UNREFERENCED_PARAMETER( DeviceObject );
+	KEVENT Event;
+	NTSTATUS Status;
+	PIO_STACK_LOCATION NextIrpSp;
 
-	//
-	//  If we got an error (or verify required), remember it in the Irp
-	//
+	PAGED_CODE();
 
-	if (!NT_SUCCESS( Irp->IoStatus.Status ))
-	{
-		InterlockedExchange(&IoContext->Status, Irp->IoStatus.Status);
-	}
+	UNREFERENCED_PARAMETER( IrpContext );
 
 	//
-	//  Decrement IrpCount and see if it goes to zero.
+	//  Get the next stack location, and copy over the stack location
 	//
 
-	if (InterlockedDecrement(&IoContext->IrpCount) == 0)
-	{
-		//
-		//  Mark the master Irp pending
-		//
-
-		IoMarkIrpPending(IoContext->MasterIrp);
+	NextIrpSp = IoGetNextIrpStackLocation(Irp);
 
-		//
-		//  Update the Master Irp with any error status from the associated Irps.
-		//
+	*NextIrpSp = *IoGetCurrentIrpStackLocation(Irp);
 
-		IoContext->MasterIrp->IoStatus.Status = IoContext->Status;
+	NextIrpSp->MajorFunction = IRP_MJ_FLUSH_BUFFERS;
+	NextIrpSp->MinorFunction = 0;
 
-		//
-		//  Update the information field with the correct value.
-		//
+	//
+	//  Set up the completion routine
+	//
 
-		IoContext->MasterIrp->IoStatus.Information = 0;
+	KeInitializeEvent(&Event, NotificationEvent, FALSE);
 
-		if (NT_SUCCESS( IoContext->MasterIrp->IoStatus.Status ))
-		{
-			IoContext->MasterIrp->IoStatus.Information = IoContext->RequestedByteCount;
-		}
+	IoSetCompletionRoutine(Irp,
+	                       CdSyncCompletionRoutine,
+	                       &Event,
+	                       TRUE,
+	                       TRUE,
+	                       TRUE);
 
-		//
-		//  Now release the resource
-		//
+	//
+	//  Send the request.
+	//
 
-		_Analysis_assume_lock_held_(*IoContext->Resource);
-		ExReleaseResourceForThreadLite(IoContext->Resource, IoContext->ResourceThreadId);
+	Status = IoCallDriver( TargetDeviceObject, Irp );
 
-		//
-		//  and __finally, free the context record.
-		//
+	if (Status == STATUS_PENDING)
+	{
+		(VOID)KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
 
-		CdFreeIoContext( IoContext );
+		Status = Irp->IoStatus.Status;
+	}
 
-		//
-		//  Return success in this case.
-		//
+	//
+	//  If the driver doesn't support flushes, return SUCCESS.
+	//
 
-		return STATUS_SUCCESS ;
-	}
-	else
+	if (Status == STATUS_INVALID_DEVICE_REQUEST)
 	{
-		//
-		//  We need to cleanup the associated Irp and its Mdl.
-		//
+		Status = STATUS_SUCCESS ;
+	}
 
-		IoFreeMdl(Irp->MdlAddress);
-		IoFreeIrp(Irp);
+	Irp->IoStatus.Status = 0;
+	Irp->IoStatus.Information = 0;
 
-		return STATUS_MORE_PROCESSING_REQUIRED;
-	}
+	return Status;
 }
 
 
-//
-//  Local support routine
-//
-
-NTSTATUS
-CdSingleSyncCompletionRoutine(
-	PDEVICE_OBJECT DeviceObject,
-	PIRP Irp,
-	PVOID Context
+VOID
+CdRecordReadTrace(
+	_In_ PVCB Vcb,
+	     _In_ LONGLONG FileId,
+	     _In_ LONGLONG ByteOffset,
+	     _In_ ULONG ByteCount,
+	     _In_ ULONG Flags
 )
 
 /*++
 
 Routine Description:
 
-    This is the completion routine for all reads started via CdSingleAsynch.
-
-    The completion routine has has the following responsibilities:
-
-        It sets the event in the Context parameter to signal the caller
-        that all of the asynch requests are done.
+    This routine appends a read to the volume's read trace, overwriting the
+    oldest record once the ring is full.  It is used both for the reads we
+    receive in CdCommonRead and for the reads we send to the device, so the
+    trace shows how one turned into the other.  Nothing is recorded if the
+    volume has no trace.
 
 Arguments:
 
-    DeviceObject - Pointer to the file system device object.
+    Vcb - Volume the read is on.
 
-    Irp - Pointer to the Irp for this request.  (This Irp will no longer
-        be accessible after this routine returns.)
+    FileId - File id of the stream being read, zero if none.
 
-    Context - The context parameter which was specified in the call to
-        CdSingleAsynch.
+    ByteOffset - Byte offset of the read in the stream, or on the disk for
+        device reads.
+
+    ByteCount - Length of the read.
+
+    Flags - CDFS_READ_TRACE_* flags describing the read.
 
 Return Value:
 
-    The routine returns STATUS_MORE_PROCESSING_REQUIRED so that we can
-    immediately complete the Master Irp without being in a race condition
-    with the IoCompleteRequest thread trying to decrement the IrpCount in
-    the Master Irp.
+    None.
 
 --*/
 
 {
-	_Analysis_assume_(Context != NULL);
-
-	UNREFERENCED_PARAMETER( DeviceObject );
-
-	AssertVerifyDeviceIrp( Irp );
+	PCD_READ_TRACE ReadTrace = Vcb->ReadTrace;
+	PCDFS_READ_TRACE_RECORD Record;
 
-	//
-	//  Store the correct information field into the Irp.
-	//
+	PAGED_CODE();
 
-	if (!NT_SUCCESS( Irp->IoStatus.Status ))
+	if (ReadTrace == NULL)
 	{
-		Irp->IoStatus.Information = 0;
+		return;
 	}
 
-	KeSetEvent(&((PCD_IO_CONTEXT)Context)->SyncEvent, 0, FALSE);
+	Record = &ReadTrace->Records[ (InterlockedIncrement(&ReadTrace->NextRecord) - 1) & (CD_READ_TRACE_RECORDS - 1) ];
 
-	return STATUS_MORE_PROCESSING_REQUIRED;
+	Record->FileId = FileId;
+	Record->ByteOffset = ByteOffset;
+	Record->Length = ByteCount;
+	Record->Flags = Flags;
+	Record->Timestamp = KeQueryInterruptTime();
 }
 
 
-//
-//  Local support routine
-//
-
-NTSTATUS
-CdSingleAsyncCompletionRoutine(
-	PDEVICE_OBJECT DeviceObject,
-	PIRP Irp,
-	PVOID Context
+VOID
+CdStartWarmUp(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PVCB Vcb
 )
 
 /*++
 
 Routine Description:
 
-    This is the completion routine for all asynchronous reads
-    started via CdSingleAsynch.
-
-Arguments:
+    This routine queues the background warm-up of a newly mounted volume's
+    sector cache.  The warm-up reads the path table, each directory within
+    Vcb->WarmUpLevels of the root and the zisofs block pointer tables those
+    directories point to, all in disk order and within a budget, so the
+    first opens and directory listings on the volume find them in memory.
 
-    DeviceObject - Pointer to the file system device object.
+    Nothing is queued if the volume has no sector cache, warm-up is turned
+    off or we can't allocate the work item.
 
-    Irp - Pointer to the Irp for this request.  (This Irp will no longer
-        be accessible after this routine returns.)
+Arguments:
 
-    Context - The context parameter which was specified in the call to
-        CdSingleAsynch.
+    Vcb - Vcb of the volume just mounted.  It is held exclusive and has
+        just been marked mounted.
 
 Return Value:
 
-    Currently always returns STATUS_SUCCESS.
+    None.
 
 --*/
 
 {
-	PCD_IO_CONTEXT IoContext = reinterpret_cast<PCD_IO_CONTEXT>(Context);
-
-	UNREFERENCED_PARAMETER( DeviceObject );
-
-	_Analysis_assume_(IoContext != NULL);
-	AssertVerifyDeviceIrp( Irp );
+	PAGED_CODE();
 
-	//
-	//  Update the information field with the correct value for bytes read.
-	//
+	UNREFERENCED_PARAMETER( IrpContext );
 
-	Irp->IoStatus.Information = 0;
+	ASSERT_EXCLUSIVE_VCB( Vcb );
 
-	if (NT_SUCCESS( Irp->IoStatus.Status ))
+	if ((Vcb->SectorCache == NULL) ||
+		(Vcb->PathTableFcb == NULL) ||
+		(Vcb->WarmUpLevels == 0))
 	{
-		Irp->IoStatus.Information = IoContext->RequestedByteCount;
+		return;
 	}
 
-	//
-	//  Mark the Irp pending
-	//
+	Vcb->WarmUpItem = IoAllocateWorkItem( (PDEVICE_OBJECT) CONTAINING_RECORD( Vcb, VOLUME_DEVICE_OBJECT, Vcb ));
 
-	IoMarkIrpPending(Irp);
+	if (Vcb->WarmUpItem == NULL)
+	{
+		return;
+	}
 
 	//
-	//  Now release the resource
+	//  The worker can't look at the path table Fcb, which dismount may
+	//  delete before it stops the warm-up, so take what it needs now.
 	//
 
-	_Analysis_assume_lock_held_(*IoContext->Resource);
-	ExReleaseResourceForThreadLite(IoContext->Resource, IoContext->ResourceThreadId);
+	Vcb->WarmUpPathTableLbn = (ULONG) SectorsFromLlBytes( Vcb->PathTableFcb->Mcb.McbArray[0].DiskOffset );
+	Vcb->WarmUpPathTableAllocation = (ULONG) Vcb->PathTableFcb->AllocationSize.QuadPart;
+	Vcb->WarmUpPathTableSize = (ULONG) Vcb->PathTableFcb->FileSize.QuadPart;
+	Vcb->WarmUpPathTableOffset = Vcb->PathTableFcb->Index.StreamOffset;
 
-	//
-	//  and __finally, free the context record.
-	//
+	KeClearEvent( &Vcb->WarmUpDone );
 
-	CdFreeIoContext( IoContext );
-	return STATUS_SUCCESS ;
+	IoQueueWorkItem( Vcb->WarmUpItem, CdWarmUpWorker, DelayedWorkQueue, Vcb );
 }
 
 
@@ -3769,35 +5788,26 @@ Return Value:
 //  Local support routine
 //
 
-_When_(SafeNodeType(Fcb) != CDFS_NTC_FCB_PATH_TABLE && StartingOffset == 0, _At_(ByteCount, _In_range_(>=, CdAudioDirentSize + sizeof(RAW_DIRENT))))
-_When_(SafeNodeType(Fcb) != CDFS_NTC_FCB_PATH_TABLE && StartingOffset != 0, _At_(ByteCount, _In_range_(>=, CdAudioDirentSize + SECTOR_SIZE)))
 VOID
-CdReadAudioSystemFile(
-	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ PFCB Fcb,
-	     _In_ LONGLONG StartingOffset,
-	     _In_ _In_range_(>=, CdAudioDirentSize) ULONG ByteCount,
-	     _Out_writes_bytes_(ByteCount) PVOID SystemBuffer
+CdWarmUpWorker(
+	_In_ PDEVICE_OBJECT DeviceObject,
+	     _In_opt_ PVOID Context
 )
 
 /*++
 
 Routine Description:
 
-    This routine is called to read the pseudo root directory and path
-    table for a music disk.  We build the individual elements on the
-    stack and copy into the cache buffer.
+    Work item routine which runs the warm-up queued by CdStartWarmUp.  There
+    is no request to take an IrpContext from, so we build one around an Irp
+    of our own, marked low priority.  Any error ends the warm-up quietly,
+    it is only ever a hint.  WarmUpDone is signalled on the way out.
 
 Arguments:
 
-    Fcb - Fcb representing the file to read.
-
-    StartingOffset - Logical offset in the file to read from.
-
-    ByteCount - Number of bytes to read.
+    DeviceObject - Volume device object.
 
-    SystemBuffer - Pointer to buffer to fill in.  This will always be page
-        aligned.
+    Context - Vcb of the volume.
 
 Return Value:
 
@@ -3806,375 +5816,579 @@ Return Value:
 --*/
 
 {
-	PRAW_PATH_ISO RawPath;
-	PRAW_DIRENT RawDirent;
-
-	ULONG CurrentTrack;
-	ULONG SectorOffset;
-	ULONG EntryCount;
-	UCHAR TrackOnes;
-	UCHAR TrackTens;
-	PTRACK_DATA ThisTrack;
-
-	LONGLONG CurrentOffset;
-
-	PVOID CurrentSector;
-
-	PSYSTEM_USE_XA SystemUse;
-
-	ULONG BytesToCopy;
-
-	UCHAR LocalBuffer[FIELD_OFFSET( RAW_DIRENT, FileId ) + 12];
+	PVCB Vcb = reinterpret_cast<PVCB>(Context);
+	PIRP_CONTEXT IrpContext = NULL;
+	PIO_STACK_LOCATION IrpSp;
+	PIRP Irp;
 
 	PAGED_CODE();
 
-	//
-	//  If this is the path table then we just need a single entry.
-	//
+	Irp = IoAllocateIrp( 1, FALSE );
 
-	if (SafeNodeType( Fcb ) == CDFS_NTC_FCB_PATH_TABLE)
+	if (Irp != NULL)
 	{
-		//
-		//  Sanity check that the offset is zero.
-		//
-
-		NT_ASSERT( StartingOffset == 0 );
+		IoSetNextIrpStackLocation( Irp );
+		IrpSp = IoGetCurrentIrpStackLocation( Irp );
+		IrpSp->MajorFunction = IRP_MJ_READ;
+		IrpSp->DeviceObject = DeviceObject;
 
 		//
-		//  Store a pseudo path entry in our local buffer.
+		//  Our reads are speculative, so they make way for any others.
 		//
 
-		RawPath = (PRAW_PATH_ISO) LocalBuffer;
-
-		RtlZeroMemory( RawPath, sizeof( LocalBuffer ));
+		IoSetIoPriorityHint( Irp, IoPriorityLow );
 
-		RawPath->DirIdLen = 1;
-		RawPath->ParentNum = 1;
-		RawPath->DirId[0] = '\0';
+		FsRtlEnterFileSystem();
 
-		//
-		//  Now copy to the user's buffer.
-		//
+		__try
+		{
+			IrpContext = CdCreateIrpContext( Irp, TRUE );
 
-		BytesToCopy = FIELD_OFFSET( RAW_PATH_ISO, DirId ) + 2;
+			CdWarmUpSectorCache( IrpContext, Vcb );
+		}
+		__except (FsRtlIsNtstatusExpected( GetExceptionCode() ) ?
+		          EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+		{
+			NOTHING;
+		}
 
-		if (BytesToCopy > ByteCount)
+		if (IrpContext != NULL)
 		{
-			BytesToCopy = ByteCount;
+			CdCleanupIrpContext( IrpContext, FALSE );
 		}
 
-		RtlCopyMemory( SystemBuffer,
-			RawPath,
-			BytesToCopy );
+		FsRtlExitFileSystem();
 
-		//
-		//  We need to deal with the multiple sector case for the root directory.
-		//
+		IoFreeIrp( Irp );
 	}
-	else
-	{
-		//
-		//  Initialize the first track to return to our caller.
-		//
 
-		CurrentTrack = 0;
+	IoFreeWorkItem( Vcb->WarmUpItem );
+	Vcb->WarmUpItem = NULL;
 
-		//
-		//  If the offset is zero then store the entries for the self and parent
-		//  entries.
-		//
+	KeSetEvent( &Vcb->WarmUpDone, 0, FALSE );
+}
 
-		if (StartingOffset == 0)
-		{
-			RawDirent = reinterpret_cast<PRAW_DIRENT>(SystemBuffer);
 
-			//
-			//  Clear all of the fields initially.
-			//
+//
+//  Local support routine
+//
 
-			RtlZeroMemory( RawDirent, FIELD_OFFSET( RAW_DIRENT, FileId ));
+_Requires_lock_held_(_Global_critical_region_)
+VOID
+CdWarmUpSectorCache(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PVCB Vcb
+)
 
-			//
-			//  Now fill in the interesting fields.
-			//
+/*++
 
-			RawDirent->DirLen = FIELD_OFFSET( RAW_DIRENT, FileId ) + 1;
-			RawDirent->FileIdLen = 1;
-			RawDirent->FileId[0] = '\0';
-			SetFlag( RawDirent->FlagsISO, CD_ATTRIBUTE_DIRECTORY );
+Routine Description:
 
-			//
-			//  Set the time stamp to be Jan 1, 1995
-			//
+    This routine does the work of the warm-up.  The path table lists the
+    directories level by level, so those within WarmUpLevels of the root
+    are the start of it, and each one's level follows from its parent's.
+    Their extents are read in disk order, as long as the self entry in the
+    first sector of each says, collecting the zisofs files in them whose
+    header and block pointer table fit in a sector, and then those are read
+    in disk order too.  A directory which would take the warm-up over its
+    budget is read as far as the budget allows, and ends it.
 
-			RawDirent->RecordTime[0] = 95;
-			RawDirent->RecordTime[1] = 1;
-			RawDirent->RecordTime[2] = 1;
+    The warm-up brings at most half the chunks of the sector cache in, so
+    it can't push out everything foreground requests read meanwhile.  A
+    path table too long for a quarter of the cache is cut short, which only
+    loses the deepest directories.
 
-			SectorOffset = RawDirent->DirLen;
+Arguments:
 
-			RawDirent = Add2Ptr( RawDirent, SectorOffset, PRAW_DIRENT );
+    Vcb - Volume to warm up.
 
-			//
-			//  Clear all of the fields initially.
-			//
+Return Value:
 
-			RtlZeroMemory( RawDirent, FIELD_OFFSET( RAW_DIRENT, FileId ));
+    None.  Raises STATUS_CANCELLED if the warm-up is stopped.
 
-			//
-			//  Now fill in the interesting fields.
-			//
+--*/
 
-			RawDirent->DirLen = FIELD_OFFSET( RAW_DIRENT, FileId ) + 1;
-			RawDirent->FileIdLen = 1;
-			RawDirent->FileId[0] = '\1';
-			SetFlag( RawDirent->FlagsISO, CD_ATTRIBUTE_DIRECTORY );
+{
+	CD_WARM_UP_CONTEXT WarmUp;
 
-			//
-			//  Set the time stamp to be Jan 1, 1995
-			//
+	PUCHAR PathTable = NULL;
+	PUCHAR Sector = NULL;
+	PCD_WARM_UP_EXTENT Extents = NULL;
+	PCD_WARM_UP_EXTENT Tables = NULL;
 
-			RawDirent->RecordTime[0] = 95;
-			RawDirent->RecordTime[1] = 1;
-			RawDirent->RecordTime[2] = 1;
+	PRAW_PATH_ENTRY RawPath;
+	PRAW_DIRENT RawDirent;
+	ULONG PathTableBytes;
+	ULONG PathTableEnd;
+	ULONG Offset;
+	ULONG EntryLength;
+	USHORT Parent;
+	ULONG Level;
+
+	ULONG MaxExtents;
+	ULONG ExtentCount = 0;
+	ULONG TableCount = 0;
+	ULONG Index;
 
-			SectorOffset += RawDirent->DirLen;
-			EntryCount = 2;
+	ULONG DataLength;
+	ULONG SectorCount;
+	ULONG SectorIndex;
 
-			//
-			//  Otherwise compute the starting track to write to the buffer.
-			//
+	PAGED_CODE();
+
+	WarmUp.LastChunk = CD_SEC_CACHE_NO_CHUNK;
+	WarmUp.ChunksLeft = Vcb->SectorCache->ChunkCount / 2;
+
+	PathTableBytes = BytesFromSectors( (WarmUp.ChunksLeft / 2) * CD_SEC_CHUNK_BLOCKS );
+
+	if (Vcb->WarmUpPathTableAllocation < PathTableBytes)
+	{
+		PathTableBytes = Vcb->WarmUpPathTableAllocation;
+	}
+
+	PathTableEnd = Min( Vcb->WarmUpPathTableSize, PathTableBytes );
+	MaxExtents = PathTableBytes / MIN_RAW_PATH_ENTRY_LEN;
+
+	__try
+	{
+		PathTable = reinterpret_cast<PUCHAR>( ExAllocatePoolWithTag( CdPagedPool, PathTableBytes, TAG_IO_BUFFER ));
+		Sector = reinterpret_cast<PUCHAR>( ExAllocatePoolWithTag( CdPagedPool, SECTOR_SIZE, TAG_IO_BUFFER ));
+		Extents = reinterpret_cast<PCD_WARM_UP_EXTENT>( ExAllocatePoolWithTag( CdPagedPool,
+			MaxExtents * sizeof( CD_WARM_UP_EXTENT ),
+			TAG_IO_BUFFER ));
+		Tables = reinterpret_cast<PCD_WARM_UP_EXTENT>( ExAllocatePoolWithTag( CdPagedPool,
+			MaxExtents * sizeof( CD_WARM_UP_EXTENT ),
+			TAG_IO_BUFFER ));
+
+		if ((PathTable == NULL) || (Sector == NULL) || (Extents == NULL) || (Tables == NULL) ||
+			!CdWarmUpRead( IrpContext,
+			               &WarmUp,
+			               Vcb->WarmUpPathTableLbn,
+			               PathTableBytes,
+			               PathTable,
+			               CDFS_SECTOR_CACHE_CLASS_PATH_TABLE ))
+		{
+			__leave;
 		}
-		else
+
+		//
+		//  Walk the path table, which starts at its offset in the first
+		//  sector, until we reach a directory too deep or an entry we can't
+		//  trust.  The root is entry one and its own parent.
+		//
+
+		Offset = Vcb->WarmUpPathTableOffset;
+
+		while ((Offset + MIN_RAW_PATH_ENTRY_LEN <= PathTableEnd) &&
+			(ExtentCount < MaxExtents))
 		{
-			//
-			//  Count the tracks in each preceding sector.
-			//
+			RawPath = Add2Ptr( PathTable, Offset, PRAW_PATH_ENTRY );
 
-			CurrentOffset = 0;
+			EntryLength = WordAlign( CdRawPathIdLen( IrpContext, RawPath ) + MIN_RAW_PATH_ENTRY_LEN - 1 );
 
-			do
+			if (Offset + EntryLength > PathTableEnd)
 			{
-				CurrentTrack += CdAudioDirentsPerSector;
-				CurrentOffset += SECTOR_SIZE;
+				break;
 			}
-			while (CurrentOffset < StartingOffset);
 
-			//
-			//  Bias the track count to reflect the two default entries.
-			//
+			CopyUchar2( &Parent, &RawPath->ParentNum );
+
+			if (ExtentCount == 0)
+			{
+				Level = 0;
+			}
+			else if ((Parent == 0) || (Parent > ExtentCount))
+			{
+				break;
+			}
+			else
+			{
+				Level = Extents[Parent - 1].Level + 1;
+			}
+
+			if (Level > Vcb->WarmUpLevels)
+			{
+				break;
+			}
 
-			CurrentTrack -= 2;
+			CopyUchar4( &Extents[ExtentCount].Lbn, CdRawPathLoc( IrpContext, RawPath ));
+			Extents[ExtentCount].Lbn += CdRawPathXar( IrpContext, RawPath );
+			Extents[ExtentCount].Level = Level;
 
-			SectorOffset = 0;
-			EntryCount = 0;
+			ExtentCount += 1;
+			Offset += EntryLength;
 		}
 
 		//
-		//  We now know the first track to return as well as where we are in
-		//  the current sector.  We will walk through sector by sector adding
-		//  the entries for the separate tracks in the TOC.  We will zero
-		//  any sectors or partial sectors without data.
+		//  Read the directories, noting the tables to read after them.  The
+		//  depth is checked again since it may be lowered while we run.
 		//
 
-		CurrentSector = SystemBuffer;
-		BytesToCopy = SECTOR_SIZE;
-
-		//
-		//  Loop for each sector.
-		//
+		CdSortWarmUpExtents( Extents, ExtentCount );
 
-		do
+		for (Index = 0; (Index < ExtentCount) && (WarmUp.ChunksLeft != 0); Index++)
 		{
+			if (Extents[Index].Level > Vcb->WarmUpLevels)
+			{
+				continue;
+			}
+
 			//
-			//  Add entries until we reach our threshold for each sector.
+			//  We only know the length of the directory once we have its
+			//  first sector.  Reading the rest a sector at a time costs
+			//  nothing extra, since the cache fills a whole chunk on the
+			//  first miss in it.
 			//
 
-			do
+			SectorCount = 1;
+
+			for (SectorIndex = 0;
+			     (SectorIndex < SectorCount) && (WarmUp.ChunksLeft != 0);
+			     SectorIndex++)
 			{
+				if (!CdWarmUpRead( IrpContext,
+				                   &WarmUp,
+				                   Extents[Index].Lbn + SectorIndex,
+				                   SECTOR_SIZE,
+				                   Sector,
+				                   CDFS_SECTOR_CACHE_CLASS_DIRECTORY ))
+				{
+					break;
+				}
+
 				//
-				//  If we are beyond the entries in the TOC then exit.
+				//  The first dirent is the directory's self entry.  If it
+				//  doesn't look like one we just keep the first sector.
 				//
 
-				if (CurrentTrack >= IrpContext->Vcb->TrackCount)
+				if (SectorIndex == 0)
 				{
-					break;
+					RawDirent = reinterpret_cast<PRAW_DIRENT>( Sector );
+
+					if ((RawDirent->DirLen >= MIN_RAW_DIRENT_LEN) &&
+						FlagOn( CdRawDirentFlags( IrpContext, RawDirent ), CD_ATTRIBUTE_DIRECTORY ))
+					{
+						CopyUchar4( &DataLength, RawDirent->DataLen );
+
+						if (DataLength != 0)
+						{
+							SectorCount = ((DataLength - 1) >> SECTOR_SHIFT) + 1;
+						}
+					}
 				}
 
-				ThisTrack = &IrpContext->Vcb->CdromToc->TrackData[CurrentTrack];
+				CdFindWarmUpTables( IrpContext,
+				                    Sector,
+				                    Extents[Index].Level,
+				                    Tables,
+				                    &TableCount,
+				                    MaxExtents );
+			}
+		}
 
-				//
-				//  Point to the current position in the buffer.
-				//
+		CdSortWarmUpExtents( Tables, TableCount );
 
-				RawDirent = Add2Ptr( CurrentSector, SectorOffset, PRAW_DIRENT );
+		for (Index = 0; (Index < TableCount) && (WarmUp.ChunksLeft != 0); Index++)
+		{
+			if (Tables[Index].Level <= Vcb->WarmUpLevels)
+			{
+				(VOID) CdWarmUpRead( IrpContext,
+				                     &WarmUp,
+				                     Tables[Index].Lbn,
+				                     SECTOR_SIZE,
+				                     Sector,
+				                     CDFS_SECTOR_CACHE_CLASS_COMPRESSION_TABLE );
+			}
+		}
+	}
+	__finally
+	{
+		CdFreePool( reinterpret_cast<PVOID*>(&PathTable) );
+		CdFreePool( reinterpret_cast<PVOID*>(&Sector) );
+		CdFreePool( reinterpret_cast<PVOID*>(&Extents) );
+		CdFreePool( reinterpret_cast<PVOID*>(&Tables) );
+	}
+}
 
-				//
-				//  Clear all of the fields initially.
-				//
 
-				RtlZeroMemory( RawDirent, CdAudioDirentSize );
+//
+//  Local support routine
+//
 
-				//
-				//  Now fill in the interesting fields.
-				//
+_Requires_lock_held_(_Global_critical_region_)
+BOOLEAN
+CdWarmUpRead(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PCD_WARM_UP_CONTEXT WarmUp,
+	     _In_ ULONG Lbn,
+	     _In_ ULONG ByteCount,
+	     _Out_writes_bytes_(ByteCount) PVOID Buffer,
+	     _In_ ULONG CacheClass
+)
 
-				RawDirent->DirLen = (UCHAR) CdAudioDirentSize;
-				RawDirent->FileIdLen = CdAudioFileNameLength;
+/*++
 
-				RtlCopyMemory( RawDirent->FileId,
-					CdAudioFileName,
-					CdAudioFileNameLength );
+Routine Description:
 
-				//
-				//  Set the time stamp to be Jan 1, 1995 00:00
-				//
+    This routine makes one read of the warm-up through the sector cache.
+    It first waits until no read has arrived on the volume for
+    CD_WARM_UP_IDLE_TIME, so the warm-up only uses the drive while nobody
+    else is, and checks the warm-up hasn't been stopped by dismount, a
+    media change or tuning.  Reads which would take the warm-up over its
+    budget of chunks are refused, and end it.
 
-				RawDirent->RecordTime[0] = 95;
-				RawDirent->RecordTime[1] = 1;
-				RawDirent->RecordTime[2] = 1;
+Arguments:
 
-				//
-				//  Put the track number into the file name.
-				//
+    WarmUp - Progress of the warm-up, updated with the chunks this read
+        brings in.
 
-				TrackTens = TrackOnes = ThisTrack->TrackNumber;
+    Lbn - First block to read.  Blocks before the volume descriptors are
+        refused.
 
-				TrackOnes = (TrackOnes % 10) + '0';
+    ByteCount - Bytes to read, a multiple of the sector size.
 
-				TrackTens /= 10;
-				TrackTens = (TrackTens % 10) + '0';
+    Buffer - Buffer to read into.
 
-				RawDirent->FileId[AUDIO_NAME_TENS_OFFSET] = TrackTens;
-				RawDirent->FileId[AUDIO_NAME_ONES_OFFSET] = TrackOnes;
+    CacheClass - CDFS_SECTOR_CACHE_CLASS_ of the read.
 
-				SystemUse = Add2Ptr( RawDirent, CdAudioSystemUseOffset, PSYSTEM_USE_XA );
+Return Value:
 
-				SystemUse->Attributes = SYSTEM_USE_XA_DA;
-				SystemUse->Signature = SYSTEM_XA_SIGNATURE;
+    BOOLEAN - TRUE if Buffer was filled, FALSE otherwise.  Raises
+        STATUS_CANCELLED if the warm-up has been stopped.
 
-				//
-				//  Store the track number as the file number.
-				//
+--*/
 
-				SystemUse->FileNumber = (UCHAR) CurrentTrack;
+{
+	PVCB Vcb = IrpContext->Vcb;
+	IO_RUN Run;
+	LARGE_INTEGER Delay;
+	ULONG FirstChunk;
+	ULONG LastChunk;
+	ULONG Chunks;
 
-				EntryCount += 1;
-				SectorOffset += CdAudioDirentSize;
-				CurrentTrack += 1;
-			}
-			while (EntryCount < CdAudioDirentsPerSector);
+	PAGED_CODE();
 
-			//
-			//  Zero the remaining portion of this buffer.
-			//
+	if (Lbn < 16)
+	{
+		return FALSE;
+	}
 
-			RtlZeroMemory( Add2Ptr( CurrentSector, SectorOffset, PVOID ),
-				SECTOR_SIZE - SectorOffset );
+	FirstChunk = (Lbn - 16) / CD_SEC_CHUNK_BLOCKS;
+	LastChunk = (Lbn + SectorsFromBytes( ByteCount ) - 1 - 16) / CD_SEC_CHUNK_BLOCKS;
 
-			//
-			//  Prepare for the next sector.
-			//
+	Chunks = LastChunk - FirstChunk + 1;
 
-			EntryCount = 0;
-			BytesToCopy += SECTOR_SIZE;
-			SectorOffset = 0;
-			CurrentSector = Add2Ptr( CurrentSector, SECTOR_SIZE, PVOID );
+	if (FirstChunk == WarmUp->LastChunk)
+	{
+		Chunks -= 1;
+	}
+
+	if (Chunks > WarmUp->ChunksLeft)
+	{
+		WarmUp->ChunksLeft = 0;
+		return FALSE;
+	}
+
+	Delay.QuadPart = -10 * 1000 * CD_WARM_UP_IDLE_TIME;
+
+	for (;;)
+	{
+		if ((Vcb->WarmUpLevels == 0) ||
+			(Vcb->VcbCondition != VcbMounted) ||
+			CdRealDevNeedsVerify( Vcb->Vpb->RealDevice ))
+		{
+			CdRaiseStatus( IrpContext, STATUS_CANCELLED );
 		}
-		while (BytesToCopy <= ByteCount);
+
+		if ((ULONG) (KeQueryInterruptTime() / (10 * 1000)) - Vcb->LastForegroundRead >= CD_WARM_UP_IDLE_TIME)
+		{
+			break;
+		}
+
+		KeDelayExecutionThread( KernelMode, FALSE, &Delay );
 	}
 
-	
+	WarmUp->ChunksLeft -= Chunks;
+	WarmUp->LastChunk = LastChunk;
+
+	RtlZeroMemory( &Run, sizeof( IO_RUN ));
+
+	Run.DiskOffset = LlBytesFromSectors( Lbn );
+	Run.DiskByteCount = ByteCount;
+	Run.TransferBuffer = Buffer;
+
+	InterlockedIncrement( &Vcb->WarmUpReads );
+
+	return CdReadDirDataThroughCache( IrpContext, &Run, CacheClass );
 }
 
 
-NTSTATUS
-CdHijackIrpAndFlushDevice(
+//
+//  Local support routine
+//
+
+VOID
+CdFindWarmUpTables(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _Inout_ PIRP Irp,
-	     _In_ PDEVICE_OBJECT TargetDeviceObject
+	     _In_reads_bytes_(SECTOR_SIZE) PUCHAR Sector,
+	     _In_ ULONG Level,
+	     _Out_writes_(MaxTables) PCD_WARM_UP_EXTENT Tables,
+	     _Inout_ PULONG TableCount,
+	     _In_ ULONG MaxTables
 )
 
 /*++
 
 Routine Description:
 
-    This routine is called when we need to send a flush to a device but
-    we don't have a flush Irp.  What this routine does is make a copy
-    of its current Irp stack location, but changes the Irp Major code
-    to a IRP_MJ_FLUSH_BUFFERS amd then send it down, but cut it off at
-    the knees in the completion routine, fix it up and return to the
-    user as if nothing had happened.
+    This routine adds the zisofs files in a directory sector to the tables
+    the warm-up reads.  Only files whose header and block pointer table fit
+    in their first sector are taken, since that is all the warm-up reads of
+    them.  The sector is raw disk data, so the dirents and their system use
+    entries are checked as we go and the scan stops at the first bad one.
 
 Arguments:
 
-    Irp - The Irp to hijack
+    Sector - Directory sector to scan.
 
-    TargetDeviceObject - The device to send the request to.
+    Level - Level below the root of the directory.
+
+    Tables - Array of tables to add to.
+
+    TableCount - Number of entries in Tables, updated.
+
+    MaxTables - Number of entries Tables has room for.
 
 Return Value:
 
-    NTSTATUS - The Status from the flush in case anybody cares.
+    None.
 
 --*/
 
 {
-	KEVENT Event;
-	NTSTATUS Status;
-	PIO_STACK_LOCATION NextIrpSp;
+	PRAW_DIRENT RawDirent;
+	PRAW_SUSP_ENTRY_HEADER SuspEntry;
+	PRAW_ZISO_ENTRY ZisoEntry;
+	ULONG Offset = 0;
+	ULONG DirentLength;
+	ULONG SystemUseOffset;
+	ULONG DataLength;
+	ULONG UncompressedSize;
+	ULONG TableBytes;
 
 	PAGED_CODE();
 
-	UNREFERENCED_PARAMETER( IrpContext );
+	while ((Offset + MIN_RAW_DIRENT_LEN <= SECTOR_SIZE) &&
+		(*TableCount < MaxTables))
+	{
+		RawDirent = Add2Ptr( Sector, Offset, PRAW_DIRENT );
+		DirentLength = RawDirent->DirLen;
 
-	//
-	//  Get the next stack location, and copy over the stack location
-	//
+		if ((DirentLength < MIN_RAW_DIRENT_LEN) ||
+			(Offset + DirentLength > SECTOR_SIZE))
+		{
+			break;
+		}
 
-	NextIrpSp = IoGetNextIrpStackLocation(Irp);
+		CopyUchar4( &DataLength, RawDirent->DataLen );
 
-	*NextIrpSp = *IoGetCurrentIrpStackLocation(Irp);
+		if (!FlagOn( CdRawDirentFlags( IrpContext, RawDirent ), CD_ATTRIBUTE_DIRECTORY ) &&
+			(DataLength != 0))
+		{
+			SystemUseOffset = WordAlign( FIELD_OFFSET( RAW_DIRENT, FileId ) + RawDirent->FileIdLen );
 
-	NextIrpSp->MajorFunction = IRP_MJ_FLUSH_BUFFERS;
-	NextIrpSp->MinorFunction = 0;
+			while (SystemUseOffset + sizeof( RAW_SUSP_ENTRY_HEADER ) <= DirentLength)
+			{
+				SuspEntry = Add2Ptr( RawDirent, SystemUseOffset, PRAW_SUSP_ENTRY_HEADER );
 
-	//
-	//  Set up the completion routine
-	//
+				if ((SuspEntry->Length < sizeof( RAW_SUSP_ENTRY_HEADER )) ||
+					(SystemUseOffset + SuspEntry->Length > DirentLength))
+				{
+					break;
+				}
 
-	KeInitializeEvent(&Event, NotificationEvent, FALSE);
+				if ((SuspEntry->Signature[0] == 'Z') &&
+					(SuspEntry->Signature[1] == 'F') &&
+					(SuspEntry->Length >= sizeof( RAW_ZISO_ENTRY )))
+				{
+					ZisoEntry = (PRAW_ZISO_ENTRY) SuspEntry;
 
-	IoSetCompletionRoutine(Irp,
-	                       CdSyncCompletionRoutine,
-	                       &Event,
-	                       TRUE,
-	                       TRUE,
-	                       TRUE);
+					if ((ZisoEntry->BlockSizeLog2 >= 15) &&
+						(ZisoEntry->BlockSizeLog2 <= 17))
+					{
+						CopyUchar4( &UncompressedSize, ZisoEntry->UncompressedSizeIntel );
 
-	//
-	//  Send the request.
-	//
+						TableBytes = (ZisoEntry->HeaderSizeDiv4 << 2) +
+							((UncompressedSize >> ZisoEntry->BlockSizeLog2) + 2) * sizeof( ULONG );
 
-	Status = IoCallDriver( TargetDeviceObject, Irp );
+						if (TableBytes <= SECTOR_SIZE)
+						{
+							CopyUchar4( &Tables[*TableCount].Lbn, RawDirent->FileLoc );
+							Tables[*TableCount].Lbn += RawDirent->XarLen;
+							Tables[*TableCount].Level = Level;
 
-	if (Status == STATUS_PENDING)
-	{
-		(VOID)KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
+							*TableCount += 1;
+						}
+					}
 
-		Status = Irp->IoStatus.Status;
+					break;
+				}
+
+				SystemUseOffset += SuspEntry->Length;
+			}
+		}
+
+		Offset += DirentLength;
 	}
+}
 
-	//
-	//  If the driver doesn't support flushes, return SUCCESS.
-	//
 
-	if (Status == STATUS_INVALID_DEVICE_REQUEST)
+//
+//  Local support routine
+//
+
+VOID
+CdSortWarmUpExtents(
+	_Inout_updates_(Count) PCD_WARM_UP_EXTENT Extents,
+	     _In_ ULONG Count
+)
+
+/*++
+
+Routine Description:
+
+    This routine sorts warm-up extents into disk order.  Path tables and
+    directories are usually laid out close to that order already, which is
+    the case an insertion sort handles best.
+
+Arguments:
+
+    Extents - Array to sort.
+
+    Count - Number of entries in it.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+	CD_WARM_UP_EXTENT Extent;
+	ULONG Index;
+	ULONG Slot;
+
+	PAGED_CODE();
+
+	for (Index = 1; Index < Count; Index++)
 	{
-		Status = STATUS_SUCCESS ;
-	}
+		Extent = Extents[Index];
 
-	Irp->IoStatus.Status = 0;
-	Irp->IoStatus.Information = 0;
+		for (Slot = Index; (Slot > 0) && (Extents[Slot - 1].Lbn > Extent.Lbn); Slot--)
+		{
+			Extents[Slot] = Extents[Slot - 1];
+		}
 
-	return Status;
+		Extents[Slot] = Extent;
+	}
 }
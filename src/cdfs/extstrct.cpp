@@ -108,12 +108,46 @@ VOID COMPRESSION_CONTEXT::FreeBuffer()
 	{
 		return;
 	}
+	if (this->m_BufferRetained)
+	{
+		InterlockedExchangeAdd(&CdData.RetainedCompressionBytes, -(LONG)this->m_BufferCapacity);
+		this->m_BufferRetained = FALSE;
+	}
 	MmUnmapReservedMapping(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING, this->m_Mdl);
 	MmFreeMappingAddress(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING);
 	MmFreePagesFromMdl(this->m_Mdl);
 	ExFreePool(this->m_Mdl);
 	this->m_Mdl = NULL;
 	this->m_Buffer = NULL;
+	this->m_BufferCapacity = 0;
+}
+
+VOID COMPRESSION_CONTEXT::ReleaseBuffer()
+{
+	PAGED_CODE();
+	if (!this->m_Mdl)
+	{
+		return;
+	}
+	if ((this->m_BufferCapacity > COMPRESSION_BUFFER_RETAIN_LIMIT) || CdIsMemoryLow())
+	{
+		FreeBuffer();
+		return;
+	}
+
+	//
+	// Count the buffer against the total kept by all handles, and give it
+	// back if there is no room for it.
+	//
+
+	if ((ULONG)InterlockedExchangeAdd(&CdData.RetainedCompressionBytes, (LONG)this->m_BufferCapacity) +
+		this->m_BufferCapacity > COMPRESSION_BUFFER_RETAIN_TOTAL)
+	{
+		InterlockedExchangeAdd(&CdData.RetainedCompressionBytes, -(LONG)this->m_BufferCapacity);
+		FreeBuffer();
+		return;
+	}
+	this->m_BufferRetained = TRUE;
 }
 
 VOID COMPRESSION_CONTEXT::Set(ULONG RawStartingOffset, ULONG OffsetInFirstBlock,
@@ -153,6 +187,7 @@ BOOLEAN COMPRESSION_CONTEXT::AllocateBuffer()
 	PHYSICAL_ADDRESS Min;
 	PHYSICAL_ADDRESS Max;
 	PHYSICAL_ADDRESS Skip;
+	ULONG Capacity;
 	PAGED_CODE();
 
 	NT_ASSERT(this->m_AlignedSize > 0);
@@ -161,26 +196,48 @@ BOOLEAN COMPRESSION_CONTEXT::AllocateBuffer()
 	Max.QuadPart = -1LL;
 	Skip.QuadPart = PAGE_SIZE;
 
+	//
+	// Reuse the buffer left by the previous read if it is big enough
+	//
+
 	if (this->m_Buffer)
 	{
+		if (this->m_BufferRetained)
+		{
+			InterlockedExchangeAdd(&CdData.RetainedCompressionBytes, -(LONG)this->m_BufferCapacity);
+			this->m_BufferRetained = FALSE;
+		}
+		if (this->m_BufferCapacity >= this->m_AlignedSize)
+		{
+			return TRUE;
+		}
 		FreeBuffer();
 	}
 
-	this->m_Buffer = reinterpret_cast<PUCHAR>(MmAllocateMappingAddress(this->m_AlignedSize, TAG_COMPRESSION_CTX_MAPPING));
+	Capacity = (ULONG)ROUND_TO_PAGES(this->m_AlignedSize);
+
+	this->m_Buffer = reinterpret_cast<PUCHAR>(MmAllocateMappingAddress(Capacity, TAG_COMPRESSION_CTX_MAPPING));
 	if (!this->m_Buffer)
 	{
 		return FALSE;
 	}
 
+	//
+	// The buffer is only ever touched by the device and by inflate, so it
+	// is mapped cached; a non-cached mapping makes every inflate input
+	// fetch go to memory.
+	//
+
 	this->m_Mdl = MmAllocatePagesForMdlEx(Min, Max, Skip,
-	                                      this->m_AlignedSize, MmNonCached, MM_ALLOCATE_FULLY_REQUIRED);
+	                                      Capacity, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
 	if (!this->m_Mdl)
 	{
 		MmFreeMappingAddress(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING);
+		this->m_Buffer = NULL;
 		return FALSE;
 	}
 
-	mapping = MmMapLockedPagesWithReservedMapping(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING, this->m_Mdl, MmNonCached);
+	mapping = MmMapLockedPagesWithReservedMapping(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING, this->m_Mdl, MmCached);
 	NT_ASSERT(mapping == this->m_Buffer);
 
 	if (!mapping)
@@ -189,9 +246,12 @@ BOOLEAN COMPRESSION_CONTEXT::AllocateBuffer()
 		ExFreePool(this->m_Mdl);
 		this->m_Mdl = NULL;
 		MmFreeMappingAddress(this->m_Buffer, TAG_COMPRESSION_CTX_MAPPING);
+		this->m_Buffer = NULL;
 		return FALSE;
 	}
 
+	this->m_BufferCapacity = Capacity;
+
 	return TRUE;
 }
 
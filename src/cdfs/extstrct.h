@@ -162,8 +162,8 @@ public:
 
 typedef VECTOR_OF_BLOCK_INFO* PVECTOR_OF_BLOCK_INFO;
 
-#define CdAllocateVectorOfBlockInfo(IC, Capacity) \
-	new VECTOR_OF_BLOCK_INFO(Capacity)
+#define CdAllocateVectorOfBlockInfo(IC, BlockSize, Capacity) \
+	new VECTOR_OF_BLOCK_INFO(BlockSize, Capacity)
 
 #pragma code_seg(push, "PAGE")
 
@@ -198,6 +198,14 @@ public:
 	PMDL m_Mdl;
 	PUCHAR m_Buffer;
 	//
+	// Size of the staging buffer, kept across reads on the handle
+	//
+	ULONG m_BufferCapacity;
+	//
+	// Set while the buffer is counted in CdData.RetainedCompressionBytes
+	//
+	BOOLEAN m_BufferRetained;
+	//
 	// Real size of buffer (aligned data)
 	//
 	ULONG m_AlignedStartingOffset;
@@ -225,7 +233,10 @@ public:
 
 	COMPRESSION_CONTEXT()
 		: m_Zstream(NULL),
-		  m_Buffer(NULL)
+		  m_Mdl(NULL),
+		  m_Buffer(NULL),
+		  m_BufferCapacity(0),
+		  m_BufferRetained(FALSE)
 	{
 		PAGED_CODE();
 	}
@@ -243,6 +254,8 @@ public:
 
 	VOID FreeBuffer();
 
+	VOID ReleaseBuffer();
+
 	VOID Set(ULONG RawStartingOffset, ULONG OffsetInFirstBlock,
 		ULONG ComprByteCount, ULONG BlockCount, ULONG BlockSize,
 		ULONG AlignedStartingOffset, ULONG AlignedSize,
@@ -255,6 +268,17 @@ public:
 
 typedef COMPRESSION_CONTEXT* PCOMPRESSION_CONTEXT;
 
+//
+//  Staging buffers up to this size stay with the compression context after
+//  a read, so the next read on the handle doesn't have to allocate and map
+//  pages again.  Larger ones are given back as soon as the read is done,
+//  and so is any buffer which would take the total kept by all handles
+//  past COMPRESSION_BUFFER_RETAIN_TOTAL, or is released while memory is low.
+//
+
+#define COMPRESSION_BUFFER_RETAIN_LIMIT (0x40000)
+#define COMPRESSION_BUFFER_RETAIN_TOTAL (0x400000)
+
 #define CdAllocateCompressionContext(IC) \
 	new COMPRESSION_CONTEXT
 
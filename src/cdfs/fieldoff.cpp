@@ -15,6 +15,7 @@ main (argc, argv)
         doit( CD_MCB, MaximumEntryCount );
         doit( CD_MCB, CurrentEntryCount );
         doit( CD_MCB, McbArray );
+        doit( CD_MCB, LastEntryOffset );
     }
     printf("\n");
     {
@@ -34,7 +35,7 @@ main (argc, argv)
     printf("\n");
     {
         NAME_LINK d;
-        doit( NAME_LINK, Links );
+        doit( NAME_LINK, Hash );
         doit( NAME_LINK, FileName );
     }
     printf("\n");
@@ -72,6 +73,9 @@ main (argc, argv)
         doit( CD_DATA, CacheManagerCallbacks );
         doit( CD_DATA, CacheManagerVolumeCallbacks );
         doit( CD_DATA, CloseItem );
+        doit( CD_DATA, LowMemoryEvent );
+        doit( CD_DATA, LowMemoryEventHandle );
+        doit( CD_DATA, RetainedCompressionBytes );
     }
     printf("\n");
     {
@@ -90,6 +94,7 @@ main (argc, argv)
         doit( VCB, VolumeDasdFcb );
         doit( VCB, RootIndexFcb );
         doit( VCB, PathTableFcb );
+        doit( VCB, PathIndex );
         doit( VCB, BaseSector );
         doit( VCB, VdSectorOffset );
         doit( VCB, PrimaryVdSectorOffset );
@@ -108,6 +113,9 @@ main (argc, argv)
         doit( VCB, BlockMask );
         doit( VCB, BlockInverseMask );
         doit( VCB, FcbTable );
+        doit( VCB, FcbTableBuckets );
+        doit( VCB, FcbTableCount );
+        doit( VCB, FcbTableInitialBuckets );
         doit( VCB, CdromToc );
         doit( VCB, TocLength );
         doit( VCB, TrackCount );
@@ -138,8 +146,15 @@ main (argc, argv)
         doit( FCB_INDEX, Ordinal );
         doit( FCB_INDEX, ChildPathTableOffset );
         doit( FCB_INDEX, ChildOrdinal );
-        doit( FCB_INDEX, ExactCaseRoot );
-        doit( FCB_INDEX, IgnoreCaseRoot );
+        doit( FCB_INDEX, ExactCaseTable );
+        doit( FCB_INDEX, IgnoreCaseTable );
+        doit( FCB_INDEX, NameIndex );
+        doit( FCB_INDEX, NameIndexGeneration );
+        doit( FCB_INDEX, NameIndexLinks );
+        doit( FCB_INDEX, NameArena );
+        doit( FCB_INDEX, NameArenaTried );
+        doit( FCB_INDEX, NameArenaLinks );
+        doit( FCB_INDEX, NegativeCache );
     }
     printf("\n");
     {
@@ -158,6 +173,7 @@ main (argc, argv)
         doit( FCB, ParentFcb );
         doit( FCB, FcbLinks );
         doit( FCB, FileId );
+        doit( FCB, FcbTableLinks );
         doit( FCB, FcbCleanup );
         doit( FCB, FcbReference );
         doit( FCB, FcbUserReference );
@@ -310,6 +326,7 @@ main (argc, argv)
         doit( FILE_ENUM_CONTEXT, CurrentDirent );
         doit( FILE_ENUM_CONTEXT, Flags );
         doit( FILE_ENUM_CONTEXT, FileSize );
+        doit( FILE_ENUM_CONTEXT, ExtentCount );
         doit( FILE_ENUM_CONTEXT, ShortName );
         doit( FILE_ENUM_CONTEXT, ShortNameBuffer );
         doit( FILE_ENUM_CONTEXT, Dirents );
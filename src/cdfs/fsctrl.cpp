@@ -125,6 +125,36 @@ extern "C"
 		        _Inout_ PIRP Irp
 	);
 
+	NTSTATUS
+	CdQueryReadTrace(
+		_Inout_ PIRP_CONTEXT IrpContext,
+		        _Inout_ PIRP Irp
+	);
+
+	NTSTATUS
+	CdQueryIoStatistics(
+		_Inout_ PIRP_CONTEXT IrpContext,
+		        _Inout_ PIRP Irp
+	);
+
+	NTSTATUS
+	CdQuerySectorCache(
+		_Inout_ PIRP_CONTEXT IrpContext,
+		        _Inout_ PIRP Irp
+	);
+
+	NTSTATUS
+	CdQueryTuning(
+		_Inout_ PIRP_CONTEXT IrpContext,
+		        _Inout_ PIRP Irp
+	);
+
+	NTSTATUS
+	CdSetTuning(
+		_Inout_ PIRP_CONTEXT IrpContext,
+		        _Inout_ PIRP Irp
+	);
+
 	_Requires_lock_held_(_Global_critical_region_)
 	VOID
 	CdScanForDismountedVcb(
@@ -174,7 +204,12 @@ extern "C"
 #pragma alloc_text(PAGE, CdMountVolume)
 #pragma alloc_text(PAGE, CdOplockRequest)
 #pragma alloc_text(PAGE, CdAllowExtendedDasdIo)
+#pragma alloc_text(PAGE, CdQueryIoStatistics)
+#pragma alloc_text(PAGE, CdQueryReadTrace)
+#pragma alloc_text(PAGE, CdQuerySectorCache)
+#pragma alloc_text(PAGE, CdQueryTuning)
 #pragma alloc_text(PAGE, CdScanForDismountedVcb)
+#pragma alloc_text(PAGE, CdSetTuning)
 #pragma alloc_text(PAGE, CdUnlockVolume)
 #pragma alloc_text(PAGE, CdUserFsctl)
 #pragma alloc_text(PAGE, CdVerifyVolume)
@@ -506,6 +541,31 @@ Return Value:
 		Status = CdAllowExtendedDasdIo(IrpContext, Irp);
 		break;
 
+	case FSCTL_CDFS_QUERY_READ_TRACE:
+
+		Status = CdQueryReadTrace(IrpContext, Irp);
+		break;
+
+	case FSCTL_CDFS_QUERY_SECTOR_CACHE:
+
+		Status = CdQuerySectorCache(IrpContext, Irp);
+		break;
+
+	case FSCTL_CDFS_QUERY_IO_STATISTICS:
+
+		Status = CdQueryIoStatistics(IrpContext, Irp);
+		break;
+
+	case FSCTL_CDFS_QUERY_TUNING:
+
+		Status = CdQueryTuning(IrpContext, Irp);
+		break;
+
+	case FSCTL_CDFS_SET_TUNING:
+
+		Status = CdSetTuning(IrpContext, Irp);
+		break;
+
 		//
 		//  We don't support any of the known or unknown requests.
 		//
@@ -530,7 +590,6 @@ CdReMountOldVcb(
 )
 {
 	KIRQL SavedIrql;
-	ULONG Index;
 	PUCHAR Buffer;
 
 	UNREFERENCED_PARAMETER( IrpContext );
@@ -548,20 +607,31 @@ CdReMountOldVcb(
 	CdUpdateVcbCondition( OldVcb, VcbMounted);
 	CdUpdateMediaChangeCount( OldVcb, NewVcb->MediaChangeCount);
 
+	//
+	//  Have the directories rebuild their name indexes on next use.
+	//
+
+	InterlockedIncrement( &OldVcb->NameIndexGeneration );
+
 	ClearFlag( OldVcb->VcbState, VCB_STATE_VPB_NOT_ON_DEVICE);
 
-	Buffer = OldVcb->SectorCacheBuffer = NewVcb->SectorCacheBuffer;
-	NewVcb->SectorCacheBuffer = NULL;
+	//
+	//  Hand the new sector cache buffer to the old Vcb, which keeps its own
+	//  chunk table and resources.  We can't free paged pool here, so any
+	//  buffer the old Vcb still has goes to the new one to be deleted with
+	//  it.  The disc is the same so the tables are the same size, but don't
+	//  take the buffer if they are not.
+	//
 
-	if (NULL != Buffer)
+	if ((NULL != NewVcb->SectorCacheBuffer) &&
+		(NULL != OldVcb->SectorCache) &&
+		(OldVcb->SectorCache->ChunkCount == NewVcb->SectorCache->ChunkCount))
 	{
-		for (Index = 0; Index < CD_SEC_CACHE_CHUNKS; Index++)
-		{
-			OldVcb->SecCacheChunks[Index].Buffer = Buffer;
-			OldVcb->SecCacheChunks[Index].BaseLbn = (ULONG)-1;
+		Buffer = OldVcb->SectorCacheBuffer;
+		OldVcb->SectorCacheBuffer = NewVcb->SectorCacheBuffer;
+		NewVcb->SectorCacheBuffer = Buffer;
 
-			Buffer += CD_SEC_CHUNK_BLOCKS * SECTOR_SIZE;
-		}
+		CdResetSectorCache( OldVcb->SectorCache );
 	}
 
 	IoReleaseVpbSpinLock(SavedIrql);
@@ -635,6 +705,12 @@ Return Value:
 	DISK_GEOMETRY DiskGeometry;
 
 	IO_SCSI_CAPABILITIES Capabilities;
+	STORAGE_PROPERTY_QUERY PropertyQuery;
+	STORAGE_ADAPTER_DESCRIPTOR AdapterDescriptor;
+	ULONG MaximumTransferLength;
+	ULONG MaximumPhysicalPages;
+	ULONG StagingSectors;
+	ULONG StagingBytes;
 
 	IO_STATUS_BLOCK Iosb;
 
@@ -1024,36 +1100,10 @@ Return Value:
 		if (!FlagOn( Vcb->VcbState, VCB_STATE_AUDIO_DISK) &&
 			((Vcb->CdromToc->LastTrack - Vcb->CdromToc->FirstTrack) == 0))
 		{
-			ULONG Index;
-			PUCHAR Buffer;
-
-			Buffer =
-				Vcb->SectorCacheBuffer = reinterpret_cast<PUCHAR>(FsRtlAllocatePool( CdPagedPool,
-					CD_SEC_CACHE_CHUNKS *
-					CD_SEC_CHUNK_BLOCKS *
-					SECTOR_SIZE ));
-
-			for (Index = 0; Index < (ULONG)CD_SEC_CACHE_CHUNKS; Index++)
-			{
-				Vcb->SecCacheChunks[Index].Buffer = Buffer;
-				Vcb->SecCacheChunks[Index].BaseLbn = (ULONG)-1;
-
-				Buffer += CD_SEC_CHUNK_BLOCKS * SECTOR_SIZE;
-			}
-
-			Vcb->SectorCacheIrp = IoAllocateIrp(StackSize, FALSE);
-
-			if (Vcb->SectorCacheIrp == NULL)
-			{
-				try_leave( Status = STATUS_INSUFFICIENT_RESOURCES );
-			}
-
-			IoInitializeIrp(Vcb->SectorCacheIrp,
-			                IoSizeOfIrp( StackSize),
-			                (CCHAR)StackSize);
-
-			KeInitializeEvent(&Vcb->SectorCacheEvent, SynchronizationEvent, FALSE);
-			ExInitializeResourceLite(&Vcb->SectorCacheResource);
+			CdCreateSectorCache(IrpContext,
+			                    Vcb,
+			                    CdRvdPtSz( RawIsoVd, Vcb->VcbState ),
+			                    StackSize);
 		}
 
 		//
@@ -1116,32 +1166,132 @@ Return Value:
 		}
 
 		//
-		//  Now check the maximum transfer limits on the device in case we
-		//  get raw reads on this volume.
+		//  Now check the maximum transfer limits on the device.  Ask the
+		//  storage stack for the adapter's limits, which also covers
+		//  adapters which aren't SCSI ports, and fall back to the port's
+		//  capabilities.
 		//
 
-		Status = CdPerformDevIoCtrl(IrpContext,
-		                            IOCTL_SCSI_GET_CAPABILITIES,
-		                            DeviceObjectWeTalkTo,
-		                            &Capabilities,
-		                            sizeof( IO_SCSI_CAPABILITIES),
-		                            FALSE,
-		                            TRUE,
-		                            NULL);
+		RtlZeroMemory( &PropertyQuery, sizeof( STORAGE_PROPERTY_QUERY ));
+		RtlZeroMemory( &AdapterDescriptor, sizeof( STORAGE_ADAPTER_DESCRIPTOR ));
+
+		PropertyQuery.PropertyId = StorageAdapterProperty;
+		PropertyQuery.QueryType = PropertyStandardQuery;
+
+		Status = CdPerformDevIoCtrlEx(IrpContext,
+		                              IOCTL_STORAGE_QUERY_PROPERTY,
+		                              DeviceObjectWeTalkTo,
+		                              &PropertyQuery,
+		                              sizeof( STORAGE_PROPERTY_QUERY ),
+		                              &AdapterDescriptor,
+		                              sizeof( STORAGE_ADAPTER_DESCRIPTOR ),
+		                              FALSE,
+		                              TRUE,
+		                              NULL);
 
-		if (NT_SUCCESS(Status))
+		if (NT_SUCCESS( Status ) &&
+			(AdapterDescriptor.Size >= RTL_SIZEOF_THROUGH_FIELD( STORAGE_ADAPTER_DESCRIPTOR, AlignmentMask )))
 		{
-			Vcb->MaximumTransferRawSectors = Capabilities.MaximumTransferLength / RAW_SECTOR_SIZE;
-			Vcb->MaximumPhysicalPages = Capabilities.MaximumPhysicalPages;
+			MaximumTransferLength = AdapterDescriptor.MaximumTransferLength;
+			MaximumPhysicalPages = AdapterDescriptor.MaximumPhysicalPages;
+
+			if (AdapterDescriptor.AlignmentMask > Vcb->AlignmentMask)
+			{
+				Vcb->AlignmentMask = AdapterDescriptor.AlignmentMask;
+			}
 		}
 		else
 		{
-			//
-			//  This should never happen, but we can safely assume 64k and 16 pages.
-			//
+			Status = CdPerformDevIoCtrl(IrpContext,
+			                            IOCTL_SCSI_GET_CAPABILITIES,
+			                            DeviceObjectWeTalkTo,
+			                            &Capabilities,
+			                            sizeof( IO_SCSI_CAPABILITIES),
+			                            FALSE,
+			                            TRUE,
+			                            NULL);
+
+			if (NT_SUCCESS(Status))
+			{
+				MaximumTransferLength = Capabilities.MaximumTransferLength;
+				MaximumPhysicalPages = Capabilities.MaximumPhysicalPages;
+			}
+			else
+			{
+				//
+				//  This should never happen, but we can safely assume 64k and 16 pages.
+				//
 
-			Vcb->MaximumTransferRawSectors = (64 * 1024) / RAW_SECTOR_SIZE;
-			Vcb->MaximumPhysicalPages = 16;
+				MaximumTransferLength = 64 * 1024;
+				MaximumPhysicalPages = 16;
+			}
+		}
+
+		//
+		//  An adapter reporting no page limit gets the same 16 pages as one
+		//  we couldn't ask, so that the page clamp below doesn't wrap.
+		//
+
+		if (MaximumPhysicalPages == 0)
+		{
+			MaximumPhysicalPages = 16;
+		}
+
+		Vcb->MaximumTransferRawSectors = MaximumTransferLength / RAW_SECTOR_SIZE;
+		Vcb->MaximumPhysicalPages = MaximumPhysicalPages;
+
+		//
+		//  Cooked reads are split to fit in one transfer from any buffer.
+		//  One which doesn't start on a page boundary spans a page more
+		//  than its length, so allow for that against the page limit.  We
+		//  never go below a page, which unaligned runs are read in.
+		//
+
+		if (MaximumPhysicalPages - 1 < MaximumTransferLength / PAGE_SIZE)
+		{
+			MaximumTransferLength = (MaximumPhysicalPages - 1) * PAGE_SIZE;
+		}
+
+		Vcb->DeviceMaximumTransfer = SectorTruncate( MaximumTransferLength );
+
+		if (Vcb->DeviceMaximumTransfer < PAGE_SIZE)
+		{
+			Vcb->DeviceMaximumTransfer = PAGE_SIZE;
+		}
+
+		Vcb->MaximumTransfer = Vcb->DeviceMaximumTransfer;
+
+		//
+		//  Give the volume buffers to stage unaligned cooked runs in, so a
+		//  long one is a single transfer rather than one per page.
+		//
+
+		StagingBytes = min( CD_STAGING_BYTES, Vcb->DeviceMaximumTransfer );
+
+		if (StagingBytes > PAGE_SIZE)
+		{
+			CdCreateBufferPool( &Vcb->StagingPool,
+			                    CD_STAGING_BUFFERS,
+			                    StagingBytes );
+		}
+
+		//
+		//  Give XA volumes buffers to stage raw reads in, each as large as
+		//  the device takes in one raw transfer.  There's no point unless
+		//  a buffer holds at least two sectors.
+		//
+
+		if (FlagOn( Vcb->VcbState, VCB_STATE_CDXA ))
+		{
+			StagingSectors = min( CD_XA_STAGING_SECTORS, Vcb->MaximumTransferRawSectors );
+			StagingSectors = min( StagingSectors, (Vcb->MaximumPhysicalPages * PAGE_SIZE) / RAW_SECTOR_SIZE );
+
+			if (StagingSectors > 1)
+			{
+				CdCreateBufferPool( &Vcb->XAStagingPool,
+				                    CD_XA_STAGING_BUFFERS,
+				                    StagingSectors * RAW_SECTOR_SIZE );
+			}
 		}
 
 		//
@@ -1156,6 +1306,13 @@ Return Value:
 
 		CdUpdateVcbCondition( Vcb, VcbMounted);
 
+		//
+		//  Start reading the top of the directory tree into the sector
+		//  cache while nobody is using the volume.
+		//
+
+		CdStartWarmUp( IrpContext, Vcb );
+
 		CdReleaseVcb( IrpContext, Vcb );
 		Vcb = NULL;
 
@@ -1613,11 +1770,14 @@ Return Value:
 		}
 
 		//
-		//  The volume is OK, clear the verify bit.
+		//  The volume is OK, clear the verify bit.  Name indexes built
+		//  before the verify are rebuilt on next use.
 		//
 
 		CdUpdateVcbCondition( Vcb, VcbMounted);
 
+		InterlockedIncrement( &Vcb->NameIndexGeneration );
+
 		CdMarkRealDevVerifyOk( Vpb->RealDevice);
 
 		//
@@ -2697,6 +2857,450 @@ Return Value:
 }
 
 
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdQueryReadTrace(
+	_Inout_ PIRP_CONTEXT IrpContext,
+	        _Inout_ PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine returns the volume's read trace.  We copy out as many of
+    the most recent records as fit in the caller's buffer, oldest first.
+    Reads arriving while we copy may overwrite records being returned; the
+    trace is a diagnostic aid and we don't stop the volume to take it.
+
+Arguments:
+
+    Irp - Supplies the Irp to process
+
+Return Value:
+
+    NTSTATUS - The return status for the operation
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+	PFCB Fcb;
+	PCCB Ccb;
+
+	PCD_READ_TRACE ReadTrace;
+	PCDFS_READ_TRACE OutputTrace;
+	ULONG OutputLength;
+	ULONG TotalRecorded;
+	ULONG RecordCount;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	//
+	//  Decode the file object, the only type of opens we accept are
+	//  user volume opens.
+	//
+
+	if (CdDecodeFileObject(IrpContext, IrpSp->FileObject, &Fcb, &Ccb) != UserVolumeOpen)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	OutputTrace = reinterpret_cast<PCDFS_READ_TRACE>(Irp->AssociatedIrp.SystemBuffer);
+	OutputLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
+
+	if ((OutputTrace == NULL) ||
+		(OutputLength < FIELD_OFFSET( CDFS_READ_TRACE, Records )))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	ReadTrace = Fcb->Vcb->ReadTrace;
+
+	if (ReadTrace == NULL)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_NOT_SUPPORTED);
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	//
+	//  Work out how many records we can return.  We want the newest ones,
+	//  limited by both the ring and the output buffer.
+	//
+
+	TotalRecorded = (ULONG)ReadTrace->NextRecord;
+
+	RecordCount = min( TotalRecorded, CD_READ_TRACE_RECORDS );
+	RecordCount = min( RecordCount,
+	                   (OutputLength - FIELD_OFFSET( CDFS_READ_TRACE, Records )) / sizeof( CDFS_READ_TRACE_RECORD ));
+
+	for (Index = 0; Index < RecordCount; Index += 1)
+	{
+		OutputTrace->Records[Index] =
+			ReadTrace->Records[ (TotalRecorded - RecordCount + Index) & (CD_READ_TRACE_RECORDS - 1) ];
+	}
+
+	OutputTrace->RecordCount = RecordCount;
+	OutputTrace->TotalRecorded = TotalRecorded;
+
+	Irp->IoStatus.Information = FIELD_OFFSET( CDFS_READ_TRACE, Records ) +
+		RecordCount * sizeof( CDFS_READ_TRACE_RECORD );
+
+	CdCompleteRequest(IrpContext, Irp, STATUS_SUCCESS);
+	return STATUS_SUCCESS ;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdQuerySectorCache(
+	_Inout_ PIRP_CONTEXT IrpContext,
+	        _Inout_ PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine returns the size and counters of the volume's sector
+    cache.  The cache structure lives as long as the Vcb, so we don't need
+    any lock to sample it.
+
+Arguments:
+
+    Irp - Supplies the Irp to process
+
+Return Value:
+
+    NTSTATUS - The return status for the operation
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+	PFCB Fcb;
+	PCCB Ccb;
+
+	PCD_SECTOR_CACHE SectorCache;
+	PCDFS_SECTOR_CACHE_STATISTICS Statistics;
+	ULONG Class;
+
+	PAGED_CODE();
+
+	//
+	//  Decode the file object, the only type of opens we accept are
+	//  user volume opens.
+	//
+
+	if (CdDecodeFileObject(IrpContext, IrpSp->FileObject, &Fcb, &Ccb) != UserVolumeOpen)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	Statistics = reinterpret_cast<PCDFS_SECTOR_CACHE_STATISTICS>(Irp->AssociatedIrp.SystemBuffer);
+
+	if ((Statistics == NULL) ||
+		(IrpSp->Parameters.FileSystemControl.OutputBufferLength < sizeof( CDFS_SECTOR_CACHE_STATISTICS )))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	RtlZeroMemory( Statistics, sizeof( CDFS_SECTOR_CACHE_STATISTICS ));
+
+	SectorCache = Fcb->Vcb->SectorCache;
+
+	if (SectorCache != NULL)
+	{
+		Statistics->ChunkCount = SectorCache->ChunkCount;
+		Statistics->ChunkSize = CD_SEC_CHUNK_BLOCKS * SECTOR_SIZE;
+		Statistics->Evictions = (ULONG)SectorCache->Evictions;
+
+		for (Class = 0; Class < CDFS_SECTOR_CACHE_CLASSES; Class++)
+		{
+			Statistics->Classes[Class].Hits = (ULONG)SectorCache->Hits[Class];
+			Statistics->Classes[Class].Misses = (ULONG)SectorCache->Misses[Class];
+
+			Statistics->Hits += Statistics->Classes[Class].Hits;
+			Statistics->Misses += Statistics->Classes[Class].Misses;
+		}
+	}
+
+	Irp->IoStatus.Information = sizeof( CDFS_SECTOR_CACHE_STATISTICS );
+
+	CdCompleteRequest(IrpContext, Irp, STATUS_SUCCESS);
+	return STATUS_SUCCESS ;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdQueryIoStatistics(
+	_Inout_ PIRP_CONTEXT IrpContext,
+	        _Inout_ PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine returns the volume's non-cached read counters.  They are
+    sampled without any lock.
+
+Arguments:
+
+    Irp - Supplies the Irp to process
+
+Return Value:
+
+    NTSTATUS - The return status for the operation
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+	PFCB Fcb;
+	PCCB Ccb;
+
+	PCDFS_IO_STATISTICS Statistics;
+
+	PAGED_CODE();
+
+	//
+	//  Decode the file object, the only type of opens we accept are
+	//  user volume opens.
+	//
+
+	if (CdDecodeFileObject(IrpContext, IrpSp->FileObject, &Fcb, &Ccb) != UserVolumeOpen)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	Statistics = reinterpret_cast<PCDFS_IO_STATISTICS>(Irp->AssociatedIrp.SystemBuffer);
+
+	if ((Statistics == NULL) ||
+		(IrpSp->Parameters.FileSystemControl.OutputBufferLength < sizeof( CDFS_IO_STATISTICS )))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	RtlZeroMemory( Statistics, sizeof( CDFS_IO_STATISTICS ));
+
+	Statistics->BounceBufferCount = Fcb->Vcb->BouncePool.BufferCount;
+	Statistics->BounceBufferUses = (ULONG)Fcb->Vcb->BounceBufferUses;
+	Statistics->BounceBufferMisses = (ULONG)Fcb->Vcb->BounceBufferMisses;
+	Statistics->XAStagingBufferCount = Fcb->Vcb->XAStagingPool.BufferCount;
+	Statistics->XAStagedReads = (ULONG)Fcb->Vcb->XAStagedReads;
+	Statistics->XAStagingMisses = (ULONG)Fcb->Vcb->XAStagingMisses;
+	Statistics->BridgedReads = (ULONG)Fcb->Vcb->BridgedReads;
+	Statistics->BridgedGaps = (ULONG)Fcb->Vcb->BridgedGaps;
+	Statistics->BridgedGapBytes = (ULONG)Fcb->Vcb->BridgedGapBytes;
+	Statistics->CoalescedReads = (ULONG)Fcb->Vcb->CoalescedReads;
+	Statistics->WarmUpReads = (ULONG)Fcb->Vcb->WarmUpReads;
+	Statistics->SplitRuns = (ULONG)Fcb->Vcb->SplitRuns;
+
+	RtlCopyMemory( Statistics->Priorities,
+	               Fcb->Vcb->ReadPriorityStatistics,
+	               sizeof( Statistics->Priorities ));
+
+	Statistics->NameLookupMisses = (ULONG)Fcb->Vcb->NameLookupMisses;
+	Statistics->NegativeBloomHits = (ULONG)Fcb->Vcb->NegativeBloomHits;
+	Statistics->NegativeListHits = (ULONG)Fcb->Vcb->NegativeListHits;
+	Statistics->StagingBufferCount = Fcb->Vcb->StagingPool.BufferCount;
+	Statistics->StagedReads = (ULONG)Fcb->Vcb->StagedReads;
+	Statistics->StagingMisses = (ULONG)Fcb->Vcb->StagingMisses;
+
+	Irp->IoStatus.Information = sizeof( CDFS_IO_STATISTICS );
+
+	CdCompleteRequest(IrpContext, Irp, STATUS_SUCCESS);
+	return STATUS_SUCCESS ;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdQueryTuning(
+	_Inout_ PIRP_CONTEXT IrpContext,
+	        _Inout_ PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine returns the current tuning of the volume.
+
+Arguments:
+
+    Irp - Supplies the Irp to process
+
+Return Value:
+
+    NTSTATUS - The return status for the operation
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+	PFCB Fcb;
+	PCCB Ccb;
+
+	PCDFS_VOLUME_TUNING Tuning;
+
+	PAGED_CODE();
+
+	//
+	//  Decode the file object, the only type of opens we accept are
+	//  user volume opens.
+	//
+
+	if (CdDecodeFileObject(IrpContext, IrpSp->FileObject, &Fcb, &Ccb) != UserVolumeOpen)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	Tuning = reinterpret_cast<PCDFS_VOLUME_TUNING>(Irp->AssociatedIrp.SystemBuffer);
+
+	if ((Tuning == NULL) ||
+		(IrpSp->Parameters.FileSystemControl.OutputBufferLength < sizeof( CDFS_VOLUME_TUNING )))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	RtlZeroMemory( Tuning, sizeof( CDFS_VOLUME_TUNING ));
+
+	Tuning->MaxQueueDepth = Fcb->Vcb->MaxQueueDepth;
+	Tuning->InterleaveBridgeBytes = Fcb->Vcb->InterleaveBridgeBytes;
+	Tuning->WarmUpLevels = Fcb->Vcb->WarmUpLevels;
+	Tuning->MaxTransferLength = Fcb->Vcb->MaximumTransfer;
+
+	Irp->IoStatus.Information = sizeof( CDFS_VOLUME_TUNING );
+
+	CdCompleteRequest(IrpContext, Irp, STATUS_SUCCESS);
+	return STATUS_SUCCESS ;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdSetTuning(
+	_Inout_ PIRP_CONTEXT IrpContext,
+	        _Inout_ PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+    This routine applies new tuning to the volume.  Every value is checked
+    before any is applied.  Reads already in progress keep the values they
+    started with.  The tuning applies to every user of the volume, so the
+    caller must have SeManageVolumePrivilege.
+
+Arguments:
+
+    Irp - Supplies the Irp to process
+
+Return Value:
+
+    NTSTATUS - The return status for the operation
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+	PFCB Fcb;
+	PCCB Ccb;
+
+	PCDFS_VOLUME_TUNING Tuning;
+
+	LUID ManageVolumePrivilege = {SE_MANAGE_VOLUME_PRIVILEGE, 0};
+
+	PAGED_CODE();
+
+	//
+	//  Decode the file object, the only type of opens we accept are
+	//  user volume opens.
+	//
+
+	if (CdDecodeFileObject(IrpContext, IrpSp->FileObject, &Fcb, &Ccb) != UserVolumeOpen)
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	//
+	//  Check for the correct security access.
+	//  The caller must have the SeManageVolumePrivilege.
+	//
+
+	if (!SeSinglePrivilegeCheck(ManageVolumePrivilege, Irp->RequestorMode))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_PRIVILEGE_NOT_HELD);
+		return STATUS_PRIVILEGE_NOT_HELD;
+	}
+
+	Tuning = reinterpret_cast<PCDFS_VOLUME_TUNING>(Irp->AssociatedIrp.SystemBuffer);
+
+	if ((Tuning == NULL) ||
+		(IrpSp->Parameters.FileSystemControl.InputBufferLength < sizeof( CDFS_VOLUME_TUNING )))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	if ((Tuning->MaxQueueDepth == 0) ||
+		(Tuning->MaxQueueDepth > CDFS_MAX_QUEUE_DEPTH) ||
+		(Tuning->InterleaveBridgeBytes > CDFS_MAX_INTERLEAVE_BRIDGE) ||
+		((Tuning->MaxTransferLength != 0) &&
+			((Tuning->MaxTransferLength < CDFS_MIN_TRANSFER_LENGTH) ||
+				(Tuning->MaxTransferLength > Fcb->Vcb->DeviceMaximumTransfer) ||
+				FlagOn( Tuning->MaxTransferLength, SECTOR_MASK ))) ||
+		(Tuning->WarmUpLevels > CDFS_MAX_WARM_UP_LEVELS))
+	{
+		CdCompleteRequest(IrpContext, Irp, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER ;
+	}
+
+	Fcb->Vcb->MaxQueueDepth = Tuning->MaxQueueDepth;
+	Fcb->Vcb->InterleaveBridgeBytes = Tuning->InterleaveBridgeBytes;
+	Fcb->Vcb->MaximumTransfer = (Tuning->MaxTransferLength != 0) ?
+		Tuning->MaxTransferLength : Fcb->Vcb->DeviceMaximumTransfer;
+	Fcb->Vcb->WarmUpLevels = Tuning->WarmUpLevels;
+
+	CdCompleteRequest(IrpContext, Irp, STATUS_SUCCESS);
+	return STATUS_SUCCESS ;
+}
+
+
 //
 //  Local support routine
 //
@@ -15,23 +15,61 @@ Abstract:
 
 #include "CdProcs.h"
 
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
 //
 //  The Bug check file id for this module
 //
 
 #define BugCheckFileId                   (CDFS_BUG_CHECK_NAMESUP)
 
+//
+//  WCHAR
+//  CdUpcaseAsciiChar (
+//      _In_ WCHAR Char
+//      );
+//
+//  Upcases a character below 0x80, for which the system upcase table only
+//  changes the lower case letters.
+//
+
+#define CdUpcaseAsciiChar(C)                                        \
+    ((WCHAR) ((((C) >= L'a') && ((C) <= L'z')) ? ((C) - (L'a' - L'A')) : (C)))
+
+//
+//  Local support routines
+//
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+	NTSTATUS
+	CdUpcaseUnicodeString(
+		_Inout_ PUNICODE_STRING Destination,
+		     _In_ PCUNICODE_STRING Source
+	);
+
+#if defined(__cplusplus)
+}
+#endif
+
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CdClassifyNameExpression)
 #pragma alloc_text(PAGE, CdConvertBigToLittleEndian)
 #pragma alloc_text(PAGE, CdConvertNameToCdName)
 #pragma alloc_text(PAGE, CdDissectName)
 #pragma alloc_text(PAGE, CdGenerate8dot3Name)
 #pragma alloc_text(PAGE, CdFullCompareNames)
+#pragma alloc_text(PAGE, CdHashName)
 #pragma alloc_text(PAGE, CdIsLegalName)
 #pragma alloc_text(PAGE, CdIs8dot3Name)
 #pragma alloc_text(PAGE, CdIsNameInExpression)
 #pragma alloc_text(PAGE, CdShortNameDirentOffset)
 #pragma alloc_text(PAGE, CdUpcaseName)
+#pragma alloc_text(PAGE, CdUpcaseUnicodeString)
 #endif
 
 
@@ -119,9 +157,9 @@ CdConvertBigToLittleEndian(
 Routine Description:
 
     This routine is called to convert a unicode string in big endian to
-    little endian.  We start by copying all of the source bytes __except
-    the first.  This will put the low order bytes in the correct position.
-    We then copy each high order byte in its correct position.
+    little endian by swapping the bytes of each character.  On x64 we swap
+    eight characters at a time with SSE2, and do any remaining characters
+    one at a time.
 
 Arguments:
 
@@ -143,6 +181,10 @@ Return Value:
 	PCHAR Source = BigEndian;
 	PCHAR Destination = LittleEndian;
 
+#if defined(_M_AMD64)
+	__m128i Chars;
+#endif
+
 	PAGED_CODE();
 
 	//
@@ -154,26 +196,36 @@ Return Value:
 		CdRaiseStatus( IrpContext, STATUS_DISK_CORRUPT_ERROR );
 	}
 
+#if defined(_M_AMD64)
+
 	//
-	//  Start by copy the low-order bytes into the correct position.  Do
-	//  this by skipping the first byte in the BigEndian string.
+	//  Swap the bytes of eight characters at a time.
 	//
 
-	RtlCopyMemory( Destination,
-		Source + 1,
-		RemainingByteCount - 1 );
+	while (RemainingByteCount >= sizeof( __m128i ))
+	{
+		Chars = _mm_loadu_si128( reinterpret_cast<const __m128i*>(Source) );
+		Chars = _mm_or_si128( _mm_slli_epi16( Chars, 8 ), _mm_srli_epi16( Chars, 8 ));
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(Destination), Chars );
+
+		Source += sizeof( __m128i );
+		Destination += sizeof( __m128i );
+
+		RemainingByteCount -= sizeof( __m128i );
+	}
+
+#endif
 
 	//
-	//  Now move the high-order bytes into position.
+	//  Now swap the bytes of the remaining characters.
 	//
 
-	Destination += 1;
-
 	while (RemainingByteCount != 0)
 	{
 #pragma prefast(push)
 #pragma prefast(suppress:26014, "RemainingByteCount is even")
-		*Destination = *Source;
+		Destination[0] = Source[1];
+		Destination[1] = Source[0];
 #pragma prefast(pop)
 
 		Source += 2;
@@ -262,9 +314,8 @@ Return Value:
 	//  Upcase the string using the correct upcase routine.
 	//
 
-	Status = RtlUpcaseUnicodeString(&UpcaseName->FileName,
-	                                &Name->FileName,
-	                                FALSE);
+	Status = CdUpcaseUnicodeString(&UpcaseName->FileName,
+	                               &Name->FileName);
 
 	//
 	//  This should never fail.
@@ -275,9 +326,8 @@ Return Value:
 
 	if (Name->VersionString.Length != 0)
 	{
-		Status = RtlUpcaseUnicodeString(&UpcaseName->VersionString,
-		                                &Name->VersionString,
-		                                FALSE);
+		Status = CdUpcaseUnicodeString(&UpcaseName->VersionString,
+		                               &Name->VersionString);
 
 		//
 		//  This should never fail.
@@ -847,7 +897,10 @@ Routine Description:
     is to be a case-insensitive search then they are already upcased.
 
     We compare the filename portions of the name and if they match we
-    compare the version strings if requested.
+    compare the version strings if requested.  Name expressions which
+    CdClassifyNameExpression found to be a simple prefix or suffix match
+    are compared directly, and any other wild card expression is handed to
+    FsRtlIsNameInExpression.
 
 Arguments:
 
@@ -870,16 +923,42 @@ Return Value:
 
 {
 	BOOLEAN Match = TRUE;
+	ULONG LiteralLength;
+
 	PAGED_CODE();
 
 	UNREFERENCED_PARAMETER( IrpContext );
 
 	//
-	//  If there are wildcards in the expression then we call the
-	//  appropriate FsRtlRoutine.
+	//  If the expression is a literal with a '*' at one end then compare
+	//  the literal against the same end of the name.
 	//
 
-	if (FlagOn( WildcardFlags, CCB_FLAG_ENUM_NAME_EXP_HAS_WILD ))
+	if (FlagOn( WildcardFlags, CCB_FLAG_ENUM_NAME_EXP_PREFIX | CCB_FLAG_ENUM_NAME_EXP_SUFFIX ))
+	{
+		LiteralLength = SearchExpression->FileName.Length - sizeof( WCHAR );
+
+		if ((CurrentName->FileName.Length < LiteralLength) ||
+			(FlagOn( WildcardFlags, CCB_FLAG_ENUM_NAME_EXP_PREFIX ) &&
+				!RtlEqualMemory( CurrentName->FileName.Buffer,
+					SearchExpression->FileName.Buffer,
+					LiteralLength )) ||
+			(FlagOn( WildcardFlags, CCB_FLAG_ENUM_NAME_EXP_SUFFIX ) &&
+				!RtlEqualMemory( Add2Ptr( CurrentName->FileName.Buffer,
+						CurrentName->FileName.Length - LiteralLength,
+						PVOID ),
+					SearchExpression->FileName.Buffer + 1,
+					LiteralLength )))
+		{
+			Match = FALSE;
+		}
+
+		//
+		//  If there are other wildcards in the expression then we call the
+		//  appropriate FsRtlRoutine.
+		//
+	}
+	else if (FlagOn( WildcardFlags, CCB_FLAG_ENUM_NAME_EXP_HAS_WILD ))
 	{
 		Match = FsRtlIsNameInExpression(&SearchExpression->FileName,
 		                                &CurrentName->FileName,
@@ -941,6 +1020,87 @@ Return Value:
 }
 
 
+ULONG
+CdClassifyNameExpression(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PUNICODE_STRING Expression
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called when a directory enumeration stores its search
+    expression, to find out whether the name part can be matched without
+    FsRtlIsNameInExpression.  That is the case for a literal followed by
+    '*', which matches the names starting with the literal, and for '*'
+    followed by a literal, which matches the names ending with it.
+
+    Win32 sends "*.ext" as DOS_STAR followed by ".ext".  DOS_STAR matches
+    everything up to the last '.' in the name, so when the literal starts
+    with the only '.' in it this is also a suffix match.
+
+Arguments:
+
+    Expression - Name part of the search expression, which has wild cards.
+
+Return Value:
+
+    ULONG - CCB_FLAG_ENUM_NAME_EXP_PREFIX or CCB_FLAG_ENUM_NAME_EXP_SUFFIX
+        if the expression is one of these, zero otherwise.
+
+--*/
+
+{
+	ULONG CharCount = Expression->Length / sizeof( WCHAR );
+	ULONG WildCount = 0;
+	ULONG DotCount = 0;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	//
+	//  Count the wild cards and periods.  A simple expression has a single
+	//  wild card at one end.
+	//
+
+	for (Index = 0; Index < CharCount; Index += 1)
+	{
+		if (FsRtlIsUnicodeCharacterWild( Expression->Buffer[Index] ))
+		{
+			WildCount += 1;
+		}
+		else if (Expression->Buffer[Index] == L'.')
+		{
+			DotCount += 1;
+		}
+	}
+
+	if ((CharCount == 0) || (WildCount != 1))
+	{
+		return 0;
+	}
+
+	if (Expression->Buffer[CharCount - 1] == L'*')
+	{
+		return CCB_FLAG_ENUM_NAME_EXP_PREFIX;
+	}
+
+	if ((Expression->Buffer[0] == L'*') ||
+		((Expression->Buffer[0] == DOS_STAR) &&
+			(CharCount > 1) &&
+			(Expression->Buffer[1] == L'.') &&
+			(DotCount == 1)))
+	{
+		return CCB_FLAG_ENUM_NAME_EXP_SUFFIX;
+	}
+
+	return 0;
+}
+
+
 ULONG
 CdShortNameDirentOffset(
 	_In_ PIRP_CONTEXT IrpContext,
@@ -1126,3 +1286,155 @@ Return Value:
 
 	return Result;
 }
+
+
+ULONG
+CdHashName(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PUNICODE_STRING Name
+)
+
+/*++
+
+Routine Description:
+
+    This routine computes the hash of a name for the in-memory name tables.
+    The name is upcased as it is hashed, so a name hashes the same in any
+    case and the hash of an exact case name matches that of its upcased
+    form.
+
+Arguments:
+
+    Name - Name to hash, without any version.
+
+Return Value:
+
+    ULONG - The hash of the name.
+
+--*/
+
+{
+	ULONG Hash = 2166136261;
+	ULONG Count;
+	WCHAR Char;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	for (Count = 0; Count < Name->Length / sizeof( WCHAR ); Count++)
+	{
+		Char = Name->Buffer[Count];
+
+		if (Char < 0x80)
+		{
+			Char = CdUpcaseAsciiChar( Char );
+		}
+		else
+		{
+			Char = RtlUpcaseUnicodeChar( Char );
+		}
+
+		Hash = (Hash ^ Char) * 16777619;
+	}
+
+	return Hash;
+}
+
+
+//
+//  Local support routine
+//
+
+NTSTATUS
+CdUpcaseUnicodeString(
+	_Inout_ PUNICODE_STRING Destination,
+	     _In_ PCUNICODE_STRING Source
+)
+
+/*++
+
+Routine Description:
+
+    This routine upcases a string like RtlUpcaseUnicodeString without
+    allocating the destination.  Names made up of characters below 0x80,
+    which covers nearly all names on a disc, are upcased here, eight
+    characters at a time on x64.  We hand any other name to
+    RtlUpcaseUnicodeString to use the system upcase table.  The strings may
+    be the same, and a name we give up on partway is simply upcased again.
+
+Arguments:
+
+    Destination - String to store the upcased name in.
+
+    Source - Name to upcase.
+
+Return Value:
+
+    NTSTATUS - The result of the upcase.
+
+--*/
+
+{
+	PCWCH SourceChar = Source->Buffer;
+	PWCH DestinationChar = Destination->Buffer;
+	ULONG RemainingChars = Source->Length / sizeof( WCHAR );
+
+#if defined(_M_AMD64)
+	__m128i Chars;
+	__m128i Lower;
+#endif
+
+	PAGED_CODE();
+
+	if (Source->Length > Destination->MaximumLength)
+	{
+		return RtlUpcaseUnicodeString( Destination, Source, FALSE );
+	}
+
+#if defined(_M_AMD64)
+
+	while (RemainingChars >= sizeof( __m128i ) / sizeof( WCHAR ))
+	{
+		Chars = _mm_loadu_si128( reinterpret_cast<const __m128i*>(SourceChar) );
+
+		if (_mm_movemask_epi8( _mm_cmpeq_epi16( _mm_and_si128( Chars, _mm_set1_epi16( (SHORT) 0xff80 )),
+			_mm_setzero_si128() )) != 0xffff)
+		{
+			return RtlUpcaseUnicodeString( Destination, Source, FALSE );
+		}
+
+		Lower = _mm_and_si128( _mm_cmpgt_epi16( Chars, _mm_set1_epi16( L'a' - 1 )),
+			_mm_cmplt_epi16( Chars, _mm_set1_epi16( L'z' + 1 )));
+
+		Chars = _mm_sub_epi16( Chars, _mm_and_si128( Lower, _mm_set1_epi16( L'a' - L'A' )));
+
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(DestinationChar), Chars );
+
+		SourceChar += sizeof( __m128i ) / sizeof( WCHAR );
+		DestinationChar += sizeof( __m128i ) / sizeof( WCHAR );
+
+		RemainingChars -= sizeof( __m128i ) / sizeof( WCHAR );
+	}
+
+#endif
+
+	while (RemainingChars != 0)
+	{
+		if (*SourceChar >= 0x80)
+		{
+			return RtlUpcaseUnicodeString( Destination, Source, FALSE );
+		}
+
+		*DestinationChar = CdUpcaseAsciiChar( *SourceChar );
+
+		SourceChar += 1;
+		DestinationChar += 1;
+
+		RemainingChars -= 1;
+	}
+
+	Destination->Length = Source->Length;
+
+	return STATUS_SUCCESS;
+}
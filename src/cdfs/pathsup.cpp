@@ -70,6 +70,11 @@ Abstract:
             to convert to little endian.  We assume that directories
             don't have version numbers.
 
+    At mount we read the whole path table into a CD_PATH_INDEX.  When it is
+    present, path entries are filled in from the index rather than from the
+    mapped path table, and the children of a directory are found by a hash
+    probe on the parent ordinal and name instead of a scan.
+
 
 --*/
 
@@ -96,6 +101,18 @@ Abstract:
 #define CdRawPathEntry(IC, PC)      \
     Add2Ptr( (PC)->Data, (PC)->DataOffset, PRAW_PATH_ENTRY )
 
+//
+//  ULONG
+//  CdPathIndexBucket (
+//      _In_ PCD_PATH_INDEX PathIndex,
+//      _In_ ULONG ParentOrdinal,
+//      _In_ ULONG Hash
+//      );
+//
+
+#define CdPathIndexBucket(PI, P, H)     \
+    (((H) ^ ((P) * 0x9E3779B1)) & ((PI)->BucketCount - 1))
+
 //
 //  Local support routines
 //
@@ -112,6 +129,14 @@ extern "C"
 		     _Inout_ PPATH_ENUM_CONTEXT PathContext
 	);
 
+	VOID
+	CdPathEntryFromIndex(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PCD_PATH_INDEX PathIndex,
+		     _In_ ULONG Ordinal,
+		     _Out_ PPATH_ENTRY PathEntry
+	);
+
 	_Success_(return != FALSE)
 	BOOLEAN
 	CdUpdatePathEntryFromRawPathEntry(
@@ -127,10 +152,12 @@ extern "C"
 #endif
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CdBuildPathIndex)
 #pragma alloc_text(PAGE, CdFindPathEntry)
 #pragma alloc_text(PAGE, CdLookupPathEntry)
 #pragma alloc_text(PAGE, CdLookupNextPathEntry)
 #pragma alloc_text(PAGE, CdMapPathTableBlock)
+#pragma alloc_text(PAGE, CdPathEntryFromIndex)
 #pragma alloc_text(PAGE, CdUpdatePathEntryFromRawPathEntry)
 #pragma alloc_text(PAGE, CdUpdatePathEntryName)
 #endif
@@ -174,10 +201,26 @@ Return Value:
 
 {
 	PPATH_ENUM_CONTEXT PathContext = &CompoundPathEntry->PathContext;
+	PCD_PATH_INDEX PathIndex = IrpContext->Vcb->PathIndex;
 	LONGLONG CurrentBaseOffset;
 
 	PAGED_CODE();
 
+	//
+	//  If the index has an entry with this ordinal at this offset then
+	//  take it from there.  We leave the path context empty, which tells
+	//  CdLookupNextPathEntry to carry on through the index.
+	//
+
+	if ((PathIndex != NULL) &&
+		(Ordinal != 0) &&
+		(Ordinal <= PathIndex->EntryCount) &&
+		(PathIndex->Entries[Ordinal - 1].PathTableOffset == PathEntryOffset))
+	{
+		CdPathEntryFromIndex(IrpContext, PathIndex, Ordinal, &CompoundPathEntry->PathEntry);
+		return;
+	}
+
 	//
 	//  Compute the starting base and starting path table offset.
 	//
@@ -248,10 +291,27 @@ Return Value:
 --*/
 
 {
+	PCD_PATH_INDEX PathIndex = IrpContext->Vcb->PathIndex;
 	LONGLONG CurrentBaseOffset;
 
 	PAGED_CODE();
 
+	//
+	//  If the scan started in the index then the next entry is simply the
+	//  next ordinal.
+	//
+
+	if ((PathContext->Data == NULL) && (PathIndex != NULL))
+	{
+		if (PathEntry->Ordinal >= PathIndex->EntryCount)
+		{
+			return FALSE;
+		}
+
+		CdPathEntryFromIndex(IrpContext, PathIndex, PathEntry->Ordinal + 1, PathEntry);
+		return TRUE;
+	}
+
 	//
 	//  Get the offset of the next path entry within the current
 	//  data block.
@@ -349,6 +409,11 @@ Return Value:
 	ULONG StartingOffset;
 	ULONG StartingOrdinal;
 
+	PCD_PATH_INDEX PathIndex = ParentFcb->Vcb->PathIndex;
+	PCD_PATH_INDEX_ENTRY IndexEntry;
+	ULONG Ordinal;
+	ULONG Hash;
+
 	PAGED_CODE();
 
 	//
@@ -375,6 +440,42 @@ Return Value:
 		CdRaiseStatus( IrpContext, STATUS_DISK_CORRUPT_ERROR );
 	}
 
+	//
+	//  If we have the path table in memory then probe its hash table for
+	//  children of this directory with this name.
+	//
+
+	if (PathIndex != NULL)
+	{
+		Hash = CdHashName( IrpContext, &DirName->FileName );
+		Ordinal = PathIndex->Buckets[ CdPathIndexBucket( PathIndex, ParentFcb->Index.Ordinal, Hash )];
+
+		while (Ordinal != 0)
+		{
+			IndexEntry = &PathIndex->Entries[Ordinal - 1];
+
+			if ((IndexEntry->Hash == Hash) &&
+				(IndexEntry->ParentOrdinal == ParentFcb->Index.Ordinal))
+			{
+				CdPathEntryFromIndex(IrpContext, PathIndex, Ordinal, &CompoundPathEntry->PathEntry);
+				CdUpdatePathEntryName(IrpContext, &CompoundPathEntry->PathEntry, IgnoreCase);
+
+				if (CdIsNameInExpression(IrpContext,
+				                         &CompoundPathEntry->PathEntry.CdCaseDirName,
+				                         DirName,
+				                         0,
+				                         FALSE))
+				{
+					return TRUE;
+				}
+			}
+
+			Ordinal = IndexEntry->NextOrdinal;
+		}
+
+		return FALSE;
+	}
+
 	CdLockFcb( IrpContext, ParentFcb );
 
 	if (ParentFcb->Index.ChildPathTableOffset != 0)
@@ -484,6 +585,292 @@ Return Value:
 }
 
 
+VOID
+CdBuildPathIndex(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PVCB Vcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called at mount to read the path table into an in-memory
+    index, see CD_PATH_INDEX.  We walk the table twice, once to size the
+    index and once to fill it in, and then drop the path table's pages from
+    the cache since lookups no longer map them.
+
+    The index is an optimization.  If we can't allocate it, the table is too
+    large, memory is low or we can't read all of it then we leave
+    Vcb->PathIndex NULL and the path table is walked on the disk as needed.
+    Only errors which mean the media has gone or changed are passed on to
+    fail the mount.
+
+Arguments:
+
+    Vcb - Vcb for the volume being mounted.  The path table Fcb and its
+        stream file have been created.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	COMPOUND_PATH_ENTRY CompoundPathEntry;
+	PPATH_ENTRY PathEntry = &CompoundPathEntry.PathEntry;
+
+	PCD_PATH_INDEX PathIndex = NULL;
+	PCD_PATH_INDEX_ENTRY IndexEntry;
+
+	ULONG EntryCount = 0;
+	ULONG NameBytes = 0;
+	ULONG NameLimit = 0;
+	ULONG BucketCount;
+	ULONG AllocationSize;
+	ULONG Bucket;
+	ULONG Ordinal;
+	ULONG Pass;
+
+	PAGED_CODE();
+
+	ASSERT_IRP_CONTEXT( IrpContext );
+	ASSERT_VCB( Vcb );
+
+	NT_ASSERT( Vcb->PathIndex == NULL );
+
+	//
+	//  Don't take pool for the index while memory is low.
+	//
+
+	if (CdIsMemoryLow())
+	{
+		return;
+	}
+
+	CdInitializeCompoundPathEntry( IrpContext, &CompoundPathEntry );
+
+	__try
+	{
+		__try
+		{
+			for (Pass = 0; Pass < 2; Pass += 1)
+			{
+				CdLookupPathEntry(IrpContext,
+				                  Vcb->PathTableFcb->Index.StreamOffset,
+				                  1,
+				                  TRUE,
+				                  &CompoundPathEntry);
+
+				do
+				{
+					if (Pass == 0)
+					{
+						EntryCount += 1;
+						NameBytes += PathEntry->DirNameLen;
+
+						if (EntryCount > CD_PATH_INDEX_MAX_ENTRIES)
+						{
+							__leave;
+						}
+					}
+					else
+					{
+						//
+						//  The table can't have changed, but don't trust it.
+						//
+
+						if ((PathEntry->Ordinal > PathIndex->EntryCount) ||
+							(NameBytes + PathEntry->DirNameLen > NameLimit))
+						{
+							__leave;
+						}
+
+						IndexEntry = &PathIndex->Entries[PathEntry->Ordinal - 1];
+
+						IndexEntry->PathTableOffset = PathEntry->PathTableOffset;
+						IndexEntry->DiskOffset = PathEntry->DiskOffset;
+						IndexEntry->ParentOrdinal = PathEntry->ParentOrdinal;
+						IndexEntry->NameOffset = NameBytes;
+						IndexEntry->DirNameLen = PathEntry->DirNameLen;
+
+						RtlCopyMemory( PathIndex->Names + NameBytes,
+							PathEntry->DirName,
+							PathEntry->DirNameLen );
+
+						NameBytes += PathEntry->DirNameLen;
+
+						//
+						//  The root isn't anyone's child, so only hash the others.
+						//
+
+						if (PathEntry->Ordinal != 1)
+						{
+							CdUpdatePathEntryName(IrpContext, PathEntry, FALSE);
+							IndexEntry->Hash = CdHashName( IrpContext, &PathEntry->CdDirName.FileName );
+						}
+					}
+				}
+				while (CdLookupNextPathEntry(IrpContext,
+				                             &CompoundPathEntry.PathContext,
+				                             PathEntry));
+
+				if (Pass == 0)
+				{
+					//
+					//  Size the hash table at one bucket per directory,
+					//  rounded up to a power of two.
+					//
+
+					for (BucketCount = 1; BucketCount < EntryCount; BucketCount *= 2)
+					{
+						NOTHING;
+					}
+
+					AllocationSize = sizeof( CD_PATH_INDEX ) +
+					                 EntryCount * sizeof( CD_PATH_INDEX_ENTRY ) +
+					                 BucketCount * sizeof( ULONG ) +
+					                 NameBytes;
+
+					if (AllocationSize > CD_PATH_INDEX_MAX_BYTES)
+					{
+						__leave;
+					}
+
+					PathIndex = reinterpret_cast<PCD_PATH_INDEX>( ExAllocatePoolWithTagPriority( CdPagedPool,
+						AllocationSize,
+						TAG_PATH_INDEX,
+						LowPoolPriority ));
+
+					if (PathIndex == NULL)
+					{
+						__leave;
+					}
+
+					RtlZeroMemory( PathIndex,
+						sizeof( CD_PATH_INDEX ) +
+						EntryCount * sizeof( CD_PATH_INDEX_ENTRY ) +
+						BucketCount * sizeof( ULONG ));
+
+					PathIndex->EntryCount = EntryCount;
+					PathIndex->BucketCount = BucketCount;
+					PathIndex->Entries = reinterpret_cast<PCD_PATH_INDEX_ENTRY>( PathIndex + 1 );
+					PathIndex->Buckets = reinterpret_cast<PULONG>( PathIndex->Entries + EntryCount );
+					PathIndex->Names = reinterpret_cast<PCHAR>( PathIndex->Buckets + BucketCount );
+
+					NameLimit = NameBytes;
+					NameBytes = 0;
+
+					CdCleanupCompoundPathEntry( IrpContext, &CompoundPathEntry );
+					CdInitializeCompoundPathEntry( IrpContext, &CompoundPathEntry );
+				}
+			}
+
+			//
+			//  Chain the directories into the hash table.  We push them on
+			//  the front of the chains, so go backwards to leave them in
+			//  path table order.
+			//
+
+			for (Ordinal = PathIndex->EntryCount; Ordinal > 1; Ordinal -= 1)
+			{
+				IndexEntry = &PathIndex->Entries[Ordinal - 1];
+				Bucket = CdPathIndexBucket( PathIndex, IndexEntry->ParentOrdinal, IndexEntry->Hash );
+
+				IndexEntry->NextOrdinal = PathIndex->Buckets[Bucket];
+				PathIndex->Buckets[Bucket] = Ordinal;
+			}
+
+			Vcb->PathIndex = PathIndex;
+			PathIndex = NULL;
+		}
+		__except ((FsRtlIsNtstatusExpected( GetExceptionCode() ) &&
+		           !IoIsErrorUserInduced( GetExceptionCode() )) ?
+		          EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+		{
+			//
+			//  A corrupt table, an unreadable sector or a lack of pool is
+			//  left to the lookups which reach it to fail.
+			//
+
+			IrpContext->ExceptionStatus = STATUS_SUCCESS;
+		}
+	}
+	__finally
+	{
+		CdCleanupCompoundPathEntry( IrpContext, &CompoundPathEntry );
+		CdFreePool(reinterpret_cast<PVOID*>(&PathIndex));
+	}
+
+	//
+	//  Nothing maps the path table now, so let its pages go.
+	//
+
+	if (Vcb->PathIndex != NULL)
+	{
+		CcPurgeCacheSection(&Vcb->PathTableFcb->FcbNonpaged->SegmentObject,
+		                    NULL,
+		                    0,
+		                    FALSE);
+	}
+}
+
+
+//
+//  Local support routine
+//
+
+VOID
+CdPathEntryFromIndex(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PCD_PATH_INDEX PathIndex,
+	     _In_ ULONG Ordinal,
+	     _Out_ PPATH_ENTRY PathEntry
+)
+
+/*++
+
+Routine Description:
+
+    This routine fills in a path entry from the path index, as
+    CdUpdatePathEntryFromRawPathEntry would from the disk.  The name isn't
+    converted, and DirName points to the raw bytes kept in the index.
+
+Arguments:
+
+    PathIndex - Index for the volume.
+
+    Ordinal - Ordinal of the entry to return.  It must be in the index.
+
+    PathEntry - Pointer to the in-memory path entry structure.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	PCD_PATH_INDEX_ENTRY IndexEntry = &PathIndex->Entries[Ordinal - 1];
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	NT_ASSERT( (Ordinal != 0) && (Ordinal <= PathIndex->EntryCount) );
+
+	PathEntry->Ordinal = Ordinal;
+	PathEntry->PathTableOffset = IndexEntry->PathTableOffset;
+	PathEntry->DiskOffset = IndexEntry->DiskOffset;
+	PathEntry->ParentOrdinal = IndexEntry->ParentOrdinal;
+	PathEntry->DirNameLen = IndexEntry->DirNameLen;
+	PathEntry->DirName = PathIndex->Names + IndexEntry->NameOffset;
+
+	PathEntry->PathEntryLength = WordAlign( IndexEntry->DirNameLen + MIN_RAW_PATH_ENTRY_LEN - 1 );
+}
+
+
 //
 //  Local support routine
 //
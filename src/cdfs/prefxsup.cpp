@@ -32,14 +32,22 @@ extern "C"
 	PNAME_LINK
 	CdFindNameLink(
 		_In_ PIRP_CONTEXT IrpContext,
-		     _In_ PRTL_SPLAY_LINKS* RootNode,
-		     _In_ PUNICODE_STRING Name
+		     _In_opt_ PCD_PREFIX_TABLE Table,
+		     _In_ PUNICODE_STRING Name,
+		     _In_ ULONG Hash
 	);
 
 	BOOLEAN
 	CdInsertNameLink(
 		_In_ PIRP_CONTEXT IrpContext,
-		     _Inout_ PRTL_SPLAY_LINKS* RootNode,
+		     _Inout_ PCD_PREFIX_TABLE* Table,
+		     _In_ PNAME_LINK NameLink
+	);
+
+	VOID
+	CdRemoveNameLink(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _Inout_ PCD_PREFIX_TABLE* Table,
 		     _In_ PNAME_LINK NameLink
 	);
 
@@ -52,6 +60,7 @@ extern "C"
 #pragma alloc_text(PAGE, CdFindPrefix)
 #pragma alloc_text(PAGE, CdInsertNameLink)
 #pragma alloc_text(PAGE, CdInsertPrefix)
+#pragma alloc_text(PAGE, CdRemoveNameLink)
 #pragma alloc_text(PAGE, CdRemovePrefix)
 #endif
 
@@ -70,12 +79,12 @@ CdInsertPrefix(
 
 Routine Description:
 
-    This routine inserts the names in the given Lcb into the links for the
-    parent.
+    This routine inserts the names in the given Lcb into the prefix tables
+    of the parent.
 
 Arguments:
 
-    Fcb - This is the Fcb whose name is being inserted into the tree.
+    Fcb - This is the Fcb whose name is being inserted into the table.
 
     Name - This is the name for the component.  The IgnoreCase flag tells
         us which entry this belongs to.
@@ -84,7 +93,8 @@ Arguments:
 
     ShortNameMatch - Indicates if this is the short name.
 
-    ParentFcb - This is the ParentFcb.  The prefix tree is attached to this.
+    ParentFcb - This is the ParentFcb.  The prefix tables are attached to
+        this.  It is held exclusively.
 
 Return Value:
 
@@ -96,7 +106,7 @@ Return Value:
 	ULONG PrefixFlags;
 	PNAME_LINK NameLink;
 	PPREFIX_ENTRY PrefixEntry;
-	PRTL_SPLAY_LINKS* TreeRoot;
+	PCD_PREFIX_TABLE* Table;
 
 	PWCHAR NameBuffer;
 
@@ -137,17 +147,17 @@ Return Value:
 	{
 		PrefixFlags = PREFIX_FLAG_IGNORE_CASE_IN_TREE;
 		NameLink = &PrefixEntry->IgnoreCaseName;
-		TreeRoot = &ParentFcb->Index.IgnoreCaseRoot;
+		Table = &ParentFcb->Index.IgnoreCaseTable;
 	}
 	else
 	{
 		PrefixFlags = PREFIX_FLAG_EXACT_CASE_IN_TREE;
 		NameLink = &PrefixEntry->ExactCaseName;
-		TreeRoot = &ParentFcb->Index.ExactCaseRoot;
+		Table = &ParentFcb->Index.ExactCaseTable;
 	}
 
 	//
-	//  If neither name is in the tree then check whether we have a buffer for this
+	//  If neither name is in a table then check whether we have a buffer for this
 	//  name
 	//
 
@@ -198,15 +208,17 @@ Return Value:
 	if (!FlagOn( PrefixEntry->PrefixFlags, PrefixFlags ))
 	{
 		//
-		//  Initialize the name in the prefix entry.
+		//  Initialize the name and its hash in the prefix entry.
 		//
 
 		RtlCopyMemory( NameLink->FileName.Buffer,
 			Name->FileName.Buffer,
 			Name->FileName.Length );
 
+		NameLink->Hash = CdHashName(IrpContext, &NameLink->FileName);
+
 		CdInsertNameLink(IrpContext,
-		                 TreeRoot,
+		                 Table,
 		                 NameLink);
 
 		PrefixEntry->Fcb = Fcb;
@@ -232,7 +244,8 @@ Routine Description:
 
 Arguments:
 
-    Fcb - Fcb whose entries are to be removed.
+    Fcb - Fcb whose entries are to be removed.  The parent is held
+        exclusively.
 
 Return Value:
 
@@ -243,8 +256,6 @@ Return Value:
 {
 	PAGED_CODE();
 
-	UNREFERENCED_PARAMETER( IrpContext );
-
 	//
 	//  Start with the short name prefix entry.
 	//
@@ -253,12 +264,16 @@ Return Value:
 	{
 		if (FlagOn( Fcb->ShortNamePrefix->PrefixFlags, PREFIX_FLAG_IGNORE_CASE_IN_TREE ))
 		{
-			Fcb->ParentFcb->Index.IgnoreCaseRoot = RtlDelete(&Fcb->ShortNamePrefix->IgnoreCaseName.Links);
+			CdRemoveNameLink(IrpContext,
+			                 &Fcb->ParentFcb->Index.IgnoreCaseTable,
+			                 &Fcb->ShortNamePrefix->IgnoreCaseName);
 		}
 
 		if (FlagOn( Fcb->ShortNamePrefix->PrefixFlags, PREFIX_FLAG_EXACT_CASE_IN_TREE ))
 		{
-			Fcb->ParentFcb->Index.ExactCaseRoot = RtlDelete(&Fcb->ShortNamePrefix->ExactCaseName.Links);
+			CdRemoveNameLink(IrpContext,
+			                 &Fcb->ParentFcb->Index.ExactCaseTable,
+			                 &Fcb->ShortNamePrefix->ExactCaseName);
 		}
 
 		ClearFlag( Fcb->ShortNamePrefix->PrefixFlags,
@@ -271,12 +286,16 @@ Return Value:
 
 	if (FlagOn( Fcb->FileNamePrefix.PrefixFlags, PREFIX_FLAG_IGNORE_CASE_IN_TREE ))
 	{
-		Fcb->ParentFcb->Index.IgnoreCaseRoot = RtlDelete(&Fcb->FileNamePrefix.IgnoreCaseName.Links);
+		CdRemoveNameLink(IrpContext,
+		                 &Fcb->ParentFcb->Index.IgnoreCaseTable,
+		                 &Fcb->FileNamePrefix.IgnoreCaseName);
 	}
 
 	if (FlagOn( Fcb->FileNamePrefix.PrefixFlags, PREFIX_FLAG_EXACT_CASE_IN_TREE ))
 	{
-		Fcb->ParentFcb->Index.ExactCaseRoot = RtlDelete(&Fcb->FileNamePrefix.ExactCaseName.Links);
+		CdRemoveNameLink(IrpContext,
+		                 &Fcb->ParentFcb->Index.ExactCaseTable,
+		                 &Fcb->FileNamePrefix.ExactCaseName);
 	}
 
 	ClearFlag( Fcb->FileNamePrefix.PrefixFlags,
@@ -312,7 +331,7 @@ Routine Description:
 
     This routine begins from the given CurrentFcb and walks through all of
     components of the name looking for the longest match in the prefix
-    splay trees.  The search is relative to the starting Fcb so the
+    tables.  The search is relative to the starting Fcb so the
     full name may not begin with a '\'.  On return this routine will
     update Current Fcb with the lowest point it has travelled in the
     tree.  It will also hold only that resource on return and it must
@@ -344,6 +363,8 @@ Return Value:
 	PNAME_LINK NameLink;
 	PPREFIX_ENTRY PrefixEntry;
 
+	ULONG Hash;
+
 	PAGED_CODE();
 
 	//
@@ -378,14 +399,17 @@ Return Value:
 		              &FinalName);
 
 		//
-		//  Check if this name is in the splay tree for this Scb.
+		//  Check if this name is in the prefix table for this Scb.
 		//
 
+		Hash = CdHashName(IrpContext, &FinalName);
+
 		if (IgnoreCase)
 		{
 			NameLink = CdFindNameLink(IrpContext,
-			                          &(*CurrentFcb)->Index.IgnoreCaseRoot,
-			                          &FinalName);
+			                          (*CurrentFcb)->Index.IgnoreCaseTable,
+			                          &FinalName,
+			                          Hash);
 
 			//
 			//  Get the prefix entry from this NameLink.  Don't access any
@@ -399,8 +423,9 @@ Return Value:
 		else
 		{
 			NameLink = CdFindNameLink(IrpContext,
-			                          &(*CurrentFcb)->Index.ExactCaseRoot,
-			                          &FinalName);
+			                          (*CurrentFcb)->Index.ExactCaseTable,
+			                          &FinalName,
+			                          Hash);
 
 			PrefixEntry = (PPREFIX_ENTRY) CONTAINING_RECORD( NameLink,
 				PREFIX_ENTRY,
@@ -473,6 +498,7 @@ Return Value:
 }
 
 
+
 //
 //  Local support routine
 //
@@ -480,25 +506,27 @@ Return Value:
 PNAME_LINK
 CdFindNameLink(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _In_ PRTL_SPLAY_LINKS* RootNode,
-	     _In_ PUNICODE_STRING Name
+	     _In_opt_ PCD_PREFIX_TABLE Table,
+	     _In_ PUNICODE_STRING Name,
+	     _In_ ULONG Hash
 )
 
 /*++
 
 Routine Description:
 
-    This routine searches through a splay link tree looking for a match for the
-    input name.  If we find the corresponding name we will rebalance the
-    tree.
+    This routine searches a prefix table for a match for the input name.
+    The table is not modified, so several threads may search it at once.
 
 Arguments:
 
-    RootNode - Supplies the parent to search.
+    Table - Supplies the table to search, or NULL if there isn't one.
 
     Name - This is the name to search for.  Note if we are doing a case
         insensitive search the name would have been upcased already.
 
+    Hash - CdHashName of the name.
+
 Return Value:
 
     PNAME_LINK - The name link found or NULL if there is no match.
@@ -506,72 +534,35 @@ Return Value:
 --*/
 
 {
-	FSRTL_COMPARISON_RESULT Comparison;
 	PNAME_LINK Node;
-	PRTL_SPLAY_LINKS Links;
+	ULONG Slot;
 
 	PAGED_CODE();
 
-	Links = *RootNode;
+	UNREFERENCED_PARAMETER( IrpContext );
 
-	while (Links != NULL)
+	if (Table == NULL)
 	{
-		Node = CONTAINING_RECORD( Links, NAME_LINK, Links );
-
-		//
-		//  Compare the prefix in the tree with the full name
-		//
-
-		Comparison = CdFullCompareNames(IrpContext, &Node->FileName, Name);
-
-		//
-		//  See if they don't match
-		//
-
-		if (Comparison == GreaterThan)
-		{
-			//
-			//  The prefix is greater than the full name
-			//  so we go down the left child
-			//
-
-			Links = RtlLeftChild( Links );
-
-			//
-			//  And continue searching down this tree
-			//
-		}
-		else if (Comparison == LessThan)
-		{
-			//
-			//  The prefix is less than the full name
-			//  so we go down the right child
-			//
+		return NULL;
+	}
 
-			Links = RtlRightChild( Links );
+	//
+	//  Probe from the hash's slot until we reach an empty slot.  The table
+	//  is never full so there always is one.
+	//
 
-			//
-			//  And continue searching down this tree
-			//
-		}
-		else
+	for (Slot = Hash & (Table->SlotCount - 1);
+	     (Node = Table->Slots[Slot]) != NULL;
+	     Slot = (Slot + 1) & (Table->SlotCount - 1))
+	{
+		if ((Node->Hash == Hash) &&
+			(Node->FileName.Length == Name->Length) &&
+			RtlEqualMemory( Node->FileName.Buffer, Name->Buffer, Name->Length ))
 		{
-			//
-			//  We found it.
-			//
-			//  Splay the tree and save the new root.
-			//
-
-			*RootNode = RtlSplay(Links);
-
 			return Node;
 		}
 	}
 
-	//
-	//  We didn't find the Link.
-	//
-
 	return NULL;
 }
 
@@ -583,7 +574,7 @@ Return Value:
 BOOLEAN
 CdInsertNameLink(
 	_In_ PIRP_CONTEXT IrpContext,
-	     _Inout_ PRTL_SPLAY_LINKS* RootNode,
+	     _Inout_ PCD_PREFIX_TABLE* Table,
 	     _In_ PNAME_LINK NameLink
 )
 
@@ -591,15 +582,17 @@ CdInsertNameLink(
 
 Routine Description:
 
-    This routine will insert a name in the splay tree pointed to
-    by RootNode.
+    This routine will insert a name in a prefix table, allocating or
+    growing the table as needed.  The hash in the name link has been set.
 
-    The name could already exist in this tree for a case-insensitive tree.
-    In that case we simply return FALSE and do nothing.
+    The name could already exist in this table for a case-insensitive table.
+    In that case we simply return FALSE and do nothing.  We also return
+    FALSE if we can't grow the table, since the name doesn't have to be in
+    it.
 
 Arguments:
 
-    RootNode - Supplies a pointer to the table.
+    Table - Supplies a pointer to the table, which may be NULL.
 
     NameLink - Contains the new link to enter.
 
@@ -610,120 +603,178 @@ Return Value:
 --*/
 
 {
-	FSRTL_COMPARISON_RESULT Comparison;
+	PCD_PREFIX_TABLE OldTable = *Table;
+	PCD_PREFIX_TABLE NewTable;
 	PNAME_LINK Node;
 
+	ULONG SlotCount;
+	ULONG Count;
+	ULONG Slot;
+
 	PAGED_CODE();
 
-	RtlInitializeSplayLinks(&NameLink->Links);
+	if (CdFindNameLink(IrpContext, OldTable, &NameLink->FileName, NameLink->Hash) != NULL)
+	{
+		return FALSE;
+	}
 
 	//
-	//  If we are the first entry in the tree, just become the root.
+	//  Keep the table at most half full.  Rehash into a new table twice the
+	//  size if this name would fill it further.
 	//
 
-	if (*RootNode == NULL)
+	if ((OldTable == NULL) ||
+		((OldTable->EntryCount + 1) * 2 > OldTable->SlotCount))
 	{
-		*RootNode = &NameLink->Links;
+		SlotCount = (OldTable == NULL) ? CD_PREFIX_TABLE_MIN_SLOTS : OldTable->SlotCount * 2;
+
+		NewTable = reinterpret_cast<PCD_PREFIX_TABLE>(ExAllocatePoolWithTag( CdPagedPool,
+			FIELD_OFFSET( CD_PREFIX_TABLE, Slots ) + SlotCount * sizeof( PNAME_LINK ),
+			TAG_PREFIX_TABLE ));
 
-		return TRUE;
+		if (NewTable == NULL)
+		{
+			return FALSE;
+		}
+
+		RtlZeroMemory( NewTable, FIELD_OFFSET( CD_PREFIX_TABLE, Slots ) + SlotCount * sizeof( PNAME_LINK ));
+		NewTable->SlotCount = SlotCount;
+
+		if (OldTable != NULL)
+		{
+			for (Count = 0; Count < OldTable->SlotCount; Count++)
+			{
+				Node = OldTable->Slots[Count];
+
+				if (Node != NULL)
+				{
+					for (Slot = Node->Hash & (SlotCount - 1);
+					     NewTable->Slots[Slot] != NULL;
+					     Slot = (Slot + 1) & (SlotCount - 1))
+					{
+						NOTHING;
+					}
+
+					NewTable->Slots[Slot] = Node;
+				}
+			}
+
+			NewTable->EntryCount = OldTable->EntryCount;
+
+			CdFreePool(reinterpret_cast<PVOID*>(&OldTable));
+		}
+
+		*Table = NewTable;
 	}
 
-	Node = CONTAINING_RECORD( *RootNode, NAME_LINK, Links );
+	//
+	//  Take the first empty slot from the hash's slot on.
+	//
 
-	while (TRUE)
+	for (Slot = NameLink->Hash & ((*Table)->SlotCount - 1);
+	     (*Table)->Slots[Slot] != NULL;
+	     Slot = (Slot + 1) & ((*Table)->SlotCount - 1))
 	{
-		//
-		//  Compare the prefix in the tree with the prefix we want
-		//  to insert.
-		//
+		NOTHING;
+	}
 
-		Comparison = CdFullCompareNames(IrpContext, &Node->FileName, &NameLink->FileName);
+	(*Table)->Slots[Slot] = NameLink;
+	(*Table)->EntryCount += 1;
 
-		//
-		//  If we found the entry, return immediately.
-		//
+	return TRUE;
+}
 
-		if (Comparison == EqualTo)
-		{
-			return FALSE;
-		}
 
-		//
-		//  If the tree prefix is greater than the new prefix then
-		//  we go down the left subtree
-		//
+//
+//  Local support routine
+//
 
-		if (Comparison == GreaterThan)
-		{
-			//
-			//  We want to go down the left subtree, first check to see
-			//  if we have a left subtree
-			//
+VOID
+CdRemoveNameLink(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PCD_PREFIX_TABLE* Table,
+	     _In_ PNAME_LINK NameLink
+)
 
-			if (RtlLeftChild( &Node->Links ) == NULL)
-			{
-				//
-				//  there isn't a left child so we insert ourselves as the
-				//  new left child
-				//
+/*++
 
-				RtlInsertAsLeftChild(&Node->Links, &NameLink->Links);
+Routine Description:
 
-				//
-				//  and exit the while loop
-				//
+    This routine will remove a name link from a prefix table.  The link may
+    not be in the table, if another link with the same name was inserted
+    first or the table couldn't be grown, in which case we do nothing.
 
-				break;
-			}
-			else
-			{
-				//
-				//  there is a left child so simply go down that path, and
-				//  go back to the top of the loop
-				//
-
-				Node = CONTAINING_RECORD( RtlLeftChild( &Node->Links ),
-					NAME_LINK,
-					Links );
-			}
-		}
-		else
-		{
-			//
-			//  The tree prefix is either less than or a proper prefix
-			//  of the new string.  We treat both cases as less than when
-			//  we do insert.  So we want to go down the right subtree,
-			//  first check to see if we have a right subtree
-			//
+    The entries following the removed one in its run of full slots are
+    moved back as far as their hash allows, so that no probe for them stops
+    at the slot we empty.  The table is freed with its last entry.
 
-			if (RtlRightChild( &Node->Links ) == NULL)
-			{
-				//
-				//  These isn't a right child so we insert ourselves as the
-				//  new right child
-				//
+Arguments:
 
-				RtlInsertAsRightChild(&Node->Links, &NameLink->Links);
+    Table - Supplies a pointer to the table, which may be NULL.
 
-				//
-				//  and exit the while loop
-				//
+    NameLink - Contains the link to remove.
 
-				break;
-			}
-			else
-			{
-				//
-				//  there is a right child so simply go down that path, and
-				//  go back to the top of the loop
-				//
-
-				Node = CONTAINING_RECORD( RtlRightChild( &Node->Links ),
-					NAME_LINK,
-					Links );
-			}
+Return Value:
+
+    None.
+
+--*/
+
+{
+	PCD_PREFIX_TABLE PrefixTable = *Table;
+	ULONG Mask;
+	ULONG Slot;
+	ULONG Next;
+	ULONG Home;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER( IrpContext );
+
+	if (PrefixTable == NULL)
+	{
+		return;
+	}
+
+	Mask = PrefixTable->SlotCount - 1;
+
+	//
+	//  Find the slot holding this link.
+	//
+
+	for (Slot = NameLink->Hash & Mask;
+	     PrefixTable->Slots[Slot] != NameLink;
+	     Slot = (Slot + 1) & Mask)
+	{
+		if (PrefixTable->Slots[Slot] == NULL)
+		{
+			return;
 		}
 	}
 
-	return TRUE;
+	//
+	//  Walk the rest of the run.  An entry can fill the hole if the hole
+	//  lies cyclically between its home slot and where it is now.
+	//
+
+	for (Next = (Slot + 1) & Mask;
+	     PrefixTable->Slots[Next] != NULL;
+	     Next = (Next + 1) & Mask)
+	{
+		Home = PrefixTable->Slots[Next]->Hash & Mask;
+
+		if (((Next - Home) & Mask) >= ((Next - Slot) & Mask))
+		{
+			PrefixTable->Slots[Slot] = PrefixTable->Slots[Next];
+			Slot = Next;
+		}
+	}
+
+	PrefixTable->Slots[Slot] = NULL;
+	PrefixTable->EntryCount -= 1;
+
+	if (PrefixTable->EntryCount == 0)
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(Table));
+	}
 }
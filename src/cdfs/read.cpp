@@ -240,6 +240,27 @@ Return Value:
 			}
 		}
 
+		//
+		//  Record the request in the volume's read trace.  We do this once we
+		//  know the request will not be posted, so a posted read shows up a
+		//  single time.
+		//
+
+		CdRecordReadTrace(Fcb->Vcb,
+		                  Fcb->FileId.QuadPart,
+		                  StartingOffset,
+		                  ByteCount,
+		                  (PagingIo ? CDFS_READ_TRACE_PAGING_IO : 0) |
+		                  (NonCachedIo ? CDFS_READ_TRACE_NON_CACHED : 0) |
+		                  (SynchronousIo ? CDFS_READ_TRACE_SYNCHRONOUS : 0) |
+		                  (IsCompressed ? CDFS_READ_TRACE_COMPRESSED : 0));
+
+		//
+		//  The sector cache warm-up holds off while reads are arriving.
+		//
+
+		Fcb->Vcb->LastForegroundRead = (ULONG) (KeQueryInterruptTime() / (10 * 1000));
+
 		//
 		//  Check request beyond end of file if this is not a read on a volume
 		//  handle marked for extended DASD IO.
@@ -17,6 +17,7 @@ CdRawReadFile(
 	     __in PFCB Fcb,
 	     __in LONGLONG Offset,
 	     __in ULONG Length,
+	     __in BOOLEAN UseSectorCache,
 	     __inout __LOCAL_Buffer& Buff);
 
 
@@ -38,6 +39,20 @@ CdRawReadFile(
 //helper structs
 static const UCHAR MAGIC[] = {0x37, 0xe4, 0x53, 0x96, 0xc9, 0xdb, 0xd6, 0x07};
 
+//
+// Largest first read of a compressed file.  It holds the header and, for
+// files up to a few hundred megabytes, the whole block pointer table.
+//
+
+#define ZISO_INITIAL_TABLE_READ	(0x8000)
+
+//
+// Largest table read sent through the sector cache.  Bigger ones would
+// push out the directory chunks the cache is there for.
+//
+
+#define ZISO_CACHED_TABLE_READ	(0x2000)
+
 class ZISO_HEADER
 {
 public:
@@ -56,34 +71,36 @@ class __LOCAL_Buffer
 public:
 	PUCHAR Buff;
 	PMDL MdlBuff;
+	ULONG Size;
 
-	__LOCAL_Buffer() : Buff(NULL), MdlBuff(NULL)
+	__LOCAL_Buffer() : Buff(NULL), MdlBuff(NULL), Size(0)
 	{
 	}
 
 
-	void Allocate(PIRP_CONTEXT IrpContext)
+	void Allocate(PIRP_CONTEXT IrpContext, ULONG BufferSize = CD_SECTOR_SIZE)
 	{
 		Buff = (PUCHAR)FsRtlAllocatePoolWithTag(
-			CdNonPagedPool, CD_SECTOR_SIZE, TAG_COMPRESSION_BUFFER );
+			CdNonPagedPool, BufferSize, TAG_COMPRESSION_BUFFER );
 
 		if (!Buff)
 		{
 			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
 		}
 
-		MdlBuff = IoAllocateMdl(Buff, CD_SECTOR_SIZE, FALSE, FALSE, NULL);
+		MdlBuff = IoAllocateMdl(Buff, BufferSize, FALSE, FALSE, NULL);
 		if (!MdlBuff)
 		{
 			CdFreePool((PVOID*)&Buff);
 			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
 		}
 		MmBuildMdlForNonPagedPool(MdlBuff);
+		Size = BufferSize;
 	}
 
 	void Zero(PIRP_CONTEXT IrpContext)
 	{
-		SafeZeroMemory(IrpContext, Buff, CD_SECTOR_SIZE);
+		SafeZeroMemory(IrpContext, Buff, Size);
 	}
 
 	void Deallocate()
@@ -97,6 +114,7 @@ public:
 		{
 			CdFreePool((PVOID*)&Buff);
 		}
+		Size = 0;
 	}
 };
 
@@ -115,6 +133,7 @@ NTSTATUS CdInflateData(
 	PUCHAR HelperCompressedDataPointer;
 	PUCHAR HelperCopySource;
 	ULONG LastBlock;
+	BOOLEAN InflateDirect;
 	int Err;
 	ULONG ToCopyCount = 0;
 	ULONG LeftToCopyCount = CompressionCtx->m_ComprByteCount;
@@ -181,37 +200,10 @@ NTSTATUS CdInflateData(
 	}
 	else
 	{
-		HelperCopySource = TempBuffer;
 		LastBlock = CompressionCtx->m_ComprFirstBlockIndex + CompressionCtx->m_BlockCount - 1;
 		for (; Block <= LastBlock;
 		       UserBuffer += ToCopyCount , LeftToCopyCount -= ToCopyCount , ++Block)
 		{
-			if (!BlockOffsetTable[Block].m_IsZero)
-			{
-				SafeZeroMemory(IrpContext, TempBuffer, BlockSize);
-				Zstream->total_out = 0;
-				Zstream->avail_out = BlockSize;
-				Zstream->next_out = TempBuffer;
-				//
-				DbgPrint("%c\n", *HelperCompressedDataPointer);
-				Zstream->next_in = HelperCompressedDataPointer;
-				Zstream->total_in = 0;
-				Zstream->avail_in = BlockOffsetTable[Block].m_Size;
-
-				inflateReset(Zstream);
-				Err = inflate(Zstream, Z_SYNC_FLUSH);
-
-				if (Err != Z_STREAM_END)
-				{
-					DbgPrint("Inflate error, probably wrong input data");
-					DbgBreakPoint();
-				}
-				NT_ASSERT(Err == Z_STREAM_END);
-				NT_ASSERT(Zstream->total_in == BlockOffsetTable[Block].m_Size);
-
-				HelperCompressedDataPointer += Zstream->total_in;
-			}
-
 			if (Block == CompressionCtx->m_ComprFirstBlockIndex)
 			{
 				//first block specific	
@@ -230,16 +222,59 @@ NTSTATUS CdInflateData(
 				HelperCopySource = TempBuffer;
 				ToCopyCount = BlockSize;
 			}
-			if (!BlockOffsetTable[Block].m_IsZero)
+
+			if (BlockOffsetTable[Block].m_IsZero)
 			{
-				NT_ASSERT((ULONG)((UserBuffer + ToCopyCount) - (PUCHAR)CompressionCtx->m_UserBuffer) < CompressionCtx->m_UserBufferByteCount);
-				NT_ASSERT(ToCopyCount <= BlockSize);
-				NT_ASSERT((ULONG)(HelperCopySource - TempBuffer) < BlockSize);
-				RtlCopyMemory(UserBuffer, HelperCopySource, ToCopyCount);
+				SafeZeroMemory(IrpContext, UserBuffer, ToCopyCount);
+				continue;
+			}
+
+			//
+			//  A block the caller wants in full is inflated straight into the
+			//  user buffer, only partial head and tail blocks go through the
+			//  temporary buffer.
+			//
+
+			InflateDirect = (HelperCopySource == TempBuffer && ToCopyCount == BlockSize);
+
+			Zstream->total_out = 0;
+			Zstream->avail_out = BlockSize;
+			Zstream->next_out = InflateDirect ? UserBuffer : TempBuffer;
+			//
+			Zstream->next_in = HelperCompressedDataPointer;
+			Zstream->total_in = 0;
+			Zstream->avail_in = BlockOffsetTable[Block].m_Size;
+
+			inflateReset(Zstream);
+			Err = inflate(Zstream, Z_SYNC_FLUSH);
+
+			if (Err != Z_STREAM_END)
+			{
+				DbgPrint("Inflate error, probably wrong input data");
+				DbgBreakPoint();
+			}
+			NT_ASSERT(Err == Z_STREAM_END);
+			NT_ASSERT(Zstream->total_in == BlockOffsetTable[Block].m_Size);
+
+			HelperCompressedDataPointer += Zstream->total_in;
+
+			if (InflateDirect)
+			{
+				if (Zstream->total_out < BlockSize)
+				{
+					SafeZeroMemory(IrpContext, UserBuffer + Zstream->total_out, BlockSize - Zstream->total_out);
+				}
 			}
 			else
 			{
-				SafeZeroMemory(IrpContext, UserBuffer, ToCopyCount);
+				if (Zstream->total_out < BlockSize)
+				{
+					SafeZeroMemory(IrpContext, TempBuffer + Zstream->total_out, BlockSize - Zstream->total_out);
+				}
+				NT_ASSERT((ULONG)((UserBuffer + ToCopyCount) - (PUCHAR)CompressionCtx->m_UserBuffer) <= CompressionCtx->m_UserBufferByteCount);
+				NT_ASSERT(ToCopyCount <= BlockSize);
+				NT_ASSERT((ULONG)(HelperCopySource - TempBuffer) < BlockSize);
+				RtlCopyMemory(UserBuffer, HelperCopySource, ToCopyCount);
 			}
 		}
 	}
@@ -252,7 +287,7 @@ NTSTATUS CdInflateData(
 //must be sector alligned (reads 2048 bytes)
 __drv_mustHoldCriticalRegion
 NTSTATUS CdRawReadFile(
-	PIRP_CONTEXT IrpContext, PFCB Fcb, LONGLONG Offset, ULONG Length, __LOCAL_Buffer& Buffer)
+	PIRP_CONTEXT IrpContext, PFCB Fcb, LONGLONG Offset, ULONG Length, BOOLEAN UseSectorCache, __LOCAL_Buffer& Buffer)
 {
 	NTSTATUS Status;
 	//	PIRP Irp = IrpContext->Irp;
@@ -266,6 +301,8 @@ NTSTATUS CdRawReadFile(
 
 	PAGED_CODE();
 
+	RtlZeroMemory( &LocalIoContext, sizeof( CD_IO_CONTEXT ));
+
 	KeInitializeEvent(&LocalIoContext.SyncEvent,
 	                  NotificationEvent,
 	                  FALSE);
@@ -279,6 +316,8 @@ NTSTATUS CdRawReadFile(
 	IrpRead->UserBuffer = Buffer.Buff;
 	IrpRead->MdlAddress = Buffer.MdlBuff;
 
+	IoSetIoPriorityHint( IrpRead, IoGetIoPriorityHint( IrpContext->Irp ));
+
 	IoSetNextIrpStackLocation(IrpRead);
 	IrpSpRead = IoGetCurrentIrpStackLocation(IrpRead);
 	IrpSpRead->MajorFunction = IRP_MJ_READ;
@@ -290,6 +329,17 @@ NTSTATUS CdRawReadFile(
 	IrpContextRead->IoContext = &LocalIoContext;
 	ClearFlag( IrpContextRead->Flags, IRP_CONTEXT_FLAG_ALLOC_IO );
 
+	//
+	//  Raw reads are only issued for the zisofs header and block pointer
+	//  table.  Send small ones through the sector cache, since mastered
+	//  discs put the tables of neighbouring files close together.
+	//
+
+	if (UseSectorCache)
+	{
+		SetFlag( IrpContextRead->Flags, IRP_CONTEXT_FLAG_COMPRESSION_TABLE );
+	}
+
 	IrpRead->IoStatus.Information = Length;
 
 	Status = CdNonCachedRead(IrpContextRead, Fcb, Offset, Length);
@@ -315,41 +365,6 @@ NTSTATUS CdRawReadFile(
 	return Status;
 }
 
-__drv_mustHoldCriticalRegion
-INLINE
-BOOLEAN
-CdParseBuffer(
-	PIRP_CONTEXT IrpContext,
-	PFCB Fcb,
-	PULONG& BlockPointer,
-	ULONG RawLength,
-	PUCHAR Buff,
-	PVECTOR_OF_BLOCK_INFO BlockOffsetTable)
-{
-	if ((PUCHAR)BlockPointer == Buff)
-	{
-		BlockOffsetTable->AddItem(BlockOffsetTable->LastItem()->m_AddrEnd, BlockPointer[0]);
-		++BlockPointer;
-	}
-
-	while (((PUCHAR)BlockPointer - Buff) < (LONGLONG)RawLength)
-	{
-		BlockOffsetTable->AddItem(BlockPointer[-1], BlockPointer[0]);
-
-		if (BlockPointer[0] == (ULONG)Fcb->FileSizeOnDisk.QuadPart)
-		{
-			if (!BlockOffsetTable->Compact())
-			{
-				CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-			}
-			return TRUE;
-		}
-
-		++BlockPointer;
-	}
-	return FALSE;
-}
-
 __drv_mustHoldCriticalRegion
 NTSTATUS CdInitializeFcbBlockOffsetTable(
 	PIRP_CONTEXT IrpContext, PIRP Irp, PFCB Fcb, PCCB Ccb)
@@ -357,11 +372,11 @@ NTSTATUS CdInitializeFcbBlockOffsetTable(
 	__LOCAL_Buffer Buffer;
 	PZISO_HEADER Header;
 	PVECTOR_OF_BLOCK_INFO BlockOffsetTable = NULL;
-	LONGLONG RawOffset = 0;
 	NTSTATUS Status = STATUS_SUCCESS;
-	ULONG SectorsForBlockOffsetTable;
-	ULONG RawBlockCount;
+	ULONG TableLength;
+	ULONG PointerCount;
 	ULONG RawLength;
+	ULONGLONG ExpectedLength;
 	PULONG BlockPointer;
 	//
 	UNREFERENCED_PARAMETER(Irp);
@@ -378,21 +393,33 @@ NTSTATUS CdInitializeFcbBlockOffsetTable(
 	{
 		__try
 		{
-			Buffer.Allocate(IrpContext);
+			//
+			// Read the header together with the pointer table the file size
+			// calls for, up to ZISO_INITIAL_TABLE_READ, so most files need a
+			// single device read here instead of one per table sector.
+			//
 
-			RawLength = (Fcb->AllocationSizeOnDisk.QuadPart < CD_SECTOR_SIZE ?
-				             (ULONG)Fcb->AllocationSizeOnDisk.QuadPart :
-				             CD_SECTOR_SIZE);
+			ExpectedLength = sizeof(ZISO_HEADER) +
+				((((ULONGLONG)Fcb->FileSize.QuadPart + (1 << Fcb->BlockSizeLog2) - 1) >> Fcb->BlockSizeLog2) + 1) * sizeof(ULONG);
 
+			RawLength = (ExpectedLength < ZISO_INITIAL_TABLE_READ ?
+				             SectorAlign(ExpectedLength) :
+				             ZISO_INITIAL_TABLE_READ);
+
+			if (Fcb->AllocationSizeOnDisk.QuadPart < RawLength)
+			{
+				RawLength = (ULONG)Fcb->AllocationSizeOnDisk.QuadPart;
+			}
+
+			Buffer.Allocate(IrpContext, RawLength);
 			Buffer.Zero(IrpContext);
 			//
-			Status = CdRawReadFile(IrpContext, Fcb, RawOffset, RawLength, Buffer);
+			Status = CdRawReadFile(IrpContext, Fcb, 0, RawLength, (RawLength <= ZISO_CACHED_TABLE_READ), Buffer);
 
 			if (!NT_SUCCESS( Status ))
 			{
 				try_return( Status = STATUS_FILE_CORRUPT_ERROR );
 			}
-			RawOffset += RawLength;
 			Header = (PZISO_HEADER)Buffer.Buff;
 			if ((RtlCompareMemory(Header->Magic, MAGIC, 8) != 8) ||
 				(Header->HeaderSize != (Fcb->HeaderSize >> 2)) ||
@@ -403,77 +430,97 @@ NTSTATUS CdInitializeFcbBlockOffsetTable(
 				try_return( Status = STATUS_FILE_CORRUPT_ERROR );
 			}
 
+			//
+			// The first pointer is where the first block starts, which is
+			// right behind the pointer table.  The table holds one pointer
+			// per block and one more, so it can't be longer than the file
+			// size calls for.
+			//
+
 			BlockPointer = Add2Ptr(Buffer.Buff, sizeof(ZISO_HEADER), PULONG);
-			if ((LONGLONG)BlockPointer[0] > Fcb->FileSizeOnDisk.QuadPart)
+			TableLength = BlockPointer[0];
+
+			if (((LONGLONG)TableLength > Fcb->FileSizeOnDisk.QuadPart) ||
+				((ULONGLONG)TableLength > ExpectedLength) ||
+				(TableLength < sizeof(ZISO_HEADER) + 2 * sizeof(ULONG)))
 			{
 				try_return( Status = STATUS_FILE_CORRUPT_ERROR );
 			}
 
-			SectorsForBlockOffsetTable = (BlockPointer[0] % CD_SECTOR_SIZE ?
-				                              BlockPointer[0] / CD_SECTOR_SIZE + 1 :
-				                              BlockPointer[0] / CD_SECTOR_SIZE);
-
-			RawBlockCount = (BlockPointer[0] - sizeof(ZISO_HEADER)) >> 2;
-
-			BlockOffsetTable = CdAllocateVectorOfBlockInfo(IrpContext, RawBlockCount - 1);
-			if (!BlockOffsetTable)
+			if (TableLength > RawLength)
 			{
+				//
+				// The table didn't fit, read all of it in one go.  Raw reads
+				// must be whole sectors.
+				//
+
 				Buffer.Deallocate();
-				CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
-			}
 
-			BlockOffsetTable->AddItem(BlockPointer[0], BlockPointer[1]);
-			BlockPointer += 2;
-			RawBlockCount -= 2;
-			--SectorsForBlockOffsetTable;
+				RawLength = SectorAlign(TableLength);
 
-			if (BlockPointer[-1] == (ULONG)Fcb->FileSizeOnDisk.QuadPart)
-			{
-				if (BlockOffsetTable->Compact())
+				if (Fcb->AllocationSizeOnDisk.QuadPart < RawLength)
 				{
-					try_return(Status);
+					RawLength = (ULONG)Fcb->AllocationSizeOnDisk.QuadPart;
 				}
-				else
+
+				Buffer.Allocate(IrpContext, RawLength);
+				Buffer.Zero(IrpContext);
+				//
+				Status = CdRawReadFile(IrpContext, Fcb, 0, RawLength, (RawLength <= ZISO_CACHED_TABLE_READ), Buffer);
+
+				if (!NT_SUCCESS( Status ))
 				{
-					CdDeallocateVectorOfBlockInfo(&BlockOffsetTable);
-					Buffer.Deallocate();
-					CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+					try_return( Status = STATUS_FILE_CORRUPT_ERROR );
 				}
+
+				BlockPointer = Add2Ptr(Buffer.Buff, sizeof(ZISO_HEADER), PULONG);
 			}
-			else
-			{
-				NT_ASSERT(RawBlockCount >= 1 );
 
-				while (RawBlockCount-- > 0)
-				{
-					if (CdParseBuffer(IrpContext, Fcb, BlockPointer, RawLength, Buffer.Buff, BlockOffsetTable))
-					{
-						try_return(Status);
-					}
+			PointerCount = (TableLength - sizeof(ZISO_HEADER)) >> 2;
 
-					RawLength = SectorsForBlockOffsetTable == 1 ? RawBlockCount << 2 : CD_SECTOR_SIZE;
+			//
+			// There must be a block for every part of the file, or reads near
+			// its end would look past the end of the table.
+			//
 
-					Buffer.Zero(IrpContext);
-					//
-					Status = CdRawReadFile(IrpContext, Fcb, RawOffset, RawLength, Buffer);
+			if ((ULONGLONG)(PointerCount - 1) <
+				(((ULONGLONG)Header->RealSize + (1 << Fcb->BlockSizeLog2) - 1) >> Fcb->BlockSizeLog2))
+			{
+				try_return( Status = STATUS_FILE_CORRUPT_ERROR );
+			}
 
-					if (!NT_SUCCESS( Status ))
-					{
-						try_return( Status = STATUS_FILE_CORRUPT_ERROR );
-					}
+			BlockOffsetTable = CdAllocateVectorOfBlockInfo(IrpContext, 1 << Fcb->BlockSizeLog2, PointerCount - 1);
+			if (!BlockOffsetTable || !BlockOffsetTable->m_Data)
+			{
+				try_return( Status = STATUS_INSUFFICIENT_RESOURCES );
+			}
+
+			for (ULONG Pointer = 0; Pointer + 1 < PointerCount; ++Pointer)
+			{
+				if ((BlockPointer[Pointer + 1] < BlockPointer[Pointer]) ||
+					((LONGLONG)BlockPointer[Pointer + 1] > Fcb->FileSizeOnDisk.QuadPart))
+				{
+					try_return( Status = STATUS_FILE_CORRUPT_ERROR );
+				}
 
-					BlockPointer = (PULONG)Buffer.Buff;
-					RawOffset += RawLength;
+				if (!BlockOffsetTable->AddItem(BlockPointer[Pointer], BlockPointer[Pointer + 1]))
+				{
+					try_return( Status = STATUS_INSUFFICIENT_RESOURCES );
 				}
 			}
 
+			if (!BlockOffsetTable->Compact())
+			{
+				try_return( Status = STATUS_INSUFFICIENT_RESOURCES );
+			}
+
 			//
 			RETURN_OUT_OF_SEH_SUPPORTED(try_exit: NOTHING);
 		}
 		__finally
 		{
 			Buffer.Deallocate();
-			if (NT_SUCCESS(Status))
+			if (NT_SUCCESS(Status) && !AbnormalTermination())
 			{
 				CdLockFcb(IrpContext, Fcb);
 				Fcb->BlockOffsetTable = BlockOffsetTable;
@@ -632,5 +679,5 @@ CdComprFinishBuffers(
 	Irp->UserBuffer = CompressionCtx->m_UserBuffer;
 	Irp->MdlAddress = CompressionCtx->m_UserMdl;
 	Irp->IoStatus.Information = CompressionCtx->m_ComprByteCount;
-	CompressionCtx->FreeBuffer();
+	CompressionCtx->ReleaseBuffer();
 }
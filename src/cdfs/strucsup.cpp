@@ -96,25 +96,20 @@ Abstract:
 #define CdDeallocateCcb(IC,C) \
     CdFreePool(reinterpret_cast<PVOID*>( &(C) ))
 
-//
-//  Local structures
-//
-
-typedef struct _FCB_TABLE_ELEMENT
-{
-	FILE_ID FileId;
-	PFCB Fcb;
-} FCB_TABLE_ELEMENT, *PFCB_TABLE_ELEMENT;
-
 //
 //  Local macros
 //
 
 //
-//  VOID
-//  CdInsertFcbTable (
-//      _In_ PIRP_CONTEXT IrpContext,
-//      _In_ PFCB Fcb
+//  ULONG
+//  CdHashFileId (
+//      _In_ FILE_ID FileId
+//      );
+//
+//  ULONG
+//  CdFcbTableBucket (
+//      _In_ PVCB Vcb,
+//      _In_ FILE_ID FileId
 //      );
 //
 //  VOID
@@ -124,21 +119,15 @@ typedef struct _FCB_TABLE_ELEMENT
 //      );
 //
 
+#define CdHashFileId(FID)                                           \
+    (((ULONG) (FID).LowPart ^ (ULONG) (FID).HighPart) * 0x9E3779B1)
 
-#define CdInsertFcbTable(IC,F) {                                    \
-    FCB_TABLE_ELEMENT _Key;                                         \
-    _Key.Fcb = (F);                                                 \
-    _Key.FileId = (F)->FileId;                                      \
-    RtlInsertElementGenericTable( &(F)->Vcb->FcbTable,              \
-                                  &_Key,                            \
-                                  sizeof( FCB_TABLE_ELEMENT ),      \
-                                  NULL );                           \
-}
+#define CdFcbTableBucket(V,FID)                                     \
+    ((CdHashFileId( FID ) ^ (CdHashFileId( FID ) >> 16)) & ((V)->FcbTableBuckets - 1))
 
 #define CdDeleteFcbTable(IC,F) {                                    \
-    FCB_TABLE_ELEMENT _Key;                                         \
-    _Key.FileId = (F)->FileId;                                      \
-    RtlDeleteElementGenericTable( &(F)->Vcb->FcbTable, &_Key );     \
+    RemoveEntryList( &(F)->FcbTableLinks );                         \
+    (F)->Vcb->FcbTableCount -= 1;                                   \
 }
 
 //
@@ -166,32 +155,10 @@ extern "C"
 		     _In_ PFCB_NONPAGED FcbNonpaged
 	);
 
-	//  Inform prefast that this is a compare routine.
-	RTL_GENERIC_COMPARE_ROUTINE CdFcbTableCompare;
-
-	RTL_GENERIC_COMPARE_RESULTS
-	CdFcbTableCompare(
-		_In_ PRTL_GENERIC_TABLE FcbTable,
-		     _In_ PVOID Fid1,
-		     _In_ PVOID Fid2
-	);
-
-	//  Inform prefast that this is an alloc reoutine.
-	RTL_GENERIC_ALLOCATE_ROUTINE CdAllocateFcbTable;
-
-	PVOID
-	CdAllocateFcbTable(
-		_In_ PRTL_GENERIC_TABLE FcbTable,
-		     _In_ CLONG ByteSize
-	);
-
-	//  Inform prefast that this is a free reoutine.
-	RTL_GENERIC_FREE_ROUTINE CdDeallocateFcbTable;
-
 	VOID
-	CdDeallocateFcbTable(
-		_In_ PRTL_GENERIC_TABLE FcbTable,
-		     _In_ __drv_freesMem(Mem) _Post_invalid_ PVOID Buffer
+	CdInsertFcbTable(
+		_In_ PIRP_CONTEXT IrpContext,
+		     _In_ PFCB Fcb
 	);
 
 	ULONG
@@ -205,25 +172,27 @@ extern "C"
 #endif
 
 #ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, CdAllocateFcbTable)
 #pragma alloc_text(PAGE, CdCleanupIrpContext)
+#pragma alloc_text(PAGE, CdCreateBufferPool)
 #pragma alloc_text(PAGE, CdCreateCcb)
 #pragma alloc_text(PAGE, CdCreateFcb)
 #pragma alloc_text(PAGE, CdCreateFcbNonpaged)
 #pragma alloc_text(PAGE, CdCreateFileLock)
 #pragma alloc_text(PAGE, CdCreateIrpContext)
-#pragma alloc_text(PAGE, CdDeallocateFcbTable)
+#pragma alloc_text(PAGE, CdCreateSectorCache)
+#pragma alloc_text(PAGE, CdDeleteBufferPool)
 #pragma alloc_text(PAGE, CdDeleteCcb)
 #pragma alloc_text(PAGE, CdDeleteFcb)
 #pragma alloc_text(PAGE, CdDeleteFcbNonpaged)
 #pragma alloc_text(PAGE, CdDeleteFileLock)
+#pragma alloc_text(PAGE, CdDeleteSectorCache)
 #pragma alloc_text(PAGE, CdDeleteVcb)
-#pragma alloc_text(PAGE, CdFcbTableCompare)
 #pragma alloc_text(PAGE, CdGetNextFcb)
 #pragma alloc_text(PAGE, CdInitializeFcbFromFileContext)
 #pragma alloc_text(PAGE, CdInitializeFcbFromPathEntry)
 #pragma alloc_text(PAGE, CdInitializeStackIrpContext)
 #pragma alloc_text(PAGE, CdInitializeVcb)
+#pragma alloc_text(PAGE, CdInsertFcbTable)
 #pragma alloc_text(PAGE, CdLookupFcbTable)
 #pragma alloc_text(PAGE, CdProcessToc)
 #pragma alloc_text(PAGE, CdTeardownStructures)
@@ -294,6 +263,8 @@ Return Value:
 --*/
 
 {
+	ULONG Bucket;
+
 	PAGED_CODE();
 
 	UNREFERENCED_PARAMETER( IrpContext );
@@ -345,6 +316,54 @@ Return Value:
 
 	RtlZeroMemory( Vcb->SwapVpb, sizeof( VPB ) );
 
+	//
+	//  The read trace is optional, so don't fail the mount if we can't get it.
+	//
+
+	Vcb->ReadTrace = reinterpret_cast<PCD_READ_TRACE>( ExAllocatePoolWithTag( CdNonPagedPool,
+		sizeof( CD_READ_TRACE ),
+		TAG_READ_TRACE ));
+
+	if (Vcb->ReadTrace != NULL)
+	{
+		RtlZeroMemory( Vcb->ReadTrace, sizeof( CD_READ_TRACE ));
+	}
+
+	Vcb->MaxQueueDepth = CD_DEFAULT_QUEUE_DEPTH;
+
+	//
+	//  Until the mount asks the adapter, keep to a transfer size every
+	//  adapter takes and the alignment the target asks for.
+	//
+
+	Vcb->DeviceMaximumTransfer =
+		Vcb->MaximumTransfer = CD_DEFAULT_MAXIMUM_TRANSFER;
+	Vcb->AlignmentMask = TargetDeviceObject->AlignmentRequirement;
+
+	Vcb->InterleaveBridgeBytes = CD_DEFAULT_INTERLEAVE_BRIDGE;
+	Vcb->WarmUpLevels = CD_DEFAULT_WARM_UP_LEVELS;
+
+	CdCreateBufferPool( &Vcb->BouncePool, CD_BOUNCE_BUFFERS, PAGE_SIZE );
+	InitializeSListHead( &Vcb->StagingPool.List );
+	InitializeSListHead( &Vcb->XAStagingPool.List );
+
+	InitializeListHead( &Vcb->InFlightReads );
+	ExInitializeFastMutex( &Vcb->InFlightMutex );
+
+	KeInitializeEvent( &Vcb->WarmUpDone, NotificationEvent, TRUE );
+
+	KeInitializeSpinLock( &Vcb->ReadPriorityLock );
+	KeInitializeEvent( &Vcb->ForegroundIdle, NotificationEvent, TRUE );
+
+	//
+	//  New Fcbs have a zero NameIndexGeneration, so start the volume at one
+	//  for them to build their name indexes.
+	//
+
+	Vcb->NameIndexGeneration = 1;
+	InitializeListHead( &Vcb->NameIndexQueue );
+	InitializeListHead( &Vcb->NameArenaQueue );
+
 	//
 	//  Initialize the resource variable for the Vcb and files.
 	//
@@ -379,14 +398,16 @@ Return Value:
 	}
 
 	//
-	//  Initialize the generic Fcb Table.
+	//  Initialize the Fcb Table with the buckets in the Vcb.
 	//
 
-	RtlInitializeGenericTable(&Vcb->FcbTable,
-	                          (PRTL_GENERIC_COMPARE_ROUTINE) CdFcbTableCompare,
-	                          (PRTL_GENERIC_ALLOCATE_ROUTINE) CdAllocateFcbTable,
-	                          (PRTL_GENERIC_FREE_ROUTINE) CdDeallocateFcbTable,
-	                          NULL);
+	Vcb->FcbTable = Vcb->FcbTableInitialBuckets;
+	Vcb->FcbTableBuckets = CD_FCB_TABLE_INITIAL_BUCKETS;
+
+	for (Bucket = 0; Bucket < CD_FCB_TABLE_INITIAL_BUCKETS; Bucket++)
+	{
+		InitializeListHead( &Vcb->FcbTable[Bucket] );
+	}
 
 	//
 	//  Show that we have a mount in progress.
@@ -584,6 +605,13 @@ Return Value:
 
 			CdCreateInternalStream(IrpContext, Vcb, Vcb->PathTableFcb, &CdInternalStreamNames[0]);
 
+			//
+			//  Read the path table into memory so directory lookups don't
+			//  need to map it.
+			//
+
+			CdBuildPathIndex( IrpContext, Vcb );
+
 			//
 			//  Create the root index and reference it in the Vcb.
 			//
@@ -922,6 +950,19 @@ Return Value:
 
 	UNREFERENCED_PARAMETER( IrpContext );
 
+	//
+	//  Stop any warm-up of the sector cache and wait for it to finish with
+	//  the Vcb and our target.
+	//
+
+	Vcb->WarmUpLevels = 0;
+
+	KeWaitForSingleObject( &Vcb->WarmUpDone,
+	                       Executive,
+	                       KernelMode,
+	                       FALSE,
+	                       NULL );
+
 	//
 	//  Chuck the backpocket Vpb we kept just in case.
 	//
@@ -948,16 +989,24 @@ Return Value:
 	//
 
 	CdFreePool(&Vcb->XASector);
-	CdFreePool(reinterpret_cast<PVOID*>(&Vcb->SectorCacheBuffer));
+	CdDeleteSectorCache( Vcb );
 
-	if (Vcb->SectorCacheIrp != NULL)
-	{
-		IoFreeIrp(Vcb->SectorCacheIrp);
-		Vcb->SectorCacheIrp = NULL;
+	CdFreePool(reinterpret_cast<PVOID*>(&Vcb->ReadTrace));
+	CdDeleteBufferPool( &Vcb->BouncePool );
+
+	//
+	//  Free the Fcb table buckets if they outgrew the Vcb.
+	//
 
-		ExDeleteResourceLite(&Vcb->SectorCacheResource);
+	if (Vcb->FcbTable != Vcb->FcbTableInitialBuckets)
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Vcb->FcbTable));
 	}
 
+	CdDeleteBufferPool( &Vcb->StagingPool );
+	CdDeleteBufferPool( &Vcb->XAStagingPool );
+	CdFreePool(reinterpret_cast<PVOID*>(&Vcb->PathIndex));
+
 	//
 	//  Remove this entry from the global queue.
 	//
@@ -998,6 +1047,357 @@ Return Value:
 }
 
 
+VOID
+CdCreateBufferPool(
+	_Inout_ PCD_BUFFER_POOL Pool,
+	        _In_ ULONG BufferCount,
+	        _In_ ULONG BufferSize
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to build a pool of bounce buffers.  The pools
+    are optional, so we quietly give up if we can't get the memory and
+    leave the pool with fewer or no buffers.
+
+Arguments:
+
+    Pool - Pool being initialized.
+
+    BufferCount - Number of buffers wanted.
+
+    BufferSize - Size of each buffer in bytes.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	PCD_BOUNCE_BUFFER BounceBuffer;
+	PVOID Buffers;
+	ULONG Stride = ROUND_TO_PAGES( BufferSize );
+	ULONG Index;
+
+	PAGED_CODE();
+
+	InitializeSListHead( &Pool->List );
+
+	Pool->BufferCount = 0;
+	Pool->BufferSize = BufferSize;
+
+	Pool->Buffers = reinterpret_cast<PCD_BOUNCE_BUFFER>( ExAllocatePoolWithTag( CdNonPagedPool,
+		BufferCount * sizeof( CD_BOUNCE_BUFFER ),
+		TAG_IO_BUFFER ));
+
+	if (Pool->Buffers == NULL)
+	{
+		return;
+	}
+
+	//
+	//  One allocation holds all the buffers, each starting on a page.
+	//
+
+	Buffers = ExAllocatePoolWithTag( CdNonPagedPool,
+		BufferCount * Stride,
+		TAG_IO_BUFFER );
+
+	if (Buffers == NULL)
+	{
+		CdFreePool(reinterpret_cast<PVOID*>(&Pool->Buffers));
+		return;
+	}
+
+	RtlZeroMemory( Pool->Buffers, BufferCount * sizeof( CD_BOUNCE_BUFFER ));
+
+	for (Index = 0; Index < BufferCount; Index++)
+	{
+		BounceBuffer = &Pool->Buffers[Index];
+
+		BounceBuffer->Buffer = Add2Ptr( Buffers, Index * Stride, PVOID );
+		BounceBuffer->Mdl = IoAllocateMdl( BounceBuffer->Buffer, BufferSize, FALSE, FALSE, NULL );
+
+		if (BounceBuffer->Mdl == NULL)
+		{
+			break;
+		}
+
+		MmBuildMdlForNonPagedPool( BounceBuffer->Mdl );
+
+		InterlockedPushEntrySList( &Pool->List, &BounceBuffer->Links );
+		Pool->BufferCount += 1;
+	}
+
+	if (Pool->BufferCount == 0)
+	{
+		CdFreePool( &Buffers );
+		CdFreePool(reinterpret_cast<PVOID*>(&Pool->Buffers));
+	}
+}
+
+
+VOID
+CdDeleteBufferPool(
+	_Inout_ PCD_BUFFER_POOL Pool
+)
+
+/*++
+
+Routine Description:
+
+    This routine frees a pool of bounce buffers.  There is no I/O on the
+    volume at this point so they are all back on the list.
+
+Arguments:
+
+    Pool - Pool being deleted.  It may never have been created.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	ULONG Index;
+
+	PAGED_CODE();
+
+	if (Pool->Buffers == NULL)
+	{
+		return;
+	}
+
+	for (Index = 0; Index < Pool->BufferCount; Index++)
+	{
+		IoFreeMdl( Pool->Buffers[Index].Mdl );
+	}
+
+	CdFreePool( &Pool->Buffers[0].Buffer );
+	CdFreePool(reinterpret_cast<PVOID*>(&Pool->Buffers));
+
+	InitializeSListHead( &Pool->List );
+	Pool->BufferCount = 0;
+}
+
+
+VOID
+CdCreateSectorCache(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _Inout_ PVCB Vcb,
+	     _In_ ULONG PathTableSize,
+	     _In_ ULONG StackSize
+)
+
+/*++
+
+Routine Description:
+
+    This routine is called to allocate the sector cache for a volume being
+    mounted.  The number of chunks grows with the size of the path table,
+    since that is roughly proportional to the number of directories on the
+    disc.  We raise if an allocation fails; whatever has been attached to
+    the Vcb by then is cleaned up by CdDeleteVcb.
+
+Arguments:
+
+    Vcb - Vcb being mounted.
+
+    PathTableSize - Size of the path table in bytes.
+
+    StackSize - Stack size needed for Irps sent to the target device.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	PCD_SECTOR_CACHE SectorCache;
+	ULONG ChunkCount;
+	ULONG BucketCount;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	//
+	//  Size the cache and round it to a whole number of chunks per
+	//  partition.  Each partition gets a power of two number of hash
+	//  buckets, at least one per chunk.
+	//
+
+	ChunkCount = PathTableSize / CD_SEC_CACHE_PT_BYTES_PER_CHUNK;
+
+	if (ChunkCount < CD_SEC_CACHE_MIN_CHUNKS)
+	{
+		ChunkCount = CD_SEC_CACHE_MIN_CHUNKS;
+	}
+	else if (ChunkCount > CD_SEC_CACHE_MAX_CHUNKS)
+	{
+		ChunkCount = CD_SEC_CACHE_MAX_CHUNKS;
+	}
+
+	ChunkCount = (ChunkCount + CD_SEC_CACHE_PARTITIONS - 1) & ~(CD_SEC_CACHE_PARTITIONS - 1);
+
+	BucketCount = 1;
+
+	while (BucketCount < ChunkCount / CD_SEC_CACHE_PARTITIONS)
+	{
+		BucketCount <<= 1;
+	}
+
+	//
+	//  The chunk table and buckets follow the cache structure in a single
+	//  nonpaged allocation.
+	//
+
+	SectorCache = reinterpret_cast<PCD_SECTOR_CACHE>(FsRtlAllocatePoolWithTag( CdNonPagedPool,
+		sizeof( CD_SECTOR_CACHE ) +
+		ChunkCount * sizeof( CD_SECTOR_CACHE_CHUNK ) +
+		CD_SEC_CACHE_PARTITIONS * BucketCount * sizeof( ULONG ),
+		TAG_SECTOR_CACHE ));
+
+	RtlZeroMemory( SectorCache, sizeof( CD_SECTOR_CACHE ));
+
+	SectorCache->ChunkCount = ChunkCount;
+	SectorCache->BucketMask = BucketCount - 1;
+	SectorCache->Chunks = Add2Ptr( SectorCache, sizeof( CD_SECTOR_CACHE ), PCD_SECTOR_CACHE_CHUNK );
+	SectorCache->Buckets = Add2Ptr( SectorCache->Chunks,
+	                                ChunkCount * sizeof( CD_SECTOR_CACHE_CHUNK ),
+	                                PULONG );
+
+	for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+	{
+		KeInitializeEvent( &SectorCache->Partitions[Index].Event, SynchronizationEvent, FALSE );
+		ExInitializeResourceLite( &SectorCache->Partitions[Index].Resource );
+	}
+
+	CdResetSectorCache( SectorCache );
+
+	Vcb->SectorCache = SectorCache;
+
+	//
+	//  Now the Irps used to fill each partition and the buffer itself.
+	//
+
+	for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+	{
+		SectorCache->Partitions[Index].Irp = IoAllocateIrp( (CCHAR)StackSize, FALSE );
+
+		if (SectorCache->Partitions[Index].Irp == NULL)
+		{
+			CdRaiseStatus( IrpContext, STATUS_INSUFFICIENT_RESOURCES );
+		}
+
+		IoInitializeIrp( SectorCache->Partitions[Index].Irp,
+		                 IoSizeOfIrp( (CCHAR)StackSize ),
+		                 (CCHAR)StackSize );
+	}
+
+	Vcb->SectorCacheBuffer = reinterpret_cast<PUCHAR>(FsRtlAllocatePool( CdPagedPool,
+		ChunkCount *
+		CD_SEC_CHUNK_BLOCKS *
+		SECTOR_SIZE ));
+}
+
+
+VOID
+CdResetSectorCache(
+	_Inout_ PCD_SECTOR_CACHE SectorCache
+)
+
+/*++
+
+Routine Description:
+
+    This routine marks every chunk in the sector cache free and empties the
+    hash chains.  It touches only nonpaged memory and may be called with a
+    spinlock held.
+
+Arguments:
+
+    SectorCache - Cache to reset.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	ULONG Index;
+
+	for (Index = 0; Index < SectorCache->ChunkCount; Index++)
+	{
+		SectorCache->Chunks[Index].BaseLbn = CD_SEC_CACHE_NO_LBN;
+		SectorCache->Chunks[Index].NextInBucket = CD_SEC_CACHE_NO_CHUNK;
+		SectorCache->Chunks[Index].Referenced = FALSE;
+	}
+
+	for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS * (SectorCache->BucketMask + 1); Index++)
+	{
+		SectorCache->Buckets[Index] = CD_SEC_CACHE_NO_CHUNK;
+	}
+
+	for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+	{
+		SectorCache->Partitions[Index].ClockHand = 0;
+	}
+}
+
+
+VOID
+CdDeleteSectorCache(
+	_Inout_ PVCB Vcb
+)
+
+/*++
+
+Routine Description:
+
+    This routine frees the sector cache buffer and chunk table of a Vcb,
+    if present.
+
+Arguments:
+
+    Vcb - Vcb being deleted.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+	PCD_SECTOR_CACHE SectorCache = Vcb->SectorCache;
+	ULONG Index;
+
+	PAGED_CODE();
+
+	CdFreePool(reinterpret_cast<PVOID*>(&Vcb->SectorCacheBuffer));
+
+	if (SectorCache != NULL)
+	{
+		for (Index = 0; Index < CD_SEC_CACHE_PARTITIONS; Index++)
+		{
+			if (SectorCache->Partitions[Index].Irp != NULL)
+			{
+				IoFreeIrp( SectorCache->Partitions[Index].Irp );
+			}
+
+			ExDeleteResourceLite( &SectorCache->Partitions[Index].Resource );
+		}
+
+		CdFreePool(reinterpret_cast<PVOID*>(&Vcb->SectorCache));
+	}
+}
+
+
 PFCB
 CdCreateFcb(
 	_In_ PIRP_CONTEXT IrpContext,
@@ -1372,6 +1772,13 @@ Return Value:
 		CurrentFileOffset = 0;
 		CurrentMcbEntryOffset = 0;
 
+		//
+		//  We counted the extents when we found the dirents, so size the
+		//  Mcb for all of them now rather than growing it as we go.
+		//
+
+		CdReserveMcbEntries(IrpContext, Fcb, FileContext->ExtentCount);
+
 		while (TRUE)
 		{
 			CdAddAllocationFromDirent(IrpContext,
@@ -2162,24 +2569,27 @@ Return Value:
 --*/
 
 {
-	FCB_TABLE_ELEMENT Key;
-	PFCB_TABLE_ELEMENT Hit;
-	PFCB ReturnFcb = NULL;
+	PLIST_ENTRY Bucket;
+	PLIST_ENTRY Links;
+	PFCB ThisFcb;
 
 	PAGED_CODE();
 
-	Key.FileId = FileId;
+	UNREFERENCED_PARAMETER( IrpContext );
 
-	Hit = (PFCB_TABLE_ELEMENT) RtlLookupElementGenericTable(&Vcb->FcbTable, &Key);
+	Bucket = &Vcb->FcbTable[ CdFcbTableBucket( Vcb, FileId ) ];
 
-	if (Hit != NULL)
+	for (Links = Bucket->Flink; Links != Bucket; Links = Links->Flink)
 	{
-		ReturnFcb = Hit->Fcb;
-	}
+		ThisFcb = CONTAINING_RECORD( Links, FCB, FcbTableLinks );
 
-	return ReturnFcb;
+		if (ThisFcb->FileId.QuadPart == FileId.QuadPart)
+		{
+			return ThisFcb;
+		}
+	}
 
-	UNREFERENCED_PARAMETER( IrpContext );
+	return NULL;
 }
 
 
@@ -2194,15 +2604,18 @@ CdGetNextFcb(
 
 Routine Description:
 
-    This routine will enumerate through all of the Fcb's in the Fcb table.
+    This routine will enumerate through all of the Fcb's in the Fcb table,
+    a bucket at a time.  The table must not grow during the enumeration,
+    which our callers ensure by holding the Vcb exclusively.
 
 Arguments:
 
     Vcb - Vcb for this volume.
 
-    RestartKey - This value is used by the table package to maintain
-        its position in the enumeration.  It is initialized to NULL
-        for the first search.
+    RestartKey - This value is used to maintain our position in the
+        enumeration.  It is initialized to NULL for the first search and
+        then holds the last Fcb returned, which the caller must keep
+        referenced until the next call.
 
 Return Value:
 
@@ -2212,19 +2625,49 @@ Return Value:
 --*/
 
 {
-	PFCB Fcb;
+	PFCB Fcb = (PFCB) *RestartKey;
+	PLIST_ENTRY Links;
+	ULONG Bucket;
 
 	PAGED_CODE();
 
 	UNREFERENCED_PARAMETER( IrpContext );
 
-	Fcb = (PFCB) RtlEnumerateGenericTableWithoutSplaying(&Vcb->FcbTable, RestartKey);
+	//
+	//  Start after the last Fcb returned, or at the first bucket.
+	//
 
 	if (Fcb != NULL)
 	{
-		Fcb = ((PFCB_TABLE_ELEMENT)(Fcb))->Fcb;
+		Bucket = CdFcbTableBucket( Vcb, Fcb->FileId );
+		Links = Fcb->FcbTableLinks.Flink;
+	}
+	else
+	{
+		Bucket = 0;
+		Links = Vcb->FcbTable[0].Flink;
+	}
+
+	//
+	//  Move on through the buckets until we find an Fcb.
+	//
+
+	while (Links == &Vcb->FcbTable[Bucket])
+	{
+		Bucket += 1;
+
+		if (Bucket == Vcb->FcbTableBuckets)
+		{
+			*RestartKey = NULL;
+			return NULL;
+		}
+
+		Links = Vcb->FcbTable[Bucket].Flink;
 	}
 
+	Fcb = CONTAINING_RECORD( Links, FCB, FcbTableLinks );
+	*RestartKey = Fcb;
+
 	return Fcb;
 }
 
@@ -2497,6 +2940,17 @@ Return Value:
 
 	CdUninitializeMcb(IrpContext, Fcb);
 
+	//
+	//  Take a directory off the volume's name index and arena queues before
+	//  its resource goes, since a trim may try to acquire it from there.
+	//
+
+	if (Fcb->NodeTypeCode == CDFS_NTC_FCB_INDEX)
+	{
+		CdDeleteNameIndex( IrpContext, Fcb );
+		CdDeleteNameArena( IrpContext, Fcb );
+	}
+
 	CdDeleteFcbNonpaged(IrpContext, Fcb->FcbNonpaged);
 
 	//
@@ -2550,6 +3004,15 @@ Return Value:
 			Vcb->PathTableFcb = NULL;
 		}
 
+		CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Index.NegativeCache));
+
+		//
+		//  The prefix tables go with the last child, but free any left.
+		//
+
+		CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Index.ExactCaseTable));
+		CdFreePool(reinterpret_cast<PVOID*>(&Fcb->Index.IgnoreCaseTable));
+
 		CdDeallocateFcbIndex( IrpContext, Fcb );
 		break;
 
@@ -2680,128 +3143,88 @@ Return Value:
 //  Local support routine
 //
 
-RTL_GENERIC_COMPARE_RESULTS
-CdFcbTableCompare(
-	_In_ PRTL_GENERIC_TABLE FcbTable,
-	     _In_ PVOID Fid1,
-	     _In_ PVOID Fid2
+VOID
+CdInsertFcbTable(
+	_In_ PIRP_CONTEXT IrpContext,
+	     _In_ PFCB Fcb
 )
 
 /*++
 
 Routine Description:
 
-    This routine is the Cdfs compare routine called by the generic table package.
-    If will compare the two File Id values and return a comparison result.
+    This routine inserts an Fcb into the Fcb table of its volume.  If the
+    table holds twice as many Fcbs as it has buckets we first try to double
+    the buckets.  If we can't allocate them we keep the current buckets,
+    so this routine doesn't fail.  The Vcb is locked.
 
 Arguments:
 
-    FcbTable - This is the table being searched.
-
-    Fid1 - First key value.
-
-    Fid2 - Second key value.
+    Fcb - Fcb to insert.  Its FileId has been set.
 
 Return Value:
 
-    RTL_GENERIC_COMPARE_RESULTS - The results of comparing the two
-        input structures
+    None.
 
 --*/
 
 {
-	FILE_ID Id1, Id2;
-	PAGED_CODE();
-
-	Id1 = *((FILE_ID UNALIGNED *) Fid1);
-	Id2 = *((FILE_ID UNALIGNED *) Fid2);
-
-	if (Id1.QuadPart < Id2.QuadPart)
-	{
-		return GenericLessThan;
-	}
-	else if (Id1.QuadPart > Id2.QuadPart)
-	{
-		return GenericGreaterThan;
-	}
-	else
-	{
-		return GenericEqual;
-	}
-
-	UNREFERENCED_PARAMETER( FcbTable );
-}
-
-
-//
-//  Local support routine
-//
-
-PVOID
-CdAllocateFcbTable(
-	_In_ PRTL_GENERIC_TABLE FcbTable,
-	     _In_ CLONG ByteSize
-)
+	PVCB Vcb = Fcb->Vcb;
+	PLIST_ENTRY OldTable;
+	PLIST_ENTRY NewTable;
+	PLIST_ENTRY Links;
+	ULONG OldBuckets;
+	ULONG Bucket;
 
-/*++
-
-Routine Description:
-
-    This is a generic table support routine to allocate memory
-
-Arguments:
-
-    FcbTable - Supplies the generic table being used
-
-    ByteSize - Supplies the number of bytes to allocate
-
-Return Value:
-
-    PVOID - Returns a pointer to the allocated data
-
---*/
-
-{
 	PAGED_CODE();
 
-	UNREFERENCED_PARAMETER( FcbTable );
-
-	return(FsRtlAllocatePoolWithTag( CdPagedPool, ByteSize, TAG_FCB_TABLE ));
-}
-
-
-//
-//  Local support routine
-//
-VOID
-CdDeallocateFcbTable(
-	_In_ PRTL_GENERIC_TABLE FcbTable,
-	     _In_ __drv_freesMem(Mem) _Post_invalid_ PVOID Buffer
-)
-/*++
-
-Routine Description:
+	UNREFERENCED_PARAMETER( IrpContext );
 
-    This is a generic table support routine that deallocates memory
+	if (Vcb->FcbTableCount >= Vcb->FcbTableBuckets * 2)
+	{
+		NewTable = reinterpret_cast<PLIST_ENTRY>(ExAllocatePoolWithTag( CdPagedPool,
+			Vcb->FcbTableBuckets * 2 * sizeof( LIST_ENTRY ),
+			TAG_FCB_TABLE ));
 
-Arguments:
+		if (NewTable != NULL)
+		{
+			OldTable = Vcb->FcbTable;
+			OldBuckets = Vcb->FcbTableBuckets;
 
-    FcbTable - Supplies the generic table being used
+			Vcb->FcbTable = NewTable;
+			Vcb->FcbTableBuckets = OldBuckets * 2;
 
-    Buffer - Supplies the buffer being deallocated
+			for (Bucket = 0; Bucket < Vcb->FcbTableBuckets; Bucket++)
+			{
+				InitializeListHead( &NewTable[Bucket] );
+			}
 
-Return Value:
+			//
+			//  Move the Fcbs over, keeping their order within each chain.
+			//
 
-    None.
+			for (Bucket = 0; Bucket < OldBuckets; Bucket++)
+			{
+				while (!IsListEmpty( &OldTable[Bucket] ))
+				{
+					Links = RemoveHeadList( &OldTable[Bucket] );
 
---*/
+					InsertTailList( &NewTable[ CdFcbTableBucket( Vcb, CONTAINING_RECORD( Links, FCB, FcbTableLinks )->FileId ) ],
+						Links );
+				}
+			}
 
-{
-	PAGED_CODE();
+			if (OldTable != Vcb->FcbTableInitialBuckets)
+			{
+				CdFreePool(reinterpret_cast<PVOID*>(&OldTable));
+			}
+		}
+	}
 
-	CdFreePool(&Buffer);
+	InsertTailList( &Vcb->FcbTable[ CdFcbTableBucket( Vcb, Fcb->FileId ) ],
+		&Fcb->FcbTableLinks );
 
-	UNREFERENCED_PARAMETER( FcbTable );
+	Vcb->FcbTableCount += 1;
 }
 
 